@@ -35,11 +35,16 @@
 #include <cstdlib>
 #include <cstdint>
 
+#include <fstream>
+#include <string>
+
 #include <squish.h>
 
 #include <io_util.h>
+#include <sleep.h>
 
 #include "dds.h"
+#include "parallel.h"
 
 #define DDSD_CAPS 0x1
 #define DDSD_HEIGHT 0x2
@@ -70,6 +75,9 @@
 #define DDPF_YUV 0x200
 #define DDPF_LUMINANCE 0x20000
 
+// Rough cost of compressing a block, compared to touching one pixel, for parallel_rows.
+#define DDS_BLOCK_WORK 1024
+
 #define FOURCC(x,y,z,w) uint32_t(((w)<<24) | ((z)<<16) | ((y)<<8) | (x))
 
 
@@ -137,6 +145,41 @@ std::string format_to_string (DDSFormat format)
 
 namespace {
 
+    /** The file being written.  Values are written with write(v), as with OutFile from io_util.h,
+     * and a buffer whose size is only known at run time (e.g. a compressed level) in one go. */
+    class DDSOutFile {
+        std::ofstream f;
+        std::string filename;
+
+        public:
+
+        DDSOutFile (const std::string &filename)
+          : f(filename.c_str(), std::ios::binary), filename(filename)
+        {
+            if (!f.good()) {
+                EXCEPT << "Couldn't open " << filename << " for writing." << ENDL;
+            }
+        }
+
+        void write (const void *data, size_t bytes)
+        {
+            f.write(static_cast<const char*>(data), bytes);
+            if (!f.good()) {
+                EXCEPT << "Couldn't write " << filename << ENDL;
+            }
+        }
+
+        template<class T> void write (const T &v) { write(&v, sizeof(T)); }
+
+        void close (void)
+        {
+            f.close();
+            if (!f.good()) {
+                EXCEPT << "Couldn't write " << filename << ENDL;
+            }
+        }
+    };
+
     void check_colour (DDSFormat format, chan_t ch, bool alpha)
     {
         switch (format) {
@@ -242,7 +285,7 @@ namespace {
         }
     }
 
-    void output_pixelformat (OutFile &out, DDSFormat format)
+    void output_pixelformat (DDSOutFile &out, DDSFormat format)
     {
         // DDS_HEADER.PIXELFORMAT
         uint32_t flags = 0;
@@ -415,7 +458,7 @@ namespace {
         return v * max + 0.5;
     }
 
-    template<chan_t ch, chan_t ach> void write_colour (OutFile &out, DDSFormat format, const Colour<ch,ach> &col)
+    template<chan_t ch, chan_t ach> void write_colour (DDSOutFile &out, DDSFormat format, const Colour<ch,ach> &col)
     {
         switch (format) {
             case DDSF_R5G6B5: {
@@ -531,7 +574,7 @@ namespace {
         }
     }
 
-    template<chan_t ch, chan_t ach> void write_image2 (OutFile &out, DDSFormat format, const ImageBase *img_)
+    template<chan_t ch, chan_t ach> void write_image2 (DDSOutFile &out, DDSFormat format, const ImageBase *img_)
     {
         ASSERT(!is_compressed(format));
         const Image<ch,ach> *img = static_cast<const Image<ch,ach>*>(img_);
@@ -590,7 +633,56 @@ namespace {
 
     }
 
-    void write_compressed_image (OutFile &out, DDSFormat format, const ImageBase *img, int squish_flags_)
+    unsigned block_size (DDSFormat format)
+    {
+        switch (format) {
+            case DDSF_BC1: case DDSF_BC4: return 8;
+            default: return 16;
+        }
+    }
+
+    void compress_block (const ImageBase *img, uimglen_t x, uimglen_t y, DDSFormat format,
+                         int squish_flags, squish::u8 *out)
+    {
+        squish::u8 input[4*4*4] = { 0 };
+        squish::u8 input2[4*4*4] = { 0 };
+        initialise_squish_input(img, input, input2, x, y, format);
+        switch (format) {
+            case DDSF_BC1:
+            squish::Compress(input, out, squish_flags | squish::kDxt1);
+            break;
+            case DDSF_BC2:
+            squish::Compress(input, out, squish_flags | squish::kDxt3);
+            break;
+            case DDSF_BC3:
+            squish::Compress(input, out, squish_flags | squish::kDxt5);
+            break;
+            case DDSF_BC4: {
+                // Convert to RGBA with RGB zero, use DXT5, throw away colour channel
+                squish::u8 output[16];
+                squish::Compress(input, output, squish_flags | squish::kDxt5);
+                for (unsigned i=0 ; i<8 ; ++i)
+                    out[i] = output[i];
+            }
+            break;
+            case DDSF_BC5: {
+                // As BC4, but do it once for each input channel.
+                squish::u8 output[16];
+                squish::u8 output2[16];
+                squish::Compress(input, output, squish_flags | squish::kDxt5);
+                squish::Compress(input2, output2, squish_flags | squish::kDxt5);
+                for (unsigned i=0 ; i<8 ; ++i)
+                    out[i] = output2[i];
+                for (unsigned i=0 ; i<8 ; ++i)
+                    out[8+i] = output[i];
+            }
+            break;
+            default: EXCEPTEX << format << ENDL;
+        }
+    }
+
+    void write_compressed_image (DDSOutFile &out, DDSFormat format, const ImageBase *img, int squish_flags_,
+                                 DDSEncodeStats &stats)
     {
         ASSERT(is_compressed(format));
 
@@ -606,64 +698,32 @@ namespace {
                         squish::kColourMetricPerceptual : squish::kColourMetricUniform;
         if (squish_flags_ & SQUISH_WEIGHT_COLOUR_BY_ALPHA) squish_flags |= squish::kWeightColourByAlpha;
 
-        for (uimglen_t y=0 ; y<img->height ; y+=4) {
-            for (uimglen_t x=0 ; x<img->width ; x+=4) {
-                squish::u8 input[4*4*4] = { 0 };
-                squish::u8 input2[4*4*4] = { 0 };
-                switch (format) {
-                    case DDSF_BC1: {
-                        squish::u8 output[8];
-                        initialise_squish_input(img, input, input2, x, y, format);
-                        squish::Compress(input, output, squish_flags | squish::kDxt1);
-                        out.write(output);
-                    }
-                    break;
-                    case DDSF_BC2: {
-                        squish::u8 output[16];
-                        initialise_squish_input(img, input, input2, x, y, format);
-                        squish::Compress(input, output, squish_flags | squish::kDxt3);
-                        out.write(output);
-                    }
-                    break;
-                    case DDSF_BC3: {
-                        squish::u8 output[16];
-                        initialise_squish_input(img, input, input2, x, y, format);
-                        squish::Compress(input, output, squish_flags | squish::kDxt5);
-                        out.write(output);
-                    }
-                    break;
-                    case DDSF_BC4: {
-                        // Convert to RGBA with RGB zero, use DXT5, throw away colour channel
-                        squish::u8 output[16];
-                        initialise_squish_input(img, input, input2, x, y, format);
-                        squish::Compress(input, output, squish_flags | squish::kDxt5);
-                        for (unsigned i=0 ; i<8 ; ++i)
-                            out.write(output[i]);
-                    }
-                    break;
-                    case DDSF_BC5: {
-                        // As BC4, but do it once for each input channel.
-                        squish::u8 output[16];
-                        squish::u8 output2[16];
-                        initialise_squish_input(img, input, input2, x, y, format);
-                        squish::Compress(input, output, squish_flags | squish::kDxt5);
-                        squish::Compress(input2, output2, squish_flags | squish::kDxt5);
-                        for (unsigned i=0 ; i<8 ; ++i)
-                            out.write(output2[i]);
-                        for (unsigned i=0 ; i<8 ; ++i)
-                            out.write(output[i]);
-                    }
-                    break;
-                    default: EXCEPTEX << format << ENDL;
+        // Every block is compressed independently into its own place in the buffer, so the
+        // output does not depend on how the rows of blocks are shared out between threads.
+        const uimglen_t blocks_x = (img->width + 3) / 4;
+        const uimglen_t blocks_y = (img->height + 3) / 4;
+        const unsigned bytes = block_size(format);
+        std::vector<squish::u8> buf(size_t(blocks_x) * blocks_y * bytes);
+        unsigned long long before = micros();
+        parallel_rows(blocks_y, blocks_x * DDS_BLOCK_WORK, [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t by=y0 ; by<y1 ; ++by) {
+                for (uimglen_t bx=0 ; bx<blocks_x ; ++bx) {
+                    squish::u8 *block = &buf[(size_t(by) * blocks_x + bx) * bytes];
+                    compress_block(img, 4*bx, 4*by, format, squish_flags, block);
                 }
             }
-        }
+        });
+        stats.blocks += size_t(blocks_x) * blocks_y;
+        stats.seconds += (micros() - before) / 1E6;
+
+        out.write(buf.data(), buf.size());
     }
 
-    void write_image (OutFile &out, DDSFormat format, const ImageBase *map, int squish_flags)
+    void write_image (DDSOutFile &out, DDSFormat format, const ImageBase *map, int squish_flags,
+                      DDSEncodeStats &stats)
     {
         if (is_compressed(format)) {
-            write_compressed_image(out, format, static_cast<const Image<3,1>*>(map), squish_flags);
+            write_compressed_image(out, format, static_cast<const Image<3,1>*>(map), squish_flags, stats);
             return;
         }
         // a GCC bug got in the way of
@@ -712,24 +772,18 @@ namespace {
     uint32_t pitch_or_linear_size (DDSFormat format, uimglen_t width, uimglen_t height)
     {
         if (is_compressed(format)) {
-            unsigned block_size;
-            switch (format) {
-                case DDSF_BC1: case DDSF_BC4: block_size = 8;
-                break;
-                default: block_size = 16;
-            }
             unsigned width_blocks = (width + 3)/4;
             if (width_blocks == 0) width_blocks = 1;
             unsigned height_blocks = (height + 3)/4;
             if (height_blocks == 0) height_blocks = 1;
-            return width_blocks * height_blocks * block_size;
+            return width_blocks * height_blocks * block_size(format);
         } else {
             return (width * bits_per_pixel(format) + 7) / 8;
         }
     }
 }
 
-void dds_save (const std::string &filename, DDSFormat format, const DDSFile &content, int squish_flags)
+DDSEncodeStats dds_save (const std::string &filename, DDSFormat format, const DDSFile &content, int squish_flags)
 {
     // sanity checks:
     unsigned mipmap_count;
@@ -818,7 +872,7 @@ void dds_save (const std::string &filename, DDSFormat format, const DDSFile &con
         default: EXCEPTEX << content.kind << ENDL; // avoid warning
     }
 
-    OutFile out(filename);
+    DDSOutFile out(filename);
 
     // Filetype magic
     out.write(FOURCC('D', 'D', 'S', ' '));
@@ -872,32 +926,35 @@ void dds_save (const std::string &filename, DDSFormat format, const DDSFile &con
         out.write(misc_flags2);
     }
 
+    DDSEncodeStats stats = { 0, 0 };
     switch (content.kind) {
         case DDS_SIMPLE: {
             for (unsigned i=0 ; i<mipmap_count ; ++i) {
-                write_image(out, format, content.simple[i], squish_flags);
+                write_image(out, format, content.simple[i], squish_flags, stats);
             }
         } break;
         case DDS_CUBE: {
             for (unsigned i=0 ; i<mipmap_count ; ++i)
-                write_image(out, format, content.cube.X[i], squish_flags);
+                write_image(out, format, content.cube.X[i], squish_flags, stats);
             for (unsigned i=0 ; i<mipmap_count ; ++i)
-                write_image(out, format, content.cube.x[i], squish_flags);
+                write_image(out, format, content.cube.x[i], squish_flags, stats);
             for (unsigned i=0 ; i<mipmap_count ; ++i)
-                write_image(out, format, content.cube.Y[i], squish_flags);
+                write_image(out, format, content.cube.Y[i], squish_flags, stats);
             for (unsigned i=0 ; i<mipmap_count ; ++i)
-                write_image(out, format, content.cube.y[i], squish_flags);
+                write_image(out, format, content.cube.y[i], squish_flags, stats);
             for (unsigned i=0 ; i<mipmap_count ; ++i)
-                write_image(out, format, content.cube.Z[i], squish_flags);
+                write_image(out, format, content.cube.Z[i], squish_flags, stats);
             for (unsigned i=0 ; i<mipmap_count ; ++i)
-                write_image(out, format, content.cube.z[i], squish_flags);
+                write_image(out, format, content.cube.z[i], squish_flags, stats);
         } break;
         case DDS_VOLUME: {
             for (unsigned i=0 ; i<mipmap_count ; ++i)
                 for (unsigned z=0 ; z<content.volume[i].size() ; ++z)
-                    write_image(out, format, content.volume[i][z], squish_flags);
+                    write_image(out, format, content.volume[i][z], squish_flags, stats);
         } break;
     }
+    out.close();
+    return stats;
 }
 
 namespace {
@@ -93,7 +93,13 @@ struct DDSFile {
     std::vector<ImageBases> volume;
 };
 
-void dds_save (const std::string &filename, DDSFormat format, const DDSFile &content, int flags);
+/** How much block compression dds_save did, and how long it took (excluding file I/O). */
+struct DDSEncodeStats {
+    unsigned long long blocks;
+    double seconds;
+};
+
+DDSEncodeStats dds_save (const std::string &filename, DDSFormat format, const DDSFile &content, int flags);
 DDSFile dds_open (const std::string &filename);
 
 #endif
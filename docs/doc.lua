@@ -138,6 +138,52 @@ doc { "function", "seconds", module="General Utilities",
     { "return", "number" },
 }
 
+doc { "function", "threads", module="General Utilities",
+
+[[Return the number of threads used for image processing, after optionally
+setting it.  0 means use one thread per hardware thread (the default, which can
+also be overridden with the -j commandline option), and 1 disables threading.
+The results of image operations do not depend on this setting.]],
+
+    { "param", "n", "number", optional=true },
+    { "return", "number" },
+}
+
+doc { "function", "memory_budget", module="General Utilities",
+
+[[Return the limit on the memory used for image pixels in bytes, after
+optionally setting it.  0 means no limit (the default).  Freed pixel buffers are
+kept for reuse by images of the same size, these are given back to stay within
+the budget, and creating an image that would still exceed it is an error.]],
+
+    { "param", "bytes", "number", optional=true },
+    { "return", "number" },
+}
+
+doc { "function", "memory_high_water", module="General Utilities",
+
+[[Return the memory used for image pixels in bytes beyond which a full garbage
+collection is run when an image operation is called or returns, after optionally
+setting it.  If the memory stays above it, the next collection waits until a
+quarter more is in use.  0 means never (the default).  Images that are no longer referenced are otherwise only
+freed when Lua decides to collect them, which can take a while.  Also see
+Image.free.]],
+
+    { "param", "bytes", "number", optional=true },
+    { "return", "number" },
+}
+
+doc { "function", "memory_stats", module="General Utilities",
+
+[[Return a table describing the memory used for image pixels, in bytes: live
+(in use), peak (the most ever in use), cached (freed buffers kept for reuse) and
+budget (see memory_budget), highWater (see memory_high_water), and the counts of
+allocations that reused a cached buffer (hits), that needed new memory (misses),
+and of garbage collections run because of the high water mark (collections).]],
+
+    { "return", "table" },
+}
+
 doc { "function", "vec", module="General Utilities",
 
 [[Convert to a vector value, the number of arguments determines the number of
@@ -234,9 +280,23 @@ doc { "function", "open", module="Disk I/O",
 [[Load an image file from disk.  The file extension is used to determine the
 format.  The extension 'sfi' is a special raw format.  This can be used to save
 and restore images in LuaImg's internal representation, which is 4 bytes per
-pixel per channel.  All other formats are loaded with libfreeimage.]],
+pixel per channel.  All other formats are loaded with libfreeimage.</p><p>If map
+is true, an sfi file is mapped into memory instead of being read, so opening it
+is instant even for huge images, and only the parts that are used get loaded.
+Drawing into the image does not change the file.  This is only possible for sfi
+files saved with the SFI_PADDED type, others are read as usual.
+SFI2 files are compressed so are never mapped.</p><p>If map is the string
+PACKED instead, 8 and 16 bit per channel images and SFI2_HALF files keep the
+precision of the file, using 1 or 2 bytes per channel (see the pack
+method).</p><p>Alternatively, give the
+bottom left corner and size of a region (which must be inside the image) to
+load only that part of the image.  For SFI2 files, only the tiles that overlap
+the region are decoded.]],
 
     { "param", "filename", "string" },
+    { "param", "map", {"boolean","string"}, optional=true },
+    { "param", "bottom_left", "vector2", optional=true },
+    { "param", "size", "vector2", optional=true },
     { "return", "Image" },
 }
 
@@ -274,11 +334,16 @@ use a single element array.  You can also use the mipmaps() function to generate
 mipmaps for you.</p><p>Note that the supplied images must have the right number
 of channels/alpha for the chosen format.  Don't forget that BC1 has an alpha
 channel.  To add a 100% alpha channel to an RGB image, use the img.xyzF
-swizzle.]],
+swizzle.</p><p>The BC formats are compressed using all the threads set by
+threads().  The compression throughput (in 4x4 blocks per second) and the
+number of blocks compressed are returned, which is useful for choosing a
+quality level.  Both are 0 for uncompressed formats.]],
 
     { "param", "filename", "string" },
     { "param", "format", "string" },
     { "param", "mipmaps", "array of images" },
+    { "return", "number" },
+    { "return", "number" },
 }
 
 doc { "function", "dds_save_cube", module="Disk I/O",
@@ -294,6 +359,8 @@ dds_save_simple() except all sides of the cube must be supplied.]],
     { "param", "neg_y", "array of images" },
     { "param", "pos_z", "array of images" },
     { "param", "neg_z", "array of images" },
+    { "return", "number" },
+    { "return", "number" },
 }
 
 doc { "function", "dds_save_volume", module="Disk I/O",
@@ -308,6 +375,8 @@ images.]],
     { "param", "filename", "string" },
     { "param", "format", "string" },
     { "param", "mipmaps", "array of arrays of images" },
+    { "return", "number" },
+    { "return", "number" },
 }
 
 doc { "function", "gif_open", module="Disk I/O",
@@ -354,6 +423,45 @@ a function that provides the colour at each pixel.]],
     { "return", "Image" },
 }
 
+doc { "function", "makeRows", module="Image Globals",
+
+[[As make with a function, except the function is called once per row rather
+than once per pixel, which saves the cost of a call for each pixel.  It is
+given the row's y coordinate and an empty table, which it fills with the row's
+colours, the colour at x going at index x+1.]],
+
+    { "param", "size", "vector2" },
+    { "param", "channels", {1,2,3,4} },
+    { "param", "alpha", "boolean", optional=true },
+    { "param", "init", "(number, array[colour])->()" },
+    { "return", "Image" },
+}
+
+doc { "function", "makeParallel", module="Image Globals",
+
+[[As make with a function, except the function is run on all the threads.  It
+is copied into a Lua state per thread, with the same restrictions on its
+upvalues as mapParallel.]],
+
+    { "param", "size", "vector2" },
+    { "param", "channels", {1,2,3,4} },
+    { "param", "alpha", "boolean", optional=true },
+    { "param", "init", "(vector2)->(colour)" },
+    { "return", "Image" },
+}
+
+doc { "function", "eval", module="Image Globals",
+
+[[Create a new image by evaluating an expression for each pixel, as the eval
+method but without c.]],
+
+    { "param", "size", "vector2" },
+    { "param", "expr", "string" },
+    { "param", "alpha", "boolean", optional=true },
+    { "param", "constants", "table", optional=true },
+    { "return", "Image" },
+}
+
 doc { "function", "lerp", module="Image Globals",
 
 [[Interpolate between two colours / images.  T can be number, vector2/3/4, or
@@ -379,10 +487,18 @@ doc { "function", "mipmaps", module="Image Globals",
 [[Takes an image, and creates an array of scaled versions of the image, where
 each successive image is half the size of the previous one in both dimensions.
 This is mainly useful for the dds_save family of functions.  The available
-filters are the same as for the image:scale() method.]],
+filters are the same as for the image:scale() method.  The BOX filter (the
+default) uses a dedicated 2x2 reduction, which is much faster than scaling each
+level.</p><p>Flags may follow the filter.  "LINEAR" averages the colour
+channels in linear light (gamma 2.2), which avoids darkening high contrast
+detail in the smaller levels.  "ALPHA_COVERAGE" scales the alpha of each level
+so that the same proportion of pixels passes the alpha test as in the original
+image, which stops alpha tested foliage from thinning out with distance.  It
+may be followed by the alpha test reference value, the default being 0.5.]],
 
     { "param", "img", "Image" },
-    { "param", "filter", "string" },
+    { "param", "filter", "string", optional=true },
+    { "param", "...", "strings" },
     { "return", "array of Images" },
 }
 
@@ -470,11 +586,20 @@ create a channel containing 1 or 0, respectively.]],
     { "field", "height", "number", "The number of pixels in a column of the image.", },
     { "field", "size", "vector2", "The width and height as a single value.", },
     { "field", "numPixels", "vector2", "The width x height.", },
+    { "field", "numBytes", "number", "The memory used by the pixels (or that they will use once computed).", },
+    { "field", "storage", "string", "How the pixels are stored: FLOAT, U8, U16, or F16 for packed images, or PLANAR.", },
+    { "field", "freed", "boolean", "Whether free() has been called, after which the image cannot be used.", },
+    {
+        "method",
+        "free",
+        "Release the memory of this image now instead of when it is garbage collected.  Images that share its pixels keep them, and lazy images computed from it keep it until they are computed, when one the same type as this image writes its pixels over this image's instead of allocating new ones.  This is the way to let arithmetic reuse a temporary image, as one still referenced by Lua is only reused once it is garbage collected.  Using the image afterwards is an error.",
+    },
     {
         "method",
         "save",
-        "Write the contents of the file to disk, guessing the format from the file extension.",
+        "Write the contents of the file to disk, guessing the format from the file extension.  The optional type can be RGB16 or RGBA16 for 16 bit per channel formats.  For sfi files, SFI2 writes a tiled, losslessly compressed file that can be partially loaded with open(), and SFI2_HALF does the same with 16 bit floats.  SFI_PADDED writes the plain sfi format with a slightly larger header, so that open() can map the file into memory; the default leaves it out, for compatibility with older readers.",
         { "param", "filename", "string" },
+        { "param", "type", "string", optional=true },
     },
     {
         "method",
@@ -494,15 +619,69 @@ create a channel containing 1 or 0, respectively.]],
     {
         "method",
         "reduce",
-        "Compute a single value from this image in a generic fashion.  The computed value has the same number of channels as the image.  The given function is called for each pixel.  It is provided with the old running total, the current pixel value, and the current pixel position.  It is expected to return the new running total.",
+        "Compute a single value from this image in a generic fashion.  The computed value has the same number of channels as the image.  The given function is called for each pixel.  It is provided with the old running total, the current pixel value, and the current pixel position.  It is expected to return the new running total.  Instead of a function, the name of a built-in operator (\"+\", \"min\", or \"max\") can be given, which is computed without calling Lua, on all the threads (see sum).",
         { "param", "zero", "colour" },
-        { "param", "func", "(colour,colour,vector2)->(colour)" },
+        { "param", "func", {"(colour,colour,vector2)->(colour)", "string"} },
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "foreachRow",
+        "As foreach, except the closure is called once per row, with the row's y coordinate and a table of its colours (the colour at x is at index x+1).  This saves the cost of a call for each pixel.",
+        { "param", "func", "(number, array[colour])->()" },
+    },
+    {
+        "method",
+        "mapRows",
+        "As map, except the function is called once per row.  It is given the row's y coordinate, a table of the row's colours from this image, and an empty table that it fills with the row's colours for the new image.  The colour at x is at index x+1 of both tables.",
+        { "param", "channels", "number" },
+        { "param", "alpha", "boolean", optional=true },
+        { "param", "func", "(number, array[colour], array[colour])->()" },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "mapParallel",
+        "As map, except the function is run on all the threads (see threads), so it must not depend on the order in which pixels are visited.  Each thread runs a copy of the function in its own Lua state, made from its bytecode and copies of its upvalues.  Upvalues can be nil, booleans, numbers, strings, vectors, tables without metatables, global C functions (like floor), images, and other Lua functions with such upvalues.  An error is raised for any other upvalue.  Since they are copies, assignments to upvalues are not seen by the caller.  Images can only be read inside the function: methods and globals that would create or modify an image (like crop, arithmetic, or make) raise an error.  Only the standard and image globals are available, so reading any other global of the script, or assigning a global, is an error; other values should be upvalues (locals) instead.",
+        { "param", "channels", "number" },
+        { "param", "alpha", "boolean", optional=true },
+        { "param", "func", "(colour, vector2)->(colour)" },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "eval",
+        "Create a new image the same size as this image by evaluating an expression for each pixel, e.g. \"vec(1-x^2, y^1.5, x*y) * c\".  The expression is compiled once and run natively on all the threads, without calling Lua.  It can use Lua's arithmetic and comparison operators (comparisons give 1 or 0), swizzles like c.xy, vec/vec2/vec3/vec4, #, and the functions abs, floor, ceil, sqrt, exp, log, sin, cos, tan, pow, min, max, clamp, lerp, dot, norm and select(cond, a, b).  It can read c (this image's pixel), pos (the pixel's coordinate), x and y (the coordinate divided by the image size), size, and the given constants, which are numbers or vectors.  The number of channels is the size of the result, the last of which is alpha if alpha is true.  Anything else, such as and/or or a call to a Lua function, is an error naming the construct and its column.",
+        { "param", "expr", "string" },
+        { "param", "alpha", "boolean", optional=true },
+        { "param", "constants", "table", optional=true },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "integral",
+        "Build the summed-area table of this image on all threads (see IntegralImage), for constant-time sums over rectangles and box blurs of any radius.",
+        { "return", "IntegralImage" },
+    },
+    {
+        "method",
+        "boxBlur",
+        "Equivalent to integral():boxBlur(radius).  Its cost does not depend on the radius.",
+        { "param", "radius", "number" },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "reduceRows",
+        "As reduce, except the function is called once per row, with the old running total, the row's y coordinate, and a table of its colours (the colour at x is at index x+1).  It returns the new running total.",
+        { "param", "zero", "colour" },
+        { "param", "func", "(colour, number, array[colour])->(colour)" },
         { "return", "colour" },
     },
     {
         "method",
         "crop",
-        "Create a new image of the given size that is initialised to a copied version of this image, or the background colour if the pixel is not within the bounds of this image.  If no background colour is given, the image is wrapped (repeated).",
+        "Create a new image of the given size that is initialised to a copied version of this image, or the background colour if the pixel is not within the bounds of this image.  If no background colour is given, the image is wrapped (repeated).  This takes constant time: the pixels are only copied when they are used, and drawing into either image afterwards does not affect the other.",
         { "param", "bottom_left", "vector2" },
         { "param", "size", "vector2" },
         { "param", "background", "colour", optional=true },
@@ -519,7 +698,7 @@ create a channel containing 1 or 0, respectively.]],
     {
         "method",
         "scale",
-        "Create a new image the same as this one but a different size.  The available filter methods are BOX, BILINEAR, BSPLINE, BICUBIC, CATMULLROM, and LANCZOS3.",
+        "Create a new image the same as this one but a different size, which must be at least 1x1.  The available filter methods are BOX, BILINEAR, BSPLINE, BICUBIC, CATMULLROM, and LANCZOS3.",
         { "param", "size", "vector2" },
         { "param", "filter", "string" },
         { "return", "Image" },
@@ -527,7 +706,7 @@ create a channel containing 1 or 0, respectively.]],
     {
         "method",
         "scaleBy",
-        "Just like scale(), except the new size is given as a multiple of the old size.",
+        "Just like scale(), except the new size is given as a multiple of the old size.  The factor must be large enough for the new size to be at least 1x1.",
         { "param", "factor", {"vector2","number"} },
         { "param", "filter", "string" },
         { "return", "Image" },
@@ -535,14 +714,34 @@ create a channel containing 1 or 0, respectively.]],
     {
         "method",
         "rotate",
-        "Create a new image the same as this one but rotated by the given angle (degrees).  The resulting image will have larger area if the angle is not a multiple of 90.",
+        "Create a new image the same as this one but rotated anticlockwise by the given angle (degrees).  The resulting image will have larger area if the angle is not a multiple of 90.  If it is, the pixels are moved exactly, as with rotate90.",
         { "param", "angle", "number" },
         { "return", "Image" },
     },
+    {
+        "method",
+        "rotate90",
+        "Create a new image the same as this one but rotated anticlockwise by the given number of quarter turns (default 1, may be negative).  No resampling is done, the pixels are moved exactly.",
+        { "param", "turns", "number", optional=true },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "transpose",
+        "Create a new image whose pixel (x,y) is pixel (y,x) of this one, i.e. reflected in its diagonal.",
+        { "return", "Image" },
+    },
     {
         "method",
         "clone",
-        "Create a new image identical to this one.  This is useful if you then modify it with set, drawImage, etc.",
+        "Create a new image identical to this one.  This is useful if you then modify it with set, drawImage, etc.  This takes constant time, the pixels are shared until either image is drawn into.",
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "pack",
+        "Create a copy of this image that stores each channel as U8 or U16 (clamped to the range 0 to 1) or F16 (half float), or FLOAT to convert back.  Packed images use less memory and are converted to float a row at a time as they are read, e.g. by arithmetic, sum, mean, minimum, maximum, variance and histogram.  Other methods work on a temporary FLOAT copy, so the image stays packed but each such call needs the memory of the whole image as FLOAT for as long as it runs; only drawing into it (or an in-place method) converts it to FLOAT for good.  NaN is packed as 0 in U8 and U16.  PLANAR stores each channel as a separate plane of floats, which arithmetic, abs, clamp, gamma and convolveSep process many pixels at a time, giving PLANAR images; anything else converts them back as it reads them.",
+        { "param", "storage", "string" },
         { "return", "Image" },
     },
     {
@@ -571,6 +770,73 @@ create a channel containing 1 or 0, respectively.]],
         { "param", "other", "Image" },
         { "return", "colour" },
     },
+    {
+        "method",
+        "sum",
+        "The sum of each channel over all the pixels, computed on all the threads.  The sum is compensated so it does not lose precision on large images, and does not depend on the number of threads.",
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "mean",
+        "The mean of each channel over all the pixels, computed as sum.",
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "minimum",
+        "The smallest value of each channel over all the pixels (as opposed to min, which compares two images).",
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "maximum",
+        "The largest value of each channel over all the pixels (as opposed to max, which compares two images).",
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "variance",
+        "The variance of each channel over all the pixels, i.e. the mean squared difference from the mean.  It is computed in a way that stays accurate when the variance is small compared to the mean.",
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "histogram",
+        "Count the values of each channel in the given number of bins, which divide the range from min to max (by default 0 to 1) equally.  The counts are returned as an image of size (bins, 1) with the same channels as this image, so the count of channel c in bin b is img:histogram(...)(b, 0)[c].  Values outside the range are counted in the first or last bin, and NaNs are not counted.  There can be at most 65536 bins.  The counts are exact up to 16777216 per bin; larger counts are rounded as floats are.  The counting is done on all the threads.",
+        { "param", "bins", "number" },
+        { "param", "min", "colour", optional=true },
+        { "param", "max", "colour", optional=true },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "percentile",
+        "The value of each channel below which the given fraction (0 to 1) of the pixels lie, interpolating between the two nearest pixels.  The result is exact: a histogram is used to find the few values that need sorting.",
+        { "param", "p", "number" },
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "median",
+        "Equivalent to percentile(0.5).",
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "autoLevels",
+        "Stretch each colour channel so that its low percentile (by default 0.005) becomes 0 and its high percentile (by default 0.995) becomes 1, clamping values outside that range.  The alpha channel is unchanged.",
+        { "param", "low", "number", optional=true },
+        { "param", "high", "number", optional=true },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "autoExposure",
+        "Scale the colour channels so that the median brightness (the average of the colour channels) becomes the target, by default 0.5.  The alpha channel is unchanged.",
+        { "param", "target", "number", optional=true },
+        { "return", "Image" },
+    },
     {
         "method",
         "max",
@@ -593,19 +859,40 @@ create a channel containing 1 or 0, respectively.]],
         { "param", "max", "colour" },
         { "return", "Image" },
     },
+    {
+        "method",
+        "clampInPlace",
+        "As clamp, but changing this image instead of making a new one.  Other images that share its pixels (e.g. clones) are not affected.",
+        { "param", "min", "colour" },
+        { "param", "max", "colour" },
+        { "return", "Image" },
+    },
     {
         "method",
         "abs",
         "The returned image is the absolute value of this image, i.e. negative pixel channel values are made positive.",
         { "return", "Image" },
     },
+    {
+        "method",
+        "absInPlace",
+        "As abs, but changing this image instead of making a new one.",
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "negateInPlace",
+        "As the unary minus operator, but changing this image instead of making a new one.",
+        { "return", "Image" },
+    },
     {
         "method",
         "convolve",
-        "Perform a convolution operation on this image, using the given kernel, to yield a new image.  The kernel must have a single channel and have an odd width and height.  The wrapx and wrapy control the behaviour at the edge of the image and default to false.  When not wrapping, the effect is to 'clamp' the lookups at the pixel border.",
+        "Perform a convolution operation on this image, using the given kernel, to yield a new image.  The kernel must have a single channel and have an odd width and height.  The wrapx and wrapy control the behaviour at the edge of the image and default to false.  When not wrapping, the effect is to 'clamp' the lookups at the pixel border.  The method can be \"DIRECT\", which sums over the kernel for every pixel, or \"FFT\", which is much faster for large kernels.  The default, \"AUTO\", picks whichever should be faster.  Both give the same result, up to floating point error.",
         { "param", "kernel", "Image" },
         { "param", "wrapx", "boolean", optional=true },
         { "param", "wrapy", "boolean", optional=true },
+        { "param", "method", "string", optional=true },
         { "return", "Image" },
     },
     {
@@ -624,6 +911,13 @@ create a channel containing 1 or 0, respectively.]],
         { "param", "n", "colour" },
         { "return", "Image" },
     },
+    {
+        "method",
+        "gammaInPlace",
+        "As gamma, but changing this image instead of making a new one.",
+        { "param", "n", "colour" },
+        { "return", "Image" },
+    },
     {
         "method",
         "quantise",
@@ -632,12 +926,26 @@ create a channel containing 1 or 0, respectively.]],
         { "param", "num_colours", "vector" },
         { "return", "Image" },
     },
+    {
+        "method",
+        "quantiseInPlace",
+        "As quantise, but changing this image instead of making a new one.",
+        { "param", "dither", "string" },
+        { "param", "num_colours", "vector" },
+        { "return", "Image" },
+    },
     {
         "method",
         "normalise",
         "Return a new image where the sum of all the positive pixel channels is 1, and the sum of all the negative pixel channels is -1.  This is useful for normalising kernels for convolutions, so that the overall brightness of the image is unchanged during the convolution.",
         { "return", "Image" },
     },
+    {
+        "method",
+        "normaliseInPlace",
+        "As normalise, but changing this image instead of making a new one.",
+        { "return", "Image" },
+    },
     {
         "method",
         "draw",
@@ -677,6 +985,59 @@ create a channel containing 1 or 0, respectively.]],
 -- }}}
 
 
+-- {{{ IntegralImage Class
+
+doc {
+    "class",
+    "IntegralImage",
+
+[[A summed-area table of an image, made with Image.integral().  It holds, in
+double precision, the sum of each channel over every rectangle that starts at
+the bottom left corner of the image.  The sum over any rectangle can then be
+found in constant time, so box filters built on it cost the same whatever
+their radius.]],
+
+    { "field", "channels", "number", "The number of channels of the image (including alpha).", },
+    { "field", "hasAlpha", "boolean", "Whether or not the last channel is an alpha channel.", },
+    { "field", "width", "number", "The width of the image.", },
+    { "field", "height", "number", "The height of the image.", },
+    { "field", "size", "vector2", "The width and height as a single value.", },
+    { "field", "numBytes", "number", "The memory used by the table.", },
+    {
+        "method",
+        "sum",
+        "The sum of each channel over the pixels of the given rectangle.  Only the part of the rectangle that lies on the image counts.",
+        { "param", "bottom_left", "vector2" },
+        { "param", "size", "vector2" },
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "mean",
+        "As sum, but divided by the number of pixels of the rectangle that lie on the image, of which there must be at least one.",
+        { "param", "bottom_left", "vector2" },
+        { "param", "size", "vector2" },
+        { "return", "colour" },
+    },
+    {
+        "method",
+        "boxBlur",
+        "A new image in which each pixel is the mean of the square of pixels within the given radius of it.  At the edges, only the pixels on the image are averaged.",
+        { "param", "radius", "number" },
+        { "return", "Image" },
+    },
+    {
+        "method",
+        "blur",
+        "As boxBlur, but with a radius for each pixel, from a 1 channel image of the same size.  Fractional radii blend the boxes of the two nearest whole radii, so the blur can vary smoothly across the image.",
+        { "param", "radii", "Image" },
+        { "return", "Image" },
+    },
+}
+
+-- }}}
+
+
 function emit_html_file(name, content_func)
 
     file = io.open(name,"w")
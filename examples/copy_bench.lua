@@ -0,0 +1,50 @@
+#!../luaimg.linux.x86_64 -F
+
+-- Times the operations that copy whole spans of pixels: wrapped and background crops, mirror, flip,
+-- clone and drawImage.  Run it before and after a change to compare.  Reading a pixel forces the
+-- lazy results, so that the copying is included in the time.
+
+local sz = vec(2048, 2048)
+local img = open("../examples/lena_std.png"):scale(sz, "BILINEAR")
+-- A third of the pixels are opaque, which drawImage copies without blending.
+local overlay = make(sz, 3, true, function(p)
+    return vec4(p.x / 2048, p.y / 2048, 0.5, p.x < 2048 / 3 and 1 or 0.5)
+end)
+
+-- The best of 5 runs of f, which may return its own time to leave out its setup.
+local function bench(name, f)
+    local best = 1e30
+    for i=1,5 do
+        local before = seconds()
+        local t = f()
+        best = min(best, t or seconds() - before)
+    end
+    print(string.format("%-20s %8.2f ms", name, best * 1000))
+end
+
+-- A forced copy of img to draw into, so that drawImage does not copy it first.
+local function target()
+    local dst = img * 1
+    dst(0, 0)
+    return dst
+end
+
+bench("crop-wrapped", function() img:crop(vec(-300, -500), sz + vec(600, 1000))(0, 0) end)
+bench("crop-background", function() img:crop(vec(-300, -500), sz + vec(600, 1000), vec(0, 0, 0))(0, 0) end)
+bench("crop-inside", function() img:crop(vec(100, 100), sz - vec(200, 200))(0, 0) end)
+bench("mirror", function() img:mirror()(0, 0) end)
+bench("flip", function() img:flip()(0, 0) end)
+-- The pixels of a clone are shared until it is drawn into, so draw a pixel to make it copy them.
+bench("clone", function() img:clone():draw(vec(0, 0), vec(0, 0, 0)) end)
+bench("drawImage", function()
+    local dst = target()
+    local before = seconds()
+    dst:drawImage(overlay, vec(0, 0))
+    return seconds() - before
+end)
+bench("drawImage-wrapped", function()
+    local dst = target()
+    local before = seconds()
+    dst:drawImage(overlay, vec(700, 900), true, true)
+    return seconds() - before
+end)
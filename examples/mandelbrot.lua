@@ -10,8 +10,8 @@ function mb_generate (sz, iters, bot_left, top_right)
     bot_left = bot_left or vec(-2.5, 0)
     top_right = top_right or vec(1.5, 1.5)
     print("Generating mandelbrot set of size: "..sz)
-    -- 1 channel texture, no alpha channel
-    mb = make(sz, 1, function(pos)
+    -- 1 channel texture, no alpha channel, computed on all threads
+    mb = makeParallel(sz, 1, function(pos)
         local c = vec(lerp(bot_left.x, top_right.x, pos.x/sz.x),
                       lerp(bot_left.y, top_right.y, pos.y/sz.y))
         local p = c
@@ -18,10 +18,12 @@ end
 function process_names(list)
     for _,fname in ipairs(list) do
         local counter = 0
-        open(fname):foreach(function(pix)
-            local qty = is_northern_lights(pix)
-            if qty > 0 then
-                counter = counter + qty
+        open(fname):foreachRow(function(y, row)
+            for x=1,#row do
+                local qty = is_northern_lights(row[x])
+                if qty > 0 then
+                    counter = counter + qty
+                end
             end
         end)
         print(floor(counter))
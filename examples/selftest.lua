@@ -55,6 +55,16 @@ function require_rms(name, a, b, thresh)
     end
 end
 
+function require_img_eq(name, a, b)
+    if a.size ~= b.size or a.allChannels ~= b.allChannels or a.hasAlpha ~= b.hasAlpha then
+        append_error(name..": images differ in size or channels")
+    elseif #(a - b):abs():maximum() ~= 0 then
+        append_error(name..": images were not identical")
+    else
+        num_success = num_success + 1
+    end
+end
+
 function require_img_eq_val(name, img, val)
     local bad = 0
     for y=0,img.height-1 do
@@ -163,10 +173,76 @@ try_io(imgbase, ".jpg", 1/40)
 
 --local imgbase_a_pma = imgbase_a:map(3,true,function(c)return vec4(c.xyz * c.w, c.w)end)
 try_io(imgbase_a, ".png", 1/255)
+try_io(imgbase, ".sfi", 0)
+try_io(imgbase_a, ".sfi", 0)
+do
+    local filename = os.tmpname()..".sfi"
+    imgbase_a:save(filename, "SFI_PADDED")
+    require_rms("sfi-map", open(filename, true), imgbase_a, 0)
+    imgbase_a:save(filename)
+    require_rms("sfi-map-unpadded", open(filename, true), imgbase_a, 0)
+    os.remove(filename)
+end
+for _,type in ipairs{"SFI2", "SFI2_HALF"} do
+    local filename = os.tmpname()..".sfi"
+    imgbase_a:save(filename, type)
+    require_rms("sfi-"..type, open(filename), imgbase_a, type == "SFI2" and 0 or 1/1000)
+    require_rms("sfi-region-"..type, open(filename, vec(3,2), vec(10,5)), imgbase_a:crop(vec(3,2), vec(10,5)),
+                type == "SFI2" and 0 or 1/1000)
+    if type == "SFI2_HALF" then
+        local packed = open(filename, "PACKED")
+        require_eq("sfi-packed-storage", packed.storage, "F16")
+        require_rms("sfi-packed", packed, open(filename), 0)
+    end
+    os.remove(filename)
+end
+
+for storage,thresh in pairs{U8=1/255, U16=1/65535, F16=1/1000, FLOAT=0, PLANAR=0} do
+    local packed = imgbase_a:pack(storage)
+    require_eq("pack-storage-"..storage, packed.storage, storage)
+    require_rms("pack-lazy-"..storage, packed + packed, imgbase_a + imgbase_a, 2*thresh)
+    require_rms("pack-"..storage, packed, imgbase_a, thresh)
+    require_eq("pack-kept-"..storage, packed.storage, storage)
+    packed:absInPlace()
+    require_eq("pack-unpacked-"..storage, packed.storage, "FLOAT")
+end
 
 
 lena = open("lena_std.png")
 lena_a = lena:map(lena.colourChannels,true,function(c)return vec4(c,0.5)end)
+do
+    local packed = open("lena_std.png", "PACKED")
+    require_eq("open-packed-storage", packed.storage, "U8")
+    require_eq("open-packed-bytes", packed.numBytes, lena.numBytes / 4)
+    require_rms("open-packed", packed, lena, 0)
+    require_rms("open-packed-crop", packed:crop(vec(10,20), vec(30,40)), lena:crop(vec(10,20), vec(30,40)), 0)
+    require_eq("open-packed-kept", packed.storage, "U8")
+    -- Reductions widen a few rows at a time, so they fit in far less than a FLOAT copy.
+    collectgarbage()
+    local old_budget = memory_budget()
+    memory_budget(memory_stats().live + lena.numBytes / 4)
+    local ok_sum, sum = pcall(packed.sum, packed)
+    local ok_hist, hist = pcall(packed.histogram, packed, 16)
+    memory_budget(old_budget)
+    require_eq("packed-sum-budget", ok_sum, true)
+    require_eq("packed-sum", sum, lena:sum())
+    require_eq("packed-histogram-budget", ok_hist, true)
+    require_rms("packed-histogram", hist, lena:histogram(16), 0)
+    require_eq("packed-sum-kept", packed.storage, "U8")
+end
+do
+    local planar = lena:pack("PLANAR")
+    local function still_planar(name, img, expected)
+        require_eq(name.."-storage", img.storage, "PLANAR")
+        require_rms(name, img, expected, 1e-6)
+    end
+    still_planar("planar-unm", -planar, -lena)
+    still_planar("planar-abs", (planar - 0.5):abs(), (lena - 0.5):abs())
+    still_planar("planar-clamp", planar:clamp(0.2, 0.6), lena:clamp(0.2, 0.6))
+    still_planar("planar-gamma", planar:gamma(2.2), lena:gamma(2.2))
+    still_planar("planar-zip", planar * planar + vec(0.1,0.2,0.3), lena * lena + vec(0.1,0.2,0.3))
+    still_planar("planar-convolve-sep", planar:convolveSep(gaussian(7)), lena:convolveSep(gaussian(7)))
+end
 
 -- SIMPLE TRANSFORMATIONS AND MAP
 function simpletrans(name,img)
@@ -175,15 +251,129 @@ function simpletrans(name,img)
     require_rms(name.."-map-mirror-rms", img:mirror(), img:map(img.colourChannels, img.hasAlpha, function(col, pos) return img(pos*vec(-1,1)+vec(img.width-1,0)) end))
     require_rms(name.."-map-flip-rms", img:flip(), img:map(img.colourChannels, img.hasAlpha, function(col, pos) return img(pos*vec(1,-1)+vec(0,img.height-1)) end))
     require_rms(name.."-flip-mirror-rotate180-rms", img:flip():mirror(), img:rotate(180), 1.2e-5)
+    local turned = vec(img.height, img.width)
+    require_rms(name.."-transpose-rms", img:transpose(), make(turned, img.colourChannels, img.hasAlpha, function(p) return img(vec(p.y, p.x)) end))
+    require_rms(name.."-rotate90-rms", img:rotate(90), make(turned, img.colourChannels, img.hasAlpha, function(p) return img(vec(img.width-1-p.y, p.x)) end))
+    require_rms(name.."-rotate270-rms", img:rotate(270), img:rotate90(-1))
+    require_rms(name.."-rotate90x4-rms", img:rotate90(4), img)
     local scaled = make(img.size*2, img.colourChannels, img.hasAlpha, function(p) return img(p/2) end)
     require_rms(name.."-map-scale-rms", img:scale(img.size*2,"LANCZOS3"), scaled,0.05)
 end
 
 require_rms("gaussian", gaussian(10), make(vec(10,1), 1, {1,9,36,84,126,126,84,36,9,1}):normalise())
+local lena_half = make(lena.size/2, 3, function(p)
+    return (lena(2*p) + lena(2*p+vec(1,0)) + lena(2*p+vec(0,1)) + lena(2*p+vec(1,1))) / 4
+end)
+require_rms("scale-box-half", lena:scale(lena.size/2, "BOX"), lena_half, 1e-6)
+for _,filter in ipairs{"BOX", "BILINEAR", "BSPLINE", "BICUBIC", "CATMULLROM", "LANCZOS3"} do
+    require_rms("scale-const-"..filter, make(vec(37,20),2,vec(0.25,0.5)):scale(vec(64,9), filter), vec(0.25,0.5), 1e-6)
+end
+require_eq("scale-zero", pcall(lena.scale, lena, vec(0,10), "BOX"), false)
+require_eq("scaleBy-zero", pcall(lena.scaleBy, lena, 0.001, "BOX"), false)
+local lena_mips = mipmaps(lena, "BOX")
+require_eq("mipmaps-count", #lena_mips, 1 + floor(log(max(lena.width, lena.height)) / log(2) + 0.5))
+require_rms("mipmaps-box", lena_mips[2], lena_half, 1e-6)
+require_rms("mipmaps-odd", mipmaps(make(vec(5,3),1,0.5), "BOX")[2], make(vec(2,1),1,0.5), 1e-6)
+require_rms("mipmaps-linear", mipmaps(make(vec(4,4),3,function(p) return (p.x+p.y)%2 end), "BOX", "LINEAR")[2],
+            vec3(0.5^(1/2.2)), 1e-5)
+do
+    -- Stripes of alpha that box filtering thins below the alpha test.
+    local stripes = make(vec(64,64), 3, true, function(p) return vec4(1, 1, 1, p.x % 4 == 0 and 0.5 + 0.5 * p.y / 63 or 0) end)
+    local function coverage(img) return img:map(1, false, function(c) return c.w > 0.5 and 1 or 0 end):mean() end
+    local top = coverage(stripes)
+    require_eq("mipmaps-coverage-thins", coverage(mipmaps(stripes, "BOX")[3]), 0)
+    local mips = mipmaps(stripes, "BOX", "ALPHA_COVERAGE", 0.5)
+    for i=2,4 do
+        require_eq("mipmaps-coverage-"..i, #(coverage(mips[i]) - top) <= 1 / mips[i].height, true)
+    end
+end
+do
+    -- Images of just alpha only come from files, so write the stripes as an SFI by hand: width,
+    -- height, channels, 'A' for alpha, then the floats (1 is 0x3f800000).
+    local filename = os.tmpname()..".sfi"
+    local f = io.open(filename, "wb")
+    f:write("\8\0\0\0", "\8\0\0\0", "\1", "A")
+    for y=0,7 do
+        for x=0,7 do
+            f:write(x % 4 == 0 and "\0\0\128\63" or "\0\0\0\0")
+        end
+    end
+    f:close()
+    local alpha = open(filename)
+    os.remove(filename)
+    local function alpha_only(img) return img.hasAlpha and img.allChannels == 1 end
+    local function coverage(img) return img:map(1, false, function(a) return a > 0.5 and 1 or 0 end):mean() end
+    require_eq("mipmaps-alpha-only-open", alpha_only(alpha), true)
+    local plain = mipmaps(alpha, "BOX")
+    local mips = mipmaps(alpha, "BOX", "ALPHA_COVERAGE", 0.5)
+    for i=2,#mips do
+        require_eq("mipmaps-alpha-only-"..i, alpha_only(plain[i]) and alpha_only(mips[i]), true)
+    end
+    require_eq("mipmaps-alpha-only-thins", coverage(plain[2]), 0)
+    require_eq("mipmaps-alpha-only-coverage", coverage(mips[2]) > 0, true)
+end
 simpletrans("lena",lena)
 simpletrans("lena-a",lena_a)
 simpletrans("lena.x",lena.x)
 simpletrans("imgbase",imgbase)
+do
+    local rotated = make(vec(37,20), 3, vec(0.2,0.4,0.6)):rotate(33, vec(0.2,0.4,0.6))
+    require_rms("rotate-flat", rotated, make(rotated.size, 3, vec(0.2,0.4,0.6)), 1e-6)
+
+    -- Bilinear sampling a pixel at a time, about the centre, where integer coordinates are pixel
+    -- centres and anything outside reads the background.
+    local function rotate_reference(img, angle, bg)
+        local s, c = math.sin(math.rad(angle)), math.cos(math.rad(angle))
+        local w, h = img.width, img.height
+        local size = vec(floor(#c*w + #s*h + 0.5), floor(#s*w + #c*h + 0.5))
+        local function at(x, y)
+            if x < 0 or y < 0 or x >= w or y >= h then return bg end
+            return img(x, y)
+        end
+        local function mix(a, b, t) return a + (b - a) * t end
+        return make(size, img.colourChannels, img.hasAlpha, function(p)
+            local rel_x, rel_y = p.x + 0.5 - size.x/2, p.y + 0.5 - size.y/2
+            local sx = c*rel_x - s*rel_y + w/2 - 0.5
+            local sy = s*rel_x + c*rel_y + h/2 - 0.5
+            if sx < -0.5 or sx >= w - 0.5 or sy < -0.5 or sy >= h - 0.5 then return bg end
+            local fx, fy = floor(sx), floor(sy)
+            return mix(mix(at(fx, fy), at(fx+1, fy), sx - fx),
+                       mix(at(fx, fy+1), at(fx+1, fy+1), sx - fx), sy - fy)
+        end)
+    end
+    -- A gradient under a checkerboard, so that misplaced samples or weights show.
+    local board = make(vec(45,31), 3, false, function(p)
+        return vec(p.x / 45, p.y / 31, (floor(p.x / 4) + floor(p.y / 4)) % 2)
+    end)
+    local board_a = board:map(3, true, function(c, p) return vec4(c, 1 - p.x / 90) end)
+    for _,angle in ipairs{33, 45, 90, 137, 180, 200, -71} do
+        local name = "rotate-board-"..angle
+        local rotated, expected = board:rotate(angle), rotate_reference(board, angle, vec(0,0,0))
+        require_eq(name.."-size", rotated.size, expected.size)
+        require_rms(name, rotated, expected, 1e-4)
+        local bg = vec4(0.2,0.4,0.6,0.8)
+        rotated, expected = board_a:rotate(angle, bg), rotate_reference(board_a, angle, bg)
+        require_eq(name.."-alpha-size", rotated.size, expected.size)
+        require_rms(name.."-alpha", rotated, expected, 1e-4)
+    end
+end
+
+-- crop, flip etc. read the pixels of the original, which is copied if it is drawn into
+do
+    local sheet = imgbase:clone()
+    local part = sheet:crop(vec(2,3), vec(5,4))
+    local mirrored = sheet:mirror()
+    local copy = sheet:clone()
+    require_rms("view-clone", copy, sheet)  -- now sharing the pixels of sheet
+    local part_expected = make(vec(5,4), 3, function(p) return imgbase(p + vec(2,3)) end)
+    sheet:drawLine(vec(0,0), vec(39,29), 3, vec4(1,0,0,1))
+    require_rms("view-crop-after-draw", part, part_expected)
+    require_rms("view-mirror-after-draw", mirrored, imgbase:mirror())
+    require_rms("view-clone-after-draw", copy, imgbase)
+    local part2 = imgbase:crop(vec(2,3), vec(5,4))
+    part2:drawLine(vec(0,0), vec(4,3), 1, vec4(0,1,0,1))
+    require_rms("view-draw-into-view", imgbase:crop(vec(2,3), vec(5,4)), part_expected)
+end
 
 --ARITHMETIC
 require_rms("add-rms", imgbase+1, vec(1,1,1)+imgbase)
@@ -218,6 +408,96 @@ local lena_max3 = vec(0,0,0)
 lena:foreach(function(a) local b=lena_max3 ; lena_max3 = vec(max(a.x, b.x), max(a.y, b.y), max(a.z,b.z)) end)
 require_eq("reduce", lena_max, lena_max2)
 require_eq("foreach", lena_max, lena_max3)
+local function max3(a, b) return vec(max(a.x, b.x), max(a.y, b.y), max(a.z,b.z)) end
+local lena_max4 = lena:reduceRows(vec(0,0,0), function(a, y, row)
+    for x=1,#row do a = max3(a, row[x]) end
+    return a
+end)
+local lena_max5 = vec(0,0,0)
+lena:foreachRow(function(y, row) for x=1,#row do lena_max5 = max3(lena_max5, row[x]) end end)
+require_eq("reduceRows", lena_max, lena_max4)
+require_eq("foreachRow", lena_max, lena_max5)
+require_eq("reduce-max", lena:reduce(vec(0,0,0), "max"), lena_max)
+require_eq("maximum", lena:maximum(), lena_max)
+require_eq("minimum", lena:minimum(), lena:reduce(vec(1,1,1), "min"))
+local lena_sum = lena:reduce(vec(0,0,0), function(a, b) return a + b end)
+require_close("sum", lena:sum(), lena_sum, 0.001)
+require_eq("reduce-sum", lena:reduce(vec(1,2,3), "+"), lena:sum() + vec(1,2,3))
+require_close("mean", lena:mean(), lena_sum / lena.numPixels, 0.001)
+local lena_mean = lena:mean()
+local lena_var = lena:reduce(vec(0,0,0), function(a, b) local d = b - lena_mean ; return a + d*d end) / lena.numPixels
+require_close("variance", lena:variance(), lena_var, 0.001)
+require_eq("variance-flat", make(vec(30,20), 1, 1000.25):variance(), 0)
+do
+    local ramp = make(vec(100,1), 1, function(p) return p.x / 100 end)
+    require_rms("histogram", ramp:histogram(4), make(vec(4,1), 1, 25))
+    require_rms("histogram-range", ramp:histogram(2, 0, 0.5), make(vec(2,1), 1, function(p) return p.x == 0 and 25 or 75 end))
+    require_eq("histogram-max-bins", ramp:histogram(65536).width, 65536)
+    require_eq("histogram-too-many-bins", pcall(ramp.histogram, ramp, 65537), false)
+    require_close("median", ramp:median(), 0.495, 0.0001)
+    require_close("percentile", ramp:percentile(0.9), 0.891, 0.0001)
+    local levelled = ramp:autoLevels(0.1, 0.9)
+    require_eq("autoLevels", levelled:minimum(), 0)
+    require_eq("autoLevels-max", levelled:maximum(), 1)
+    require_close("autoExposure", ramp:autoExposure(0.25):median(), 0.25, 0.0001)
+    require_eq("histogram-count", lena:histogram(16):sum(), vec(1, 1, 1) * lena.numPixels)
+end
+do
+    local small = make(vec(9,7), 2, function(p) return vec(p.x * p.x, p.y - p.x) end)
+    local function box_mean(p, r)
+        local total, n = vec(0, 0), 0
+        for y=max(0, p.y-r),min(6, p.y+r) do
+            for x=max(0, p.x-r),min(8, p.x+r) do
+                total, n = total + small(x, y), n + 1
+            end
+        end
+        return total / n
+    end
+    local integral = small:integral()
+    require_close("integral-sum", integral:sum(vec(-3,-3), vec(20,20)) + vec(1,1), small:sum() + vec(1,1), 1e-6)
+    require_eq("integral-rect", integral:sum(vec(2,1), vec(1,1)), small(2,1))
+    require_eq("integral-mean", integral:mean(vec(0,0), small.size), small:mean())
+    require_rms("boxBlur", small:boxBlur(2), make(small.size, 2, function(p) return box_mean(p, 2) end), 1e-6)
+    local radii = make(small.size, 1, function(p) return p.x / 4 end)
+    require_rms("blur", integral:blur(radii), make(small.size, 2, function(p)
+        local r = p.x / 4
+        local r0 = floor(r)
+        return (1 - (r - r0)) * box_mean(p, r0) + (r - r0) * box_mean(p, r0 + 1)
+    end), 1e-6)
+end
+require_rms("mapRows", imgbase:map(3, true, function(c, p) return vec4(c * p.x, p.y) end),
+            imgbase:mapRows(3, true, function(y, row, out)
+                for x=1,#row do out[x] = vec4(row[x] * (x-1), y) end
+            end))
+require_rms("makeRows", make(vec(7,5), 2, function(p) return p end),
+            makeRows(vec(7,5), 2, function(y, out) for x=0,6 do out[x+1] = vec(x, y) end end))
+do
+    -- The upvalues (a table, an image, and a C function) are copied into each thread's state.
+    local scale = {x=2, y=3}
+    local function f(c, p) return c * scale.x + imgbase(p) * scale.y + floor(p.x / 4) end
+    local function g(p) return p * scale.y end
+    require_rms("mapParallel", imgbase:mapParallel(3, f), imgbase:map(3, f))
+    require_rms("makeParallel", makeParallel(vec(50,40), 2, g), make(vec(50,40), 2, g))
+    local co = coroutine.create(function() end)
+    require_eq("mapParallel-refuse", pcall(imgbase.mapParallel, imgbase, 3, function(c) return co and c end), false)
+    -- Globals of the script and image constructors are refused rather than silently nil or racing.
+    selftest_global = 2
+    require_eq("mapParallel-global", pcall(imgbase.mapParallel, imgbase, 3, function(c) return c * selftest_global end), false)
+    selftest_global = nil
+    require_eq("mapParallel-make", pcall(imgbase.mapParallel, imgbase, 3, function(c) return make(vec(1,1), 3, c)(0,0) end), false)
+    require_eq("mapParallel-crop", pcall(imgbase.mapParallel, imgbase, 3, function(c, p) return imgbase:crop(p, vec(1,1))(0,0) end), false)
+end
+do
+    local tint = vec(0.5, 1, 2)
+    local w, h = imgbase.width, imgbase.height
+    require_rms("eval", imgbase:eval("c * tint + x*y", false, {tint=tint}),
+                imgbase:map(3, function(c, p) return c * tint + p.x/w * p.y/h end))
+    require_rms("eval-make", eval(vec(50,40), "vec(1-x^2, y^1.5, x*y)"),
+                make(vec(50,40), 3, function(p) local x, y = p.x/50, p.y/40 ; return vec(1-x^2, y^1.5, x*y) end))
+    require_rms("eval-alpha", eval(vec(7,5), "vec(pos, pos.x > 2)", true),
+                make(vec(7,5), 2, true, function(p) return vec(p.x, p.y, p.x > 2 and 1 or 0) end))
+    require_eq("eval-refuse", pcall(eval, vec(2,2), "x and y"), false)
+end
 
 -- SET
 img1 = make(vec(2,2), 3, 1)
@@ -232,6 +512,70 @@ imgn = make(vec(2,2), 3, 0.25)
 require_rms("norm1", imgn, img1:normalise())
 require_rms("norm2", imgn, img2:normalise())
 
+-- IN PLACE
+do
+    local img = lena:clone()  -- shares the pixels of lena until changed
+    require_eq("in-place-returns-self", img:gammaInPlace(2.2), img)
+    require_rms("in-place-gamma", img, lena:gamma(2.2))
+    require_rms("in-place-unshared", lena, open("lena_std.png"))
+    require_rms("in-place-clamp", img:clampInPlace(0.1, 0.9), lena:gamma(2.2):clamp(0.1, 0.9))
+    require_rms("in-place-negate", img:clone():negateInPlace(), -img)
+    require_rms("in-place-abs", (-img):absInPlace(), img)
+    require_rms("in-place-normalise", img:clone():normaliseInPlace(), img:normalise())
+    require_rms("in-place-quantise", img:clone():quantiseInPlace("FLOYD_STEINBERG", vec(4,8,8)),
+                img:quantise("FLOYD_STEINBERG", vec(4,8,8)))
+end
+
+-- MEMORY POOL
+do
+    collectgarbage()
+    local before = memory_stats()
+    local a = make(vec(123,45), 3, 0.5) + 0
+    a = nil
+    collectgarbage()
+    local b = make(vec(123,45), 3, 0.25) + 0
+    local after = memory_stats()
+    require_eq("pool-reuse", after.hits > before.hits, true)
+    require_img_eq_val("pool-reused-pixels", b, vec(0.25,0.25,0.25))
+    local old_budget = memory_budget()
+    memory_budget(after.live + 1024)
+    require_eq("pool-budget", pcall(make, vec(4096,4096), 4, 0), false)
+    memory_budget(old_budget)
+    require_eq("pool-peak", memory_stats().peak >= after.live, true)
+end
+do
+    -- A lazy result is written over an operand that only it owns, e.g. after free().
+    local t = imgbase:convolveSep(gaussian(3))
+    local expected = t * 2
+    expected(0, 0)
+    local r = t * 2
+    t:free()
+    local before = memory_stats()
+    r(0, 0)
+    local after = memory_stats()
+    require_eq("reuse-freed-operand", after.hits + after.misses, before.hits + before.misses)
+    require_rms("reuse-freed-operand-pixels", r, expected, 0)
+end
+
+do
+    local img = lena + 1
+    local lazy = img * 2
+    img:free()
+    require_eq("free-freed", img.freed, true)
+    require_eq("free-tostring", tostring(img), "Image (freed)")
+    require_eq("free-use", pcall(function() return img.width end), false)
+    require_rms("free-reader", lazy, (lena + 1) * 2)
+    img:free()
+    local garbage = make(vec(256,256), 4, 0) + 0
+    garbage = nil
+    local old_high_water = memory_high_water()
+    memory_high_water(memory_stats().live)
+    local before = memory_stats().collections
+    local _ = make(vec(300,300), 4, 0)
+    require_eq("high-water-collects", memory_stats().collections > before, true)
+    memory_high_water(old_high_water)
+end
+
 require_rms("swizzle-yz", lena.yz, lena:map(2,function(c)return c.yz end))
 require_rms("swizzle-zx", lena.zx, lena:map(2,function(c)return vec(c.z,c.x) end))
 require_rms("swizzle-xZ", lena.xZ, lena:map(1,true,function(c)return vec(c.x,c.z) end))
@@ -259,6 +603,21 @@ require_rms("crop2", lena:crop(vec(-10,-10),vec(800,800),vec(0.5,0.5,0.2)), make
     if p.y < 0 then return bg end
     return lena(p)
 end))
+require_rms("crop-wrap", imgbase:crop(vec(-25,-7), vec(100,70)), make(vec(100,70),3,function(p)
+    return imgbase(vec((p.x - 25) % imgbase.width, (p.y - 7) % imgbase.height))
+end))
+do
+    -- Opaque columns replace the destination, the rest are blended.
+    local src = make(vec(20,6), 3, true, function(p) return vec4(p.x/20, p.y/6, 0.5, p.x % 3 == 0 and 0.5 or 1) end)
+    local dst = imgbase:clone()
+    dst:drawImage(src, vec(-8,imgbase.height-2), true, true)
+    require_rms("draw-image-wrap", dst, make(imgbase.size, 3, function(p)
+        local sp = vec((p.x + 8) % imgbase.width, (p.y + 2) % imgbase.height)
+        if sp.x >= src.width or sp.y >= src.height then return imgbase(p) end
+        local c = src(sp)
+        return c.xyz * c.w + imgbase(p) * (1 - c.w)
+    end), 1e-6)
+end
 
 kernel = make(vec(5,5), 1, { 0,1,5,3,2, 0,1,6,2,3, 4,7,1,0,0, 2,5,4,4,1, 1,1,2,1,1, }):normalise()
 img = make(vec(5,5), 1, 0)
@@ -273,6 +632,77 @@ img2:draw(vec(2,2), 2);
 convolved = img2:convolveSep(kernel3):flip():mirror()/2
 require_rms("convolvesep", convolved, kernel2, 1e-8)
 
+kernel5 = make(vec(7,3), 1, function(p) return p.x + 2*p.y*p.y - 3 end)
+for _,wrap in ipairs{{false,false}, {true,false}, {false,true}, {true,true}} do
+    local name = "convolve-fft-"..tostring(wrap[1]).."-"..tostring(wrap[2])
+    local direct = lena:convolve(kernel5, wrap[1], wrap[2], "DIRECT")
+    require_rms(name, lena:convolve(kernel5, wrap[1], wrap[2], "FFT"), direct, 1e-5)
+end
+
+kernel4 = make(vec(5,1), 1, { 1,2,3,4,5 }):normalise()
+kernel4v = make(vec(1,5), 1, { 5,4,3,2,1 }):normalise()
+for _,wrap in ipairs{{false,false}, {true,false}, {false,true}, {true,true}} do
+    local name = "convolvesep-"..tostring(wrap[1]).."-"..tostring(wrap[2])
+    local twopass = lena:convolve(kernel4, wrap[1], wrap[2]):convolve(kernel4v, wrap[1], wrap[2])
+    require_rms(name, lena:convolveSep(kernel4, wrap[1], wrap[2]), twopass, 1e-6)
+end
+
 require_eq("blend-zero-alpha", (make(vec(1,1), 1, true, vec(1,0)) .. make(vec(1,1), 1, true, vec(0,0)))(0,0), vec(1,0))
 
+-- LAZY ARITHMETIC
+local blurred = lena:convolveSep(kernel3)
+require_rms("lazy-chain", (lena + (lena - blurred)) * 0.5, lena:map(3, function(c, p) return (c + (c - blurred(p))) * 0.5 end), 1e-7)
+local lazy_long = imgbase
+for i=1,40 do lazy_long = lazy_long + 1 end
+require_rms("lazy-long", lazy_long, imgbase + 40, 1e-5)
+local lazy_shared = imgbase * 2
+require_rms("lazy-shared", lazy_shared + lazy_shared, imgbase * 4)
+local lazy_dst = make(vec(2,2), 3, 1)
+local lazy_sum = lazy_dst + 1
+lazy_dst:draw(vec(0,0), 5)
+require_img_eq_val("lazy-draw", lazy_sum, vec(2,2,2))
+
+-- THREADS
+function threaded_ops()
+    local big = lena:scale(vec(1024,1024), "BILINEAR")
+    return {
+        lena_a:scale(vec(1024,1024), "BILINEAR") + big,
+        vec(0.5,0.2,0.1,0.3) .. big,
+        -big:gamma(2.2):clamp(0.1,0.9),
+        big:rotate(33),
+        big:crop(vec(-10,-20),vec(1100,1000)),
+        big:convolve(kernel),
+        big:normalise(),
+    }
+end
+local old_threads = threads()
+threads(1)
+local serial = threaded_ops()
+threads(8)
+local parallel = threaded_ops()
+threads(old_threads)
+for i=1,#serial do
+    require_img_eq("threads"..i, serial[i], parallel[i])
+end
+do
+    -- Compressed levels are written in one go, so check the blocks land in the same place however
+    -- they were shared out among the threads.
+    local function dds_bytes(n, fmt, levels)
+        local filename = os.tmpname()..".dds"
+        threads(n)
+        dds_save_simple(filename, fmt, levels)
+        threads(old_threads)
+        local f = io.open(filename, "rb")
+        local bytes = f:read("*a")
+        f:close()
+        os.remove(filename)
+        return bytes
+    end
+    local odd = lena_a:crop(vec(3,5), vec(256,64))
+    for _,case in ipairs{{"BC1", lena_a}, {"BC3", odd}, {"BC4", odd.x}, {"A8R8G8B8", odd}} do
+        local fmt, levels = case[1], mipmaps(case[2], "BOX")
+        require_eq("dds-threads-"..fmt, dds_bytes(1, fmt, levels) == dds_bytes(8, fmt, levels), true)
+    end
+end
+
 print_errors()
@@ -0,0 +1,259 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* The 1D transform (the factorisation and the butterflies) is derived from KISS FFT, by Mark
+ * Borgerding, whose licence follows (also in LICENSE-kissfft.txt).
+ *
+ * Copyright (c) 2003-2010, Mark Borgerding
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the author nor the names of any contributors may be used to
+ *       endorse or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// The 1D transform is a recursive decimation-in-time Cooley-Tukey: specialised butterflies for
+// radix 2, 3, 4 and 5, and a generic one for the other factors.
+
+#include <cmath>
+
+#include <algorithm>
+
+#include "fft.h"
+#include "parallel.h"
+
+unsigned fft_good_size (unsigned n)
+{
+    if (n <= 1) return 1;
+    for ( ; ; ++n) {
+        unsigned m = n;
+        while (m % 2 == 0) m /= 2;
+        while (m % 3 == 0) m /= 3;
+        while (m % 5 == 0) m /= 5;
+        if (m == 1) return n;
+    }
+}
+
+FFT::FFT (unsigned n, bool inverse)
+  : n(n), inverse(inverse), twiddles(n)
+{
+    for (unsigned i=0 ; i<n ; ++i) {
+        double phase = -2 * 3.1415926535897932385 * i / n;
+        if (inverse) phase = -phase;
+        twiddles[i] = Complex(cos(phase), sin(phase));
+    }
+
+    // Prefer radix 4, then 2, then odd numbers.
+    unsigned p = 4;
+    unsigned remaining = n;
+    do {
+        while (remaining % p != 0) {
+            switch (p) {
+                case 4: p = 2; break;
+                case 2: p = 3; break;
+                default: p += 2;
+            }
+            if (p * p > remaining) p = remaining;
+        }
+        remaining /= p;
+        factors.push_back(p);
+        factors.push_back(remaining);
+    } while (remaining > 1);
+}
+
+static void butterfly2 (Complex *out, size_t fstride, const Complex *tw, unsigned m)
+{
+    for (unsigned k=0 ; k<m ; ++k) {
+        Complex t = complex_mul(out[m+k], tw[k*fstride]);
+        out[m+k] = out[k] - t;
+        out[k] += t;
+    }
+}
+
+static void butterfly3 (Complex *out, size_t fstride, const Complex *tw, unsigned m)
+{
+    const float epi3 = tw[fstride*m].imag();
+    for (unsigned k=0 ; k<m ; ++k) {
+        Complex s1 = complex_mul(out[k+m], tw[k*fstride]);
+        Complex s2 = complex_mul(out[k+2*m], tw[k*fstride*2]);
+        Complex s3 = s1 + s2;
+        Complex s0 = (s1 - s2) * epi3;
+        Complex mid = out[k] - s3 * 0.5f;
+        out[k] += s3;
+        out[k+2*m] = Complex(mid.real() + s0.imag(), mid.imag() - s0.real());
+        out[k+m] = Complex(mid.real() - s0.imag(), mid.imag() + s0.real());
+    }
+}
+
+static void butterfly4 (Complex *out, size_t fstride, const Complex *tw, unsigned m, bool inverse)
+{
+    for (unsigned k=0 ; k<m ; ++k) {
+        Complex s0 = complex_mul(out[k+m], tw[k*fstride]);
+        Complex s1 = complex_mul(out[k+2*m], tw[k*fstride*2]);
+        Complex s2 = complex_mul(out[k+3*m], tw[k*fstride*3]);
+        Complex s5 = out[k] - s1;
+        out[k] += s1;
+        Complex s3 = s0 + s2;
+        Complex s4 = s0 - s2;
+        out[k+2*m] = out[k] - s3;
+        out[k] += s3;
+        // Multiply s4 by -i (forwards) or i (inverse).
+        Complex s4_rot = inverse ? Complex(-s4.imag(), s4.real()) : Complex(s4.imag(), -s4.real());
+        out[k+m] = s5 + s4_rot;
+        out[k+3*m] = s5 - s4_rot;
+    }
+}
+
+static void butterfly5 (Complex *out, size_t fstride, const Complex *tw, unsigned m)
+{
+    const Complex ya = tw[fstride*m];
+    const Complex yb = tw[fstride*2*m];
+    for (unsigned k=0 ; k<m ; ++k) {
+        Complex s0 = out[k];
+        Complex s1 = complex_mul(out[k+m], tw[k*fstride]);
+        Complex s2 = complex_mul(out[k+2*m], tw[k*fstride*2]);
+        Complex s3 = complex_mul(out[k+3*m], tw[k*fstride*3]);
+        Complex s4 = complex_mul(out[k+4*m], tw[k*fstride*4]);
+        Complex s7 = s1 + s4;
+        Complex s10 = s1 - s4;
+        Complex s8 = s2 + s3;
+        Complex s9 = s2 - s3;
+        out[k] += s7 + s8;
+        Complex s5 = s0 + s7 * ya.real() + s8 * yb.real();
+        Complex s6(s10.imag()*ya.imag() + s9.imag()*yb.imag(),
+                   -s10.real()*ya.imag() - s9.real()*yb.imag());
+        out[k+m] = s5 - s6;
+        out[k+4*m] = s5 + s6;
+        Complex s11 = s0 + s7 * yb.real() + s8 * ya.real();
+        Complex s12(-s10.imag()*yb.imag() + s9.imag()*ya.imag(),
+                    s10.real()*yb.imag() - s9.real()*ya.imag());
+        out[k+2*m] = s11 + s12;
+        out[k+3*m] = s11 - s12;
+    }
+}
+
+static void butterfly_generic (Complex *out, size_t fstride, const Complex *tw, unsigned m,
+                               unsigned p, unsigned n)
+{
+    std::vector<Complex> scratch(p);
+    for (unsigned u=0 ; u<m ; ++u) {
+        for (unsigned q=0 ; q<p ; ++q) scratch[q] = out[u + q*m];
+        for (unsigned q1=0 ; q1<p ; ++q1) {
+            unsigned k = u + q1*m;
+            size_t twidx = 0;
+            Complex acc = scratch[0];
+            for (unsigned q=1 ; q<p ; ++q) {
+                twidx += fstride * k;
+                if (twidx >= n) twidx %= n;
+                acc += complex_mul(scratch[q], tw[twidx]);
+            }
+            out[k] = acc;
+        }
+    }
+}
+
+void FFT::work (Complex *out, const Complex *in, size_t fstride, size_t in_stride,
+                const unsigned *f) const
+{
+    unsigned p = f[0];
+    unsigned m = f[1];
+    if (m == 1) {
+        for (unsigned i=0 ; i<p ; ++i) out[i] = in[i * fstride * in_stride];
+    } else {
+        for (unsigned i=0 ; i<p ; ++i) {
+            work(&out[i*m], &in[i * fstride * in_stride], fstride * p, in_stride, f + 2);
+        }
+    }
+    switch (p) {
+        case 2: butterfly2(out, fstride, &twiddles[0], m); break;
+        case 3: butterfly3(out, fstride, &twiddles[0], m); break;
+        case 4: butterfly4(out, fstride, &twiddles[0], m, inverse); break;
+        case 5: butterfly5(out, fstride, &twiddles[0], m); break;
+        default: butterfly_generic(out, fstride, &twiddles[0], m, p, n);
+    }
+}
+
+void FFT::transform (const Complex *in, size_t in_stride, Complex *out) const
+{
+    if (n == 1) {
+        out[0] = in[0];
+        return;
+    }
+    work(out, in, 1, in_stride, &factors[0]);
+}
+
+void fft_2d (Complex *grid, unsigned width, unsigned height, bool inverse)
+{
+    FFT row_fft(width, inverse);
+    FFT col_fft(height, inverse);
+
+    // Cost of a transform is roughly n log n.
+    unsigned long row_work = width * (1 + unsigned(log2(width)));
+    parallel_rows(height, row_work, [&] (uint32_t y0, uint32_t y1) {
+        std::vector<Complex> buf(width);
+        for (uint32_t y=y0 ; y<y1 ; ++y) {
+            row_fft.transform(&grid[size_t(y) * width], 1, &buf[0]);
+            std::copy(buf.begin(), buf.end(), &grid[size_t(y) * width]);
+        }
+    });
+
+    // The columns are treated as rows here.  They are copied out and back in blocks, so that each
+    // cache line of the grid is only visited once.
+    const unsigned block = 8;
+    unsigned blocks = (width + block - 1) / block;
+    unsigned long col_work = block * height * (1 + unsigned(log2(height)));
+    parallel_rows(blocks, col_work, [&] (uint32_t b0, uint32_t b1) {
+        std::vector<Complex> in(block * height);
+        std::vector<Complex> out(block * height);
+        for (uint32_t b=b0 ; b<b1 ; ++b) {
+            unsigned x0 = b * block;
+            unsigned bw = std::min(block, width - x0);
+            for (unsigned y=0 ; y<height ; ++y) {
+                for (unsigned i=0 ; i<bw ; ++i) in[i*height + y] = grid[size_t(y) * width + x0 + i];
+            }
+            for (unsigned i=0 ; i<bw ; ++i) col_fft.transform(&in[i*height], 1, &out[i*height]);
+            for (unsigned y=0 ; y<height ; ++y) {
+                for (unsigned i=0 ; i<bw ; ++i) grid[size_t(y) * width + x0 + i] = out[i*height + y];
+            }
+        }
+    });
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <complex>
+#include <vector>
+
+typedef std::complex<float> Complex;
+
+/** Complex multiply without the inf/nan special cases of operator*, which stop it being inlined. */
+static inline Complex complex_mul (const Complex &a, const Complex &b)
+{
+    return Complex(a.real()*b.real() - a.imag()*b.imag(), a.real()*b.imag() + a.imag()*b.real());
+}
+
+/** The smallest length >= n that has no prime factors other than 2, 3, and 5, for which the FFT is
+ * fastest. */
+unsigned fft_good_size (unsigned n);
+
+/** A mixed-radix complex FFT of a fixed length.  Any length works, but lengths from fft_good_size
+ * are much faster. */
+class FFT {
+
+    unsigned n;
+    bool inverse;
+
+    // Pairs of (radix, remaining length) for each stage.
+    std::vector<unsigned> factors;
+
+    // exp(-2 pi i k / n) for forwards, or its conjugate for the inverse transform.
+    std::vector<Complex> twiddles;
+
+    void work (Complex *out, const Complex *in, size_t fstride, size_t in_stride,
+               const unsigned *factors) const;
+
+    public:
+
+    FFT (unsigned n, bool inverse);
+
+    unsigned length (void) const { return n; }
+
+    /** Transform n values read from in[0], in[in_stride], ... into out[0] to out[n-1].  The inverse
+     * transform is not scaled, so a round trip multiplies by n.  in and out must not overlap. */
+    void transform (const Complex *in, size_t in_stride, Complex *out) const;
+};
+
+/** In-place 2D FFT of a row-major grid of width * height values, using the thread pool.  Like the
+ * 1D transform, the inverse is not scaled. */
+void fft_2d (Complex *grid, unsigned width, unsigned height, bool inverse);
+
+#endif
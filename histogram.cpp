@@ -0,0 +1,251 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cmath>
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "histogram.h"
+#include "parallel.h"
+
+/** Values handed to each band by histogram_chunks. */
+static const size_t HISTOGRAM_CHUNK = 1 << 14;
+
+// Call f(i0, i1) on all the threads for runs of indexes that together cover [0, n).
+static void histogram_chunks (size_t n, const std::function<void(size_t, size_t)> &f)
+{
+    size_t chunks = (n + HISTOGRAM_CHUNK - 1) / HISTOGRAM_CHUNK;
+    parallel_rows(chunks, HISTOGRAM_CHUNK, [&] (uint32_t c0, uint32_t c1) {
+        f(c0 * HISTOGRAM_CHUNK, std::min(n, c1 * HISTOGRAM_CHUNK));
+    });
+}
+
+// The bin of v, for bins over [lo, lo + bins/scale].  v must not be NaN.
+static inline unsigned histogram_bin (float v, float lo, float scale, unsigned bins)
+{
+    float f = (v - lo) * scale;
+    // Also catches NaN from an infinite range.
+    if (!(f > 0)) return 0;
+    return f >= bins ? bins - 1 : unsigned(f);
+}
+
+static inline float histogram_scale (float lo, float hi, unsigned bins)
+{
+    return hi > lo ? bins / (hi - lo) : 0;
+}
+
+ImageBase *image_histogram (const ImageBase *img, unsigned bins, const float *lo, const float *hi)
+{
+    const chan_t chans = img->channels();
+    const uimglen_t width = img->width;
+    // A lazy image (e.g. a packed one) is widened a few rows at a time instead of computed.
+    const float *raw = img->lazy() ? NULL : img->raw();
+    const uimglen_t block = uimglen_t(std::max(size_t(1), HISTOGRAM_CHUNK / std::max(width, uimglen_t(1))));
+    std::vector<float> scale(chans);
+    for (chan_t c=0 ; c<chans ; ++c) scale[c] = histogram_scale(lo[c], hi[c], bins);
+
+    // Bins are kept per thread rather than per band: a band takes a free set of bins (or makes one if
+    // all are in use) and puts it back when done, so there are never more sets than threads.
+    const size_t total_size = size_t(bins) * chans;
+    std::deque<std::vector<uint64_t>> sets;  // Growing a deque keeps the sets in place.
+    std::vector<std::vector<uint64_t>*> free_sets;
+    std::mutex mutex;
+    parallel_rows(img->height, size_t(width) * chans, [&] (uimglen_t y0, uimglen_t y1) {
+        std::vector<uint64_t> *counts;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (free_sets.empty()) {
+                sets.emplace_back(total_size);
+                free_sets.push_back(&sets.back());
+            }
+            counts = free_sets.back();
+            free_sets.pop_back();
+        }
+        std::vector<float> buf;
+        for (uimglen_t b0=y0, b1 ; b0<y1 ; b0=b1) {
+            b1 = b0 + std::min(block, uimglen_t(y1 - b0));
+            const float *in;
+            if (raw != NULL) {
+                in = raw + size_t(b0) * width * chans;
+            } else {
+                buf.resize(size_t(b1 - b0) * width * chans);
+                img->readRows(b0, b1, buf.data());
+                in = buf.data();
+            }
+            for (size_t i=0, n=size_t(b1 - b0)*width ; i<n ; ++i) {
+                for (chan_t c=0 ; c<chans ; ++c) {
+                    float v = in[i*chans + c];
+                    if (std::isnan(v)) continue;
+                    (*counts)[histogram_bin(v, lo[c], scale[c], bins)*chans + c]++;
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        free_sets.push_back(counts);
+    });
+
+    std::vector<uint64_t> total(total_size);
+    for (const auto &counts : sets) {
+        for (size_t j=0 ; j<total_size ; ++j) total[j] += counts[j];
+    }
+
+    ImageBase *ret = image_new(img->channels(), img->hasAlpha(), bins, 1);
+    float *out = ret->raw();
+    for (size_t j=0 ; j<total.size() ; ++j) out[j] = total[j];
+    return ret;
+}
+
+float float_percentile (const float *data, size_t n, size_t stride, float p)
+{
+    std::mutex mutex;
+
+    // The range and number of the values.
+    float lo = INFINITY, hi = -INFINITY;
+    size_t count = 0;
+    histogram_chunks(n, [&] (size_t i0, size_t i1) {
+        float lo_ = INFINITY, hi_ = -INFINITY;
+        size_t count_ = 0;
+        for (size_t i=i0 ; i<i1 ; ++i) {
+            float v = data[i*stride];
+            if (std::isnan(v)) continue;
+            lo_ = std::min(lo_, v);
+            hi_ = std::max(hi_, v);
+            count_++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        lo = std::min(lo, lo_);
+        hi = std::max(hi, hi_);
+        count += count_;
+    });
+    if (count == 0) return NAN;
+
+    p = std::min(std::max(p, 0.0f), 1.0f);
+    double rank = double(p) * (count - 1);
+    size_t k0 = size_t(rank);
+    size_t k1 = std::min(k0 + 1, count - 1);
+
+    // Which bins hold the values of rank k0 and k1.
+    const unsigned bins = HISTOGRAM_SELECT_BINS;
+    const float scale = histogram_scale(lo, hi, bins);
+    std::vector<size_t> counts(bins);
+    histogram_chunks(n, [&] (size_t i0, size_t i1) {
+        std::vector<size_t> counts_(bins);
+        for (size_t i=i0 ; i<i1 ; ++i) {
+            float v = data[i*stride];
+            if (!std::isnan(v)) counts_[histogram_bin(v, lo, scale, bins)]++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned b=0 ; b<bins ; ++b) counts[b] += counts_[b];
+    });
+    unsigned b0 = 0;
+    size_t before = 0;
+    while (before + counts[b0] <= k0) before += counts[b0++];
+    unsigned b1 = b0;
+    for (size_t upto = before + counts[b0] ; upto <= k1 ; upto += counts[++b1]) { }
+
+    // Select the values from those bins.
+    std::vector<float> kept;
+    histogram_chunks(n, [&] (size_t i0, size_t i1) {
+        std::vector<float> kept_;
+        for (size_t i=i0 ; i<i1 ; ++i) {
+            float v = data[i*stride];
+            if (std::isnan(v)) continue;
+            unsigned b = histogram_bin(v, lo, scale, bins);
+            if (b >= b0 && b <= b1) kept_.push_back(v);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        kept.insert(kept.end(), kept_.begin(), kept_.end());
+    });
+    auto nth = kept.begin() + (k0 - before);
+    std::nth_element(kept.begin(), nth, kept.end());
+    float v0 = *nth;
+    if (k1 == k0) return v0;
+    float v1 = *std::min_element(nth + 1, kept.end());
+    if (v1 == v0) return v0;
+    return v0 + float(rank - k0) * (v1 - v0);
+}
+
+void image_percentile (const ImageBase *img, float p, float *out)
+{
+    const chan_t chans = img->channels();
+    const float *raw = img->raw();
+    for (chan_t c=0 ; c<chans ; ++c) out[c] = float_percentile(raw + c, img->numPixels(), chans, p);
+}
+
+// A new image with each colour channel c of img mapped to v*gain[c] + offset[c].
+static ImageBase *histogram_scale_image (const ImageBase *img, const std::vector<float> &gain,
+                                         const std::vector<float> &offset, bool clamp)
+{
+    const chan_t chans = img->channels(), colour = img->colourChannels();
+    const float *in = img->raw();
+    ImageBase *ret = image_new(img->channels(), img->hasAlpha(), img->width, img->height);
+    float *out = ret->raw();
+    const size_t row = size_t(img->width) * chans;
+    parallel_rows(img->height, row, [&] (uint32_t y0, uint32_t y1) {
+        for (size_t i=y0*row ; i<y1*row ; i+=chans) {
+            for (chan_t c=0 ; c<chans ; ++c) {
+                float v = in[i + c];
+                if (c < colour) {
+                    v = v * gain[c] + offset[c];
+                    if (clamp) v = std::min(std::max(v, 0.0f), 1.0f);
+                }
+                out[i + c] = v;
+            }
+        }
+    });
+    return ret;
+}
+
+ImageBase *image_auto_levels (const ImageBase *img, float low, float high)
+{
+    const chan_t chans = img->channels();
+    std::vector<float> lo(chans), hi(chans), gain(chans, 1), offset(chans, 0);
+    image_percentile(img, low, &lo[0]);
+    image_percentile(img, high, &hi[0]);
+    for (chan_t c=0 ; c<img->colourChannels() ; ++c) {
+        if (!(hi[c] > lo[c])) continue;
+        gain[c] = 1 / (hi[c] - lo[c]);
+        offset[c] = -lo[c] * gain[c];
+    }
+    return histogram_scale_image(img, gain, offset, true);
+}
+
+ImageBase *image_auto_exposure (const ImageBase *img, float target)
+{
+    const chan_t chans = img->channels(), colour = img->colourChannels();
+    const float *in = img->raw();
+    std::vector<float> average(img->numPixels());
+    parallel_rows(img->height, img->width, [&] (uint32_t y0, uint32_t y1) {
+        for (size_t i=size_t(y0)*img->width ; i<size_t(y1)*img->width ; ++i) {
+            float total = 0;
+            for (chan_t c=0 ; c<colour ; ++c) total += in[i*chans + c];
+            average[i] = total / colour;
+        }
+    });
+    float median = float_percentile(average.empty() ? NULL : &average[0], average.size(), 1, 0.5);
+    float gain = median > 0 ? target / median : 1;
+    return histogram_scale_image(img, std::vector<float>(chans, gain), std::vector<float>(chans, 0), false);
+}
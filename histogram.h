@@ -0,0 +1,59 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "image.h"
+
+/** Bins used to narrow down the values at a given rank before selecting them exactly. */
+static const unsigned HISTOGRAM_SELECT_BINS = 4096;
+
+/** The most bins image_histogram will count into. */
+static const unsigned HISTOGRAM_MAX_BINS = 1 << 16;
+
+/** Count the values of each channel of img in bins equal divisions of [lo[c], hi[c]], giving a
+ * bins x 1 image of the same channels whose pixel b holds the counts of bin b.  Values outside the
+ * range are counted in the first or last bin, and NaNs are not counted.  The counting is shared
+ * among the threads, each with bins of its own, which are added up at the end.  The counts are
+ * exact up to 2^24 per bin, beyond which they are rounded to the nearest float. */
+ImageBase *image_histogram (const ImageBase *img, unsigned bins, const float *lo, const float *hi);
+
+/** The p-quantile (p from 0 to 1) of n floats at data, data+stride, ..., ignoring NaNs, interpolated
+ * linearly between the two nearest values (as in numpy).  It is exact: a histogram finds the bins
+ * that hold the ranks wanted, and only the values in those bins are kept and selected from.  NaN is
+ * returned if there are no values. */
+float float_percentile (const float *data, size_t n, size_t stride, float p);
+
+/** The p-quantile of each channel of img, into out[0..channels). */
+void image_percentile (const ImageBase *img, float p, float *out);
+
+/** A new image in which each colour channel is stretched linearly so that its low-quantile is 0
+ * and its high-quantile is 1, clamped to [0, 1].  Channels whose quantiles are equal, and alpha,
+ * are unchanged. */
+ImageBase *image_auto_levels (const ImageBase *img, float low, float high);
+
+/** A new image in which the colour channels are scaled so that the median of the pixels' average
+ * colour channel becomes target.  The image is unchanged if that median is not positive. */
+ImageBase *image_auto_exposure (const ImageBase *img, float target);
+
+#endif
@@ -29,6 +29,9 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <set>
+#include <vector>
 
 extern "C" {
 	#include <FreeImage.h>
@@ -245,10 +248,49 @@ template<> FIBITMAP *image_to_fibitmap (const Image<1,0> *image, uimglen_t width
     return output;
 }
 
+// As image_from_fibitmap, but keeping the 8 bit samples.
+template<chan_t ch, chan_t ach> Image<ch,ach> *image_from_fibitmap_packed (FIBITMAP *input, uimglen_t width, uimglen_t height)
+{
+    std::vector<uint8_t> samples(size_t(width) * height * (ch+ach));
+
+    // Greyscale images have one byte per pixel.
+    int channel_offset[4] = { FI_RGBA_RED, FI_RGBA_GREEN, FI_RGBA_BLUE, FI_RGBA_ALPHA };
+    if (ch+ach == 1) channel_offset[0] = 0;
+
+    uint8_t *out = samples.data();
+    for (uimglen_t y=0 ; y<height ; y++) {
+
+        BYTE *raw = FreeImage_GetScanLine(input, y);
+
+        for (uimglen_t x=0 ; x<width ; x++) {
+
+            for (chan_t c=0 ; c<ch+ach ; ++c)
+                *(out++) = raw[channel_offset[c]];
+
+            raw += ch+ach;
+        }
+    }
+
+    return new Image<ch,ach>(width, height, new ImageExprPacked<ch,ach,uint8_t>(std::move(samples)));
+}
+
+// For FIT_RGB16 and FIT_RGBA16, whose scanlines are already in our channel order.
+template<chan_t ch, chan_t ach> Image<ch,ach> *image_from_fibitmap_packed16 (FIBITMAP *input, uimglen_t width, uimglen_t height)
+{
+    const size_t row = size_t(width) * (ch+ach);
+    std::vector<uint16_t> samples(row * height);
+
+    for (uimglen_t y=0 ; y<height ; y++) {
+        memcpy(&samples[y * row], FreeImage_GetScanLine(input, y), row * sizeof(uint16_t));
+    }
+
+    return new Image<ch,ach>(width, height, new ImageExprPacked<ch,ach,uint16_t>(std::move(samples)));
+}
 
 
 
-ImageBase *image_load (const std::string &filename)
+
+ImageBase *image_load (const std::string &filename, bool map, bool packed)
 {
     size_t dot = filename.rfind('.');
     if (dot == std::string::npos) {
@@ -262,7 +304,7 @@ ImageBase *image_load (const std::string &filename)
 
     if (ext == "sfi") {
 
-        return sfi_open(filename);
+        return sfi_open(filename, map, packed);
 
     } else {
 
@@ -301,7 +343,8 @@ ImageBase *image_load (const std::string &filename)
             
                 switch (bits) {
                     case 8: {
-                        ImageBase *my_image = image_from_fibitmap<1,0>(input, width, height);
+                        ImageBase *my_image = packed ? image_from_fibitmap_packed<1,0>(input, width, height)
+                                                     : image_from_fibitmap<1,0>(input, width, height);
                         FreeImage_Unload(input);
                         return my_image;
                     }
@@ -313,13 +356,15 @@ ImageBase *image_load (const std::string &filename)
                     }
                         
                     case 24: {
-                        ImageBase *my_image = image_from_fibitmap<3,0>(input, width, height);
+                        ImageBase *my_image = packed ? image_from_fibitmap_packed<3,0>(input, width, height)
+                                                     : image_from_fibitmap<3,0>(input, width, height);
                         FreeImage_Unload(input);
                         return my_image;
                     }
                         
                     case 32: {
-                        ImageBase *my_image = image_from_fibitmap<3,1>(input, width, height);
+                        ImageBase *my_image = packed ? image_from_fibitmap_packed<3,1>(input, width, height)
+                                                     : image_from_fibitmap<3,1>(input, width, height);
                         FreeImage_Unload(input);
                         return my_image;
                     }
@@ -360,13 +405,15 @@ ImageBase *image_load (const std::string &filename)
             EXCEPT << "Couldn't read "<<filename<<": Unsupported image type: COMPLEX." << ENDL;
 
             case FIT_RGB16: {
-                Image<3,0> * my_image = image_from_fibitmap_rgb16(input, width, height);
+                Image<3,0> * my_image = packed ? image_from_fibitmap_packed16<3,0>(input, width, height)
+                                               : image_from_fibitmap_rgb16(input, width, height);
                 FreeImage_Unload(input);
                 return my_image;
             }
 
             case FIT_RGBA16: {
-                Image<3,1> * my_image = image_from_fibitmap_rgba16(input, width, height);
+                Image<3,1> * my_image = packed ? image_from_fibitmap_packed16<3,1>(input, width, height)
+                                               : image_from_fibitmap_rgba16(input, width, height);
                 FreeImage_Unload(input);
                 return my_image;
             }
@@ -387,6 +434,112 @@ ImageBase *image_load (const std::string &filename)
     }
 }
 
+ImageBase *image_load_region (const std::string &filename, uimglen_t left, uimglen_t bottom,
+                              uimglen_t width, uimglen_t height)
+{
+    size_t dot = filename.rfind('.');
+    if (dot != std::string::npos && filename.substr(dot+1) == "sfi") {
+        return sfi_open_region(filename, left, bottom, width, height);
+    }
+    ImageBase *whole = image_load(filename);
+    if (whole == NULL) return NULL;
+    if (left > whole->width || width > whole->width - left
+        || bottom > whole->height || height > whole->height - bottom) {
+        delete whole;
+        EXCEPT << filename << ": region (" << left << ", " << bottom << ") size (" << width << ", "
+               << height << ") is outside the image." << ENDL;
+    }
+    ImageBase *r = whole->crop(left, bottom, width, height, NULL);
+    delete whole;
+    return r;
+}
+
+// Rows of img are computed one at a time if it is lazy, so repacking a packed image never holds
+// all of it as floats.
+template<chan_t ch, chan_t ach, class T> static ImageBase *image_pack2 (const ImageBase *img_)
+{
+    auto *img = static_cast<const Image<ch,ach>*>(img_);
+    const uimglen_t width = img->width;
+    const size_t row = size_t(width) * (ch+ach);
+    const unsigned nodes = img->exprNodes();
+    std::vector<T> samples(row * img->height);
+    parallel_rows(img->height, size_t(width) * (nodes + 1), [&] (uimglen_t y0, uimglen_t y1) {
+        // A buffer for the row itself, and one per node of its expression.
+        ExprScratch scratch(size_t(nodes + 1) * width * 4);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            size_t mark = scratch.mark();
+            const float *in = reinterpret_cast<const float*>(img->row(y, scratch));
+            T *out = samples.data() + y * row;
+            for (size_t i=0 ; i<row ; ++i) out[i] = PackedSample<T>::encode(in[i]);
+            scratch.release(mark);
+        }
+    });
+    return new Image<ch,ach>(width, img->height, new ImageExprPacked<ch,ach,T>(std::move(samples)));
+}
+
+template<chan_t ch, chan_t ach> static ImageBase *image_unpack2 (const ImageBase *img_)
+{
+    auto *img = static_cast<const Image<ch,ach>*>(img_);
+    const uimglen_t width = img->width;
+    const unsigned nodes = img->exprNodes();
+    auto *ret = new Image<ch,ach>(width, img->height);
+    parallel_rows(img->height, size_t(width) * (nodes + 1), [&] (uimglen_t y0, uimglen_t y1) {
+        ExprScratch scratch(size_t(nodes + 1) * width * 4);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            size_t mark = scratch.mark();
+            std::copy_n(img->row(y, scratch), width, &ret->pixel(0, y));
+            scratch.release(mark);
+        }
+    });
+    return ret;
+}
+
+template<chan_t ch, chan_t ach> static ImageBase *image_planar2 (const ImageBase *img_)
+{
+    auto *img = static_cast<const Image<ch,ach>*>(img_);
+    const uimglen_t width = img->width;
+    const unsigned nodes = img->exprNodes();
+    auto *e = new ImageExprPlanar<ch,ach>(width, img->height);
+    auto *ret = new Image<ch,ach>(width, img->height, e);
+    parallel_rows(img->height, size_t(width) * (nodes + 1), [&] (uimglen_t y0, uimglen_t y1) {
+        ExprScratch scratch(size_t(nodes + 1) * width * 4);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            size_t mark = scratch.mark();
+            const Colour<ch,ach> *in = img->row(y, scratch);
+            for (chan_t c=0 ; c<ch+ach ; ++c) {
+                float *out = e->plane(c) + size_t(y) * width;
+                for (uimglen_t x=0 ; x<width ; ++x) out[x] = in[x][c];
+            }
+            scratch.release(mark);
+        }
+    });
+    return ret;
+}
+
+template<chan_t ch, chan_t ach> static ImageBase *image_pack1 (const ImageBase *img, PixelStorage storage)
+{
+    switch (storage) {
+        case PS_FLOAT: return image_unpack2<ch,ach>(img);
+        case PS_U8: return image_pack2<ch,ach,uint8_t>(img);
+        case PS_U16: return image_pack2<ch,ach,uint16_t>(img);
+        case PS_F16: return image_pack2<ch,ach,Half>(img);
+        case PS_PLANAR: return image_planar2<ch,ach>(img);
+    }
+    return NULL;
+}
+
+ImageBase *image_pack (const ImageBase *img, PixelStorage storage)
+{
+    switch (img->channels()) {
+        case 1: return img->hasAlpha() ? image_pack1<0,1>(img, storage) : image_pack1<1,0>(img, storage);
+        case 2: return img->hasAlpha() ? image_pack1<1,1>(img, storage) : image_pack1<2,0>(img, storage);
+        case 3: return img->hasAlpha() ? image_pack1<2,1>(img, storage) : image_pack1<3,0>(img, storage);
+        case 4: return img->hasAlpha() ? image_pack1<3,1>(img, storage) : image_pack1<4,0>(img, storage);
+        default:;
+    }
+    return NULL;
+}
+
 void image_save (ImageBase *image, const std::string &filename, const std::string &type)
 {
     size_t dot = filename.rfind('.');
@@ -404,7 +557,17 @@ void image_save (ImageBase *image, const std::string &filename, const std::strin
 
     if (ext == "sfi") {
 
-        sfi_save(filename, image);
+        SFIFormat format = SFI_RAW;
+        if (type == "SFI2") {
+            format = SFI_TILED;
+        } else if (type == "SFI2_HALF") {
+            format = SFI_TILED_HALF;
+        } else if (type == "SFI_PADDED") {
+            format = SFI_RAW_PADDED;
+        } else if (type != "AUTO") {
+            EXCEPT << "Unknown sfi type: " << type << ENDL;
+        }
+        sfi_save(filename, image, format);
 
     } else {
 
@@ -486,106 +649,180 @@ void image_save (ImageBase *image, const std::string &filename, const std::strin
     }
 }
 
-FREE_IMAGE_FILTER to_fi (ScaleFilter sf)
+// The filters (and the way the weights are computed) are the same as FreeImage_Rescale.
+
+static double filter_box (double x) { return fabs(x) <= 0.5 ? 1 : 0; }
+
+static double filter_bilinear (double x)
 {
-    switch (sf) {
-        case SF_BOX: return FILTER_BOX;
-        case SF_BILINEAR: return FILTER_BILINEAR;
-        case SF_BSPLINE: return FILTER_BSPLINE;
-        case SF_BICUBIC: return FILTER_BICUBIC;
-        case SF_CATMULLROM: return FILTER_CATMULLROM;
-        case SF_LANCZOS3: return FILTER_LANCZOS3;
-        default: return FILTER_BOX;
-    }
+    x = fabs(x);
+    return x < 1 ? 1 - x : 0;
 }
 
-template<chan_t ch, chan_t ach> FIBITMAP *image_to_fifloat (const ImageBase *img_)
+static double filter_bspline (double x)
 {
-    const Image<ch,ach> *img = static_cast<const Image<ch,ach>*>(img_);
-    FIBITMAP *fib = NULL;
-    uimglen_t actual_channels = 0;
-    switch (ch+ach) {
-        case 4:
-        actual_channels = 4;
-        fib = FreeImage_AllocateT(FIT_RGBAF, img->width, img->height);
-        break;
-
-        case 3:
-        case 2:
-        actual_channels = 3;
-        fib = FreeImage_AllocateT(FIT_RGBF, img->width, img->height);
-        break;
-
-        case 1:
-        actual_channels = 1;
-        fib = FreeImage_AllocateT(FIT_FLOAT, img->width, img->height);
-        break;
-    }
-    
-    for (uimglen_t y=0 ; y<img->height ; y++) {
-
-        float *raw = reinterpret_cast<float*>(FreeImage_GetScanLine(fib, y));
-
-        for (uimglen_t x=0 ; x<img->width ; x++) {
-            for (uimglen_t c=0 ; c<img->channels(); ++c) {
-                float v = img->pixel(x, y)[c];
-                raw[x*actual_channels + c] = v;
-            }
-        }
-    }
+    x = fabs(x);
+    if (x < 1) return (4 + x*x*(-6 + 3*x)) / 6;
+    if (x < 2) return (2-x)*(2-x)*(2-x) / 6;
+    return 0;
+}
 
-    return fib;
+// Mitchell-Netravali with B = C = 1/3.
+static double filter_bicubic (double x)
+{
+    const double b = 1.0/3, c = 1.0/3;
+    x = fabs(x);
+    if (x < 1) return ((6 - 2*b) + x*x*((-18 + 12*b + 6*c) + x*(12 - 9*b - 6*c))) / 6;
+    if (x < 2) return ((8*b + 24*c) + x*((-12*b - 48*c) + x*((6*b + 30*c) + x*(-b - 6*c)))) / 6;
+    return 0;
+}
 
+static double filter_catmullrom (double x)
+{
+    x = fabs(x);
+    if (x < 1) return 0.5 * (2 + x*x*(-5 + 3*x));
+    if (x < 2) return 0.5 * (4 + x*(-8 + x*(5 - x)));
+    return 0;
 }
 
-template<chan_t ch, chan_t ach> Image<ch,ach> *image_from_fifloat (FIBITMAP *img)
+static double sinc (double x)
 {
-    uimglen_t actual_channels = 0;
-    switch (ch+ach) {
-        case 4:
-        actual_channels = 4;
-        break;
+    x *= PI;
+    return x == 0 ? 1 : sin(x) / x;
+}
 
-        case 3:
-        case 2:
-        actual_channels = 3;
-        break;
+static double filter_lanczos3 (double x)
+{
+    return fabs(x) < 3 ? sinc(x) * sinc(x/3) : 0;
+}
 
-        case 1:
-        actual_channels = 1;
-        break;
-    }
+namespace {
+
+    // For each destination pixel along one axis, the range of source pixels that contribute to it
+    // and their (normalised) weights.
+    struct ScaleWeights {
+        std::vector<uimglen_t> left;
+        std::vector<uimglen_t> count;
+        // window entries per destination pixel
+        std::vector<float> weights;
+        unsigned window;
+
+        ScaleWeights (uimglen_t src_len, uimglen_t dst_len, ScaleFilter filter)
+          : left(dst_len), count(dst_len)
+        {
+            double (*f)(double) = filter_box;
+            double filter_width = 0.5;
+            switch (filter) {
+                case SF_BOX: f = filter_box; filter_width = 0.5; break;
+                case SF_BILINEAR: f = filter_bilinear; filter_width = 1; break;
+                case SF_BSPLINE: f = filter_bspline; filter_width = 2; break;
+                case SF_BICUBIC: f = filter_bicubic; filter_width = 2; break;
+                case SF_CATMULLROM: f = filter_catmullrom; filter_width = 2; break;
+                case SF_LANCZOS3: f = filter_lanczos3; filter_width = 3; break;
+            }
 
-    uimglen_t width = FreeImage_GetWidth(img);
-    uimglen_t height = FreeImage_GetHeight(img);
-    
-    Image<ch, ach> *output = new Image<ch, ach>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
+            // When shrinking, the filter is stretched so that every source pixel contributes.
+            double scale = double(dst_len) / src_len;
+            double width = filter_width;
+            double fscale = 1;
+            if (scale < 1) {
+                width = filter_width / scale;
+                fscale = scale;
+            }
+            window = 2 * unsigned(ceil(width)) + 1;
+            weights.resize(size_t(dst_len) * window);
+
+            for (uimglen_t u=0 ; u<dst_len ; ++u) {
+                double centre = (u + 0.5) / scale;
+                simglen_t l = std::max(0, simglen_t(centre - width + 0.5));
+                simglen_t r = std::min(simglen_t(centre + width + 0.5), simglen_t(src_len));
+                r = std::min(r, simglen_t(l + window));
+                float *w = &weights[size_t(u) * window];
+                double total = 0;
+                for (simglen_t i=l ; i<r ; ++i) {
+                    double v = fscale * f(fscale * (i + 0.5 - centre));
+                    w[i-l] = v;
+                    total += v;
+                }
+                if (total > 0) {
+                    for (simglen_t i=l ; i<r ; ++i) w[i-l] /= total;
+                }
+                // Drop zero weights from the end of the window.
+                while (r > l && w[r-l-1] == 0) --r;
+                left[u] = l;
+                count[u] = r - l;
+            }
+        }
+    };
 
-        float *raw = reinterpret_cast<float*>(FreeImage_GetScanLine(img, y));
+}
 
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            for (chan_t c=0 ; c<output->channels() ; ++c) {
-                float v = raw[x*actual_channels + c];
-                output->pixel(x, y)[c] = v;
+template<chan_t ch, chan_t ach>
+static Image<ch,ach> *scale_x (const Image<ch,ach> *src, uimglen_t dst_width, ScaleFilter filter)
+{
+    ScaleWeights sw(src->width, dst_width, filter);
+    Image<ch,ach> *ret = new Image<ch,ach>(dst_width, src->height);
+    parallel_rows(src->height, dst_width * sw.window, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            const Colour<ch,ach> *in = &src->pixel(0, y);
+            for (uimglen_t x=0 ; x<dst_width ; ++x) {
+                const float *w = &sw.weights[size_t(x) * sw.window];
+                const Colour<ch,ach> *in_x = &in[sw.left[x]];
+                Colour<ch,ach> p(0);
+                for (uimglen_t i=0 ; i<sw.count[x] ; ++i) {
+                    for (chan_t c=0 ; c<ch+ach ; ++c) p[c] += w[i] * in_x[i][c];
+                }
+                ret->pixel(x, y) = p;
             }
         }
-    }
-
-    return output;
+    });
+    return ret;
 }
 
+// Every destination row is a weighted sum of whole source rows, so the inner loop runs over the
+// floats of the row.
+template<chan_t ch, chan_t ach>
+static Image<ch,ach> *scale_y (const Image<ch,ach> *src, uimglen_t dst_height, ScaleFilter filter)
+{
+    ScaleWeights sw(src->height, dst_height, filter);
+    Image<ch,ach> *ret = new Image<ch,ach>(src->width, dst_height);
+    const size_t row_floats = size_t(src->width) * (ch+ach);
+    parallel_rows(dst_height, src->width * sw.window, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            const float *w = &sw.weights[size_t(y) * sw.window];
+            float *__restrict__ out = ret->pixel(0, y).raw();
+            for (size_t i=0 ; i<row_floats ; ++i) out[i] = 0;
+            for (uimglen_t j=0 ; j<sw.count[y] ; ++j) {
+                const float wj = w[j];
+                const float *__restrict__ in = src->pixel(0, sw.left[y] + j).raw();
+                for (size_t i=0 ; i<row_floats ; ++i) out[i] += wj * in[i];
+            }
+        }
+    });
+    return ret;
+}
 
 template<chan_t ch, chan_t ach>
-ImageBase *do_scale (const ImageBase *src, uimglen_t dst_width, uimglen_t dst_height, ScaleFilter filter)
+ImageBase *do_scale (const ImageBase *src_, uimglen_t dst_width, uimglen_t dst_height, ScaleFilter filter)
 {
-    FIBITMAP *fib = image_to_fifloat<ch,ach>(src);
-    
-    FIBITMAP *scaled = FreeImage_Rescale(fib, dst_width, dst_height, to_fi(filter));
-    FreeImage_Unload(fib);
+    const Image<ch,ach> *src = static_cast<const Image<ch,ach>*>(src_);
+    // Nothing to filter, or nothing to filter into (the weights would divide by zero).
+    if (src->width == 0 || src->height == 0 || dst_width == 0 || dst_height == 0) {
+        Image<ch,ach> *r = new Image<ch,ach>(dst_width, dst_height);
+        std::fill(r->raw(), r->raw() + r->numPixels() * (ch+ach), 0.0f);
+        return r;
+    }
 
-    ImageBase *r = image_from_fifloat<ch,ach>(scaled);
-    FreeImage_Unload(scaled);
+    // Do whichever pass leaves the smaller intermediate image first.
+    Image<ch,ach> *tmp, *r;
+    if (double(dst_width) * src->height <= double(src->width) * dst_height) {
+        tmp = scale_x(src, dst_width, filter);
+        r = scale_y(tmp, dst_height, filter);
+    } else {
+        tmp = scale_y(src, dst_height, filter);
+        r = scale_x(tmp, dst_width, filter);
+    }
+    delete tmp;
     return r;
 }
 
@@ -603,3 +840,263 @@ ImageBase *ImageBase::scale (uimglen_t dst_width, uimglen_t dst_height, ScaleFil
         default: return NULL;
     }
 }
+
+namespace {
+
+    // How each destination pixel along one axis is made from the source when halving that axis
+    // with a box filter.  Even lengths average pairs.  Odd lengths use 3 taps, each weighted by
+    // how much of that source pixel the (wider) destination pixel covers.
+    struct HalveTaps {
+        uimglen_t dstLen;
+        unsigned taps;
+        std::vector<float> weights;
+
+        HalveTaps (uimglen_t src_len)
+        {
+            if (src_len <= 1) {
+                dstLen = src_len;
+                taps = 1;
+                weights.assign(dstLen, 1.0f);
+                return;
+            }
+            dstLen = src_len / 2;
+            taps = src_len % 2 == 0 ? 2 : 3;
+            weights.resize(size_t(dstLen) * taps);
+            for (uimglen_t i=0 ; i<dstLen ; ++i) {
+                float *w = &weights[size_t(i) * taps];
+                if (taps == 2) {
+                    w[0] = w[1] = 0.5f;
+                } else {
+                    w[0] = float(dstLen - i) / src_len;
+                    w[1] = float(dstLen) / src_len;
+                    w[2] = float(i + 1) / src_len;
+                }
+            }
+        }
+
+        // The first source pixel used by destination pixel i.
+        uimglen_t first (uimglen_t i) const { return taps == 1 ? i : 2 * i; }
+    };
+
+}
+
+// Halve src with a box filter.  If encode is set, the colour channels of src are linear and enc
+// receives a gamma encoded copy of the result, written while each row is still in cache.
+template<chan_t ch, chan_t ach>
+static Image<ch,ach> *mipmap_halve (const Image<ch,ach> *src, bool encode, Image<ch,ach> *&enc)
+{
+    const HalveTaps tx(src->width), ty(src->height);
+    Image<ch,ach> *ret = new Image<ch,ach>(tx.dstLen, ty.dstLen);
+    enc = encode ? new Image<ch,ach>(tx.dstLen, ty.dstLen) : NULL;
+    if (ret->numPixels() == 0) return ret;
+    const size_t row_floats = size_t(src->width) * (ch+ach);
+    parallel_rows(ty.dstLen, src->width * ty.taps, [&] (uimglen_t y0, uimglen_t y1) {
+        std::vector<float> tmp_(row_floats);
+        float *__restrict__ tmp = &tmp_[0];
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            // Vertical pass, over whole rows of floats.
+            const float *w = &ty.weights[size_t(y) * ty.taps];
+            const float *__restrict__ r0 = src->pixel(0, ty.first(y)).raw();
+            if (ty.taps == 1) {
+                for (size_t i=0 ; i<row_floats ; ++i) tmp[i] = r0[i];
+            } else {
+                const float *__restrict__ r1 = r0 + row_floats;
+                if (ty.taps == 2) {
+                    for (size_t i=0 ; i<row_floats ; ++i) tmp[i] = w[0] * r0[i] + w[1] * r1[i];
+                } else {
+                    const float *__restrict__ r2 = r1 + row_floats;
+                    for (size_t i=0 ; i<row_floats ; ++i)
+                        tmp[i] = w[0] * r0[i] + w[1] * r1[i] + w[2] * r2[i];
+                }
+            }
+
+            // Horizontal pass.
+            float *__restrict__ out = ret->pixel(0, y).raw();
+            const unsigned c = ch + ach;
+            if (tx.taps == 1) {
+                for (size_t i=0 ; i<row_floats ; ++i) out[i] = tmp[i];
+            } else if (tx.taps == 2) {
+                for (uimglen_t x=0 ; x<tx.dstLen ; ++x) {
+                    for (unsigned k=0 ; k<c ; ++k)
+                        out[x*c + k] = 0.5f * (tmp[2*x*c + k] + tmp[(2*x+1)*c + k]);
+                }
+            } else {
+                for (uimglen_t x=0 ; x<tx.dstLen ; ++x) {
+                    const float *wx = &tx.weights[size_t(x) * 3];
+                    for (unsigned k=0 ; k<c ; ++k)
+                        out[x*c + k] = wx[0] * tmp[2*x*c + k] + wx[1] * tmp[(2*x+1)*c + k]
+                                     + wx[2] * tmp[(2*x+2)*c + k];
+                }
+            }
+
+            if (encode) {
+                float *e = enc->pixel(0, y).raw();
+                for (uimglen_t x=0 ; x<tx.dstLen ; ++x) {
+                    for (unsigned k=0 ; k<c ; ++k)
+                        e[x*c + k] = k < ch ? gamma_encode(out[x*c + k]) : out[x*c + k];
+                }
+            }
+        }
+    });
+    return ret;
+}
+
+template<chan_t ch, chan_t ach>
+static Image<ch,ach> *mipmap_gamma (const Image<ch,ach> *src, bool decode)
+{
+    Image<ch,ach> *ret = new Image<ch,ach>(src->width, src->height);
+    parallel_rows(src->height, src->width * ch * 8, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            for (uimglen_t x=0 ; x<src->width ; ++x) {
+                Colour<ch,ach> p = src->pixel(x, y);
+                for (chan_t c=0 ; c<ch ; ++c) p[c] = decode ? gamma_decode(p[c]) : gamma_encode(p[c]);
+                ret->pixel(x, y) = p;
+            }
+        }
+    });
+    return ret;
+}
+
+// The fraction of pixels whose alpha, multiplied by the given scale, exceeds alpha_ref.
+template<chan_t ch, chan_t ach>
+static float mipmap_coverage (const Image<ch,ach> *img, float alpha_ref, float scale)
+{
+    const float *raw = img->raw();
+    const size_t width = img->width;
+    unsigned long covered = 0;
+    std::mutex mutex;
+    parallel_rows(img->height, width, [&] (uimglen_t y0, uimglen_t y1) {
+        const float *a = raw + y0 * width * (ch+ach) + ch;
+        unsigned long covered_ = 0;
+        for (size_t i=0, n=(y1-y0)*width ; i<n ; ++i) {
+            if (a[i*(ch+ach)] * scale > alpha_ref) covered_++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        covered += covered_;
+    });
+    return img->numPixels() == 0 ? 0 : float(covered) / img->numPixels();
+}
+
+// Scale the alpha of img so that the given fraction of pixels passes the alpha test, as in
+// Castano's "Computing Alpha Mipmaps".  Without this, alpha tested foliage etc. gets thinner
+// with every mip level.
+template<chan_t ch, chan_t ach>
+static void mipmap_preserve_coverage (Image<ch,ach> *img, float alpha_ref, float coverage)
+{
+    float lo = 0, hi = 4;
+    for (unsigned i=0 ; i<16 ; ++i) {
+        float mid = (lo + hi) / 2;
+        if (mipmap_coverage(img, alpha_ref, mid) > coverage) hi = mid;
+        else lo = mid;
+    }
+    // Coverage is a step function of the scale, so take whichever side of the step is closer.
+    const float scale = fabsf(mipmap_coverage(img, alpha_ref, lo) - coverage)
+                      < fabsf(mipmap_coverage(img, alpha_ref, hi) - coverage) ? lo : hi;
+    float *raw = img->raw();
+    const size_t width = img->width;
+    parallel_rows(img->height, width, [&] (uimglen_t y0, uimglen_t y1) {
+        float *a = raw + y0 * width * (ch+ach) + ch;
+        for (size_t i=0, n=(y1-y0)*width ; i<n ; ++i) {
+            a[i*(ch+ach)] = std::min(1.0f, a[i*(ch+ach)] * scale);
+        }
+    });
+}
+
+template<chan_t ch, chan_t ach>
+static std::vector<ImageBase*> do_mipmaps (const ImageBase *top_, ScaleFilter filter, bool linear,
+                                           bool preserve_coverage, float alpha_ref)
+{
+    const Image<ch,ach> *top = static_cast<const Image<ch,ach>*>(top_);
+    float coverage = 0;
+    if (ach > 0 && preserve_coverage) coverage = mipmap_coverage(top, alpha_ref, 1);
+
+    std::vector<ImageBase*> r;
+    // With linear set, the chain is built in linear light and each level is gamma encoded on the
+    // way out.  Otherwise the levels themselves make up the chain.
+    linear = linear && ch > 0;
+    const Image<ch,ach> *last = linear ? mipmap_gamma(top, true) : top;
+    do {
+        Image<ch,ach> *next, *enc = NULL;
+        if (filter == SF_BOX) {
+            next = mipmap_halve(last, linear, enc);
+        } else {
+            uimglen_t width = last->width == 1 ? 1 : last->width / 2;
+            uimglen_t height = last->height == 1 ? 1 : last->height / 2;
+            next = last->scale(width, height, filter);
+        }
+        if (last != top && (r.empty() || last != r.back())) delete last;
+        last = next;
+        if (linear) {
+            if (enc == NULL) enc = mipmap_gamma(next, false);
+        } else {
+            // Coverage is adjusted per level, so must not leak into the next level.
+            enc = preserve_coverage && ach > 0 ? next->clone(false, false) : next;
+        }
+        if (ach > 0 && preserve_coverage && coverage > 0) mipmap_preserve_coverage(enc, alpha_ref, coverage);
+        r.push_back(enc);
+    } while (last->width > 1 || last->height > 1);
+    if (last != r.back()) delete last;
+    return r;
+}
+
+std::vector<ImageBase*> image_mipmaps (const ImageBase *img, ScaleFilter filter, bool linear,
+                                       bool preserve_coverage, float alpha_ref)
+{
+    switch (img->channels()) {
+        case 1: return img->hasAlpha() ? do_mipmaps<0,1>(img, filter, linear, preserve_coverage, alpha_ref)
+                                       : do_mipmaps<1,0>(img, filter, linear, preserve_coverage, alpha_ref);
+        case 2: return img->hasAlpha() ? do_mipmaps<1,1>(img, filter, linear, preserve_coverage, alpha_ref)
+                                       : do_mipmaps<2,0>(img, filter, linear, preserve_coverage, alpha_ref);
+        case 3: return img->hasAlpha() ? do_mipmaps<2,1>(img, filter, linear, preserve_coverage, alpha_ref)
+                                       : do_mipmaps<3,0>(img, filter, linear, preserve_coverage, alpha_ref);
+        case 4: return img->hasAlpha() ? do_mipmaps<3,1>(img, filter, linear, preserve_coverage, alpha_ref)
+                                       : do_mipmaps<4,0>(img, filter, linear, preserve_coverage, alpha_ref);
+        default: return std::vector<ImageBase*>();
+    }
+}
+
+
+void expr_scratch_overflow (size_t needed, size_t size)
+{
+    EXCEPT << "Internal error: lazy expression needed " << needed << " floats of row scratch but "
+           << "only had " << size << "." << ENDL;
+}
+
+// All lazy images that have yet to be computed, from any thread.
+static std::set<const ImageBase*> lazy_images;
+static std::mutex lazy_images_mutex;
+
+void lazy_image_register (const ImageBase *img)
+{
+    std::lock_guard<std::mutex> lock(lazy_images_mutex);
+    lazy_images.insert(img);
+}
+
+void lazy_image_unregister (const ImageBase *img)
+{
+    std::lock_guard<std::mutex> lock(lazy_images_mutex);
+    lazy_images.erase(img);
+}
+
+void lazy_image_force_readers (const ImageBase *img)
+{
+    // Every lazy image that reads img owns it, so if Lua is the only owner there are none.
+    if (img->refs <= (img->beenPushed ? 1u : 0u)) return;
+    // Forcing unregisters, so find them all first.  Hold them too, as allocating memory can run
+    // the garbage collector, which may free some.  One whose count already reached zero is being
+    // deleted by another thread (and is waiting to unregister), so must not be revived.
+    std::vector<const ImageBase*> readers;
+    {
+        std::lock_guard<std::mutex> lock(lazy_images_mutex);
+        for (const ImageBase *lazy : lazy_images) {
+            if (!lazy->reads(img)) continue;
+            unsigned r = lazy->refs;
+            while (r != 0 && !lazy->refs.compare_exchange_weak(r, r + 1)) { }
+            if (r != 0) readers.push_back(lazy);
+        }
+    }
+    for (const ImageBase *lazy : readers) {
+        lazy->force();
+        lazy->release();
+    }
+}
@@ -51,12 +51,20 @@ void HSVtoRGB (float H, float S, float L, float &R, float &G, float &B);
 
 #include <cmath>
 #include <cassert>
+#include <cstring>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include "dds.h"
+#include "fft.h"
+#include "parallel.h"
+#include "pixel_pool.h"
 
 static inline simglen_t mymod (simglen_t a, simglen_t b)
 {
@@ -66,6 +74,206 @@ static inline simglen_t mymod (simglen_t a, simglen_t b)
     return c;
 }
 
+/** Calls f(i, p, n) for each run of coordinates pos+i .. pos+i+n-1, with i in [0, count), that
+ * lands on p .. p+n-1 of a line of len pixels.  If wrap, the coordinates are wrapped onto the
+ * line, otherwise only the run that is already on it (if any) is visited.  This lets the callers
+ * resolve bounds once per row and copy the runs whole. */
+template<class F> static inline void image_spans (simglen_t pos, uimglen_t count, uimglen_t len,
+                                                  bool wrap, F f)
+{
+    if (len == 0) return;
+    if (!wrap) {
+        simglen_t begin = std::max(simglen_t(0), -pos);
+        simglen_t end = std::min(simglen_t(count), simglen_t(len) - pos);
+        if (begin < end) f(uimglen_t(begin), uimglen_t(pos + begin), uimglen_t(end - begin));
+        return;
+    }
+    uimglen_t p = mymod(pos, len);
+    for (uimglen_t i=0 ; i<count ; ) {
+        uimglen_t n = std::min(count - i, len - p);
+        f(i, p, n);
+        i += n;
+        p = 0;
+    }
+}
+
+/** Per-channel accumulators for image_reduce_parallel.  add folds in the next value and combine
+ * folds in the accumulator of the values that follow. */
+
+/** Compensated (Neumaier) sum in double, so that even a large image of similar values is summed
+ * to within a rounding of the exact result. */
+struct ReduceSum {
+    double sum, comp;
+    ReduceSum (void) : sum(0), comp(0) { }
+    void add (double v)
+    {
+        double t = sum + v;
+        comp += std::fabs(sum) >= std::fabs(v) ? (sum - t) + v : (v - t) + sum;
+        sum = t;
+    }
+    void combine (const ReduceSum &o) { add(o.sum); comp += o.comp; }
+    double value (void) const { return sum + comp; }
+};
+
+struct ReduceMin {
+    float v;
+    ReduceMin (void) : v(INFINITY) { }
+    void add (float x) { v = x < v ? x : v; }
+    void combine (const ReduceMin &o) { add(o.v); }
+};
+
+struct ReduceMax {
+    float v;
+    ReduceMax (void) : v(-INFINITY) { }
+    void add (float x) { v = x > v ? x : v; }
+    void combine (const ReduceMax &o) { add(o.v); }
+};
+
+/** Count, mean and sum of squared differences from the mean, updated with Welford's method and
+ * combined with that of Chan et al, which unlike summing squares does not cancel catastrophically
+ * when the variance is small relative to the mean. */
+struct ReduceMoments {
+    double n, mean, m2;
+    ReduceMoments (void) : n(0), mean(0), m2(0) { }
+    void add (double x)
+    {
+        n += 1;
+        double d = x - mean;
+        mean += d / n;
+        m2 += d * (x - mean);
+    }
+    void combine (const ReduceMoments &o)
+    {
+        if (o.n == 0) return;
+        double total = n + o.n;
+        double d = o.mean - mean;
+        mean += d * o.n / total;
+        m2 += o.m2 + d * d * n * o.n / total;
+        n = total;
+    }
+    /** Population variance, i.e. divided by n. */
+    double variance (void) const { return n == 0 ? 0 : m2 / n; }
+};
+
+/** Combine the partial accumulators of each row as a balanced tree in row order, giving the
+ * accumulators of the whole image. */
+template<class Acc, size_t n>
+std::array<Acc,n> image_reduce_combine (std::vector<std::array<Acc,n>> &partial)
+{
+    for (size_t step=1 ; step<partial.size() ; step*=2) {
+        for (size_t i=0 ; i+step<partial.size() ; i+=2*step) {
+            for (size_t c=0 ; c<n ; ++c) partial[i][c].combine(partial[i+step][c]);
+        }
+    }
+    return partial[0];
+}
+
+/** Fold every pixel of a width x height image into n per-channel accumulators, using all the
+ * threads.  f(acc, x, y) adds pixel (x, y) into acc[0..n).  Each row is folded into a partial of
+ * its own, and the partials are combined as a balanced tree in row order, so the result depends
+ * only on the pixels and not on the number of threads or how the rows were shared out. */
+template<class Acc, unsigned n, class F>
+std::array<Acc,n> image_reduce_parallel (uimglen_t width, uimglen_t height, F f)
+{
+    std::vector<std::array<Acc,n>> partial(std::max(height, uimglen_t(1)));
+    parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            std::array<Acc,n> &acc = partial[y];
+            for (uimglen_t x=0 ; x<width ; ++x) f(acc, x, y);
+        }
+    });
+    return image_reduce_combine(partial);
+}
+
+/** Entry i is the coordinate read by a convolution tap at i-kc, on a line of len pixels, with
+ * i in [0, len+2*kc).  Taps off the end of the line are wrapped or clamped to the edge. */
+static inline std::vector<uimglen_t> convolve_index_table (uimglen_t len, simglen_t kc, bool wrap)
+{
+    std::vector<uimglen_t> r(len + 2*kc);
+    for (simglen_t i=0 ; i<simglen_t(r.size()) ; ++i) {
+        simglen_t pos = i - kc;
+        if (wrap) {
+            pos = mymod(pos, len);
+        } else {
+            pos = std::max(simglen_t(0), std::min(simglen_t(len)-1, pos));
+        }
+        r[i] = pos;
+    }
+    return r;
+}
+
+/** Convolve rows of width pixels of n floats from src into dst with the 1D kernel k (of 2*kc+1
+ * taps), horizontally into mid, then vertically with the kernel reversed (the orientation it would
+ * have after rotate(90)).  Each pass runs over whole rows of floats so that the inner loops
+ * vectorise, and only the edge pixels go through the index tables (see convolve_index_table). */
+static inline void convolve_sep_floats (const float *src, float *mid, float *dst,
+                                        uimglen_t width, uimglen_t height, unsigned n,
+                                        const float *k, simglen_t kc,
+                                        const std::vector<uimglen_t> &cols,
+                                        const std::vector<uimglen_t> &rows)
+{
+    const size_t row_floats = size_t(width) * n;
+    const uimglen_t taps = 2*kc + 1;
+
+    // Pixels whose taps all land inside the row.
+    uimglen_t x_begin = std::min(uimglen_t(kc), width);
+    uimglen_t x_end = std::max(x_begin, width - std::min(uimglen_t(kc), width));
+
+    parallel_rows(height, width * taps, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            const float *__restrict__ in = &src[y * row_floats];
+            float *__restrict__ out = &mid[y * row_floats];
+            const size_t interior = size_t(x_end - x_begin) * n;
+            float *__restrict__ out_i = out + x_begin*n;
+            for (size_t i=0 ; i<interior ; ++i) out_i[i] = 0;
+            for (simglen_t j=-kc ; j<=kc && interior>0 ; ++j) {
+                const float kv = k[j + kc];
+                const float *__restrict__ in_j = in + (x_begin + j)*n;
+                for (size_t i=0 ; i<interior ; ++i) out_i[i] += kv * in_j[i];
+            }
+            auto edge = [&] (uimglen_t x) {
+                for (unsigned c=0 ; c<n ; ++c) {
+                    float p = 0;
+                    for (simglen_t j=-kc ; j<=kc ; ++j) {
+                        p += k[j + kc] * in[cols[x + j + kc]*n + c];
+                    }
+                    out[x*n + c] = p;
+                }
+            };
+            for (uimglen_t x=0 ; x<x_begin ; ++x) edge(x);
+            for (uimglen_t x=x_end ; x<width ; ++x) edge(x);
+        }
+    });
+
+    parallel_rows(height, width * taps, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            float *__restrict__ out = &dst[y * row_floats];
+            for (size_t i=0 ; i<row_floats ; ++i) out[i] = 0;
+            for (simglen_t j=-kc ; j<=kc ; ++j) {
+                const float kv = k[kc - j];
+                const float *__restrict__ in = &mid[rows[y + j + kc] * row_floats];
+                for (size_t i=0 ; i<row_floats ; ++i) out[i] += kv * in[i];
+            }
+        }
+    });
+}
+
+/** Relative cost of an FFT over one grid cell, compared to one multiply-add of the direct method. */
+static const float CONVOLVE_FFT_COST = 3;
+
+/** Whether an FFT convolution is likely to be faster than the direct method. */
+static inline bool convolve_prefer_fft (uimglen_t width, uimglen_t height, unsigned channels,
+                                        uimglen_t kernel_width, uimglen_t kernel_height)
+{
+    float direct = float(width) * height * kernel_width * kernel_height * channels;
+    float grid = float(fft_good_size(width + kernel_width - 1))
+               * fft_good_size(height + kernel_height - 1);
+    // One transform for the kernel, and a forward and inverse transform per pair of channels.
+    float transforms = 1 + 2 * ((channels + 1) / 2);
+    float fft = transforms * grid * log2f(grid) * CONVOLVE_FFT_COST;
+    return fft < direct;
+}
+
 enum ScaleFilter {
     SF_BOX,
     SF_BILINEAR,
@@ -75,12 +283,36 @@ enum ScaleFilter {
     SF_LANCZOS3
 };
 
+/** How the samples of an image are held in memory.  Everything other than PS_FLOAT is widened
+ * (or for PS_PLANAR, interleaved) to float pixels a row at a time as the pixels are read. */
+enum PixelStorage {
+    PS_FLOAT,
+    PS_U8,
+    PS_U16,
+    PS_F16,
+    PS_PLANAR
+};
+
 enum DitherAlgorithm {
     DA_NONE,
     DA_FLOYD_STEINBERG,
     DA_FLOYD_STEINBERG_LINEAR
 };
 
+enum ConvolveMethod {
+    CM_AUTO,
+    CM_DIRECT,
+    CM_FFT
+};
+
+enum ReduceOp {
+    RO_SUM,
+    RO_MEAN,
+    RO_MIN,
+    RO_MAX,
+    RO_VARIANCE
+};
+
 struct ColourBase {
 /*
     virtual chan_t channels() const = 0;
@@ -231,6 +463,44 @@ static inline void add_gamma(float &a, float b)
     a = gamma_encode(gamma_decode(a) + b);
 }
 
+// IEEE 754 half precision, rounding to nearest even.
+static inline uint16_t float_to_half (float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+    // NaN (keeping it a NaN) and infinity.
+    if (abs >= 0x7f800000) return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 | ((abs >> 13) & 0x3ff) : 0);
+    // Would round to more than 65504.
+    if (abs >= 0x477ff000) return sign | 0x7c00;
+    if (abs < 0x38800000) {
+        // Zero or a subnormal half, in units of 2^-24 (the result can round up to the smallest
+        // normal, which has the right encoding).
+        float a;
+        memcpy(&a, &abs, sizeof(a));
+        return sign | uint16_t(nearbyintf(a * 16777216.0f));
+    }
+    // Rebias the exponent, and round away the low 13 bits of the mantissa.
+    uint32_t e = abs - 0x38000000;
+    return sign | uint16_t((e + 0xfff + ((e >> 13) & 1)) >> 13);
+}
+
+static inline float half_to_float (uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t man = h & 0x3ff;
+    if (exp == 0) {
+        float f = man / 16777216.0f;
+        return sign ? -f : f;
+    }
+    uint32_t x = sign | (man << 13) | (exp == 31 ? 0x7f800000 : (exp + 112) << 23);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
 class ImageBase {
 
     public:
@@ -245,13 +515,45 @@ class ImageBase {
      * happen once or we get double-freed. */
     bool beenPushed;
 
+    /** Number of owners: the Lua heap and any lazy expressions that read from this image.  Images
+     * that have owners must be freed with release() instead of delete.  Atomic because worker
+     * threads can take and drop references (see lazy_image_force_readers). */
+    mutable std::atomic<unsigned> refs;
+
     ImageBase (uimglen_t width, uimglen_t height)
-      : width(width), height(height), beenPushed(false)
+      : width(width), height(height), beenPushed(false), refs(0), burden(0)
     {
     }
 
+    void release (void) const
+    {
+        assert(refs > 0);
+        if (--refs == 0) delete this;
+    }
+
+    /** Whether the pixels have yet to be computed from an expression. */
+    virtual bool lazy (void) const = 0;
+
+    /** Compute the pixels of a lazy image.  This must be done before accessing the pixels
+     * directly. */
+    virtual void force (void) const = 0;
+
+    /** Whether computing this lazy image would read pixels of the given image. */
+    virtual bool reads (const ImageBase *other) const = 0;
+
+    /** Give the image pixels of its own if they are shared with other images, e.g. because it is
+     * a clone.  This must be done before drawing into it. */
+    virtual void unshare (void) = 0;
+
     unsigned long numPixels() const { return (unsigned long)(height) * width; };
-    unsigned long numBytes() const { return numPixels()*4; }
+
+    /** Memory held by the pixels, or that they will need once computed if the image is lazy. */
+    virtual unsigned long numBytes() const = 0;
+
+    /** What was reported to Lua's GC for this image, while it is on the Lua heap. */
+    unsigned long burden;
+
+    virtual PixelStorage pixelStorage (void) const = 0;
 
     virtual float *raw (void) = 0;
     virtual const float *raw (void) const = 0;
@@ -271,16 +573,35 @@ class ImageBase {
     virtual ImageBase *abs (void) const = 0;
 
     virtual ImageBase *clone (bool flip_x, bool flip_y) const = 0;
+
+    /** A lazy image that copies pixels from this one as it is read, so it is made in constant
+     * time.  The area is as for crop, then mirrored and/or flipped within itself.  This image
+     * must stay alive (e.g. be Lua-owned) and is computed first if it is lazy. */
+    virtual ImageBase *view (simglen_t left, simglen_t bottom, uimglen_t w, uimglen_t h,
+                             const ColourBase *bg, bool flip_x, bool flip_y) const = 0;
     virtual ImageBase *normalise (void) const = 0;
 
     virtual ImageBase *scale (uimglen_t width, uimglen_t height, ScaleFilter filter) const;
+    /** Rotated anticlockwise by angle degrees, exactly (see rotate90) if it is a multiple of 90. */
     virtual ImageBase *rotate (float angle, const ColourBase *bg_) const = 0;
+    /** Rotated anticlockwise by k quarter turns, moving whole pixels. */
+    virtual ImageBase *rotate90 (int k) const = 0;
+    /** Pixel (x,y) of the result is pixel (y,x) of this image. */
+    virtual ImageBase *transpose (void) const = 0;
     virtual ImageBase *crop (simglen_t left, simglen_t bottom, uimglen_t w, uimglen_t h,
                              const ColourBase *bg) const = 0;
     virtual ImageBase *quantise (DitherAlgorithm d, const ColourBase *res) const = 0;
     virtual ImageBase *clamp (const ColourBase *min, const ColourBase *max) const = 0;
     virtual ImageBase *gamma (const ColourBase *n) const = 0;
 
+    // As above, but overwriting this image, which must have been computed and unshared.
+    virtual void unmInPlace (void) = 0;
+    virtual void absInPlace (void) = 0;
+    virtual void normaliseInPlace (void) = 0;
+    virtual void quantiseInPlace (DitherAlgorithm d, const ColourBase *res) = 0;
+    virtual void clampInPlace (const ColourBase *min, const ColourBase *max) = 0;
+    virtual void gammaInPlace (const ColourBase *n) = 0;
+
     virtual void drawPixel (uimglen_t x, uimglen_t y, const ColourBase *c, float a=1) = 0;
     virtual void drawPixelSafe (uimglen_t x, uimglen_t y, const ColourBase *c, float a=1) = 0;
     virtual void drawPixelSafe (simglen_t x, simglen_t y, const ColourBase *c, float a=1) = 0;
@@ -288,7 +609,17 @@ class ImageBase {
     virtual void drawLine (uimglen_t x0, uimglen_t y0, uimglen_t x1, uimglen_t y1, uimglen_t w, const ColourBase *colour) = 0;
 
     virtual void drawImage (const ImageBase *src_, simglen_t left, simglen_t bottom, bool wrap_x, bool wrap_y) = 0;
-    virtual ImageBase *convolve (const Image<1,0> *kernel, bool wrap_x, bool wrap_y) const = 0;
+    virtual ImageBase *convolve (const Image<1,0> *kernel, bool wrap_x, bool wrap_y,
+                                 ConvolveMethod method) const = 0;
+    virtual ImageBase *convolveSep (const Image<1,0> *kernel, bool wrap_x, bool wrap_y) const = 0;
+
+    /** Each channel's sum, mean, etc. over all the pixels, computed on all threads.  A lazy image
+     * (e.g. a packed one) is read a row at a time rather than computed. */
+    virtual ColourBase *reduce (ReduceOp op) const = 0;
+
+    /** Rows [y0, y1) as interleaved floats, into out.  A lazy image (e.g. a packed one) computes
+     * just those rows, and stays lazy. */
+    virtual void readRows (uimglen_t y0, uimglen_t y1, float *out) const = 0;
 
 };
 
@@ -306,9 +637,130 @@ static inline std::ostream &operator<<(std::ostream &o, const ImageBase *img)
 
 template<> class Image<0,0> : public ImageBase { };
 
+void lazy_image_register (const ImageBase *img);
+void lazy_image_unregister (const ImageBase *img);
+
+/** Compute all lazy images that read from img, e.g. because img is about to be modified. */
+void lazy_image_force_readers (const ImageBase *img);
+
+/** Side of the square tiles that operations gathering pixels from all over their source walk their
+ * result in, so that the source pixels each tile reads stay in cache. */
+static const uimglen_t IMAGE_TILE = 64;
+
+/** Narrow [lo, hi) to roughly the x for which 0 <= a + d*x < limit, erring on the wide side. */
+static inline void rotate_span (float a, float d, float limit, double &lo, double &hi)
+{
+    if (d == 0) {
+        if (!(a >= 0 && a < limit)) hi = lo;
+        return;
+    }
+    double t0 = -a / double(d), t1 = (limit - a) / double(d);
+    if (d < 0) std::swap(t0, t1);
+    lo = std::max(lo, floor(t0));
+    hi = std::min(hi, ceil(t1) + 1);
+}
+
+/** Longest chain of operations that will be fused into a single lazy expression. */
+static const unsigned IMAGE_EXPR_MAX_NODES = 16;
+
+/** Raises an error for an ExprScratch that was too small for the rows asked of it. */
+void expr_scratch_overflow (size_t needed, size_t size);
+
+/** Row buffers for evaluating lazy expressions, allocated like a stack. */
+class ExprScratch {
+    std::unique_ptr<float[]> buf;
+    size_t size;
+    size_t top;
+
+    public:
+
+    ExprScratch (size_t size) : buf(new float[size]), size(size), top(0) { }
+
+    template<chan_t ch, chan_t ach> Colour<ch,ach> *alloc (uimglen_t n)
+    {
+        size_t sz = size_t(n) * (ch+ach);
+        if (top + sz > size) expr_scratch_overflow(top + sz, size);
+        Colour<ch,ach> *r = reinterpret_cast<Colour<ch,ach>*>(&buf[top]);
+        top += sz;
+        return r;
+    }
+
+    size_t mark (void) const { return top; }
+    void release (size_t m) { top = m; }
+};
+
+/** Something other than new [] that owns the pixels of an image, e.g. a memory mapped file. */
+class ImageStorage {
+    public:
+    virtual ~ImageStorage (void) { }
+};
+
+/** Owner of the pixels of an image: an ImageStorage or an array from new [].  Images and views
+ * that share pixels share this, and the last one to go frees them. */
+typedef std::shared_ptr<void> ImagePixels;
+
+/** A per-pixel operation whose result has not been computed yet.  Expressions are evaluated a row
+ * at a time so that chains of operations do not need whole-image temporaries. */
+template<chan_t ch, chan_t ach> class ImageExpr {
+
+    public:
+
+    virtual ~ImageExpr (void) { }
+
+    /** Write row y of the result to out[0] to out[width-1]. */
+    virtual void evalRow (uimglen_t y, uimglen_t width, Colour<ch,ach> *out, ExprScratch &scratch) const = 0;
+
+    /** The number of operations that will be computed for each pixel. */
+    virtual unsigned nodes (void) const = 0;
+
+    virtual bool reads (const ImageBase *img) const = 0;
+
+    /** Whether evaluating the expression is cheap enough to repeat for every use, rather than
+     * computing the image when it is used more than once. */
+    virtual bool cheap (void) const { return false; }
+
+    /** Memory held by the expression itself, or 0 to count the image as if it was computed. */
+    virtual unsigned long bytes (void) const { return 0; }
+
+    virtual PixelStorage pixelStorage (void) const { return PS_FLOAT; }
+
+    /** If the expression holds one plane of floats per channel, the first one, with the others
+     * following stride floats apart. */
+    virtual const float *planes (size_t &) const { return NULL; }
+
+    /** If the result is exactly some existing pixels, set data and owner to them and return
+     * true, so computing the image needs no copy. */
+    virtual bool share (uimglen_t, uimglen_t, Colour<ch,ach> *&, ImagePixels &) const { return false; }
+
+    /** Pixels of an operand that nothing else can see, which can be overwritten by the result
+     * since each row only depends on the same row of the operands.  Sets owner to their owner. */
+    virtual Colour<ch,ach> *reuse (ImagePixels &) const { return NULL; }
+};
+
+template<chan_t ch, chan_t ach, chan_t sch, chan_t scha> class ImageExprView;
+template<chan_t ch, chan_t ach> class ImageExprPlanar;
+
 template<chan_t ch, chan_t ach> class Image : public ImageBase {
 
-    Colour<ch, ach> *data;
+    // Either data or expr is NULL.
+    mutable Colour<ch, ach> *data;
+    mutable ImageExpr<ch, ach> *expr;
+    // Owns data, which may be shared with other images until one of them is drawn into.
+    mutable ImagePixels owner;
+
+    static ImagePixels ownArray (Colour<ch, ach> *data)
+    {
+        return ImagePixels(data, [] (Colour<ch, ach> *d) { delete [] d; });
+    }
+
+    /** Pixels from the pool, to be given back when the last image using them goes away. */
+    static Colour<ch, ach> *allocPixels (unsigned long n, ImagePixels &o)
+    {
+        size_t bytes = n * sizeof(Colour<ch, ach>);
+        Colour<ch, ach> *d = static_cast<Colour<ch, ach>*>(pixel_pool_alloc(bytes));
+        o = ImagePixels(d, [bytes] (Colour<ch, ach> *d) { pixel_pool_free(d, bytes); });
+        return d;
+    }
 
     public:
 
@@ -317,24 +769,142 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
     chan_t colourChannels() const { return ch; }
 
     Image (uimglen_t width, uimglen_t height)
-      : ImageBase(width, height)
+      : ImageBase(width, height), expr(NULL)
+    {
+        data = allocPixels(numPixels(), owner);
+    }
+
+    /** Use pixels that belong to storage, which is deleted along with the image, or that were
+     * allocated with new [] if storage is NULL. */
+    Image (uimglen_t width, uimglen_t height, Colour<ch, ach> *data, ImageStorage *storage)
+      : ImageBase(width, height), data(data), expr(NULL),
+        owner(storage != NULL ? ImagePixels(storage) : ownArray(data))
+    {
+    }
+
+    /** A lazy image, takes ownership of the expression. */
+    Image (uimglen_t width, uimglen_t height, ImageExpr<ch, ach> *expr)
+      : ImageBase(width, height), data(NULL), expr(expr)
     {
-        data = new Colour<ch, ach>[numPixels()];
+        lazy_image_register(this);
     }
 
     ~Image (void)
     {
-        delete [] data;
+        if (expr != NULL) {
+            lazy_image_unregister(this);
+            delete expr;
+        }
+    }
+
+    bool lazy (void) const { return expr != NULL; }
+
+    void force (void) const
+    {
+        if (expr == NULL) return;
+        if (!expr->share(width, height, data, owner)) {
+            unsigned nodes = expr->nodes();
+            ImagePixels d_owner;
+            Colour<ch,ach> *d = expr->reuse(d_owner);
+            if (d == NULL) d = allocPixels(numPixels(), d_owner);
+            parallel_rows(height, width * nodes, [&] (uimglen_t y0, uimglen_t y1) {
+                // Every node can need a row buffer of at most 4 channels.
+                ExprScratch scratch(size_t(nodes) * width * 4);
+                for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                    expr->evalRow(y, width, &d[y*width], scratch);
+                }
+            });
+            data = d;
+            owner = d_owner;
+        }
+        delete expr;
+        expr = NULL;
+        lazy_image_unregister(this);
+    }
+
+    bool reads (const ImageBase *other) const { return expr != NULL && expr->reads(other); }
+
+    void unshare (void)
+    {
+        force();
+        if (owner.use_count() <= 1) return;
+        ImagePixels d_owner;
+        Colour<ch,ach> *d = allocPixels(numPixels(), d_owner);
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            std::copy(&data[y0*width], &data[y1*width], &d[y0*width]);
+        });
+        data = d;
+        owner = d_owner;
+    }
+
+    /** The pixels and their owner, if this image has been computed and they are not shared. */
+    Colour<ch,ach> *unsharedPixels (ImagePixels &o) const
+    {
+        if (expr != NULL || owner.use_count() != 1) return NULL;
+        o = owner;
+        return data;
+    }
+
+    /** The pixels and their owner, e.g. to share them with a view. */
+    const Colour<ch,ach> *pixels (ImagePixels &o) const
+    {
+        force();
+        o = owner;
+        return data;
+    }
+
+    unsigned exprNodes (void) const { return expr == NULL ? 0 : expr->nodes(); }
+
+    bool exprCheap (void) const { return expr != NULL && expr->cheap(); }
+
+    unsigned long numBytes (void) const
+    {
+        unsigned long b = expr == NULL ? 0 : expr->bytes();
+        return b != 0 ? b : numPixels() * (ch+ach) * sizeof(float);
+    }
+
+    PixelStorage pixelStorage (void) const { return expr == NULL ? PS_FLOAT : expr->pixelStorage(); }
+
+    /** The planes of a planar image (see ImageExprPlanar), stride floats apart, or NULL. */
+    const float *planes (size_t &stride) const { return expr == NULL ? NULL : expr->planes(stride); }
+
+    /** A planar image computed from this one, which must be planar, a plane at a time: f(c, in,
+     * out, n) writes n floats of plane c of the result from the same floats of this image. */
+    template<class F> Image<ch,ach> *planarMap (const F &f) const
+    {
+        size_t stride;
+        const float *src = planes(stride);
+        auto *e = new ImageExprPlanar<ch,ach>(width, height);
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height, e);
+        parallel_rows(height, width * (ch+ach), [&] (uimglen_t y0, uimglen_t y1) {
+            const size_t begin = size_t(y0) * width;
+            for (chan_t c=0 ; c<ch+ach ; ++c) {
+                f(c, src + c*stride + begin, e->plane(c) + begin, size_t(y1 - y0) * width);
+            }
+        });
+        return ret;
+    }
+
+    /** Row y, either directly from the pixels or computed into a buffer from scratch. */
+    const Colour<ch,ach> *row (uimglen_t y, ExprScratch &scratch) const
+    {
+        if (expr == NULL) return &data[y*width];
+        Colour<ch,ach> *buf = scratch.alloc<ch,ach>(width);
+        expr->evalRow(y, width, buf, scratch);
+        return buf;
     }
 
-    float *raw (void) { return data[0].raw(); }
-    const float *raw (void) const { return data[0].raw(); }
+    float *raw (void) { force(); return data[0].raw(); }
+    const float *raw (void) const { force(); return data[0].raw(); }
 
-    Colour<ch,ach> &pixel (uimglen_t x, uimglen_t y) { return data[y*width+x]; }
-    const Colour<ch,ach> &pixel (uimglen_t x, uimglen_t y) const { return data[y*width+x]; }
+    // These are used in the inner loops, so the image must have been computed first (see force).
+    Colour<ch,ach> &pixel (uimglen_t x, uimglen_t y)
+    { assert(expr == NULL); return data[y*width+x]; }
+    const Colour<ch,ach> &pixel (uimglen_t x, uimglen_t y) const
+    { assert(expr == NULL); return data[y*width+x]; }
 
-    Colour<ch,ach> &pixelSlow (uimglen_t x, uimglen_t y) { return pixel(x,y); }
-    const Colour<ch,ach> &pixelSlow (uimglen_t x, uimglen_t y) const { return pixel(x,y); }
+    Colour<ch,ach> &pixelSlow (uimglen_t x, uimglen_t y) { force(); return pixel(x,y); }
+    const Colour<ch,ach> &pixelSlow (uimglen_t x, uimglen_t y) const { force(); return pixel(x,y); }
 
     Colour<ch,ach> pixelSafe (float x, float y, const Colour<ch,ach> &bg) const
     {
@@ -364,50 +934,102 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
         Image<ch,ach>::drawPixelSafe(uimglen_t(x), uimglen_t(y), c_, a);
     }
 
-    Image<ch,ach> *unm (void) const
+    // The following write their result to ret, which may be this image.
+
+    void unmInto (Image<ch,ach> *ret) const
     {
-        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y) {
-            for (uimglen_t x=0 ; x<width ; ++x) {
-                ret->pixel(x,y) = this->pixel(x,y).unm();
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    ret->pixel(x,y) = this->pixel(x,y).unm();
+                }
+            }
+        });
+    }
+
+    void absInto (Image<ch,ach> *ret) const
+    {
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    ret->pixel(x,y) = this->pixel(x,y).abs();
+                }
             }
+        });
+    }
+
+    Image<ch,ach> *unm (void) const
+    {
+        size_t stride;
+        if (planes(stride) != NULL) {
+            return planarMap([] (chan_t c, const float *__restrict__ in, float *__restrict__ out, size_t n) {
+                // Alpha is kept.
+                if (c == ch) {
+                    std::copy_n(in, n, out);
+                    return;
+                }
+                for (size_t i=0 ; i<n ; ++i) out[i] = -in[i];
+            });
         }
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        unmInto(ret);
         return ret;
     }
 
     Image<ch,ach> *abs (void) const
     {
-        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y) {
-            for (uimglen_t x=0 ; x<width ; ++x) {
-                ret->pixel(x,y) = this->pixel(x,y).abs();
-            }
+        size_t stride;
+        if (planes(stride) != NULL) {
+            return planarMap([] (chan_t c, const float *__restrict__ in, float *__restrict__ out, size_t n) {
+                // Alpha is kept.
+                if (c == ch) {
+                    std::copy_n(in, n, out);
+                    return;
+                }
+                for (size_t i=0 ; i<n ; ++i) out[i] = fabsf(in[i]);
+            });
         }
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        absInto(ret);
         return ret;
     }
 
+    void unmInPlace (void) { unmInto(this); }
+    void absInPlace (void) { absInto(this); }
+
 
 
     Image<ch,ach> *crop (simglen_t left, simglen_t bottom, uimglen_t w, uimglen_t h, const ColourBase *bg_) const
     {
         Image<ch, ach> *ret = new Image<ch, ach>(w, h);
         if (bg_ == NULL) {
-            for (uimglen_t y=0 ; y<h ; ++y) {
-                for (uimglen_t x=0 ; x<w ; ++x) {
-                    uimglen_t old_x = mymod(x+left, width);
-                    uimglen_t old_y = mymod(y+bottom, height);
-                    ret->pixel(x,y) = this->pixel(old_x, old_y);
+            parallel_rows(h, w, [&] (uimglen_t y0, uimglen_t y1) {
+                for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                    const Colour<ch,ach> *in = &this->pixel(0, mymod(y+bottom, height));
+                    Colour<ch,ach> *out = &ret->pixel(0, y);
+                    image_spans(left, w, width, true, [&] (uimglen_t i, uimglen_t p, uimglen_t n) {
+                        std::copy_n(in + p, n, out + i);
+                    });
                 }
-            }
+            });
         } else {
             const Colour<ch, ach> &bg = *static_cast<const Colour<ch,ach>*>(bg_);
-            for (uimglen_t y=0 ; y<h ; ++y) {
-                for (uimglen_t x=0 ; x<w ; ++x) {
-                    uimglen_t old_x = x+left;
+            parallel_rows(h, w, [&] (uimglen_t y0, uimglen_t y1) {
+                for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                    Colour<ch,ach> *out = &ret->pixel(0, y);
                     uimglen_t old_y = y+bottom;
-                    ret->pixel(x,y) = (old_x<width && old_y<height) ? this->pixel(old_x, old_y) : bg;
+                    uimglen_t done = 0;
+                    if (old_y < height) {
+                        const Colour<ch,ach> *in = &this->pixel(0, old_y);
+                        image_spans(left, w, width, false, [&] (uimglen_t i, uimglen_t p, uimglen_t n) {
+                            std::fill_n(out + done, i - done, bg);
+                            std::copy_n(in + p, n, out + i);
+                            done = i + n;
+                        });
+                    }
+                    std::fill_n(out + done, w - done, bg);
                 }
-            }
+            });
         }
         return ret;
     }
@@ -421,8 +1043,15 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
     |            |            |
     -------------+-------------
 */
+    // The destination is walked a tile at a time, so that the source pixels read by a tile are
+    // still in cache for the next row of it.  Along a row, the source coordinates step by a fixed
+    // amount, and the span whose samples are all inside the source is read without bounds checks.
     Image<ch,ach> *rotate (float angle, const ColourBase *bg_) const
     {
+        // NaN for infinite angles, so those fall through to the general case.
+        float turns = fmodf(angle / 90, 4);
+        if (turns == floorf(turns)) return rotate90(int(turns));
+
         // calculate these later
         Colour<ch,ach> bg(0);
         if (bg_ != NULL) bg = *static_cast<const Colour<ch,ach>*>(bg_);
@@ -431,60 +1060,153 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
         uimglen_t w = (fabs(c)*width + fabs(s)*height + 0.5);
         uimglen_t h = (fabs(s)*width + fabs(c)*height + 0.5);
         Image<ch, ach> *ret = new Image<ch, ach>(w, h);
-        for (uimglen_t y=0 ; y<h; ++y) {
-            for (uimglen_t x=0 ; x<w; ++x) {
-                float rel_x = float(x) - w/2.0f + 0.5f; // 0.5
-                float rel_y = float(y) - h/2.0f + 0.5f; // -2 to 2
-                float src_x = c*rel_x - s*rel_y + width/2.0f; // 0.5
-                float src_y = s*rel_x + c*rel_y + height/2.0f; // 0.5 to 4.5
-                if (src_x>=0 && src_x<width && src_y>=0 && src_y<height) {
-                    src_x -= 0.5; // 0
-                    src_y -= 0.5; // 0 to 4
-                    Colour<ch,ach> c00 = this->pixelSafe(floorf(src_x+0), floorf(src_y+0), bg);
-                    Colour<ch,ach> c01 = this->pixelSafe(floorf(src_x+1), floorf(src_y+0), bg);
-                    Colour<ch,ach> c10 = this->pixelSafe(floorf(src_x+0), floorf(src_y+1), bg);
-                    Colour<ch,ach> c11 = this->pixelSafe(floorf(src_x+1), floorf(src_y+1), bg);
-                    float frac_x = src_x - floorf(src_x);
-                    float frac_y = src_y - floorf(src_y);
-                    Colour<ch,ach> c0x = colour_lerp(c00, c01, frac_x);
-                    Colour<ch,ach> c1x = colour_lerp(c10, c11, frac_x);
-                    ret->pixel(x,y) = colour_lerp(c0x, c1x, frac_y);
-                } else {
-                    ret->pixel(x,y) = bg;
+        // Of the four samples, the bottom left one.  Integer coordinates are pixel centres.
+        const float inner_w = float(width) - 1, inner_h = float(height) - 1;
+        auto sample = [&] (float src_x, float src_y) -> Colour<ch,ach> {
+            if (src_x < -0.5f || src_x >= width - 0.5f || src_y < -0.5f || src_y >= height - 0.5f)
+                return bg;
+            // Not floorf(src_x+1), which can round up to the pixel after next.
+            float fx = floorf(src_x), fy = floorf(src_y);
+            Colour<ch,ach> c00 = this->pixelSafe(fx+0, fy+0, bg);
+            Colour<ch,ach> c01 = this->pixelSafe(fx+1, fy+0, bg);
+            Colour<ch,ach> c10 = this->pixelSafe(fx+0, fy+1, bg);
+            Colour<ch,ach> c11 = this->pixelSafe(fx+1, fy+1, bg);
+            float frac_x = src_x - fx;
+            float frac_y = src_y - fy;
+            Colour<ch,ach> c0x = colour_lerp(c00, c01, frac_x);
+            Colour<ch,ach> c1x = colour_lerp(c10, c11, frac_x);
+            return colour_lerp(c0x, c1x, frac_y);
+        };
+        const uimglen_t bands = (h + IMAGE_TILE - 1) / IMAGE_TILE;
+        parallel_rows(bands, 4 * IMAGE_TILE * w, [&] (uimglen_t b0, uimglen_t b1) {
+            // Per row of the band: the source coordinates at x=0, and the inside span.
+            float row_x[IMAGE_TILE], row_y[IMAGE_TILE];
+            uimglen_t inside_begin[IMAGE_TILE], inside_end[IMAGE_TILE];
+            for (uimglen_t b=b0 ; b<b1 ; ++b) {
+                const uimglen_t y0 = b * IMAGE_TILE;
+                const uimglen_t y1 = std::min(h, y0 + IMAGE_TILE);
+                for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                    float rel_x = 0.5f - w/2.0f;
+                    float rel_y = float(y) - h/2.0f + 0.5f;
+                    float sx = row_x[y-y0] = c*rel_x - s*rel_y + width/2.0f - 0.5f;
+                    float sy = row_y[y-y0] = s*rel_x + c*rel_y + height/2.0f - 0.5f;
+                    auto inside = [&] (uimglen_t x) {
+                        float src_x = sx + c*x, src_y = sy + s*x;
+                        return src_x >= 0 && src_x < inner_w && src_y >= 0 && src_y < inner_h;
+                    };
+                    // Estimate the span, then trim it to the pixels that are really inside.
+                    double lo = 0, hi = w;
+                    rotate_span(sx, c, inner_w, lo, hi);
+                    rotate_span(sy, s, inner_h, lo, hi);
+                    uimglen_t begin = uimglen_t(std::min(lo, double(w)));
+                    uimglen_t end = uimglen_t(std::max(double(begin), std::min(hi, double(w))));
+                    while (begin < end && !inside(begin)) ++begin;
+                    while (end > begin && !inside(end-1)) --end;
+                    inside_begin[y-y0] = begin;
+                    inside_end[y-y0] = end;
+                }
+                for (uimglen_t tx=0 ; tx<w ; tx+=IMAGE_TILE) {
+                    const uimglen_t tx1 = std::min(w, tx + IMAGE_TILE);
+                    for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                        const float sx = row_x[y-y0], sy = row_y[y-y0];
+                        const uimglen_t begin = std::min(tx1, std::max(tx, inside_begin[y-y0]));
+                        const uimglen_t end = std::min(tx1, std::max(begin, inside_end[y-y0]));
+                        Colour<ch,ach> *out = &ret->pixel(0, y);
+                        for (uimglen_t x=tx ; x<begin ; ++x) out[x] = sample(sx + c*x, sy + s*x);
+                        for (uimglen_t x=begin ; x<end ; ++x) {
+                            float src_x = sx + c*x, src_y = sy + s*x;
+                            float fx = floorf(src_x), fy = floorf(src_y);
+                            const Colour<ch,ach> *p = &this->pixel(uimglen_t(fx), uimglen_t(fy));
+                            Colour<ch,ach> c0x = colour_lerp(p[0], p[1], src_x - fx);
+                            Colour<ch,ach> c1x = colour_lerp(p[width], p[width+1], src_x - fx);
+                            out[x] = colour_lerp(c0x, c1x, src_y - fy);
+                        }
+                        for (uimglen_t x=end ; x<tx1 ; ++x) out[x] = sample(sx + c*x, sy + s*x);
+                    }
                 }
             }
+        });
+        return ret;
+    }
+
+    Image<ch,ach> *rotate90 (int k) const
+    {
+        switch (mymod(k, 4)) {
+            case 0: return view(0, 0, width, height, NULL, false, false);
+            case 1: return transposed(true, false);
+            case 2: return view(0, 0, width, height, NULL, true, true);
+            default: return transposed(false, true);
         }
+    }
+
+    Image<ch,ach> *transpose (void) const { return transposed(false, false); }
+
+    // Pixel (x,y) of the result is pixel (y,x) of this image, with the source x and/or y reversed.
+    // The result is walked in tiles, so that the columns of this image read by the rows of a tile
+    // stay in cache from one row to the next.
+    Image<ch,ach> *transposed (bool flip_x, bool flip_y) const
+    {
+        const uimglen_t w = height, h = width;
+        Image<ch,ach> *ret = new Image<ch,ach>(w, h);
+        const ptrdiff_t step = flip_y ? -ptrdiff_t(width) : ptrdiff_t(width);
+        const uimglen_t bands = (h + IMAGE_TILE - 1) / IMAGE_TILE;
+        parallel_rows(bands, IMAGE_TILE * w, [&] (uimglen_t b0, uimglen_t b1) {
+            for (uimglen_t b=b0 ; b<b1 ; ++b) {
+                const uimglen_t y0 = b * IMAGE_TILE;
+                const uimglen_t y1 = std::min(h, y0 + IMAGE_TILE);
+                for (uimglen_t x0=0 ; x0<w ; x0+=IMAGE_TILE) {
+                    const uimglen_t x1 = std::min(w, x0 + IMAGE_TILE);
+                    for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                        const Colour<ch,ach> *in = &this->pixel(flip_x ? width - 1 - y : y,
+                                                                flip_y ? height - 1 - x0 : x0);
+                        Colour<ch,ach> *out = &ret->pixel(x0, y);
+                        for (uimglen_t x=0 ; x<x1-x0 ; ++x) out[x] = in[ptrdiff_t(x) * step];
+                    }
+                }
+            }
+        });
         return ret;
     }
 
+    Image<ch, ach> *view (simglen_t left, simglen_t bottom, uimglen_t w, uimglen_t h,
+                          const ColourBase *bg, bool flip_x, bool flip_y) const
+    {
+        auto *e = new ImageExprView<ch,ach,ch,ach>(this, left, bottom, h,
+                                                   static_cast<const Colour<ch,ach>*>(bg),
+                                                   flip_x, flip_y, NULL);
+        return new Image<ch, ach>(w, h, e);
+    }
+
     Image<ch, ach> *clone (bool flip_x, bool flip_y) const
     {
         Image<ch, ach> *ret = new Image<ch, ach>(width, height);
-        if (flip_x) {
-            if (flip_y) {
-                for (uimglen_t y=0 ; y<height ; ++y)
-                    for (uimglen_t x=0 ; x<width ; ++x)
-                        ret->pixel(x,y) = this->pixel(width-x-1, height-y-1);
-            } else {
-                for (uimglen_t y=0 ; y<height ; ++y)
-                    for (uimglen_t x=0 ; x<width ; ++x)
-                        ret->pixel(x,y) = this->pixel(width-x-1, y);
-            }
-        } else {
-            if (flip_y) {
-                for (uimglen_t y=0 ; y<height ; ++y)
-                    for (uimglen_t x=0 ; x<width ; ++x)
-                        ret->pixel(x,y) = this->pixel(x, height-y-1);
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            if (flip_x) {
+                if (flip_y) {
+                    for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                        const Colour<ch,ach> *in = &this->pixel(0, height-y-1);
+                        std::reverse_copy(in, in + width, &ret->pixel(0, y));
+                    }
+                } else {
+                    for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                        const Colour<ch,ach> *in = &this->pixel(0, y);
+                        std::reverse_copy(in, in + width, &ret->pixel(0, y));
+                    }
+                }
             } else {
-                for (uimglen_t y=0 ; y<height ; ++y)
-                    for (uimglen_t x=0 ; x<width ; ++x)
-                        ret->pixel(x,y) = this->pixel(x, y);
+                if (flip_y) {
+                    for (uimglen_t y=y0 ; y<y1 ; ++y)
+                        std::copy_n(&this->pixel(0, height-y-1), width, &ret->pixel(0, y));
+                } else {
+                    // The rows are contiguous, so the whole band is one copy.
+                    std::copy(&this->pixel(0, y0), &this->pixel(0, y1), &ret->pixel(0, y0));
+                }
             }
-        }
+        });
         return ret;
     }
 
-    Image<ch,ach> *normalise (void) const
+    void normaliseInto (Image<ch,ach> *ret) const
     {
         Colour<ch,ach> pos_total(0.0f);
         Colour<ch,ach> neg_total(0.0f);
@@ -500,62 +1222,63 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
                 }
             }
         }
-        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y) {
-            for (uimglen_t x=0 ; x<width ; ++x) {
-                for (chan_t c=0 ; c<ch+ach ; ++c) {
-                    float v = this->pixel(x,y)[c];
-                    if (v >= 0) {
-                        ret->pixel(x,y)[c] = v / pos_total[c];
-                    } else {
-                        ret->pixel(x,y)[c] = v / neg_total[c];
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    for (chan_t c=0 ; c<ch+ach ; ++c) {
+                        float v = this->pixel(x,y)[c];
+                        if (v >= 0) {
+                            ret->pixel(x,y)[c] = v / pos_total[c];
+                        } else {
+                            ret->pixel(x,y)[c] = v / neg_total[c];
+                        }
                     }
                 }
             }
-        }
-        return ret;
+        });
     }
 
-    Image<ch,ach> *clamp (const ColourBase *min_, const ColourBase *max_) const
+    void clampInto (Image<ch,ach> *ret, const ColourBase *min_, const ColourBase *max_) const
     {
         const auto &min = *static_cast<const Colour<ch,ach>*>(min_);
         const auto &max = *static_cast<const Colour<ch,ach>*>(max_);
-        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y) {
-            for (uimglen_t x=0 ; x<width ; ++x) {
-                for (chan_t c=0 ; c<ch+ach ; ++c) {
-                    float v = this->pixel(x,y)[c];
-                    if (v < min[c]) v = min[c];
-                    if (v > max[c]) v = max[c];
-                    ret->pixel(x,y)[c] = v;
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    for (chan_t c=0 ; c<ch+ach ; ++c) {
+                        float v = this->pixel(x,y)[c];
+                        if (v < min[c]) v = min[c];
+                        if (v > max[c]) v = max[c];
+                        ret->pixel(x,y)[c] = v;
+                    }
                 }
             }
-        }
-        return ret;
+        });
     }
 
-    Image<ch,ach> *gamma (const ColourBase *n_) const
+    void gammaInto (Image<ch,ach> *ret, const ColourBase *n_) const
     {
         const auto &n = *static_cast<const Colour<ch,ach>*>(n_);
-        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y) {
-            for (uimglen_t x=0 ; x<width ; ++x) {
-                for (chan_t c=0 ; c<ch+ach ; ++c) {
-                    float v = this->pixel(x,y)[c];
-                    ret->pixel(x,y)[c] = ((v < 0) ? -1 : 1) * pow(fabs(v), n[c]);
+        parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    for (chan_t c=0 ; c<ch+ach ; ++c) {
+                        float v = this->pixel(x,y)[c];
+                        ret->pixel(x,y)[c] = ((v < 0) ? -1 : 1) * pow(fabs(v), n[c]);
+                    }
                 }
             }
-        }
-        return ret;
+        });
     }
 
-    Image<ch,ach> *quantise (DitherAlgorithm d, const ColourBase *res_) const
+    void quantiseInto (Image<ch,ach> *ret, DitherAlgorithm d, const ColourBase *res_) const
     {
         const auto &res = *static_cast<const Colour<ch,ach>*>(res_);
-        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y)
-            for (uimglen_t x=0 ; x<width ; ++x)
-                ret->pixel(x,y) = this->pixel(x,y);
+        if (ret != this) {
+            for (uimglen_t y=0 ; y<height ; ++y)
+                for (uimglen_t x=0 ; x<width ; ++x)
+                    ret->pixel(x,y) = this->pixel(x,y);
+        }
 
         for (uimglen_t y=0 ; y<height ; ++y) {
             for (uimglen_t x=0 ; x<width ; ++x) {
@@ -600,15 +1323,64 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
                 }
             }
         }
-        return ret;
     }
 
-    Image<ch,ach> *scale (uimglen_t w, uimglen_t h, ScaleFilter filter) const
+    Image<ch,ach> *normalise (void) const
     {
-        return static_cast<Image<ch,ach>*>(ImageBase::scale(w,h, filter));
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        normaliseInto(ret);
+        return ret;
     }
 
-    // Bresenham modified for arbitrary width
+    Image<ch,ach> *clamp (const ColourBase *min_, const ColourBase *max_) const
+    {
+        size_t stride;
+        if (planes(stride) != NULL) {
+            const auto &min = *static_cast<const Colour<ch,ach>*>(min_);
+            const auto &max = *static_cast<const Colour<ch,ach>*>(max_);
+            return planarMap([&] (chan_t c, const float *__restrict__ in, float *__restrict__ out, size_t n) {
+                const float lo = min[c], hi = max[c];
+                for (size_t i=0 ; i<n ; ++i) out[i] = std::min(std::max(in[i], lo), hi);
+            });
+        }
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        clampInto(ret, min_, max_);
+        return ret;
+    }
+
+    Image<ch,ach> *gamma (const ColourBase *n_) const
+    {
+        size_t stride;
+        if (planes(stride) != NULL) {
+            const auto &e = *static_cast<const Colour<ch,ach>*>(n_);
+            return planarMap([&] (chan_t c, const float *__restrict__ in, float *__restrict__ out, size_t n) {
+                const float ec = e[c];
+                for (size_t i=0 ; i<n ; ++i) out[i] = ((in[i] < 0) ? -1 : 1) * pow(fabs(in[i]), ec);
+            });
+        }
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        gammaInto(ret, n_);
+        return ret;
+    }
+
+    Image<ch,ach> *quantise (DitherAlgorithm d, const ColourBase *res) const
+    {
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        quantiseInto(ret, d, res);
+        return ret;
+    }
+
+    void normaliseInPlace (void) { normaliseInto(this); }
+    void clampInPlace (const ColourBase *min, const ColourBase *max) { clampInto(this, min, max); }
+    void gammaInPlace (const ColourBase *n) { gammaInto(this, n); }
+    void quantiseInPlace (DitherAlgorithm d, const ColourBase *res) { quantiseInto(this, d, res); }
+
+    Image<ch,ach> *scale (uimglen_t w, uimglen_t h, ScaleFilter filter) const
+    {
+        return static_cast<Image<ch,ach>*>(ImageBase::scale(w,h, filter));
+    }
+
+    // Bresenham modified for arbitrary width
     void drawLine (uimglen_t x0, uimglen_t y0, uimglen_t x1, uimglen_t y1, uimglen_t w, const ColourBase *colour)
     {
         simglen_t dx = ::abs(int(x1-x0)); // 3
@@ -694,6 +1466,8 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
 
     }
 
+    // Bounds and wrapping are resolved once per row.  Runs of fully opaque source pixels replace
+    // the destination, so they are copied rather than blended.
     void drawImage (const ImageBase *src_, simglen_t left, simglen_t bottom, bool wrap_x, bool wrap_y)
     {
         const Image<ch,1> *src = static_cast<const Image<ch,1>*>(src_);
@@ -701,55 +1475,219 @@ template<chan_t ch, chan_t ach> class Image : public ImageBase {
         uimglen_t h = src->height;
 
         for (uimglen_t y=0 ; y<h ; ++y) {
-            for (uimglen_t x=0 ; x<w ; ++x) {
-                simglen_t dst_x = x + left;
-                simglen_t dst_y = y + bottom;
-                if (wrap_x) {
-                    dst_x = mymod(dst_x, width);
-                } else {
-                    if (dst_x < 0 || uimglen_t(dst_x) >= width) continue;
-                }
-                if (wrap_y) {
-                    dst_y = mymod(dst_y, height);
-                } else {
-                    if (dst_y < 0 || uimglen_t(dst_y) >= height) continue;
-                }
-                this->pixel(dst_x,dst_y) = colour_blend(src->pixel(x,y), this->pixel(dst_x,dst_y));
+            simglen_t dst_y = y + bottom;
+            if (wrap_y) {
+                dst_y = mymod(dst_y, height);
+            } else {
+                if (dst_y < 0 || uimglen_t(dst_y) >= height) continue;
             }
+            image_spans(left, w, width, wrap_x, [&] (uimglen_t i, uimglen_t p, uimglen_t n) {
+                const Colour<ch,1> *in = &src->pixel(i, y);
+                Colour<ch,ach> *out = &this->pixel(p, dst_y);
+                for (uimglen_t x=0 ; x<n ; ) {
+                    uimglen_t opaque = x;
+                    while (opaque < n && in[opaque][ch] == 1) ++opaque;
+                    if (opaque == x) {
+                        out[x] = colour_blend(in[x], out[x]);
+                        ++x;
+                    } else if (ach == 1) {
+                        // The same layout.
+                        std::copy(reinterpret_cast<const Colour<ch,ach>*>(in + x),
+                                  reinterpret_cast<const Colour<ch,ach>*>(in + opaque), out + x);
+                        x = opaque;
+                    } else {
+                        for ( ; x<opaque ; ++x)
+                            for (chan_t c=0 ; c<ch ; ++c) out[x][c] = in[x][c];
+                    }
+                }
+            });
         }
     }
 
-    Image<ch,ach> *convolve (const Image<1,0> *kernel, bool wrap_x, bool wrap_y) const
+    Image<ch,ach> *convolve (const Image<1,0> *kernel, bool wrap_x, bool wrap_y,
+                             ConvolveMethod method) const
     {
+        if (method == CM_AUTO) {
+            bool fft = convolve_prefer_fft(width, height, ch+ach, kernel->width, kernel->height);
+            method = fft ? CM_FFT : CM_DIRECT;
+        }
+        if (method == CM_FFT) return convolveFFT(kernel, wrap_x, wrap_y);
+
         // TODO: optimisations
         // 1) use a separate loop for the middle of the image where we don't need to test for edges
         simglen_t kcx = kernel->width / 2;
         simglen_t kcy = kernel->height / 2;
         Image<ch,ach> *ret = new Image<ch,ach>(width, height);
-        for (uimglen_t y=0 ; y<height ; ++y) {
-            for (uimglen_t x=0 ; x<width ; ++x) {
-                Colour<ch,ach> p(0);
-                for (simglen_t ky=-kcy ; ky<=kcy ; ++ky) {
-                    for (simglen_t kx=-kcx ; kx<=kcx ; ++kx) {
-                        float kv = kernel->pixel(kx+kcx, ky+kcy)[0];
-                        simglen_t this_x = x+kx;
-                        simglen_t this_y = y+ky;
-                        if (this_x < 0) this_x = wrap_x ? mymod(this_x, width): 0;
-                        if (this_y < 0) this_y = wrap_y ? mymod(this_y, height): 0;
-                        if (uimglen_t(this_x) >= width) this_x = wrap_x ? mymod(this_x, width): width-1;
-                        if (uimglen_t(this_y) >= height) this_y = wrap_y ? mymod(this_y, height): height-1;
-                        Colour<ch,ach> thisv = this->pixel((uimglen_t)this_x, (uimglen_t)this_y);
-                        for (chan_t c=0 ; c<ch+ach ; ++c) {
-                            p[c] += thisv[c] * kv;
+        parallel_rows(height, width * kernel->numPixels(), [&] (uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    Colour<ch,ach> p(0);
+                    for (simglen_t ky=-kcy ; ky<=kcy ; ++ky) {
+                        for (simglen_t kx=-kcx ; kx<=kcx ; ++kx) {
+                            float kv = kernel->pixel(kx+kcx, ky+kcy)[0];
+                            simglen_t this_x = x+kx;
+                            simglen_t this_y = y+ky;
+                            if (this_x < 0) this_x = wrap_x ? mymod(this_x, width): 0;
+                            if (this_y < 0) this_y = wrap_y ? mymod(this_y, height): 0;
+                            if (uimglen_t(this_x) >= width) this_x = wrap_x ? mymod(this_x, width): width-1;
+                            if (uimglen_t(this_y) >= height) this_y = wrap_y ? mymod(this_y, height): height-1;
+                            Colour<ch,ach> thisv = this->pixel((uimglen_t)this_x, (uimglen_t)this_y);
+                            for (chan_t c=0 ; c<ch+ach ; ++c) {
+                                p[c] += thisv[c] * kv;
+                            }
                         }
                     }
+                    ret->pixel(x,y) = p;
                 }
-                ret->pixel(x,y) = p;
+            }
+        });
+        return ret;
+    }
+
+    // The image is padded with the clamped or wrapped edge pixels, then placed in a grid large
+    // enough that the circular convolution computed by the FFT does not wrap around onto the pixels
+    // we keep.  Two channels are transformed at once, as the real and imaginary parts.
+    Image<ch,ach> *convolveFFT (const Image<1,0> *kernel, bool wrap_x, bool wrap_y) const
+    {
+        const unsigned n = ch + ach;
+        const simglen_t kcx = kernel->width / 2;
+        const simglen_t kcy = kernel->height / 2;
+        const std::vector<uimglen_t> cols = convolve_index_table(width, kcx, wrap_x);
+        const std::vector<uimglen_t> rows = convolve_index_table(height, kcy, wrap_y);
+        const unsigned gw = fft_good_size(cols.size());
+        const unsigned gh = fft_good_size(rows.size());
+        const float scale = 1.0f / (float(gw) * gh);
+
+        // Reversed, so that the product of the transforms gives the same sum as the direct method.
+        // Pixel (x,y) of the result then ends up at (x+2*kcx, y+2*kcy).
+        std::vector<Complex> kernel_fft(size_t(gw) * gh);
+        for (uimglen_t y=0 ; y<kernel->height ; ++y) {
+            for (uimglen_t x=0 ; x<kernel->width ; ++x) {
+                size_t i = size_t(2*kcy - y) * gw + (2*kcx - x);
+                kernel_fft[i] = kernel->pixel(x, y)[0] * scale;
             }
         }
+        fft_2d(&kernel_fft[0], gw, gh, false);
+
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        std::vector<Complex> grid(size_t(gw) * gh);
+        for (unsigned c=0 ; c<n ; c+=2) {
+            const bool pair = c + 1 < n;
+            std::fill(grid.begin(), grid.end(), Complex(0));
+            parallel_rows(rows.size(), cols.size(), [&] (uimglen_t y0, uimglen_t y1) {
+                for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                    for (uimglen_t x=0 ; x<cols.size() ; ++x) {
+                        const Colour<ch,ach> &p = this->pixel(cols[x], rows[y]);
+                        grid[size_t(y) * gw + x] = Complex(p[c], pair ? p[c+1] : 0);
+                    }
+                }
+            });
+            fft_2d(&grid[0], gw, gh, false);
+            parallel_rows(gh, gw, [&] (uimglen_t y0, uimglen_t y1) {
+                for (size_t i=size_t(y0)*gw ; i<size_t(y1)*gw ; ++i) grid[i] = complex_mul(grid[i], kernel_fft[i]);
+            });
+            fft_2d(&grid[0], gw, gh, true);
+            parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+                for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                    for (uimglen_t x=0 ; x<width ; ++x) {
+                        const Complex &v = grid[size_t(y + 2*kcy) * gw + x + 2*kcx];
+                        ret->pixel(x, y)[c] = v.real();
+                        if (pair) ret->pixel(x, y)[c+1] = v.imag();
+                    }
+                }
+            });
+        }
+        return ret;
+    }
+
+    // See convolve_sep_floats.  Planar images are convolved a plane at a time, and stay planar.
+    Image<ch,ach> *convolveSep (const Image<1,0> *kernel, bool wrap_x, bool wrap_y) const
+    {
+        const simglen_t kc = kernel->width / 2;
+        const float *k = kernel->raw();
+        const std::vector<uimglen_t> cols = convolve_index_table(width, kc, wrap_x);
+        const std::vector<uimglen_t> rows = convolve_index_table(height, kc, wrap_y);
+
+        size_t stride;
+        const float *src = planes(stride);
+        if (src != NULL) {
+            auto *e = new ImageExprPlanar<ch,ach>(width, height);
+            Image<ch,ach> *ret = new Image<ch,ach>(width, height, e);
+            Image<1,0> *tmp = new Image<1,0>(width, height);
+            for (chan_t c=0 ; c<ch+ach ; ++c) {
+                convolve_sep_floats(src + c*stride, tmp->raw(), e->plane(c), width, height, 1,
+                                    k, kc, cols, rows);
+            }
+            delete tmp;
+            return ret;
+        }
+
+        Image<ch,ach> *tmp = new Image<ch,ach>(width, height);
+        Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+        convolve_sep_floats(this->raw(), tmp->raw(), ret->raw(), width, height, ch+ach,
+                            k, kc, cols, rows);
+        delete tmp;
         return ret;
     }
 
+    void readRows (uimglen_t y0, uimglen_t y1, float *out) const
+    {
+        ExprScratch scratch(size_t(exprNodes() + 1) * width * 4);
+        const size_t row_floats = size_t(width) * (ch+ach);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            size_t mark = scratch.mark();
+            const float *in = reinterpret_cast<const float*>(row(y, scratch));
+            std::copy_n(in, row_floats, out + (y - y0) * row_floats);
+            scratch.release(mark);
+        }
+    }
+
+    /** As image_reduce_parallel, but reading the pixels a row at a time with row(), so a lazy
+     * image (e.g. a packed one) is never computed as a whole. */
+    template<class Acc> std::array<Acc,ch+ach> reducePixels (void) const
+    {
+        std::vector<std::array<Acc,ch+ach>> partial(std::max(height, uimglen_t(1)));
+        const unsigned nodes = exprNodes();
+        parallel_rows(height, size_t(width) * (nodes + 1), [&] (uimglen_t y0, uimglen_t y1) {
+            ExprScratch scratch(size_t(nodes + 1) * width * 4);
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                size_t mark = scratch.mark();
+                const Colour<ch,ach> *in = row(y, scratch);
+                std::array<Acc,ch+ach> &acc = partial[y];
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    for (chan_t c=0 ; c<ch+ach ; ++c) acc[c].add(in[x][c]);
+                }
+                scratch.release(mark);
+            }
+        });
+        return image_reduce_combine(partial);
+    }
+
+    Colour<ch,ach> *reduce (ReduceOp op) const
+    {
+        Colour<ch,ach> *r = new Colour<ch,ach>(0);
+        switch (op) {
+            case RO_SUM: case RO_MEAN: {
+                auto acc = reducePixels<ReduceSum>();
+                double div = op == RO_MEAN ? double(numPixels()) : 1;
+                for (chan_t c=0 ; c<ch+ach ; ++c) (*r)[c] = acc[c].value() / div;
+            } break;
+            case RO_MIN: {
+                auto acc = reducePixels<ReduceMin>();
+                for (chan_t c=0 ; c<ch+ach ; ++c) (*r)[c] = acc[c].v;
+            } break;
+            case RO_MAX: {
+                auto acc = reducePixels<ReduceMax>();
+                for (chan_t c=0 ; c<ch+ach ; ++c) (*r)[c] = acc[c].v;
+            } break;
+            case RO_VARIANCE: {
+                auto acc = reducePixels<ReduceMoments>();
+                for (chan_t c=0 ; c<ch+ach ; ++c) (*r)[c] = acc[c].variance();
+            } break;
+        }
+        return r;
+    }
+
 };
 
 static inline uimglen_t get_width (const ImageBase *a, const ColourBase *) { return a->width; }
@@ -759,51 +1697,423 @@ static inline uimglen_t get_height (const ColourBase *, const ImageBase *b) { re
 static inline uimglen_t get_width (const ImageBase *, const ImageBase *b) { return b->width; }
 static inline uimglen_t get_height (const ImageBase *, const ImageBase *b) { return b->height; }
 
+// A row of an image being read by a lazy expression.
+template<chan_t ch, chan_t ach> struct ExprRow {
+    const Colour<ch,ach> *p;
+    ExprRow (const Colour<ch,ach> *p) : p(p) { }
+    const Colour<ch,ach> &pixel (uimglen_t x, uimglen_t) const { return p[x]; }
+};
+
+// The inputs of a lazy expression: Image<ch,ach> (which may itself be lazy) or Colour<ch,ach>.
+template<class T> class ExprOperand;
+
+template<chan_t ch, chan_t ach> class ExprOperand<const Colour<ch,ach>*> {
+    const Colour<ch,ach> colour;
+
+    public:
+
+    typedef Colour<ch,ach> Pixel;
+
+    ExprOperand (const Colour<ch,ach> *colour) : colour(*colour) { }
+
+    const Colour<ch,ach> &row (uimglen_t, ExprScratch &) const { return colour; }
+    unsigned nodes (void) const { return 0; }
+    bool reads (const ImageBase *) const { return false; }
+};
+
+template<chan_t ch, chan_t ach> class ExprOperand<const Image<ch,ach>*> {
+    const Image<ch,ach> *img;
+
+    public:
+
+    typedef Colour<ch,ach> Pixel;
+
+    ExprOperand (const Image<ch,ach> *img)
+      : img(img)
+    {
+        // Evaluate lazy images that are used more than once, rather than computing them again
+        // for every use.  Also avoid arbitrarily long expressions.
+        if ((img->refs > 1 && !img->exprCheap()) || img->exprNodes() >= IMAGE_EXPR_MAX_NODES)
+            img->force();
+        img->refs++;
+    }
+
+    ExprOperand (const ExprOperand &) = delete;
+
+    ~ExprOperand (void)
+    {
+        img->release();
+    }
+
+    ExprRow<ch,ach> row (uimglen_t y, ExprScratch &scratch) const
+    {
+        return ExprRow<ch,ach>(img->row(y, scratch));
+    }
+
+    // If this operand is the only owner, the image was a temporary and its pixels are free.
+    Colour<ch,ach> *reuse (ImagePixels &o) const
+    {
+        return img->refs == 1 ? img->unsharedPixels(o) : NULL;
+    }
+
+    unsigned nodes (void) const { return img->exprNodes(); }
+    bool reads (const ImageBase *other) const { return img == other || img->reads(other); }
+};
+
+// Pixels of an operand of the same type as the result, that the result can be written over.
+template<chan_t ch, chan_t ach>
+Colour<ch,ach> *expr_reuse (const ExprOperand<const Image<ch,ach>*> &op, ImagePixels &o)
+{
+    return op.reuse(o);
+}
+template<chan_t ch, chan_t ach, class T>
+Colour<ch,ach> *expr_reuse (const ExprOperand<T> &, ImagePixels &)
+{
+    return NULL;
+}
+
+// f is called with a pixel from a and the corresponding pixel from b.
+template<chan_t ch, chan_t ach, class T1, class T2, class F>
+class ImageExprZip : public ImageExpr<ch,ach> {
+    ExprOperand<T1> a;
+    ExprOperand<T2> b;
+    F f;
+
+    public:
+
+    ImageExprZip (T1 a, T2 b, const F &f) : a(a), b(b), f(f) { }
+
+    void evalRow (uimglen_t y, uimglen_t width, Colour<ch,ach> *out, ExprScratch &scratch) const
+    {
+        size_t mark = scratch.mark();
+        const auto &row_a = a.row(y, scratch);
+        const auto &row_b = b.row(y, scratch);
+        for (uimglen_t x=0 ; x<width ; ++x) {
+            out[x] = f(row_a.pixel(x, y), row_b.pixel(x, y));
+        }
+        scratch.release(mark);
+    }
+
+    unsigned nodes (void) const { return 1 + a.nodes() + b.nodes(); }
+
+    bool reads (const ImageBase *img) const { return a.reads(img) || b.reads(img); }
+
+    Colour<ch,ach> *reuse (ImagePixels &o) const
+    {
+        Colour<ch,ach> *r = expr_reuse<ch,ach>(a, o);
+        return r != NULL ? r : expr_reuse<ch,ach>(b, o);
+    }
+};
+
+template<chan_t ch, chan_t ach, class T1, class T2, class F>
+Image<ch,ach> *image_lazy_zip (T1 a, T2 b, const F &f)
+{
+    return new Image<ch,ach>(get_width(a,b), get_height(a,b), new ImageExprZip<ch,ach,T1,T2,F>(a, b, f));
+}
+
+/** Conversion between float and the samples of a packed image.  Integer samples clamp to [0,1], and
+ * take NaN as 0. */
+template<class T> struct PackedSample;
+
+template<> struct PackedSample<uint8_t> {
+    static const PixelStorage storage = PS_U8;
+    static float decode (uint8_t v) { return v / 255.0f; }
+    static uint8_t encode (float v) { return uint8_t((v > 0 ? std::min(v, 1.0f) : 0.0f) * 255 + 0.5f); }
+};
+
+template<> struct PackedSample<uint16_t> {
+    static const PixelStorage storage = PS_U16;
+    static float decode (uint16_t v) { return v / 65535.0f; }
+    static uint16_t encode (float v) { return uint16_t((v > 0 ? std::min(v, 1.0f) : 0.0f) * 65535 + 0.5f); }
+};
+
+/** The bits of an IEEE 754 half, distinct from uint16_t so that it can select PackedSample. */
+struct Half { uint16_t bits; };
+
+template<> struct PackedSample<Half> {
+    static const PixelStorage storage = PS_F16;
+    static float decode (Half v) { return half_to_float(v.bits); }
+    static Half encode (float v) { Half h = { float_to_half(v) }; return h; }
+};
+
+/** Pixels kept in a smaller type than float, widened a row at a time whenever they are read.
+ * Lazy operations on the image therefore stream from the packed samples, and anything else that
+ * needs the pixels is given a computed copy (see image_pack), so the image stays packed until
+ * it is drawn into or forced. */
+template<chan_t ch, chan_t ach, class T>
+class ImageExprPacked : public ImageExpr<ch,ach> {
+    // Row major, channels interleaved, like the pixels of a computed image.
+    std::vector<T> samples;
+
+    public:
+
+    ImageExprPacked (std::vector<T> &&samples) : samples(std::move(samples)) { }
+
+    void evalRow (uimglen_t y, uimglen_t width, Colour<ch,ach> *out, ExprScratch &) const
+    {
+        const size_t n = size_t(width) * (ch+ach);
+        const T *in = samples.data() + y * n;
+        float *o = reinterpret_cast<float*>(out);
+        for (size_t i=0 ; i<n ; ++i) o[i] = PackedSample<T>::decode(in[i]);
+    }
+
+    unsigned nodes (void) const { return 1; }
+
+    bool reads (const ImageBase *) const { return false; }
+
+    bool cheap (void) const { return true; }
+
+    unsigned long bytes (void) const { return samples.size() * sizeof(T); }
+
+    PixelStorage pixelStorage (void) const { return PackedSample<T>::storage; }
+};
+
+/** Pixels kept as one plane of floats per channel, rather than interleaved.  Per-channel
+ * operations (see Image::planarMap) then run over whole planes, many pixels at a time, and their
+ * results are planar too.  Anything else reads the pixels a row at a time, interleaving them, so
+ * e.g. saving the image needs no special case. */
+template<chan_t ch, chan_t ach>
+class ImageExprPlanar : public ImageExpr<ch,ach> {
+    ImagePixels owner;
+    float *data;
+    uimglen_t width;
+    // Floats from one plane to the next, keeping each plane aligned like the first.
+    size_t stride;
+
+    public:
+
+    ImageExprPlanar (uimglen_t width, uimglen_t height)
+      : width(width)
+    {
+        const size_t align = PIXEL_POOL_ALIGNMENT / sizeof(float);
+        stride = (size_t(width) * height + align - 1) / align * align;
+        const size_t bytes = stride * (ch+ach) * sizeof(float);
+        data = static_cast<float*>(pixel_pool_alloc(bytes));
+        owner = ImagePixels(data, [bytes] (float *d) { pixel_pool_free(d, bytes); });
+    }
+
+    ImageExprPlanar (const ImageExprPlanar &) = delete;
+
+    float *plane (chan_t c) { return data + c * stride; }
+
+    const float *planes (size_t &s) const
+    {
+        s = stride;
+        return data;
+    }
+
+    void evalRow (uimglen_t y, uimglen_t, Colour<ch,ach> *out, ExprScratch &) const
+    {
+        const float *in = data + size_t(y) * width;
+        for (chan_t c=0 ; c<ch+ach ; ++c) {
+            const float *p = in + c * stride;
+            for (uimglen_t x=0 ; x<width ; ++x) out[x][c] = p[x];
+        }
+    }
+
+    unsigned nodes (void) const { return 1; }
+
+    bool reads (const ImageBase *) const { return false; }
+
+    bool cheap (void) const { return true; }
+
+    unsigned long bytes (void) const { return stride * (ch+ach) * sizeof(float); }
+
+    PixelStorage pixelStorage (void) const { return PS_PLANAR; }
+};
+
+/** Pixels of another image, cropped, flipped and/or with the channels rearranged, copied a row at
+ * a time as they are read.  The view is computed (becomes a copy) when its pixels are needed
+ * directly, except that a view of the whole image just shares its pixels.  The view keeps the
+ * pixels alive rather than the image, and drawing into the image gives it a copy first. */
+template<chan_t ch, chan_t ach, chan_t sch, chan_t scha>
+class ImageExprView : public ImageExpr<ch,ach> {
+    ImagePixels owner;
+    const Colour<sch,scha> *src;
+    uimglen_t srcWidth, srcHeight;
+    simglen_t left, bottom;
+    // Of the view, for flipping.
+    uimglen_t height;
+    bool flipX, flipY;
+    // Outside the source, or if not set, coordinates wrap around.
+    bool hasBg;
+    Colour<ch,ach> bg;
+    // Source channel of each channel, or -1 for 0 and -2 for 1.
+    int mapping[ch+ach];
+    // Whether pixels can be copied unchanged.
+    bool identity;
+
+    public:
+
+    ImageExprView (const Image<sch,scha> *src, simglen_t left, simglen_t bottom, uimglen_t height,
+                   const Colour<ch,ach> *bg, bool flip_x, bool flip_y, const int *mapping)
+      : srcWidth(src->width), srcHeight(src->height), left(left), bottom(bottom), height(height),
+        flipX(flip_x), flipY(flip_y), hasBg(bg != NULL), bg(bg == NULL ? Colour<ch,ach>(0) : *bg)
+    {
+        // Rows of a lazy source would need buffers of its width rather than ours, so this
+        // computes it.
+        this->src = src->pixels(owner);
+        identity = ch+ach == sch+scha;
+        for (chan_t c=0 ; c<ch+ach ; ++c) {
+            this->mapping[c] = mapping == NULL ? c : mapping[c];
+            if (this->mapping[c] != c) identity = false;
+        }
+    }
+
+    ImageExprView (const ImageExprView &) = delete;
+
+    void evalRow (uimglen_t y, uimglen_t width, Colour<ch,ach> *out, ExprScratch &) const
+    {
+        simglen_t sy = simglen_t(flipY ? height - y - 1 : y) + bottom;
+        if (!hasBg) {
+            sy = mymod(sy, srcHeight);
+        } else if (sy < 0 || sy >= simglen_t(srcHeight)) {
+            std::fill_n(out, width, bg);
+            return;
+        }
+        const Colour<sch,scha> *in = src + size_t(sy) * srcWidth;
+        if (identity) {
+            // The same layout, but possibly a different type.
+            const Colour<ch,ach> *same = reinterpret_cast<const Colour<ch,ach>*>(in);
+            if (!flipX) {
+                uimglen_t done = 0;
+                image_spans(left, width, srcWidth, !hasBg, [&] (uimglen_t i, uimglen_t p, uimglen_t n) {
+                    std::fill_n(out + done, i - done, bg);
+                    std::copy_n(same + p, n, out + i);
+                    done = i + n;
+                });
+                std::fill_n(out + done, width - done, bg);
+                return;
+            }
+            if (left >= 0 && left + simglen_t(width) <= simglen_t(srcWidth)) {
+                std::reverse_copy(same + left, same + left + width, out);
+                return;
+            }
+        }
+        for (uimglen_t x=0 ; x<width ; ++x) {
+            simglen_t sx = simglen_t(flipX ? width - x - 1 : x) + left;
+            if (!hasBg) {
+                sx = mymod(sx, srcWidth);
+            } else if (sx < 0 || sx >= simglen_t(srcWidth)) {
+                out[x] = bg;
+                continue;
+            }
+            for (chan_t c=0 ; c<ch+ach ; ++c) {
+                int m = mapping[c];
+                out[x][c] = m == -1 ? 0 : m == -2 ? 1 : in[sx][m];
+            }
+        }
+    }
+
+    unsigned nodes (void) const { return 1; }
+
+    bool reads (const ImageBase *) const { return false; }
+
+    bool share (uimglen_t width, uimglen_t height, Colour<ch,ach> *&data, ImagePixels &o) const
+    {
+        if (!identity || flipX || flipY || left != 0 || bottom != 0) return false;
+        if (width != srcWidth || height != srcHeight) return false;
+        // The same layout, but possibly a different type.
+        data = reinterpret_cast<Colour<ch,ach>*>(const_cast<Colour<sch,scha>*>(src));
+        o = owner;
+        return true;
+    }
+
+    bool cheap (void) const { return true; }
+};
+
+// The following return lazy images, whose pixels are only computed when they are needed.  The
+// operands must therefore be Lua-owned images, or otherwise freed with release().
+
 // TA and TB can be Image<ch,_> or Colour<ch,_>
 // must be compatible except for alpha channels
+// Operands of a planar zip: planar images, or colours which are the same in every pixel.
+template<chan_t ch, chan_t ach> static inline bool zip_planar (const Image<ch,ach> *img)
+{
+    size_t stride;
+    return img->planes(stride) != NULL;
+}
+template<chan_t ch, chan_t ach> static inline bool zip_planar (const Colour<ch,ach> *) { return true; }
+
+// Plane c of an operand, or NULL and its value v for a colour.
+template<chan_t ch, chan_t ach>
+static inline const float *zip_plane (const Image<ch,ach> *img, chan_t c, float &)
+{
+    size_t stride;
+    return img->planes(stride) + c * stride;
+}
+template<chan_t ch, chan_t ach>
+static inline const float *zip_plane (const Colour<ch,ach> *colour, chan_t c, float &v)
+{
+    v = (*colour)[c];
+    return NULL;
+}
+
+// As image_zip_regular, without the alpha of a, computed straight away a plane at a time.
+template<chan_t ch, chan_t ach, float op(float,float), class T1, class T2> 
+Image<ch,ach> *image_zip_planar (T1 a, T2 b)
+{
+    const uimglen_t width = get_width(a, b);
+    const uimglen_t height = get_height(a, b);
+    auto *e = new ImageExprPlanar<ch,ach>(width, height);
+    Image<ch,ach> *ret = new Image<ch,ach>(width, height, e);
+    parallel_rows(height, width * (ch+ach), [&] (uimglen_t y0, uimglen_t y1) {
+        const size_t begin = size_t(y0) * width;
+        const size_t n = size_t(y1 - y0) * width;
+        for (chan_t c=0 ; c<ch+ach ; ++c) {
+            float va = 0, vb = 0;
+            const float *__restrict__ pa = c < ch ? zip_plane(a, c, va) : NULL;
+            const float *__restrict__ pb = zip_plane(b, c, vb);
+            float *__restrict__ out = e->plane(c) + begin;
+            if (c == ch) {
+                // Alpha of b.
+                if (pb != NULL) std::copy_n(pb + begin, n, out);
+                else std::fill_n(out, n, vb);
+            } else if (pa != NULL && pb != NULL) {
+                for (size_t i=0 ; i<n ; ++i) out[i] = op(pa[begin + i], pb[begin + i]);
+            } else if (pa != NULL) {
+                for (size_t i=0 ; i<n ; ++i) out[i] = op(pa[begin + i], vb);
+            } else {
+                for (size_t i=0 ; i<n ; ++i) out[i] = op(va, pb[begin + i]);
+            }
+        }
+    });
+    return ret;
+}
+
 template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float op(float,float), class T1, class T2> 
 Image<ch2,ach2> *image_zip_regular (T1 a, T2 b)
 {
     if (ch1 != ch2) abort();
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch2,ach2> *ret = new Image<ch2,ach2>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_zip<ch1,ach1,ch2,ach2,op>(a->pixel(x, y), b->pixel(x,y));
-        }
-    }
-    return ret;
+    // Blending with the alpha of a is per pixel.
+    if (ach1 == 0 && zip_planar(a) && zip_planar(b)) return image_zip_planar<ch2,ach2,op>(a, b);
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch2,ach2>(a, b, [] (const P1 &pa, const P2 &pb) {
+        return colour_zip<ch1,ach1,ch2,ach2,op>(pa, pb);
+    });
 }
 
 // TA can be Image<1,0> or Colour<1,0>
 template<chan_t ch2, chan_t ach2, float op(float,float), class T1, class T2> 
 Image<ch2,ach2> *image_zip_left_mask (T1 a, T2 b)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch2,ach2> *ret = new Image<ch2,ach2>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_zip<ch2,0,ch2,ach2,op>(Colour<ch2,0>(a->pixel(x, y)[0]), b->pixel(x,y));
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch2,ach2>(a, b, [] (const P1 &pa, const P2 &pb) {
+        return colour_zip<ch2,0,ch2,ach2,op>(Colour<ch2,0>(pa[0]), pb);
+    });
 }
 
 // TB can be Image<1,0> or Colour<1,0>
 template<chan_t ch1, chan_t ach1, float op(float,float), class T1, class T2> 
 Image<ch1,0> *image_zip_right_mask (T1 a, T2 b)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch1,0> *ret = new Image<ch1,0>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_zip<ch1,ach1,ch1,0,op>(a->pixel(x,y), Colour<ch1,0>(b->pixel(x, y)[0]));
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch1,0>(a, b, [] (const P1 &pa, const P2 &pb) {
+        return colour_zip<ch1,ach1,ch1,0,op>(pa, Colour<ch1,0>(pb[0]));
+    });
 }
 
 
@@ -813,108 +2123,89 @@ template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, class T1, class T2>
 Image<ch2,ach2> *image_blend_regular (T1 a, T2 b)
 {
     if (ch1 != ch2) abort();
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch2,ach2> *ret = new Image<ch2,ach2>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_blend<ch1,ach1,ch2,ach2>(a->pixel(x, y), b->pixel(x,y));
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch2,ach2>(a, b, [] (const P1 &pa, const P2 &pb) {
+        return colour_blend<ch1,ach1,ch2,ach2>(pa, pb);
+    });
 }
 
 // TA can be Image<1,0> or Colour<1,0>
 template<chan_t ch2, chan_t ach2, class T1, class T2> 
 Image<ch2,ach2> *image_blend_left_mask (T1 a, T2 b)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch2,ach2> *ret = new Image<ch2,ach2>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_blend<ch2,0,ch2,ach2>(Colour<ch2,0>(a->pixel(x, y)[0]), b->pixel(x,y));
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch2,ach2>(a, b, [] (const P1 &pa, const P2 &pb) {
+        return colour_blend<ch2,0,ch2,ach2>(Colour<ch2,0>(pa[0]), pb);
+    });
 }
 
 // TB can be Image<1,0> or Colour<1,0>
 template<chan_t ch1, chan_t ach1, class T1, class T2> 
 Image<ch1,0> *image_blend_right_mask (T1 a, T2 b)
+{
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch1,0>(a, b, [] (const P1 &pa, const P2 &pb) {
+        return colour_blend<ch1,ach1,ch1,0>(pa, Colour<ch1,0>(pb[0]));
+    });
+}
+
+
+// The mean over all pixels of zop of the channels of a and b, each given by get(a, b, x, y).
+template<chan_t ch, chan_t ach, float zop(float,float), class T1, class T2, class G>
+ColourBase *image_zip_mean (T1 a, T2 b, G get)
 {
     uimglen_t width = get_width(a,b);
     uimglen_t height = get_height(a,b);
-    Image<ch1,0> *ret = new Image<ch1,0>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_blend<ch1,ach1,ch1,0>(a->pixel(x,y), Colour<ch1,0>(b->pixel(x, y)[0]));
-        }
-    }
-    return ret;
+    auto acc = image_reduce_parallel<ReduceSum, ch+ach>(width, height,
+        [&] (std::array<ReduceSum, ch+ach> &acc, uimglen_t x, uimglen_t y) {
+            Colour<ch,ach> ac, bc;
+            get(a, b, x, y, ac, bc);
+            for (chan_t c=0 ; c<ch+ach ; ++c) acc[c].add(zop(ac[c], bc[c]));
+        });
+    Colour<ch,ach> *r = new Colour<ch,ach>(0);
+    double num_pixels = double(width) * height;
+    for (chan_t c=0 ; c<ch+ach ; ++c) (*r)[c] = acc[c].value() / num_pixels;
+    return r;
 }
 
-
 // TA and TB can be Image<ch,ach> or Colour<ch,ach>
-template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), float rop(float,float), class T1, class T2> 
-ColourBase *image_zip_reduce_regular (T1 a, T2 b)
+template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), class T1, class T2> 
+ColourBase *image_zip_mean_regular (T1 a, T2 b)
 {
     if (ch1 != ch2) abort();
     if (ach1 != ach2) abort();
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Colour<ch1,ach1> *r = new Colour<ch1,ach1>(0);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            Colour<ch1,ach1> ac = a->pixel(x,y);
-            Colour<ch2,ach2> bc = b->pixel(x,y);
-            for (chan_t c=0 ; c<ch1+ach1 ; ++c) {
-                float zr = zop(ac[c], bc[c]);
-                (*r)[c] = rop((*r)[c], zr);
-            }
-        }
-    }
-    return r;
+    return image_zip_mean<ch1,ach1,zop>(a, b, [] (T1 a, T2 b, uimglen_t x, uimglen_t y,
+                                                  Colour<ch1,ach1> &ac, Colour<ch1,ach1> &bc) {
+        ac = a->pixel(x,y);
+        // ch2, ach2 match whenever this runs, but the callers' switches instantiate the rest too.
+        const Colour<ch2,ach2> &pb = b->pixel(x,y);
+        for (chan_t c=0 ; c<ch1+ach1 && c<ch2+ach2 ; ++c) bc[c] = pb[c];
+    });
 }
 
 // TA can be Image<1,0> or Colour<1,0>
-template<chan_t ch, chan_t ach, float zop(float,float), float rop(float,float), class T1, class T2> 
-ColourBase *image_zip_reduce_left_mask (T1 a, T2 b)
+template<chan_t ch, chan_t ach, float zop(float,float), class T1, class T2> 
+ColourBase *image_zip_mean_left_mask (T1 a, T2 b)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Colour<ch,ach> *r = new Colour<ch,ach>(0);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            Colour<ch,ach> ac = Colour<ch,ach>(a->pixel(x,y)[0]);
-            Colour<ch,ach> bc = b->pixel(x,y);
-            for (chan_t c=0 ; c<ch+ach ; ++c) {
-                float zr = zop(ac[c], bc[c]);
-                (*r)[c] = rop((*r)[c], zr);
-            }
-        }
-    }
-    return r;
+    return image_zip_mean<ch,ach,zop>(a, b, [] (T1 a, T2 b, uimglen_t x, uimglen_t y,
+                                                Colour<ch,ach> &ac, Colour<ch,ach> &bc) {
+        ac = Colour<ch,ach>(a->pixel(x,y)[0]);
+        bc = b->pixel(x,y);
+    });
 }
 
 // TB can be Image<1,0> or Colour<1,0>
-template<chan_t ch, chan_t ach, float zop(float,float), float rop(float,float), class T1, class T2> 
-ColourBase *image_zip_reduce_right_mask (T1 a, T2 b)
+template<chan_t ch, chan_t ach, float zop(float,float), class T1, class T2> 
+ColourBase *image_zip_mean_right_mask (T1 a, T2 b)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Colour<ch,ach> *r = new Colour<ch,ach>(0);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            Colour<ch,ach> ac = a->pixel(x,y);
-            Colour<ch,ach> bc = Colour<ch,ach>(b->pixel(x,y)[0]);
-            for (chan_t c=0 ; c<ch+ach ; ++c) {
-                float zr = zop(ac[c], bc[c]);
-                (*r)[c] = rop((*r)[c], zr);
-            }
-        }
-    }
-    return r;
+    return image_zip_mean<ch,ach,zop>(a, b, [] (T1 a, T2 b, uimglen_t x, uimglen_t y,
+                                                Colour<ch,ach> &ac, Colour<ch,ach> &bc) {
+        ac = a->pixel(x,y);
+        bc = Colour<ch,ach>(b->pixel(x,y)[0]);
+    });
 }
 
 
@@ -924,45 +2215,33 @@ template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, class T1, class T2>
 Image<ch2,ach2> *global_lerp_regular (T1 a, T2 b, float param)
 {
     if (ch1 != ch2) abort();
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch2,ach2> *ret = new Image<ch2,ach2>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_lerp<ch1,ach1,ch2,ach2>(a->pixel(x, y), b->pixel(x,y), param);
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch2,ach2>(a, b, [param] (const P1 &pa, const P2 &pb) {
+        return colour_lerp<ch1,ach1,ch2,ach2>(pa, pb, param);
+    });
 }
 
 // TA can be Image<1,0> or Colour<1,0>
 template<chan_t ch2, chan_t ach2, class T1, class T2> 
 Image<ch2,ach2> *global_lerp_left_mask (T1 a, T2 b, float param)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch2,ach2> *ret = new Image<ch2,ach2>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_lerp<ch2,0,ch2,ach2>(Colour<ch2,0>(a->pixel(x, y)[0]), b->pixel(x,y), param);
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch2,ach2>(a, b, [param] (const P1 &pa, const P2 &pb) {
+        return colour_lerp<ch2,0,ch2,ach2>(Colour<ch2,0>(pa[0]), pb, param);
+    });
 }
 
 // TB can be Image<1,0> or Colour<1,0>
 template<chan_t ch1, chan_t ach1, class T1, class T2> 
 Image<ch1,ach1> *global_lerp_right_mask (T1 a, T2 b, float param)
 {
-    uimglen_t width = get_width(a,b);
-    uimglen_t height = get_height(a,b);
-    Image<ch1,ach1> *ret = new Image<ch1,ach1>(width, height);
-    for (uimglen_t y=0 ; y<height ; ++y) {
-        for (uimglen_t x=0 ; x<width ; ++x) {
-            ret->pixel(x, y) = colour_lerp<ch1,ach1,ch1,ach1>(a->pixel(x,y), Colour<ch1,ach1>(b->pixel(x, y)[0]), param);
-        }
-    }
-    return ret;
+    typedef typename ExprOperand<T1>::Pixel P1;
+    typedef typename ExprOperand<T2>::Pixel P2;
+    return image_lazy_zip<ch1,ach1>(a, b, [param] (const P1 &pa, const P2 &pb) {
+        return colour_lerp<ch1,ach1,ch1,ach1>(pa, Colour<ch1,ach1>(pb[0]), param);
+    });
 }
 
 
@@ -993,20 +2272,45 @@ Colour<ch1,ach1> global_lerp_colour_right_mask (const Colour<ch1,ach1> *a, const
 
 
 
-ImageBase *image_load (const std::string &filename);
+/** If map is set, sfi files are mapped into memory instead of being read, where possible.  If
+ * packed is set, 8 and 16 bit integer images and half float sfi files keep the precision of the
+ * file (see image_pack) rather than being converted to float. */
+ImageBase *image_load (const std::string &filename, bool map=false, bool packed=false);
+
+/** A copy of img whose samples are stored as the given type, clamped to [0,1] for the integer
+ * types, or in planes (see ImageExprPlanar).  The result is lazy, and is only converted back to
+ * interleaved floats as it is read.  PS_FLOAT is the exception: it computes a whole image of
+ * interleaved floats straight away, without computing img. */
+ImageBase *image_pack (const ImageBase *img, PixelStorage storage);
+
+/** Load only part of an image, which must lie within it.  This is only faster than cropping
+ * afterwards for sfi files. */
+ImageBase *image_load_region (const std::string &filename, uimglen_t left, uimglen_t bottom,
+                              uimglen_t width, uimglen_t height);
 
 void image_save (ImageBase *image, const std::string &filename, const std::string &type);
 
+/** The mip chain below img, each level half the size of the previous one, down to 1x1.  The
+ * caller owns the returned images.  BOX uses a dedicated 2x2 (3 taps on odd sizes) reduction.
+ * If linear is set, colour channels are averaged in linear light (gamma 2.2).  If
+ * preserve_coverage is set, the alpha of each level is scaled so that the same fraction of
+ * pixels passes an alpha test against alpha_ref as in img.
+ */
+std::vector<ImageBase*> image_mipmaps (const ImageBase *img, ScaleFilter filter, bool linear,
+                                       bool preserve_coverage, float alpha_ref);
+
 template<chan_t ch, chan_t ach> Image<ch,ach> *image_make (uimglen_t width, uimglen_t height, const ColourBase &init_)
 {
     Image<ch,ach> *my_image = new Image<ch,ach>(width, height);
     const Colour<ch,ach> &init = static_cast<const Colour<ch,ach>&>(init_);
 
-    for (uimglen_t y=0 ; y<my_image->height ; ++y) {
-        for (uimglen_t x=0 ; x<my_image->width ; ++x) {
-            my_image->pixel(x, y) = init;
+    parallel_rows(my_image->height, width, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            for (uimglen_t x=0 ; x<my_image->width ; ++x) {
+                my_image->pixel(x, y) = init;
+            }
         }
-    }
+    });
 
     return my_image;
 }
@@ -1017,4 +2321,16 @@ template<chan_t ch, chan_t ach> ImageBase *image_make_base (uimglen_t width, uim
     return image_make<ch,ach>(width, height, init_);
 }
 
+// A new image whose pixels are yet to be written, with the channels given at run time.
+static inline ImageBase *image_new (chan_t channels, bool alpha, uimglen_t width, uimglen_t height)
+{
+    switch (channels) {
+        case 1: return new Image<1,0>(width, height);
+        case 2: return alpha ? static_cast<ImageBase*>(new Image<1,1>(width, height)) : new Image<2,0>(width, height);
+        case 3: return alpha ? static_cast<ImageBase*>(new Image<2,1>(width, height)) : new Image<3,0>(width, height);
+        case 4: return alpha ? static_cast<ImageBase*>(new Image<3,1>(width, height)) : new Image<4,0>(width, height);
+    }
+    abort();
+}
+
 #endif
@@ -0,0 +1,135 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cmath>
+
+#include <algorithm>
+#include <vector>
+
+#include "integral_image.h"
+#include "parallel.h"
+
+IntegralImage::IntegralImage (const ImageBase *img)
+  : width(img->width), height(img->height), channels(img->channels()), alpha(img->hasAlpha()),
+    tableBytes((size_t(width) + 1) * (size_t(height) + 1) * channels * sizeof(double)),
+    table(static_cast<double*>(pixel_pool_alloc(tableBytes)))
+{
+    const float *raw = img->raw();
+    const size_t stride = (size_t(width) + 1) * channels;
+
+    // Each row's running sums, independently.  Row 0 and column 0 of the table are zero.
+    std::fill_n(table, stride, 0.0);
+    parallel_rows(height, width * channels, [&] (uimglen_t y0, uimglen_t y1) {
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            const float *in = raw + size_t(y) * width * channels;
+            double *out = &table[(y + 1) * stride];
+            std::fill_n(out, channels, 0.0);
+            for (size_t i=0 ; i<size_t(width)*channels ; ++i) out[i + channels] = out[i] + in[i];
+        }
+    });
+
+    // Then down the columns, with the threads taking bands of columns.
+    parallel_rows(stride, height, [&] (uint32_t i0, uint32_t i1) {
+        for (uimglen_t y=1 ; y<height ; ++y) {
+            const double *below = &table[y * stride];
+            double *out = &table[(y + 1) * stride];
+            for (size_t i=i0 ; i<i1 ; ++i) out[i] += below[i];
+        }
+    });
+}
+
+IntegralImage::~IntegralImage (void)
+{
+    pixel_pool_free(table, tableBytes);
+}
+
+void IntegralImage::mean (uimglen_t x0, uimglen_t y0, uimglen_t x1, uimglen_t y1, double *out) const
+{
+    const double *a = corner(x0, y0), *b = corner(x1, y0), *c = corner(x0, y1), *d = corner(x1, y1);
+    const double area = double(x1 - x0) * (y1 - y0);
+    for (chan_t i=0 ; i<channels ; ++i) out[i] = (d[i] - b[i] - c[i] + a[i]) / area;
+}
+
+unsigned long IntegralImage::sum (simglen_t left, simglen_t bottom, uimglen_t w, uimglen_t h,
+                                  double *out) const
+{
+    auto clip = [] (int64_t v, uimglen_t len) { return uimglen_t(std::min(std::max(v, int64_t(0)), int64_t(len))); };
+    uimglen_t x0 = clip(left, width), x1 = clip(int64_t(left) + w, width);
+    uimglen_t y0 = clip(bottom, height), y1 = clip(int64_t(bottom) + h, height);
+    const double *a = corner(x0, y0), *b = corner(x1, y0), *c = corner(x0, y1), *d = corner(x1, y1);
+    for (chan_t i=0 ; i<channels ; ++i) out[i] = d[i] - b[i] - c[i] + a[i];
+    return (unsigned long)(x1 - x0) * (y1 - y0);
+}
+
+ImageBase *IntegralImage::boxBlur (uimglen_t radius) const
+{
+    ImageBase *ret = image_new(channels, alpha, width, height);
+    float *out = ret->raw();
+    parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+        std::vector<double> m(channels);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            uimglen_t ya = y - std::min(y, radius), yb = y + 1 + std::min(height - 1 - y, radius);
+            for (uimglen_t x=0 ; x<width ; ++x) {
+                uimglen_t xa = x - std::min(x, radius), xb = x + 1 + std::min(width - 1 - x, radius);
+                mean(xa, ya, xb, yb, &m[0]);
+                float *p = out + (size_t(y) * width + x) * channels;
+                for (chan_t c=0 ; c<channels ; ++c) p[c] = m[c];
+            }
+        }
+    });
+    return ret;
+}
+
+ImageBase *IntegralImage::blur (const Image<1,0> *radii) const
+{
+    ImageBase *ret = image_new(channels, alpha, width, height);
+    float *out = ret->raw();
+    const float *r = radii->raw();
+    // Radii beyond this cover the whole image from anywhere.
+    const float max_radius = std::max(width, height);
+    parallel_rows(height, width, [&] (uimglen_t y0, uimglen_t y1) {
+        std::vector<double> m0(channels), m1(channels);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            for (uimglen_t x=0 ; x<width ; ++x) {
+                float radius = r[size_t(y) * width + x];
+                // Also turns NaN into 0.
+                radius = radius > 0 ? std::min(radius, max_radius) : 0;
+                uimglen_t r0 = uimglen_t(radius);
+                double t = radius - r0;
+                uimglen_t ya = y - std::min(y, r0), yb = y + 1 + std::min(height - 1 - y, r0);
+                uimglen_t xa = x - std::min(x, r0), xb = x + 1 + std::min(width - 1 - x, r0);
+                mean(xa, ya, xb, yb, &m0[0]);
+                if (t > 0) {
+                    ya = y - std::min(y, r0 + 1);
+                    yb = y + 1 + std::min(height - 1 - y, r0 + 1);
+                    xa = x - std::min(x, r0 + 1);
+                    xb = x + 1 + std::min(width - 1 - x, r0 + 1);
+                    mean(xa, ya, xb, yb, &m1[0]);
+                    for (chan_t c=0 ; c<channels ; ++c) m0[c] = (1 - t) * m0[c] + t * m1[c];
+                }
+                float *p = out + (size_t(y) * width + x) * channels;
+                for (chan_t c=0 ; c<channels ; ++c) p[c] = m0[c];
+            }
+        }
+    });
+    return ret;
+}
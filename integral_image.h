@@ -0,0 +1,87 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef INTEGRAL_IMAGE_H
+#define INTEGRAL_IMAGE_H
+
+#include <ostream>
+
+#include "image.h"
+
+/** A summed-area table of an image: for each channel, the sum of the pixels below and to the left
+ * of every corner, in double precision.  The sum over any rectangle is then found from its four
+ * corners in constant time, so box filters cost the same whatever their size. */
+class IntegralImage {
+
+    public:
+
+    const uimglen_t width, height;
+    const chan_t channels;
+    const bool alpha;
+
+    /** Build the table from img (which must not be lazy), on all threads.  The table comes from
+     * the pixel pool, so it counts against the memory budget. */
+    IntegralImage (const ImageBase *img);
+
+    ~IntegralImage (void);
+
+    IntegralImage (const IntegralImage &) = delete;
+    IntegralImage &operator= (const IntegralImage &) = delete;
+
+    /** Memory held by the table. */
+    unsigned long numBytes (void) const { return tableBytes; }
+
+    /** The sum of each channel over the w x h pixels from (left, bottom), into out[0..channels).
+     * Only the part of the rectangle that is on the image counts.  Returns the number of pixels in
+     * that part. */
+    unsigned long sum (simglen_t left, simglen_t bottom, uimglen_t w, uimglen_t h, double *out) const;
+
+    /** A new image in which each pixel is the mean of the (2*radius+1)^2 pixels around it.  At the
+     * edges, the mean is of the pixels that are on the image. */
+    ImageBase *boxBlur (uimglen_t radius) const;
+
+    /** As boxBlur, but the radius of each pixel is read from radii, a 1 channel image of the same
+     * size.  Fractional radii blend the two nearest whole ones, so the radius can vary smoothly. */
+    ImageBase *blur (const Image<1,0> *radii) const;
+
+    private:
+
+    // Sum of channel c over [0, x) x [0, y) at ((y * (width+1)) + x) * channels + c.
+    size_t tableBytes;
+    double *table;
+
+    const double *corner (uimglen_t x, uimglen_t y) const
+    {
+        return &table[(size_t(y) * (width + 1) + x) * channels];
+    }
+
+    // Mean over [x0, x1) x [y0, y1), which must be on the image and not empty, into out.
+    void mean (uimglen_t x0, uimglen_t y0, uimglen_t x1, uimglen_t y1, double *out) const;
+};
+
+static inline std::ostream &operator<<(std::ostream &o, const IntegralImage &img)
+{
+    o << "IntegralImage ("<<img.width<<","<<img.height<<")x"<<int(img.channels)<<" [0x"<<&img<<"]";
+    return o;
+}
+
+#endif
@@ -337,14 +337,10 @@ static const luaL_reg global[] = {
 
     {NULL, NULL}
 };
-void interpreter_init (void)
+// The libraries available to scripts, other than the interpreter's own functions like include.
+// Worker states get a restricted image library (see lua_wrappers_image_open).
+static void interpreter_open_libs (lua_State *L, bool worker)
 {
-    L = lua_open();
-    if (L == NULL) {
-        std::cerr << "Internal error: could not create Lua state." << std::endl;
-        exit(EXIT_FAILURE);
-    }       
-
 	luaL_openlibs(L); //opens all standart lua libs
 
     // replace string functions with ICU versions
@@ -368,14 +364,35 @@ void interpreter_init (void)
     lua_getfield(L, -1, "fmod"); lua_setglobal(L, "mod");
     lua_pop(L,1); // math table
 
+    lua_gc(L, LUA_GCSETSTEPMUL, 100000000);
+
+    lua_wrappers_image_open(L, worker);
+}
+
+void interpreter_init (void)
+{
+    L = lua_open();
+    if (L == NULL) {
+        std::cerr << "Internal error: could not create Lua state." << std::endl;
+        exit(EXIT_FAILURE);
+    }       
+
+    interpreter_open_libs(L, false);
+
     luaL_register(L, "_G", global);
     lua_pop(L, 1);
 
-    lua_gc(L, LUA_GCSETSTEPMUL, 100000000);
-
     lua_wrappers_image_init(L);
 }
 
+lua_State *interpreter_new_worker (void)
+{
+    lua_State *W = lua_open();
+    if (W == NULL) return NULL;
+    interpreter_open_libs(W, true);
+    return W;
+}
+
 void interpreter_shutdown (void)
 {
     lua_wrappers_image_shutdown(L);
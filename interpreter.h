@@ -25,9 +25,16 @@
 #include <string>
 #include <vector>
 
+struct lua_State;
+
 void interpreter_init (void);
 void interpreter_shutdown (void);
 
+/** A new Lua state with the same libraries as the main one (except that images can only be read),
+ * for running copies of script functions on other threads.  Returns NULL if it could not be
+ * created.  Close it with lua_close. */
+lua_State *interpreter_new_worker (void);
+
 void interpreter_interrupt_probe (void);
 
 bool interpreter_exec_file (const std::string &fname, const std::vector<std::string> &args);
@@ -26,6 +26,8 @@
 #include <vector>
 #include <limits>
 #include <algorithm>
+#include <map>
+#include <mutex>
 
 extern "C" {
     #include "lua.h"
@@ -41,6 +43,11 @@ extern "C" {
 #include "lua_wrappers_image.h"
 
 #include "image.h"
+#include "interpreter.h"
+#include "histogram.h"
+#include "integral_image.h"
+#include "parallel.h"
+#include "pixel_expr.h"
 #include "text.h"
 #include "gif.h"
 //#include "VoxelImage.h"
@@ -248,17 +255,96 @@ void push_colour (lua_State *L, chan_t channels, bool has_alpha, const ColourBas
     }
 }
 
+// The state whose garbage collector frees unreachable images, see memory_high_water.
+static lua_State *collector_state = NULL;
+
+// Called where running the garbage collector is safe: on entry to the bindings that take images
+// and once they have pushed their result.  Not from the worker states of mapParallel, which run in
+// bands of a parallel job even on the main thread.
+static void collect_point (lua_State *L)
+{
+    if (L == collector_state) pixel_pool_collect_point();
+}
+
 // image must never have been pushed before, or it will be double-freed upon GC
 void push_image (lua_State *L, ImageBase *image)
 {
     ASSERT(image != NULL);
     ASSERT(!image->beenPushed);
     image->beenPushed = true;
+    image->refs++;
     void **self_ptr = static_cast<void**>(lua_newuserdata(L, sizeof(*self_ptr)));
-    lua_extmemburden(L, image->numBytes());
+    image->burden = image->numBytes();
+    lua_extmemburden(L, image->burden);
     *self_ptr = image;
     luaL_getmetatable(L, IMAGE_TAG);
     lua_setmetatable(L, -2);
+    collect_point(L);
+}
+
+// Use this rather than check_ptr, the userdata of an image holds NULL once it has been freed.
+static ImageBase *check_image_ptr (lua_State *L, int index)
+{
+    collect_point(L);
+    ImageBase *image = check_ptr<ImageBase>(L, index, IMAGE_TAG);
+    if (image == NULL) my_lua_error(L, "Image has been freed.");
+    return image;
+}
+
+// Computes a lazy image where it is, e.g. before its pixels are changed.  Packed and planar images
+// become float ones, and grow.
+static void force_image (lua_State *L, ImageBase *image)
+{
+    if (!image->lazy()) return;
+    image->force();
+    lua_extmemburden(L, long(image->numBytes()) - long(image->burden));
+    image->burden = image->numBytes();
+}
+
+// Use this rather than check_image_ptr unless the image may be left lazy, e.g. when building a lazy
+// expression from it.  Packed and planar images keep their storage: the caller gets a computed copy
+// instead, which replaces the image at index on the stack so that it lives until the call returns.
+// That copy is a whole FLOAT image on every call, so prefer check_image_rows where the operation
+// can read a row at a time.
+ImageBase *check_image (lua_State *L, int index)
+{
+    ImageBase *image = check_image_ptr(L, index);
+    if (image->lazy() && image->pixelStorage() != PS_FLOAT) {
+        if (index < 0) index = lua_gettop(L) + 1 + index;
+        image = image_pack(image, PS_FLOAT);
+        push_image(L, image);
+        lua_replace(L, index);
+        return image;
+    }
+    force_image(L, image);
+    return image;
+}
+
+// As check_image, for operations that change the pixels of the image, so it is computed in place.
+static ImageBase *check_image_for_write (lua_State *L, int index)
+{
+    ImageBase *image = check_image_ptr(L, index);
+    force_image(L, image);
+    return image;
+}
+
+// As check_image, but packed and planar images are left as they are, for operations that read
+// the pixels a few rows at a time (see Image::row), widening only those rows.
+static ImageBase *check_image_rows (lua_State *L, int index)
+{
+    ImageBase *image = check_image_ptr(L, index);
+    if (image->lazy() && image->pixelStorage() != PS_FLOAT) return image;
+    force_image(L, image);
+    return image;
+}
+
+// As check_image, but planar images are left as they are, for operations that process them a
+// plane at a time.
+static ImageBase *check_image_or_planar (lua_State *L, int index)
+{
+    ImageBase *image = check_image_ptr(L, index);
+    if (image->pixelStorage() == PS_PLANAR) return image;
+    return check_image(L, index);
 }
 
 
@@ -344,7 +430,7 @@ template<chan_t ch, chan_t ach, float op(float,float), class TA>
 static ImageBase *image_zip_lua2 (lua_State *L, TA a)
 {
     if (is_ptr(L, 2, IMAGE_TAG)) {
-        const ImageBase *b = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        const ImageBase *b = check_image_ptr(L, 2);
         switch (b->channels()) {
             case 1:
             return image_zip_lua3<ch,ach,1,0,op>(L, a, static_cast<const Image<1,0>*>(b));
@@ -407,7 +493,7 @@ static ImageBase *image_zip_lua1 (lua_State *L)
 {
     check_args(L,2);
     if (is_ptr(L, 1, IMAGE_TAG)) {
-        const ImageBase *a = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        const ImageBase *a = check_image_ptr(L, 1);
         switch (a->channels()) {
             case 1:
             return image_zip_lua2<1,0,op>(L, static_cast<const Image<1,0>*>(a));
@@ -547,7 +633,7 @@ static void global_lerp_lua2 (lua_State *L, TA a)
 {
     float param = luaL_checknumber(L, 3);
     if (is_ptr(L, 2, IMAGE_TAG)) {
-        const ImageBase *b = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        const ImageBase *b = check_image_ptr(L, 2);
         switch (b->channels()) {
             case 1:
             global_lerp_lua3<ch,ach,1,0>(L, a, static_cast<const Image<1,0>*>(b), param);
@@ -613,7 +699,7 @@ static void global_lerp_lua1 (lua_State *L)
 {
     check_args(L,3);
     if (is_ptr(L, 1, IMAGE_TAG)) {
-        const ImageBase *a = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        const ImageBase *a = check_image_ptr(L, 1);
         switch (a->channels()) {
             case 1:
             global_lerp_lua2<1,0>(L, static_cast<const Image<1,0>*>(a));
@@ -676,90 +762,90 @@ static void global_lerp_lua1 (lua_State *L)
 }
 
 
-template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), float rop(float, float), class T1, class T2>
-static ColourBase *image_zip_reduce_lua4 (lua_State *L, T1 v1, T2 v2)
+template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), class T1, class T2>
+static ColourBase *image_zip_mean_lua4 (lua_State *L, T1 v1, T2 v2)
 {
     // implements (1) and (3) above
     if (ch1 == ch2 && ach1 == ach2)
-        return image_zip_reduce_regular<ch1, ach1, ch2, ach2, zop, rop, T1, T2>(v1, v2);
+        return image_zip_mean_regular<ch1, ach1, ch2, ach2, zop, T1, T2>(v1, v2);
     if (ch1 == 1 && ach1 == 0)
-        return image_zip_reduce_left_mask<ch2, ach2, zop, rop, T1, T2>(v1, v2);
+        return image_zip_mean_left_mask<ch2, ach2, zop, T1, T2>(v1, v2);
     if (ch2 == 1 && ach2 == 0)
-        return image_zip_reduce_right_mask<ch1, ach1, zop, rop, T1, T2>(v1, v2);
+        return image_zip_mean_right_mask<ch1, ach1, zop, T1, T2>(v1, v2);
     my_lua_error(L, "Image operation on incompatible images/colours.");
     return NULL;
 }
 
-template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), float rop(float, float)>
-static ColourBase *image_zip_reduce_lua3 (lua_State *L, const Image<ch1,ach1> *v1, const Image<ch2,ach2> *v2)
+template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float)>
+static ColourBase *image_zip_mean_lua3 (lua_State *L, const Image<ch1,ach1> *v1, const Image<ch2,ach2> *v2)
 {
     // both are images, must check size, but no issue with amibiguous vec(...)
     if (!v1->sizeCompatibleWith(v2)) {
         my_lua_error(L, "Operations require images have the same dimensions.");
     }
-    return image_zip_reduce_lua4<ch1, ach1, ch2, ach2, zop, rop, const Image<ch1,ach1>*, const Image<ch2,ach2>*>(L, v1, v2);
+    return image_zip_mean_lua4<ch1, ach1, ch2, ach2, zop, const Image<ch1,ach1>*, const Image<ch2,ach2>*>(L, v1, v2);
     
 }
 
-template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), float rop(float, float)>
-static ColourBase *image_zip_reduce_lua3 (lua_State *, const Colour<ch1,ach1> *, const Colour<ch2,ach2> *)
+template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float)>
+static ColourBase *image_zip_mean_lua3 (lua_State *, const Colour<ch1,ach1> *, const Colour<ch2,ach2> *)
 {
     abort();
     return NULL;
 }
 
-template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), float rop(float, float)>
-static ColourBase *image_zip_reduce_lua3 (lua_State *L, const Image<ch1,ach1> *v1, const Colour<ch2,ach2> *v2)
+template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float)>
+static ColourBase *image_zip_mean_lua3 (lua_State *L, const Image<ch1,ach1> *v1, const Colour<ch2,ach2> *v2)
 {
     if (ch1+ach1 == ch2) {
         // redo the colour
         Colour<ch1, ach1> v2_;
         for (chan_t c=0 ; c<ch2 ; ++c) v2_[c] = (*v2)[c];
-        return image_zip_reduce_lua4<ch1, ach1, ch1, ach1, zop, rop, const Image<ch1,ach1>*, const Colour<ch1,ach1>*>(L, v1, &v2_);
+        return image_zip_mean_lua4<ch1, ach1, ch1, ach1, zop, const Image<ch1,ach1>*, const Colour<ch1,ach1>*>(L, v1, &v2_);
     } else {
-        return image_zip_reduce_lua4<ch1, ach1, ch2, ach2, zop, rop, const Image<ch1,ach1>*, const Colour<ch2,ach2>*>(L, v1, v2);
+        return image_zip_mean_lua4<ch1, ach1, ch2, ach2, zop, const Image<ch1,ach1>*, const Colour<ch2,ach2>*>(L, v1, v2);
     }
 }
 
-template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float), float rop(float, float)>
-static ColourBase *image_zip_reduce_lua3 (lua_State *L, const Colour<ch1,ach1> *v1, const Image<ch2,ach2> *v2)
+template<chan_t ch1, chan_t ach1, chan_t ch2, chan_t ach2, float zop(float,float)>
+static ColourBase *image_zip_mean_lua3 (lua_State *L, const Colour<ch1,ach1> *v1, const Image<ch2,ach2> *v2)
 {
     if (ch1 == ch2+ach2) {
         // redo the colour
         Colour<ch2, ach2> v1_;
         for (chan_t c=0 ; c<ch1 ; ++c) v1_[c] = (*v1)[c];
-        return image_zip_reduce_lua4<ch2, ach2, ch2, ach2, zop, rop, const Colour<ch2,ach2>*, const Image<ch2,ach2>*>(L, &v1_, v2);
+        return image_zip_mean_lua4<ch2, ach2, ch2, ach2, zop, const Colour<ch2,ach2>*, const Image<ch2,ach2>*>(L, &v1_, v2);
     } else {
-        return image_zip_reduce_lua4<ch1, ach1, ch2, ach2, zop, rop, const Colour<ch1,ach1>*, const Image<ch2,ach2>*>(L, v1, v2);
+        return image_zip_mean_lua4<ch1, ach1, ch2, ach2, zop, const Colour<ch1,ach1>*, const Image<ch2,ach2>*>(L, v1, v2);
     }
 }
 
-template<chan_t ch, chan_t ach, float zop(float,float), float rop(float, float), class TA>
-static ColourBase *image_zip_reduce_lua2 (lua_State *L, TA a, const ImageBase *&some_image)
+template<chan_t ch, chan_t ach, float zop(float,float), class TA>
+static ColourBase *image_zip_mean_lua2 (lua_State *L, TA a, const ImageBase *&some_image)
 {
     if (is_ptr(L, 2, IMAGE_TAG)) {
-        const ImageBase *b = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        const ImageBase *b = check_image(L, 2);
         some_image = b;
         switch (b->channels()) {
             case 1:
-            return image_zip_reduce_lua3<ch,ach,1,0,zop,rop>(L, a, static_cast<const Image<1,0>*>(b));
+            return image_zip_mean_lua3<ch,ach,1,0,zop>(L, a, static_cast<const Image<1,0>*>(b));
             case 2:
             if (b->hasAlpha()) {
-                return image_zip_reduce_lua3<ch,ach,1,1,zop,rop>(L, a, static_cast<const Image<1,1>*>(b));
+                return image_zip_mean_lua3<ch,ach,1,1,zop>(L, a, static_cast<const Image<1,1>*>(b));
             } else {
-                return image_zip_reduce_lua3<ch,ach,2,0,zop,rop>(L, a, static_cast<const Image<2,0>*>(b));
+                return image_zip_mean_lua3<ch,ach,2,0,zop>(L, a, static_cast<const Image<2,0>*>(b));
             }
             case 3:
             if (b->hasAlpha()) {
-                return image_zip_reduce_lua3<ch,ach,2,1,zop,rop>(L, a, static_cast<const Image<2,1>*>(b));
+                return image_zip_mean_lua3<ch,ach,2,1,zop>(L, a, static_cast<const Image<2,1>*>(b));
             } else {
-                return image_zip_reduce_lua3<ch,ach,3,0,zop,rop>(L, a, static_cast<const Image<3,0>*>(b));
+                return image_zip_mean_lua3<ch,ach,3,0,zop>(L, a, static_cast<const Image<3,0>*>(b));
             }
             case 4:
             if (b->hasAlpha()) {
-                return image_zip_reduce_lua3<ch,ach,3,1,zop,rop>(L, a, static_cast<const Image<3,1>*>(b));
+                return image_zip_mean_lua3<ch,ach,3,1,zop>(L, a, static_cast<const Image<3,1>*>(b));
             } else {
-                return image_zip_reduce_lua3<ch,ach,4,0,zop,rop>(L, a, static_cast<const Image<4,0>*>(b));
+                return image_zip_mean_lua3<ch,ach,4,0,zop>(L, a, static_cast<const Image<4,0>*>(b));
             }
 
             default: my_lua_error(L, "Internal error, strange number of channels.");
@@ -770,25 +856,25 @@ static ColourBase *image_zip_reduce_lua2 (lua_State *L, TA a, const ImageBase *&
         case 1: {
             Colour<1,0> colour;
             if (!check_colour(L,colour,2)) return NULL;
-            return image_zip_reduce_lua3<ch,ach,1,0,zop,rop>(L, a, &colour);
+            return image_zip_mean_lua3<ch,ach,1,0,zop>(L, a, &colour);
         }
 
         case 2: {
             Colour<2,0> colour;
             if (!check_colour(L,colour,2)) return NULL;
-            return image_zip_reduce_lua3<ch,ach,2,0,zop,rop>(L, a, &colour);
+            return image_zip_mean_lua3<ch,ach,2,0,zop>(L, a, &colour);
         }
 
         case 3: {
             Colour<3,0> colour;
             if (!check_colour(L,colour,2)) return NULL;
-            return image_zip_reduce_lua3<ch,ach,3,0,zop,rop>(L, a, &colour);
+            return image_zip_mean_lua3<ch,ach,3,0,zop>(L, a, &colour);
         }
 
         case 4: {
             Colour<4,0> colour;
             if (!check_colour(L,colour,2)) return NULL;
-            return image_zip_reduce_lua3<ch,ach,4,0,zop,rop>(L, a, &colour);
+            return image_zip_mean_lua3<ch,ach,4,0,zop>(L, a, &colour);
         }
 
         default:
@@ -797,33 +883,33 @@ static ColourBase *image_zip_reduce_lua2 (lua_State *L, TA a, const ImageBase *&
     return NULL;
 }
 
-template<float zop(float,float), float rop(float, float)>
-static ColourBase *image_zip_reduce_lua1 (lua_State *L, const ImageBase *&some_image)
+template<float zop(float,float)>
+static ColourBase *image_zip_mean_lua1 (lua_State *L, const ImageBase *&some_image)
 {
     check_args(L,2);
     if (is_ptr(L, 1, IMAGE_TAG)) {
-        const ImageBase *a = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        const ImageBase *a = check_image(L, 1);
         some_image = a;
         switch (a->channels()) {
             case 1:
-            return image_zip_reduce_lua2<1,0,zop,rop>(L, static_cast<const Image<1,0>*>(a), some_image);
+            return image_zip_mean_lua2<1,0,zop>(L, static_cast<const Image<1,0>*>(a), some_image);
             case 2:
             if (a->hasAlpha()) {
-                return image_zip_reduce_lua2<1,1,zop,rop>(L, static_cast<const Image<1,1>*>(a), some_image);
+                return image_zip_mean_lua2<1,1,zop>(L, static_cast<const Image<1,1>*>(a), some_image);
             } else {
-                return image_zip_reduce_lua2<2,0,zop,rop>(L, static_cast<const Image<2,0>*>(a), some_image);
+                return image_zip_mean_lua2<2,0,zop>(L, static_cast<const Image<2,0>*>(a), some_image);
             }
             case 3:
             if (a->hasAlpha()) {
-                return image_zip_reduce_lua2<2,1,zop,rop>(L, static_cast<const Image<2,1>*>(a), some_image);
+                return image_zip_mean_lua2<2,1,zop>(L, static_cast<const Image<2,1>*>(a), some_image);
             } else {
-                return image_zip_reduce_lua2<3,0,zop,rop>(L, static_cast<const Image<3,0>*>(a), some_image);
+                return image_zip_mean_lua2<3,0,zop>(L, static_cast<const Image<3,0>*>(a), some_image);
             }
             case 4:
             if (a->hasAlpha()) {
-                return image_zip_reduce_lua2<3,1,zop,rop>(L, static_cast<const Image<3,1>*>(a), some_image);
+                return image_zip_mean_lua2<3,1,zop>(L, static_cast<const Image<3,1>*>(a), some_image);
             } else {
-                return image_zip_reduce_lua2<4,0,zop,rop>(L, static_cast<const Image<4,0>*>(a), some_image);
+                return image_zip_mean_lua2<4,0,zop>(L, static_cast<const Image<4,0>*>(a), some_image);
             }
 
             default: my_lua_error(L, "Internal error, strange number of channels.");
@@ -834,25 +920,25 @@ static ColourBase *image_zip_reduce_lua1 (lua_State *L, const ImageBase *&some_i
         case 1: {
             Colour<1,0> colour;
             if (!check_colour(L,colour,1)) return nullptr;
-            return image_zip_reduce_lua2<1,0,zop,rop>(L, &colour, some_image);
+            return image_zip_mean_lua2<1,0,zop>(L, &colour, some_image);
         }
 
         case 2: {
             Colour<2,0> colour;
             if (!check_colour(L,colour,1)) return nullptr;
-            return image_zip_reduce_lua2<2,0,zop,rop>(L, &colour, some_image);
+            return image_zip_mean_lua2<2,0,zop>(L, &colour, some_image);
         }
 
         case 3: {
             Colour<3,0> colour;
             if (!check_colour(L,colour,1)) return nullptr;
-            return image_zip_reduce_lua2<3,0,zop,rop>(L, &colour, some_image);
+            return image_zip_mean_lua2<3,0,zop>(L, &colour, some_image);
         }
 
         case 4: {
             Colour<4,0> colour;
             if (!check_colour(L,colour,1)) return nullptr;
-            return image_zip_reduce_lua2<4,0,zop,rop>(L, &colour, some_image);
+            return image_zip_mean_lua2<4,0,zop>(L, &colour, some_image);
         }
 
         default:
@@ -932,7 +1018,7 @@ template<chan_t ch, chan_t ach, class TA>
 static ImageBase *image_blend_lua2 (lua_State *L, TA a)
 {
     if (is_ptr(L, 2, IMAGE_TAG)) {
-        const ImageBase *b = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        const ImageBase *b = check_image_ptr(L, 2);
         switch (b->channels()) {
             case 1:
             return image_blend_lua3<ch,ach,1,0>(L, a, static_cast<const Image<1,0>*>(b));
@@ -994,7 +1080,7 @@ static ImageBase *image_blend_lua1 (lua_State *L)
 {
     check_args(L,2);
     if (is_ptr(L, 1, IMAGE_TAG)) {
-        const ImageBase *a = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        const ImageBase *a = check_image_ptr(L, 1);
         switch (a->channels()) {
             case 1:
             return image_blend_lua2<1,0>(L, static_cast<const Image<1,0>*>(a));
@@ -1057,9 +1143,25 @@ static int image_gc (lua_State *L)
 { 
     check_args(L, 1); 
     ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    lua_extmemburden(L, -(long)self->numBytes());
-    delete self; 
+    if (self == NULL) return 0;
+    lua_extmemburden(L, -(long)self->burden);
+    self->release();
+    return 0; 
+}
+
+static int image_free (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 1); 
+    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    if (self == NULL) return 0;
+    // Lazy images computed from this one own it too, so it lives until they are computed, and then
+    // (as they are the only owners) the result can be written over its pixels.
+    lua_extmemburden(L, -(long)self->burden);
+    *static_cast<ImageBase**>(lua_touserdata(L, 1)) = NULL;
+    self->release();
     return 0; 
+HANDLE_END
 }
 
 static int image_eq (lua_State *L)
@@ -1067,7 +1169,7 @@ static int image_eq (lua_State *L)
     check_args(L, 2); 
     ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
     ImageBase *that = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
-    lua_pushboolean(L, self==that); 
+    lua_pushboolean(L, self!=NULL && self==that); 
     return 1; 
 }
 
@@ -1075,6 +1177,10 @@ static int image_tostring (lua_State *L)
 {
     check_args(L,1);
     ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    if (self == NULL) {
+        lua_pushstring(L, "Image (freed)");
+        return 1;
+    }
     std::stringstream ss;
     ss << self;
     push_string(L, ss.str());
@@ -1088,12 +1194,12 @@ HANDLE_BEGIN
     std::string filename;
     std::string type = "AUTO";
     if (lua_gettop(L) == 3) {
-        self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        self = check_image(L, 1);
         filename = lua_tostring(L, 2);
         type = lua_tostring(L, 3);
     } else {
         check_args(L,2);
-        self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        self = check_image(L, 1);
         filename = lua_tostring(L, 2);
     }
     image_save(self, filename, type);
@@ -1101,10 +1207,340 @@ HANDLE_BEGIN
 HANDLE_END
 }
 
-template<chan_t ch, chan_t ach> void foreach (lua_State *L, const ImageBase *self_, int func_index)
+// Work per pixel of calling a Lua function, for parallel_rows, relative to a simple kernel.
+static const unsigned long LUA_CALL_WORK = 100;
+
+typedef std::map<lua_CFunction, std::string> CFunctionPaths;
+
+// Where each C function in the globals of L can be found, e.g. "floor" or "string.format", so that
+// the same function can be found in a worker state.
+static CFunctionPaths lua_cfunction_paths (lua_State *L)
+{
+    CFunctionPaths r;
+    lua_pushglobaltable(L);
+    int g = lua_gettop(L);
+    for (lua_pushnil(L) ; lua_next(L, g) != 0 ; lua_pop(L, 1)) {
+        if (lua_type(L, -2) != LUA_TSTRING) continue;
+        std::string name = lua_tostring(L, -2);
+        if (lua_iscfunction(L, -1)) {
+            r[lua_tocfunction(L, -1)] = name;
+        } else if (lua_type(L, -1) == LUA_TTABLE) {
+            int t = lua_gettop(L);
+            for (lua_pushnil(L) ; lua_next(L, t) != 0 ; lua_pop(L, 1)) {
+                if (lua_type(L, -2) != LUA_TSTRING || !lua_iscfunction(L, -1)) continue;
+                // Prefer the top level name if there is one.
+                lua_CFunction f = lua_tocfunction(L, -1);
+                if (r.find(f) == r.end()) r[f] = name + "." + lua_tostring(L, -2);
+            }
+        }
+    }
+    lua_pop(L, 1);
+    return r;
+}
+
+static int lua_dump_to_string (lua_State *, const void *p, size_t sz, void *ud)
+{
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+    return 0;
+}
+
+// The environment of the functions copied into a worker state: reads fall through to the worker's
+// own globals, except that reading a global the worker lacks but the calling script has (which
+// would otherwise silently be nil) is an error, as is assigning any global.  The upvalue is a set of
+// the names of those script globals.
+static int worker_env_index (lua_State *W)
+{
+    lua_pushglobaltable(W);
+    lua_pushvalue(W, 2);
+    lua_rawget(W, -2);
+    if (!lua_isnil(W, -1)) return 1;
+    lua_pushvalue(W, 2);
+    lua_rawget(W, lua_upvalueindex(1));
+    if (lua_toboolean(W, -1)) {
+        my_lua_error(W, "Global \""+std::string(lua_tostring(W, 2))+"\" is not available inside "
+                        "mapParallel or makeParallel, make it a local so that it is copied instead.");
+    }
+    lua_pushnil(W);
+    return 1;
+}
+
+static int worker_env_newindex (lua_State *W)
+{
+    std::string name = lua_type(W, 2) == LUA_TSTRING ? lua_tostring(W, 2) : "?";
+    my_lua_error(W, "Cannot assign global \""+name+"\" inside mapParallel or makeParallel, "
+                    "as the caller and the other threads would not see it.");
+    return 0;
+}
+
+// Pushes onto W the environment for copies of the functions of L (see worker_env_index).
+static void push_worker_env (lua_State *L, lua_State *W)
+{
+    lua_newtable(W);
+    lua_newtable(W);
+
+    lua_newtable(W);
+    int names = lua_gettop(W);
+    lua_pushglobaltable(W);
+    int wg = lua_gettop(W);
+    lua_pushglobaltable(L);
+    int g = lua_gettop(L);
+    for (lua_pushnil(L) ; lua_next(L, g) != 0 ; lua_pop(L, 1)) {
+        if (lua_type(L, -2) != LUA_TSTRING) continue;
+        size_t len;
+        const char *name = lua_tolstring(L, -2, &len);
+        lua_pushlstring(W, name, len);
+        lua_rawget(W, wg);
+        bool worker_has = !lua_isnil(W, -1);
+        lua_pop(W, 1);
+        if (worker_has) continue;
+        lua_pushlstring(W, name, len);
+        lua_pushboolean(W, 1);
+        lua_rawset(W, names);
+    }
+    lua_pop(L, 1);
+    lua_pop(W, 1);
+
+    lua_pushcclosure(W, worker_env_index, 1);
+    lua_setfield(W, -2, "__index");
+    lua_pushcfunction(W, worker_env_newindex);
+    lua_setfield(W, -2, "__newindex");
+    lua_setmetatable(W, -2);
+}
+
+// Pushes onto W a copy of the value at index of L, or throws if it cannot be shared with another
+// thread.  Lua functions are copied through their bytecode and upvalues and get the environment at
+// env in W, tables are copied deeply, C functions are looked up by their global name, and images
+// become new images sharing the same pixels (which can only be read in W).  The table at memo in W
+// maps the values of L already copied to their copies, so that cycles and sharing are preserved.
+// Nothing here can raise a Lua error in W, as there is no pcall around it.
+static void lua_copy_value (lua_State *L, int index, lua_State *W, int memo, int env,
+                            const CFunctionPaths &cfuncs, const std::string &what)
+{
+    if (index < 0) index = lua_gettop(L) + 1 + index;
+    switch (lua_type(L, index)) {
+        case LUA_TNIL: lua_pushnil(W); return;
+        case LUA_TBOOLEAN: lua_pushboolean(W, lua_toboolean(L, index)); return;
+        case LUA_TNUMBER: lua_pushnumber(W, lua_tonumber(L, index)); return;
+        case LUA_TSTRING: {
+            size_t len;
+            const char *str = lua_tolstring(L, index, &len);
+            lua_pushlstring(W, str, len);
+        } return;
+        case LUA_TVECTOR2: {
+            float x, y;
+            lua_checkvector2(L, index, &x, &y);
+            lua_pushvector2(W, x, y);
+        } return;
+        case LUA_TVECTOR3: {
+            float x, y, z;
+            lua_checkvector3(L, index, &x, &y, &z);
+            lua_pushvector3(W, x, y, z);
+        } return;
+        case LUA_TVECTOR4: {
+            float x, y, z, w;
+            lua_checkvector4(L, index, &x, &y, &z, &w);
+            lua_pushvector4(W, x, y, z, w);
+        } return;
+        case LUA_TTABLE: case LUA_TFUNCTION: case LUA_TUSERDATA: break;
+        default:
+        EXCEPT << what << " is a " << type_name(L, index) << ", which cannot be shared with other threads." << ENDL;
+    }
+
+    if (!lua_checkstack(L, 4) || !lua_checkstack(W, 4))
+        EXCEPT << what << " is nested too deeply to be shared with other threads." << ENDL;
+
+    void *key = const_cast<void*>(lua_topointer(L, index));
+    lua_pushlightuserdata(W, key);
+    lua_rawget(W, memo);
+    if (!lua_isnil(W, -1)) return;
+    lua_pop(W, 1);
+
+    if (lua_type(L, index) == LUA_TUSERDATA) {
+        if (!is_ptr(L, index, IMAGE_TAG))
+            EXCEPT << what << " is a userdata, which cannot be shared with other threads." << ENDL;
+        ImageBase *image = check_ptr<ImageBase>(L, index, IMAGE_TAG);
+        if (image == NULL) EXCEPT << what << " is an image that has been freed." << ENDL;
+        ImageBase *copy;
+        if (image->lazy() && image->pixelStorage() != PS_FLOAT) {
+            // As check_image, leave packed and planar images as they are.
+            copy = image_pack(image, PS_FLOAT);
+        } else {
+            image->force();
+            copy = image->view(0, 0, image->width, image->height, NULL, false, false);
+            copy->force();
+        }
+        push_image(W, copy);
+    } else if (lua_type(L, index) == LUA_TTABLE) {
+        if (lua_getmetatable(L, index)) {
+            lua_pop(L, 1);
+            EXCEPT << what << " is a table with a metatable, which cannot be shared with other threads." << ENDL;
+        }
+        lua_newtable(W);
+        lua_pushlightuserdata(W, key);
+        lua_pushvalue(W, -2);
+        lua_rawset(W, memo);
+        for (lua_pushnil(L) ; lua_next(L, index) != 0 ; lua_pop(L, 1)) {
+            // Not lua_tostring, which would turn a number key into a string under lua_next.
+            std::string field = lua_type(L, -2) == LUA_TSTRING ? std::string(lua_tostring(L, -2))
+                              : lua_type(L, -2) == LUA_TNUMBER ? str(lua_tonumber(L, -2)) : "?";
+            lua_copy_value(L, -2, W, memo, env, cfuncs, "a key of " + what);
+            lua_copy_value(L, -1, W, memo, env, cfuncs, what + "[" + field + "]");
+            lua_rawset(W, -3);
+        }
+    } else if (lua_iscfunction(L, index)) {
+        auto it = cfuncs.find(lua_tocfunction(L, index));
+        if (it == cfuncs.end())
+            EXCEPT << what << " is a C function that is not a global, so cannot be shared with other threads." << ENDL;
+        const std::string &path = it->second;
+        size_t dot = path.find('.');
+        lua_getglobal(W, path.substr(0, dot).c_str());
+        if (dot != std::string::npos) {
+            if (lua_type(W, -1) == LUA_TTABLE) {
+                lua_getfield(W, -1, path.substr(dot+1).c_str());
+                lua_remove(W, -2);
+            } else {
+                lua_pop(W, 1);
+                lua_pushnil(W);
+            }
+        }
+        if (!lua_iscfunction(W, -1))
+            EXCEPT << what << " is " << path << ", which is not available in other threads." << ENDL;
+    } else {
+        std::string code;
+        lua_pushvalue(L, index);
+        lua_dump(L, lua_dump_to_string, &code);
+        lua_pop(L, 1);
+        if (luaL_loadbuffer(W, code.data(), code.size(), what.c_str()) != 0)
+            EXCEPT << what << " could not be loaded in another thread: " << lua_tostring(W, -1) << ENDL;
+        lua_pushvalue(W, env);
+        lua_setfenv(W, -2);
+        lua_pushlightuserdata(W, key);
+        lua_pushvalue(W, -2);
+        lua_rawset(W, memo);
+        for (int i=1 ; const char *name = lua_getupvalue(L, index, i) ; ++i) {
+            lua_copy_value(L, -1, W, memo, env, cfuncs, "upvalue '" + std::string(name) + "' of " + what);
+            lua_pop(L, 1);
+            lua_setupvalue(W, -2, i);
+        }
+    }
+}
+
+// A private Lua state per thread, each holding a copy of the function at func_index of L at its
+// stack index 1, for mapParallel and makeParallel.  They are created and closed on the calling
+// thread, as many as parallel_rows will run bands of a width by height job at once (so just one if
+// it runs serially), and each band of rows borrows one that no other band is using.  Since the
+// function and its upvalues are copies, assignments to the upvalues are not seen by the caller or
+// the other states.
+class LuaWorkers {
+
+    std::mutex mutex;
+    std::vector<lua_State*> all;
+    std::vector<lua_State*> idle;
+
+    void close (void)
+    {
+        for (lua_State *W : all) lua_close(W);
+        all.clear();
+    }
+
+    public:
+
+    LuaWorkers (lua_State *L, int func_index, uimglen_t width, uimglen_t height)
+    {
+        CFunctionPaths cfuncs = lua_cfunction_paths(L);
+        unsigned n = parallel_rows_threads(height, width * LUA_CALL_WORK);
+        try {
+            for (unsigned i=0 ; i<n ; ++i) {
+                lua_State *W = interpreter_new_worker();
+                if (W == NULL) EXCEPT << "Could not create a Lua state for a worker thread." << ENDL;
+                all.push_back(W);
+                lua_newtable(W);
+                push_worker_env(L, W);
+                lua_copy_value(L, func_index, W, 1, 2, cfuncs, "the function");
+                lua_replace(W, 1);
+                lua_settop(W, 1);
+            }
+        } catch (...) {
+            close();
+            throw;
+        }
+        idle = all;
+    }
+
+    ~LuaWorkers (void) { close(); }
+
+    lua_State *acquire (void)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ASSERT(!idle.empty());
+        lua_State *W = idle.back();
+        idle.pop_back();
+        return W;
+    }
+
+    void release (lua_State *W)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lua_settop(W, 1);
+        idle.push_back(W);
+    }
+};
+
+// Calls body(W, y0, y1) for bands of rows on the worker pool, each with a state of workers.
+template<class F> void lua_workers_rows (LuaWorkers &workers, uimglen_t width, uimglen_t height, F body)
+{
+    parallel_rows(height, width * LUA_CALL_WORK, [&] (uimglen_t y0, uimglen_t y1) {
+        lua_State *W = workers.acquire();
+        try {
+            body(W, y0, y1);
+        } catch (...) {
+            workers.release(W);
+            throw;
+        }
+        workers.release(W);
+    });
+}
+
+// A new table holding the width pixels of a row at 1 .. width, for the row-batched callbacks.
+template<chan_t ch, chan_t ach> void push_row (lua_State *L, const Colour<ch,ach> *row, uimglen_t width)
+{
+    lua_createtable(L, width, 0);
+    for (uimglen_t x=0 ; x<width ; ++x) {
+        push_colour(L, row[x]);
+        lua_rawseti(L, -2, x+1);
+    }
+}
+
+// Reads the width pixels a row-batched callback left in the table at index, or returns the first
+// x at which the value has the wrong type (leaving that value on the stack).
+template<chan_t ch, chan_t ach> uimglen_t check_row (lua_State *L, int index, Colour<ch,ach> *row, uimglen_t width)
+{
+    for (uimglen_t x=0 ; x<width ; ++x) {
+        lua_rawgeti(L, index, x+1);
+        if (!check_colour(L, row[x], -1)) return x;
+        lua_pop(L, 1);
+    }
+    return width;
+}
+
+// With rows, the function is called once per row with the row number and a table of its pixels.
+template<chan_t ch, chan_t ach> void foreach (lua_State *L, const ImageBase *self_, int func_index, bool rows)
 {
     const Image<ch,ach> *self = static_cast<const Image<ch,ach>*>(self_);
     for (uimglen_t y=0 ; y<self->height ; ++y) {
+        if (rows) {
+            lua_pushvalue(L, func_index);
+            lua_pushnumber(L, y);
+            push_row(L, &self->pixel(0,y), self->width);
+            int status = lua_pcall(L, 2, 0, 0);
+            if (status != 0) {
+                const char *msg = lua_tostring(L, -1);
+                std::stringstream ss;
+                ss << "During foreachRow on image at row " << y << ": " << msg;
+                my_lua_error(L, ss.str());
+            }
+            continue;
+        }
         for (uimglen_t x=0 ; x<self->width ; ++x) {
             lua_pushvalue(L, func_index);
             push_colour(L, self->pixel(x,y));
@@ -1120,44 +1556,114 @@ template<chan_t ch, chan_t ach> void foreach (lua_State *L, const ImageBase *sel
     }   
 }
 
-static int image_foreach (lua_State *L)
+static int image_foreach_common (lua_State *L, bool rows)
 {
+HANDLE_BEGIN
     check_args(L,2);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
     check_is_function(L, 2);
     int fi = 2;
 
     if (self->hasAlpha()) {
         switch (self->channels()) {
-            case 2: foreach<1,1>(L, self, fi); break;
-            case 3: foreach<2,1>(L, self, fi); break;
-            case 4: foreach<3,1>(L, self, fi); break;
+            case 2: foreach<1,1>(L, self, fi, rows); break;
+            case 3: foreach<2,1>(L, self, fi, rows); break;
+            case 4: foreach<3,1>(L, self, fi, rows); break;
             default:
             my_lua_error(L, "Channels must be either 2, 3, or 4.");
         }
     } else {
         switch (self->channels()) {
-            case 1: foreach<1,0>(L, self, fi); break;
-            case 2: foreach<2,0>(L, self, fi); break;
-            case 3: foreach<3,0>(L, self, fi); break;
-            case 4: foreach<4,0>(L, self, fi); break;
+            case 1: foreach<1,0>(L, self, fi, rows); break;
+            case 2: foreach<2,0>(L, self, fi, rows); break;
+            case 3: foreach<3,0>(L, self, fi, rows); break;
+            case 4: foreach<4,0>(L, self, fi, rows); break;
             default:
             my_lua_error(L, "Channels must be either 1, 2, 3, or 4.");
         }
     }
 
     return 0;
+HANDLE_END
+}
+
+static int image_foreach (lua_State *L)
+{
+    return image_foreach_common(L, false);
+}
+
+static int image_foreach_row (lua_State *L)
+{
+    return image_foreach_common(L, true);
+}
+
+template<chan_t src_ch, chan_t src_ach, chan_t dst_ch, chan_t dst_ach>
+ImageBase *map_with_lua_workers (lua_State *L, const ImageBase *src_, int func_index)
+{
+    const Image<src_ch, src_ach> *src = static_cast<const Image<src_ch, src_ach>*>(src_);
+    uimglen_t width = src->width;
+    uimglen_t height = src->height;
+    LuaWorkers workers(L, func_index, width, height);
+    Image<dst_ch, dst_ach> *dst = new Image<dst_ch, dst_ach>(width, height);
+    try {
+        lua_workers_rows(workers, width, height, [&] (lua_State *W, uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    lua_pushvalue(W, 1);
+                    push_colour(W, src->pixel(x,y));
+                    lua_pushvector2(W, x, y);
+                    if (lua_pcall(W, 2, 1, 0) != 0)
+                        EXCEPT << "While mapping the image at (" << x << "," << y << "): " << lua_tostring(W, -1) << ENDL;
+                    if (!check_colour(W, dst->pixel(x,y), -1))
+                        EXCEPT << "While mapping the image at (" << x << "," << y << "): returned value had bad type: " << type_name(W, -1) << ENDL;
+                    lua_pop(W, 1);
+                }
+            }
+        });
+    } catch (...) {
+        delete dst;
+        throw;
+    }
+    return dst;
 }
 
+// With rows, the function is called once per row with the row number, a table of its pixels, and a
+// table to fill with the new ones.  With parallel, copies of it are called in worker states.
 template<chan_t src_ch, chan_t src_ach, chan_t dst_ch, chan_t dst_ach>
-ImageBase *map_with_lua_func (lua_State *L, const ImageBase *src_, int func_index)
+ImageBase *map_with_lua_func (lua_State *L, const ImageBase *src_, int func_index, bool rows, bool parallel)
 {
+    if (parallel) return map_with_lua_workers<src_ch, src_ach, dst_ch, dst_ach>(L, src_, func_index);
     const Image<src_ch, src_ach> *src = static_cast<const Image<src_ch, src_ach>*>(src_);
     uimglen_t width = src->width;
     uimglen_t height = src->height;
     Image<dst_ch, dst_ach> *dst = new Image<dst_ch, dst_ach>(width, height);
     Colour<dst_ch, dst_ach> p(0);
     for (uimglen_t y=0 ; y<height ; ++y) {
+        if (rows) {
+            // The function fills in the output table, which is kept below it on the stack.
+            lua_createtable(L, width, 0);
+            lua_pushvalue(L, func_index);
+            lua_pushnumber(L, y);
+            push_row(L, &src->pixel(0,y), width);
+            lua_pushvalue(L, -4);
+            int status = lua_pcall(L, 3, 0, 0);
+            if (status != 0) {
+                const char *msg = lua_tostring(L, -1);
+                delete dst;
+                std::stringstream ss;
+                ss << "While mapping row " << y << " of the image: " << msg;
+                my_lua_error(L, ss.str());
+            }
+            uimglen_t x = check_row(L, -1, &dst->pixel(0,y), width);
+            if (x < width) {
+                delete dst;
+                std::stringstream ss;
+                ss << "While mapping the image at (" << x << "," << y << "): output value had bad type: " << type_name(L,-1);
+                my_lua_error(L, ss.str());
+            }
+            lua_pop(L, 1);
+            continue;
+        }
         for (uimglen_t x=0 ; x<width ; ++x) {
             lua_pushvalue(L, func_index);
             push_colour(L, src->pixel(x,y));
@@ -1185,14 +1691,15 @@ ImageBase *map_with_lua_func (lua_State *L, const ImageBase *src_, int func_inde
     return dst;
 }
 
-static int image_map (lua_State *L)
+static int image_map_common (lua_State *L, bool rows, bool parallel)
 {
+HANDLE_BEGIN
     ImageBase *src;
     chan_t dst_ch;
     bool dst_ach = false;
     int fi;
     if (lua_gettop(L) == 4) {
-        src = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        src = check_image(L, 1);
         dst_ch = check_int(L, 2, 1, 4);
         dst_ach = check_bool(L, 3);
         check_is_function(L, 4);
@@ -1200,7 +1707,7 @@ static int image_map (lua_State *L)
         fi = 4;
     } else {
         check_args(L,3);
-        src = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        src = check_image(L, 1);
         dst_ch = check_int(L, 2, 1, 4);
         check_is_function(L, 3);
         fi = 3;
@@ -1214,10 +1721,10 @@ static int image_map (lua_State *L)
     switch (src_ch) {
         case 1:
         switch (dst_ch) {
-            case 1: out =                                                    map_with_lua_func<1,0,1,0>(L, src, fi); break;
-            case 2: out = dst_ach ? map_with_lua_func<1,0,1,1>(L, src, fi) : map_with_lua_func<1,0,2,0>(L, src, fi); break;
-            case 3: out = dst_ach ? map_with_lua_func<1,0,2,1>(L, src, fi) : map_with_lua_func<1,0,3,0>(L, src, fi); break;
-            case 4: out = dst_ach ? map_with_lua_func<1,0,3,1>(L, src, fi) : map_with_lua_func<1,0,4,0>(L, src, fi); break;
+            case 1: out =                                                    map_with_lua_func<1,0,1,0>(L, src, fi, rows, parallel); break;
+            case 2: out = dst_ach ? map_with_lua_func<1,0,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<1,0,2,0>(L, src, fi, rows, parallel); break;
+            case 3: out = dst_ach ? map_with_lua_func<1,0,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<1,0,3,0>(L, src, fi, rows, parallel); break;
+            case 4: out = dst_ach ? map_with_lua_func<1,0,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<1,0,4,0>(L, src, fi, rows, parallel); break;
             default:
             my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
         }
@@ -1226,19 +1733,19 @@ static int image_map (lua_State *L)
         case 2:
         if (src->hasAlpha()) {
             switch (dst_ch) {
-                case 1: out =                                                    map_with_lua_func<1,1,1,0>(L, src, fi); break;
-                case 2: out = dst_ach ? map_with_lua_func<1,1,1,1>(L, src, fi) : map_with_lua_func<1,1,2,0>(L, src, fi); break;
-                case 3: out = dst_ach ? map_with_lua_func<1,1,2,1>(L, src, fi) : map_with_lua_func<1,1,3,0>(L, src, fi); break;
-                case 4: out = dst_ach ? map_with_lua_func<1,1,3,1>(L, src, fi) : map_with_lua_func<1,1,4,0>(L, src, fi); break;
+                case 1: out =                                                    map_with_lua_func<1,1,1,0>(L, src, fi, rows, parallel); break;
+                case 2: out = dst_ach ? map_with_lua_func<1,1,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<1,1,2,0>(L, src, fi, rows, parallel); break;
+                case 3: out = dst_ach ? map_with_lua_func<1,1,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<1,1,3,0>(L, src, fi, rows, parallel); break;
+                case 4: out = dst_ach ? map_with_lua_func<1,1,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<1,1,4,0>(L, src, fi, rows, parallel); break;
                 default:
                 my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
             }
         } else {
             switch (dst_ch) {
-                case 1: out =                                                    map_with_lua_func<2,0,1,0>(L, src, fi); break;
-                case 2: out = dst_ach ? map_with_lua_func<2,0,1,1>(L, src, fi) : map_with_lua_func<2,0,2,0>(L, src, fi); break;
-                case 3: out = dst_ach ? map_with_lua_func<2,0,2,1>(L, src, fi) : map_with_lua_func<2,0,3,0>(L, src, fi); break;
-                case 4: out = dst_ach ? map_with_lua_func<2,0,3,1>(L, src, fi) : map_with_lua_func<2,0,4,0>(L, src, fi); break;
+                case 1: out =                                                    map_with_lua_func<2,0,1,0>(L, src, fi, rows, parallel); break;
+                case 2: out = dst_ach ? map_with_lua_func<2,0,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<2,0,2,0>(L, src, fi, rows, parallel); break;
+                case 3: out = dst_ach ? map_with_lua_func<2,0,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<2,0,3,0>(L, src, fi, rows, parallel); break;
+                case 4: out = dst_ach ? map_with_lua_func<2,0,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<2,0,4,0>(L, src, fi, rows, parallel); break;
                 default:
                 my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
             }
@@ -1248,19 +1755,19 @@ static int image_map (lua_State *L)
         case 3:
         if (src->hasAlpha()) {
             switch (dst_ch) {
-                case 1: out =                                                    map_with_lua_func<2,1,1,0>(L, src, fi); break;
-                case 2: out = dst_ach ? map_with_lua_func<2,1,1,1>(L, src, fi) : map_with_lua_func<2,1,2,0>(L, src, fi); break;
-                case 3: out = dst_ach ? map_with_lua_func<2,1,2,1>(L, src, fi) : map_with_lua_func<2,1,3,0>(L, src, fi); break;
-                case 4: out = dst_ach ? map_with_lua_func<2,1,3,1>(L, src, fi) : map_with_lua_func<2,1,4,0>(L, src, fi); break;
+                case 1: out =                                                    map_with_lua_func<2,1,1,0>(L, src, fi, rows, parallel); break;
+                case 2: out = dst_ach ? map_with_lua_func<2,1,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<2,1,2,0>(L, src, fi, rows, parallel); break;
+                case 3: out = dst_ach ? map_with_lua_func<2,1,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<2,1,3,0>(L, src, fi, rows, parallel); break;
+                case 4: out = dst_ach ? map_with_lua_func<2,1,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<2,1,4,0>(L, src, fi, rows, parallel); break;
                 default:
                 my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
             }
         } else {
             switch (dst_ch) {
-                case 1: out =                                                    map_with_lua_func<3,0,1,0>(L, src, fi); break;
-                case 2: out = dst_ach ? map_with_lua_func<3,0,1,1>(L, src, fi) : map_with_lua_func<3,0,2,0>(L, src, fi); break;
-                case 3: out = dst_ach ? map_with_lua_func<3,0,2,1>(L, src, fi) : map_with_lua_func<3,0,3,0>(L, src, fi); break;
-                case 4: out = dst_ach ? map_with_lua_func<3,0,3,1>(L, src, fi) : map_with_lua_func<3,0,4,0>(L, src, fi); break;
+                case 1: out =                                                    map_with_lua_func<3,0,1,0>(L, src, fi, rows, parallel); break;
+                case 2: out = dst_ach ? map_with_lua_func<3,0,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<3,0,2,0>(L, src, fi, rows, parallel); break;
+                case 3: out = dst_ach ? map_with_lua_func<3,0,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<3,0,3,0>(L, src, fi, rows, parallel); break;
+                case 4: out = dst_ach ? map_with_lua_func<3,0,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<3,0,4,0>(L, src, fi, rows, parallel); break;
                 default:
                 my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
             }
@@ -1270,19 +1777,19 @@ static int image_map (lua_State *L)
         case 4:
         if (src->hasAlpha()) {
             switch (dst_ch) {
-                case 1: out =                                                    map_with_lua_func<3,1,1,0>(L, src, fi); break;
-                case 2: out = dst_ach ? map_with_lua_func<3,1,1,1>(L, src, fi) : map_with_lua_func<3,1,2,0>(L, src, fi); break;
-                case 3: out = dst_ach ? map_with_lua_func<3,1,2,1>(L, src, fi) : map_with_lua_func<3,1,3,0>(L, src, fi); break;
-                case 4: out = dst_ach ? map_with_lua_func<3,1,3,1>(L, src, fi) : map_with_lua_func<3,1,4,0>(L, src, fi); break;
+                case 1: out =                                                    map_with_lua_func<3,1,1,0>(L, src, fi, rows, parallel); break;
+                case 2: out = dst_ach ? map_with_lua_func<3,1,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<3,1,2,0>(L, src, fi, rows, parallel); break;
+                case 3: out = dst_ach ? map_with_lua_func<3,1,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<3,1,3,0>(L, src, fi, rows, parallel); break;
+                case 4: out = dst_ach ? map_with_lua_func<3,1,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<3,1,4,0>(L, src, fi, rows, parallel); break;
                 default:
                 my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
             }
         } else {
             switch (dst_ch) {
-                case 1: out =                                                    map_with_lua_func<4,0,1,0>(L, src, fi); break;
-                case 2: out = dst_ach ? map_with_lua_func<4,0,1,1>(L, src, fi) : map_with_lua_func<4,0,2,0>(L, src, fi); break;
-                case 3: out = dst_ach ? map_with_lua_func<4,0,2,1>(L, src, fi) : map_with_lua_func<4,0,3,0>(L, src, fi); break;
-                case 4: out = dst_ach ? map_with_lua_func<4,0,3,1>(L, src, fi) : map_with_lua_func<4,0,4,0>(L, src, fi); break;
+                case 1: out =                                                    map_with_lua_func<4,0,1,0>(L, src, fi, rows, parallel); break;
+                case 2: out = dst_ach ? map_with_lua_func<4,0,1,1>(L, src, fi, rows, parallel) : map_with_lua_func<4,0,2,0>(L, src, fi, rows, parallel); break;
+                case 3: out = dst_ach ? map_with_lua_func<4,0,2,1>(L, src, fi, rows, parallel) : map_with_lua_func<4,0,3,0>(L, src, fi, rows, parallel); break;
+                case 4: out = dst_ach ? map_with_lua_func<4,0,3,1>(L, src, fi, rows, parallel) : map_with_lua_func<4,0,4,0>(L, src, fi, rows, parallel); break;
                 default:
                 my_lua_error(L, "Dest channels must be either 1, 2, 3, or 4.");
             }
@@ -1295,14 +1802,94 @@ static int image_map (lua_State *L)
 
     push_image(L, out);
     return 1;
+HANDLE_END
+}
+
+static int image_map (lua_State *L)
+{
+    return image_map_common(L, false, false);
+}
+
+static int image_map_rows (lua_State *L)
+{
+    return image_map_common(L, true, false);
+}
+
+static int image_map_parallel (lua_State *L)
+{
+    return image_map_common(L, false, true);
+}
+
+// The named constants of eval, from the table at index (if there is one).
+static std::map<std::string, std::vector<float>> check_pixel_expr_constants (lua_State *L, int index)
+{
+    std::map<std::string, std::vector<float>> r;
+    if (lua_gettop(L) < index) return r;
+    // Throwing, rather than a Lua error, so that r is not leaked.
+    if (!lua_istable(L, index))
+        EXCEPT << "Expected a table of constants at argument " << index << ", got " << type_name(L, index) << ENDL;
+    for (lua_pushnil(L) ; lua_next(L, index) != 0 ; lua_pop(L, 1)) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            lua_pop(L, 2);
+            EXCEPT << "Constants must have string names." << ENDL;
+        }
+        std::string name = lua_tostring(L, -2);
+        std::vector<float> &v = r[name];
+        float x, y, z, w;
+        switch (lua_type(L, -1)) {
+            case LUA_TNUMBER: v = { float(lua_tonumber(L, -1)) }; break;
+            case LUA_TVECTOR2: lua_checkvector2(L, -1, &x, &y); v = { x, y }; break;
+            case LUA_TVECTOR3: lua_checkvector3(L, -1, &x, &y, &z); v = { x, y, z }; break;
+            case LUA_TVECTOR4: lua_checkvector4(L, -1, &x, &y, &z, &w); v = { x, y, z, w }; break;
+            default:
+            std::string type = type_name(L, -1);
+            lua_pop(L, 2);
+            EXCEPT << "Constant " << name << " must be a number or vector, got " << type << ENDL;
+        }
+    }
+    return r;
+}
+
+static int image_eval (lua_State *L)
+{
+HANDLE_BEGIN
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 4) my_lua_error(L, "Wrong number of arguments to eval.");
+    ImageBase *self = check_image(L, 1);
+    std::string src = luaL_checkstring(L, 2);
+    bool alpha = lua_gettop(L) >= 3 && check_bool(L, 3);
+    PixelExpr e(src, check_pixel_expr_constants(L, 4), self->channels());
+    push_image(L, pixel_expr_image(e, self, self->width, self->height, alpha));
+    return 1;
+HANDLE_END
 }
 
 template<chan_t ch, chan_t ach>
-void reduce_with_lua_func (lua_State *L, const ImageBase *self_, Colour<ch,ach> zero, int func_index)
+void reduce_with_lua_func (lua_State *L, const ImageBase *self_, Colour<ch,ach> zero, int func_index, bool rows)
 {
     const Image<ch,ach> *self = static_cast<const Image<ch,ach>*>(self_);
 
     for (uimglen_t y=0 ; y<self->height ; ++y) {
+        if (rows) {
+            lua_pushvalue(L, func_index);
+            push_colour(L, zero);
+            lua_pushnumber(L, y);
+            push_row(L, &self->pixel(0,y), self->width);
+            int status = lua_pcall(L, 3, 1, 0);
+            if (status != 0) {
+                const char *msg = lua_tostring(L, -1);
+                std::stringstream ss;
+                ss << "While reducing row " << y << " of the image: " << msg;
+                my_lua_error(L, ss.str());
+            }
+            if (!check_colour(L, zero, -1)) {
+                const char *msg = lua_tostring(L, -1);
+                std::stringstream ss;
+                ss << "While reducing row " << y << " of the image: returned value \""<<msg<<"\" has the wrong type.";
+                my_lua_error(L, ss.str());
+            }
+            lua_pop(L, 1);
+            continue;
+        }
         for (uimglen_t x=0 ; x<self->width ; ++x) {
             lua_pushvalue(L, func_index);
             push_colour(L, zero);
@@ -1328,11 +1915,37 @@ void reduce_with_lua_func (lua_State *L, const ImageBase *self_, Colour<ch,ach>
     push_colour(L, zero);
 }
 
-static int image_reduce (lua_State *L)
+// img:reduce(zero, op) for the built-in operators, which need no Lua calls so run on all threads.
+static int image_reduce_named (lua_State *L, const ImageBase *self, const char *name)
 {
+    ReduceOp op;
+    if (!::strcmp(name, "+")) op = RO_SUM;
+    else if (!::strcmp(name, "min")) op = RO_MIN;
+    else if (!::strcmp(name, "max")) op = RO_MAX;
+    else {
+        my_lua_error(L, "Unknown reduce operator \"" + std::string(name) + "\", expected +, min, or max.");
+        return 0;
+    }
+    ColourBase *zero = alloc_colour(L, self->channels(), self->hasAlpha(), 2);
+    ColourBase *value = self->reduce(op);
+    float *z = (float*)zero; // maybe UB in C++ (OK in C)
+    const float *v = (const float*)value;
+    for (chan_t c=0 ; c<self->channels() ; ++c) {
+        z[c] = op == RO_SUM ? z[c] + v[c] : op == RO_MIN ? op_min(z[c], v[c]) : op_max(z[c], v[c]);
+    }
+    push_colour(L, self->channels(), self->hasAlpha(), *zero);
+    delete zero;
+    delete value;
+    return 1;
+}
+
+static int image_reduce_common (lua_State *L, bool rows)
+{
+HANDLE_BEGIN
     check_args(L,3);
     // img:A, zero:A, func:A,A -> A
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
+    if (!rows && lua_type(L, 3) == LUA_TSTRING) return image_reduce_named(L, self, lua_tostring(L, 3));
     int pi = 2;
     check_is_function(L, 3);
     int fi = 3;
@@ -1343,7 +1956,7 @@ static int image_reduce (lua_State *L)
         } else {
             Colour<1,0> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         }
         break;
 
@@ -1351,11 +1964,11 @@ static int image_reduce (lua_State *L)
         if (self->hasAlpha()) {
             Colour<1,1> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         } else {
             Colour<2,0> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         }
         break;
 
@@ -1363,11 +1976,11 @@ static int image_reduce (lua_State *L)
         if (self->hasAlpha()) {
             Colour<2,1> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         } else {
             Colour<3,0> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         }
         break;
 
@@ -1375,11 +1988,11 @@ static int image_reduce (lua_State *L)
         if (self->hasAlpha()) {
             Colour<3,1> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         } else {
             Colour<4,0> p;
             if (!check_colour(L, p, pi)) my_lua_error(L, "Reduce 'zero' value had the wrong number of elements.");
-            else reduce_with_lua_func(L, self, p, fi);
+            else reduce_with_lua_func(L, self, p, fi, rows);
         }
         break;
 
@@ -1387,52 +2000,67 @@ static int image_reduce (lua_State *L)
         my_lua_error(L, "Image must have either 1, 2, 3, or 4 channels.");
     }
     return 1;
+HANDLE_END
+}
+
+static int image_reduce (lua_State *L)
+{
+    return image_reduce_common(L, false);
+}
+
+static int image_reduce_rows (lua_State *L)
+{
+    return image_reduce_common(L, true);
 }
 
 static int image_crop (lua_State *L)
 {
+HANDLE_BEGIN
     if (lua_gettop(L) == 3) {
-        ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        ImageBase *self = check_image(L, 1);
         simglen_t left, bottom;
         check_scoord(L, 2, left, bottom);
         uimglen_t width, height;
         check_coord(L, 3, width, height);
-        push_image(L, self->crop(left,bottom,width,height,NULL));
+        push_image(L, self->view(left,bottom,width,height,NULL,false,false));
     } else {
         check_args(L,4);
-        ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        ImageBase *self = check_image(L, 1);
         simglen_t left, bottom;
         check_scoord(L, 2, left, bottom);
         uimglen_t width, height;
         check_coord(L, 3, width, height);
         ColourBase *colour = alloc_colour(L, self->channels(), self->hasAlpha(), 4);
-        push_image(L, self->crop(left,bottom,width,height,colour));
+        push_image(L, self->view(left,bottom,width,height,colour,false,false));
         delete colour;
     }
     return 1;
+HANDLE_END
 }
 
 static int image_crop_centre (lua_State *L)
 {
+HANDLE_BEGIN
     if (lua_gettop(L) == 2) {
-        ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        ImageBase *self = check_image(L, 1);
         uimglen_t width, height;
         check_coord(L, 2, width, height);
         simglen_t left = (simglen_t(self->width) - simglen_t(width))/2;
         simglen_t bottom = (simglen_t(self->height) - simglen_t(height))/2;
-        push_image(L, self->crop(left,bottom,width,height,NULL));
+        push_image(L, self->view(left,bottom,width,height,NULL,false,false));
     } else {
         check_args(L,3);
-        ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        ImageBase *self = check_image(L, 1);
         uimglen_t width, height;
         check_coord(L, 2, width, height);
         simglen_t left = (simglen_t(self->width) - simglen_t(width))/2;
         simglen_t bottom = (simglen_t(self->height) - simglen_t(height))/2;
         ColourBase *colour = alloc_colour(L, self->channels(), self->hasAlpha(), 3);
-        push_image(L, self->crop(left,bottom,width,height,colour));
+        push_image(L, self->view(left,bottom,width,height,colour,false,false));
         delete colour;
     }
     return 1;
+HANDLE_END
 }
 
 ScaleFilter scale_filter_from_string (const std::string &s)
@@ -1450,9 +2078,10 @@ static int image_scale (lua_State *L)
 {
 HANDLE_BEGIN
     check_args(L, 3);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
     uimglen_t width, height;
     check_coord(L, 2, width, height);
+    if (width == 0 || height == 0) EXCEPT << "Cannot scale to " << width << "x" << height << "." << ENDL;
     std::string filter_type = luaL_checkstring(L, 3);
     ImageBase *out = self->scale(width, height, scale_filter_from_string(filter_type));
     push_image(L, out);
@@ -1464,7 +2093,7 @@ static int image_scale_by (lua_State *L)
 {
 HANDLE_BEGIN
     check_args(L, 3);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
     float x_=0, y_=0;
     switch (lua_type(L,2)) {
         case LUA_TNUMBER:
@@ -1476,8 +2105,12 @@ HANDLE_BEGIN
         default:
         my_lua_error(L, "Scale must be a number or vector2 (got "+type_name(L,2)+")");
     }
-    uimglen_t width = x_ * self->width;
-    uimglen_t height = y_ * self->height;
+    if (!(x_ > 0 && y_ > 0)) EXCEPT << "Scale must be greater than 0 (got " << x_ << ", " << y_ << ")." << ENDL;
+    float w_ = x_ * self->width, h_ = y_ * self->height;
+    if (!(w_ >= 1 && h_ >= 1) || w_ > std::numeric_limits<uimglen_t>::max() || h_ > std::numeric_limits<uimglen_t>::max())
+        EXCEPT << "Cannot scale to " << w_ << "x" << h_ << "." << ENDL;
+    uimglen_t width = w_;
+    uimglen_t height = h_;
     ScaleFilter scale_filter = scale_filter_from_string(luaL_checkstring(L, 3));
     ImageBase *out = self->scale(width, height, scale_filter);
     push_image(L, out);
@@ -1487,90 +2120,311 @@ HANDLE_END
 
 static int image_rotate (lua_State *L)
 {
+HANDLE_BEGIN
     if (lua_gettop(L) == 2) {
-        ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        ImageBase *self = check_image(L, 1);
         float angle = luaL_checknumber(L, 2);
         push_image(L, self->rotate(angle, NULL));
     } else {
         check_args(L,3);
-        ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+        ImageBase *self = check_image(L, 1);
         float angle = luaL_checknumber(L, 2);
         ColourBase *colour = alloc_colour(L, self->channels(), self->hasAlpha(), 3);
         push_image(L, self->rotate(angle, colour));
         delete colour;
     }
     return 1;
+HANDLE_END
 }
 
-static int image_clone (lua_State *L)
+static int image_rotate90 (lua_State *L)
 {
-    check_args(L, 1);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    ImageBase *out = self->clone(false, false);
-    push_image(L, out);
+HANDLE_BEGIN
+    int k = 1;
+    if (lua_gettop(L) == 2) {
+        k = check_int(L, 2, std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+    } else {
+        check_args(L,1);
+    }
+    ImageBase *self = check_image(L, 1);
+    push_image(L, self->rotate90(k));
     return 1;
+HANDLE_END
 }
 
-static int image_flip (lua_State *L)
+static int image_transpose (lua_State *L)
 {
-    check_args(L, 1);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    ImageBase *out = self->clone(false, true);
-    push_image(L, out);
+HANDLE_BEGIN
+    check_args(L,1);
+    ImageBase *self = check_image(L, 1);
+    push_image(L, self->transpose());
     return 1;
+HANDLE_END
 }
 
-static int image_mirror (lua_State *L)
+static int image_clone (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L, 1);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    ImageBase *out = self->clone(true, false);
+    ImageBase *self = check_image(L, 1);
+    ImageBase *out = self->view(0, 0, self->width, self->height, NULL, false, false);
     push_image(L, out);
     return 1;
+HANDLE_END
 }
 
-static int image_mean_diff (lua_State *L)
+static const char *pixel_storage_to_string (PixelStorage s)
 {
-    const ImageBase *some_image;
-    ColourBase *value = image_zip_reduce_lua1<op_diff,op_add>(L, some_image);
-    float num_pixels = some_image->numPixels();
-    float *raw = (float*)value; // maybe UB in C++ (OK in C)
-    for (chan_t c=0 ; c<some_image->channels() ; ++c) {
-        raw[c] = raw[c]/num_pixels;
+    switch (s) {
+        case PS_FLOAT: return "FLOAT";
+        case PS_U8: return "U8";
+        case PS_U16: return "U16";
+        case PS_F16: return "F16";
+        case PS_PLANAR: return "PLANAR";
     }
-    push_colour(L, some_image->channels(), some_image->hasAlpha(), *value);
-    delete value;
-    return 1;
+    return "UNKNOWN";
 }
 
-static int image_rms_diff (lua_State *L)
+static PixelStorage pixel_storage_from_string (const std::string &s)
 {
-    const ImageBase *some_image;
-    ColourBase *value = image_zip_reduce_lua1<op_diffsq,op_add>(L, some_image);
-    float num_pixels = some_image->numPixels();
-    float *raw = (float*)value; // maybe UB in C++ (OK in C)
-    for (chan_t c=0 ; c<some_image->channels() ; ++c) {
-        raw[c] = raw[c]/num_pixels;
-    }
-    push_colour(L, some_image->channels(), some_image->hasAlpha(), *value);
-    delete value;
-    return 1;
+    if (s == "FLOAT") return PS_FLOAT;
+    if (s == "U8") return PS_U8;
+    if (s == "U16") return PS_U16;
+    if (s == "F16") return PS_F16;
+    if (s == "PLANAR") return PS_PLANAR;
+    EXCEPT << "Expected FLOAT, U8, U16, F16, or PLANAR.  Got: \"" << s << "\"" << ENDL;
 }
 
-static int image_abs (lua_State *L)
+static int image_pack (lua_State *L)
 {
-    check_args(L,1);
-    ImageBase *src = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    push_image(L, src->abs());
+HANDLE_BEGIN
+    check_args(L, 2);
+    // Left lazy, so packing a packed image does not unpack it first.
+    ImageBase *self = check_image_ptr(L, 1);
+    std::string storage = luaL_checkstring(L, 2);
+    ImageBase *out = image_pack(self, pixel_storage_from_string(storage));
+    push_image(L, out);
     return 1;
+HANDLE_END
+}
+
+static int image_flip (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 1);
+    ImageBase *self = check_image(L, 1);
+    ImageBase *out = self->view(0, 0, self->width, self->height, NULL, false, true);
+    push_image(L, out);
+    return 1;
+HANDLE_END
+}
+
+static int image_mirror (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 1);
+    ImageBase *self = check_image(L, 1);
+    ImageBase *out = self->view(0, 0, self->width, self->height, NULL, true, false);
+    push_image(L, out);
+    return 1;
+HANDLE_END
+}
+
+static int image_mean_diff (lua_State *L)
+{
+HANDLE_BEGIN
+    const ImageBase *some_image;
+    ColourBase *value = image_zip_mean_lua1<op_diff>(L, some_image);
+    push_colour(L, some_image->channels(), some_image->hasAlpha(), *value);
+    delete value;
+    return 1;
+HANDLE_END
+}
+
+static int image_rms_diff (lua_State *L)
+{
+HANDLE_BEGIN
+    const ImageBase *some_image;
+    ColourBase *value = image_zip_mean_lua1<op_diffsq>(L, some_image);
+    push_colour(L, some_image->channels(), some_image->hasAlpha(), *value);
+    delete value;
+    return 1;
+HANDLE_END
+}
+
+static int image_reduce_op (lua_State *L, ReduceOp op)
+{
+HANDLE_BEGIN
+    check_args(L, 1);
+    ImageBase *self = check_image_rows(L, 1);
+    ColourBase *value = self->reduce(op);
+    push_colour(L, self->channels(), self->hasAlpha(), *value);
+    delete value;
+    return 1;
+HANDLE_END
+}
+
+static int image_sum (lua_State *L)
+{
+    return image_reduce_op(L, RO_SUM);
+}
+
+static int image_mean (lua_State *L)
+{
+    return image_reduce_op(L, RO_MEAN);
+}
+
+static int image_minimum (lua_State *L)
+{
+    return image_reduce_op(L, RO_MIN);
+}
+
+static int image_maximum (lua_State *L)
+{
+    return image_reduce_op(L, RO_MAX);
+}
+
+static int image_variance (lua_State *L)
+{
+    return image_reduce_op(L, RO_VARIANCE);
+}
+
+// A number or vector of the given channels.
+template<class T> static void push_channels (lua_State *L, const T *v, chan_t channels)
+{
+    switch (channels) {
+        case 1: lua_pushnumber(L, v[0]); break;
+        case 2: lua_pushvector2(L, v[0], v[1]); break;
+        case 3: lua_pushvector3(L, v[0], v[1], v[2]); break;
+        case 4: lua_pushvector4(L, v[0], v[1], v[2], v[3]); break;
+        default: my_lua_error(L, "Internal error: weird channels");
+    }
+}
+
+static int image_histogram (lua_State *L)
+{
+HANDLE_BEGIN
+    if (lua_gettop(L) != 2 && lua_gettop(L) != 4) my_lua_error(L, "histogram takes bins and optionally min and max.");
+    ImageBase *self = check_image_rows(L, 1);
+    unsigned bins = check_int(L, 2, 1, HISTOGRAM_MAX_BINS);
+    chan_t chans = self->channels();
+    ColourBase *lo_ = NULL, *hi_ = NULL;
+    if (lua_gettop(L) == 4) {
+        lo_ = alloc_colour(L, chans, self->hasAlpha(), 3);
+        hi_ = alloc_colour(L, chans, self->hasAlpha(), 4);
+    }
+    std::vector<float> lo(chans, 0), hi(chans, 1);
+    if (lo_ != NULL) {
+        std::copy_n((const float*)lo_, chans, lo.begin()); // maybe UB in C++ (OK in C)
+        std::copy_n((const float*)hi_, chans, hi.begin());
+        delete lo_;
+        delete hi_;
+    }
+    for (chan_t c=0 ; c<chans ; ++c) {
+        if (!(hi[c] > lo[c])) EXCEPT << "Histogram max must be greater than min, in channel " << int(c) << "." << ENDL;
+    }
+    push_image(L, image_histogram(self, bins, &lo[0], &hi[0]));
+    return 1;
+HANDLE_END
+}
+
+static int image_percentile_common (lua_State *L, float p)
+{
+HANDLE_BEGIN
+    ImageBase *self = check_image(L, 1);
+    std::vector<float> out(self->channels());
+    image_percentile(self, p, &out[0]);
+    push_channels(L, &out[0], self->channels());
+    return 1;
+HANDLE_END
+}
+
+static int image_percentile (lua_State *L)
+{
+    check_args(L, 2);
+    float p = luaL_checknumber(L, 2);
+    if (!(p >= 0 && p <= 1)) my_lua_error(L, "Percentile must be between 0 and 1.");
+    return image_percentile_common(L, p);
+}
+
+static int image_median (lua_State *L)
+{
+    check_args(L, 1);
+    return image_percentile_common(L, 0.5);
+}
+
+static int image_auto_levels (lua_State *L)
+{
+HANDLE_BEGIN
+    if (lua_gettop(L) != 1 && lua_gettop(L) != 3) my_lua_error(L, "autoLevels takes optionally low and high.");
+    ImageBase *self = check_image(L, 1);
+    float low = lua_gettop(L) == 3 ? luaL_checknumber(L, 2) : 0.005;
+    float high = lua_gettop(L) == 3 ? luaL_checknumber(L, 3) : 0.995;
+    if (!(low >= 0 && low < high && high <= 1)) my_lua_error(L, "autoLevels needs 0 <= low < high <= 1.");
+    push_image(L, image_auto_levels(self, low, high));
+    return 1;
+HANDLE_END
+}
+
+static int image_auto_exposure (lua_State *L)
+{
+HANDLE_BEGIN
+    if (lua_gettop(L) != 1 && lua_gettop(L) != 2) my_lua_error(L, "autoExposure takes optionally a target.");
+    ImageBase *self = check_image(L, 1);
+    float target = lua_gettop(L) == 2 ? luaL_checknumber(L, 2) : 0.5;
+    push_image(L, image_auto_exposure(self, target));
+    return 1;
+HANDLE_END
+}
+
+// Before drawing into img or otherwise changing its pixels.
+static void prepare_write (ImageBase *img)
+{
+    lazy_image_force_readers(img);
+    img->unshare();
+}
+
+static int image_abs (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L,1);
+    ImageBase *src = check_image_or_planar(L, 1);
+    push_image(L, src->abs());
+    return 1;
+HANDLE_END
+}
+
+static int image_abs_in_place (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L,1);
+    ImageBase *self = check_image_for_write(L, 1);
+    prepare_write(self);
+    self->absInPlace();
+    lua_pushvalue(L, 1);
+    return 1;
+HANDLE_END
+}
+
+static int image_negate_in_place (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L,1);
+    ImageBase *self = check_image_for_write(L, 1);
+    prepare_write(self);
+    self->unmInPlace();
+    lua_pushvalue(L, 1);
+    return 1;
+HANDLE_END
 }
 
 static int image_draw (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,3);
     uimglen_t x;
     uimglen_t y;
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image_for_write(L, 1);
     check_coord(L, 2, x, y);
     int pi = 3;
 
@@ -1587,11 +2441,13 @@ static int image_draw (lua_State *L)
         colour = alloc_colour(L, self->channels()+1, true, pi);
     }
 
+    prepare_write(self);
     self->drawPixelSafe(x, y, colour);
 
     delete colour;
 
     return 0;
+HANDLE_END
 }
 
 static void draw_image_common (lua_State *L, ImageBase *dst, ImageBase *src, simglen_t x, simglen_t y, bool wrap_x, bool wrap_y)
@@ -1605,19 +2461,21 @@ static void draw_image_common (lua_State *L, ImageBase *dst, ImageBase *src, sim
         my_lua_error(L, "Can only draw onto image with same number of colour channels.");
     }
 
+    prepare_write(dst);
     dst->drawImage(src, x, y, wrap_x, wrap_y);
 }
 
 static int image_draw_image_at (lua_State *L)
 {
+HANDLE_BEGIN
     bool wrap_x = false;
     bool wrap_y = false;
     simglen_t x, y;
     ImageBase *dst, *src;
 
     if (lua_gettop(L) == 5) {
-        dst = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-        src = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        dst = check_image_for_write(L, 1);
+        src = check_image(L, 2);
         float x_, y_;
         lua_checkvector2(L, 3, &x_, &y_);
         x = x_ - src->width/2;
@@ -1626,8 +2484,8 @@ static int image_draw_image_at (lua_State *L)
         wrap_y = check_bool(L, 5);
     } else {
         check_args(L,3);
-        dst = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-        src = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        dst = check_image_for_write(L, 1);
+        src = check_image(L, 2);
         float x_, y_;
         lua_checkvector2(L, 3, &x_, &y_);
         x = x_ - src->width/2;
@@ -1636,12 +2494,14 @@ static int image_draw_image_at (lua_State *L)
 
     draw_image_common(L, dst, src, x, y, wrap_x, wrap_y);
     return 0;
+HANDLE_END
 }
 
 static int image_draw_line (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,5);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image_for_write(L, 1);
     uimglen_t x0, y0;
     uimglen_t x1, y1;
     check_coord(L, 2, x0, y0);
@@ -1654,89 +2514,144 @@ static int image_draw_line (lua_State *L)
     } else {
         colour = alloc_colour(L, self->channels()+1, true, 5);
     }
+    prepare_write(self);
     self->drawLine(x0, y0, x1, y1, w, colour);
     delete colour;
     return 0;
+HANDLE_END
 }
 
 static int image_draw_image (lua_State *L)
 {
+HANDLE_BEGIN
     bool wrap_x = false;
     bool wrap_y = false;
     simglen_t x, y;
     ImageBase *dst, *src;
 
     if (lua_gettop(L) == 5) {
-        dst = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-        src = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        dst = check_image_for_write(L, 1);
+        src = check_image(L, 2);
         check_scoord(L, 3, x, y);
         wrap_x = check_bool(L, 4);
         wrap_y = check_bool(L, 5);
     } else {
         check_args(L,3);
-        dst = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-        src = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+        dst = check_image_for_write(L, 1);
+        src = check_image(L, 2);
         check_scoord(L, 3, x, y);
     }
 
     draw_image_common(L, dst, src, x, y, wrap_x, wrap_y);
     return 0;
+HANDLE_END
 }
 
 static int image_max (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<op_max>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_min (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<op_min>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_clamp (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L, 3);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image_or_planar(L, 1);
     ColourBase *min = alloc_colour(L, self->channels(), self->hasAlpha(), 2);
     ColourBase *max = alloc_colour(L, self->channels(), self->hasAlpha(), 3);
     push_image(L, self->clamp(min, max));
     delete min;
     delete max;
     return 1;
+HANDLE_END
+}
+
+static int image_clamp_in_place (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 3);
+    ImageBase *self = check_image_for_write(L, 1);
+    ColourBase *min = alloc_colour(L, self->channels(), self->hasAlpha(), 2);
+    ColourBase *max = alloc_colour(L, self->channels(), self->hasAlpha(), 3);
+    prepare_write(self);
+    self->clampInPlace(min, max);
+    delete min;
+    delete max;
+    lua_pushvalue(L, 1);
+    return 1;
+HANDLE_END
 }
 
 static int image_gamma (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L, 2);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image_or_planar(L, 1);
     ColourBase *n = alloc_colour(L, self->channels(), self->hasAlpha(), 2);
     push_image(L, self->gamma(n));
     delete n;
     return 1;
+HANDLE_END
+}
+
+static int image_gamma_in_place (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 2);
+    ImageBase *self = check_image_for_write(L, 1);
+    ColourBase *n = alloc_colour(L, self->channels(), self->hasAlpha(), 2);
+    prepare_write(self);
+    self->gammaInPlace(n);
+    delete n;
+    lua_pushvalue(L, 1);
+    return 1;
+HANDLE_END
 }
 
 static int global_lerp (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,3);
     global_lerp_lua1(L);
     return 1;
+HANDLE_END
+}
+
+ConvolveMethod convolve_method_from_string (const std::string &s)
+{
+    if (s == "AUTO") return CM_AUTO;
+    if (s == "DIRECT") return CM_DIRECT;
+    if (s == "FFT") return CM_FFT;
+    EXCEPT << "Expected AUTO, DIRECT, or FFT.  Got: \"" << s << "\"" << ENDL;
 }
 
 static int image_convolve (lua_State *L)
 {
+HANDLE_BEGIN
     bool wrap_x = false;
     bool wrap_y = false;
+    ConvolveMethod method = CM_AUTO;
     switch (lua_gettop(L)) {
+        case 5: method = convolve_method_from_string(luaL_checkstring(L, 5)); __attribute__((fallthrough));
         case 4: wrap_y = check_bool(L, 4); __attribute__((fallthrough));
         case 3: wrap_x = check_bool(L, 3); __attribute__((fallthrough));
         case 2: break;
         default: 
-        my_lua_error(L, "image_convolve takes 2, 3, or 4 arguments");
+        my_lua_error(L, "image_convolve takes 2, 3, 4, or 5 arguments");
     }
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    ImageBase *kernel = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
+    ImageBase *kernel = check_image(L, 2);
     if (kernel->channels() != 1) {
         my_lua_error(L, "Convolution kernel must have only 1 channel.");
     }
@@ -1750,12 +2665,14 @@ static int image_convolve (lua_State *L)
     if (kernel->height % 2 != 1) {
         my_lua_error(L, "Convolution kernel height must be an odd number.");
     }
-    push_image(L, self->convolve(kern, wrap_x, wrap_y));
+    push_image(L, self->convolve(kern, wrap_x, wrap_y, method));
     return 1;
+HANDLE_END
 }
 
 static int image_convolve_sep (lua_State *L)
 {
+HANDLE_BEGIN
     bool wrap_x = false;
     bool wrap_y = false;
     switch (lua_gettop(L)) {
@@ -1765,8 +2682,8 @@ static int image_convolve_sep (lua_State *L)
         default: 
         my_lua_error(L, "image_convolve_sep takes 2, 3, or 4 arguments");
     }
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-    ImageBase *kernel_x = check_ptr<ImageBase>(L, 2, IMAGE_TAG);
+    ImageBase *self = check_image_or_planar(L, 1);
+    ImageBase *kernel_x = check_image(L, 2);
     if (kernel_x->channels() != 1) {
         my_lua_error(L, "Separable convolution kernel must have only 1 channel.");
     }
@@ -1780,21 +2697,31 @@ static int image_convolve_sep (lua_State *L)
     if (kern_x->height != 1) {
         my_lua_error(L, "Separable convolution kernel height must be 1.");
     }
-    Image<1,0> *kern_y = kern_x->rotate(90,NULL);
-    ImageBase *nu = self->convolve(kern_x, wrap_x, wrap_y);
-    ImageBase *nu2 = nu->convolve(kern_y, wrap_x, wrap_y);
-    delete nu;
-    delete kern_y;
-    push_image(L, nu2);
+    push_image(L, self->convolveSep(kern_x, wrap_x, wrap_y));
     return 1;
+HANDLE_END
 }
 
 static int image_normalise (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,1);
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
     push_image(L, self->normalise());
     return 1;
+HANDLE_END
+}
+
+static int image_normalise_in_place (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L,1);
+    ImageBase *self = check_image_for_write(L, 1);
+    prepare_write(self);
+    self->normaliseInPlace();
+    lua_pushvalue(L, 1);
+    return 1;
+HANDLE_END
 }
 
 DitherAlgorithm dither_algorithm_from_string (const std::string &s)
@@ -1807,38 +2734,195 @@ DitherAlgorithm dither_algorithm_from_string (const std::string &s)
 
 static int image_quantise (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,3);
     if (lua_gettop(L) < 2 || lua_gettop(L) > 3)
         my_lua_error(L, "image_quantise takes 2 or 3 arguments");
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
     DitherAlgorithm dither = dither_algorithm_from_string(luaL_checkstring(L, 2));
     ColourBase *res = alloc_colour(L, self->channels(), self->hasAlpha(), 3);
     push_image(L, self->quantise(dither, res));
     delete res;
     return 1;
+HANDLE_END
+}
+
+static int image_quantise_in_place (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L,3);
+    ImageBase *self = check_image_for_write(L, 1);
+    DitherAlgorithm dither = dither_algorithm_from_string(luaL_checkstring(L, 2));
+    ColourBase *res = alloc_colour(L, self->channels(), self->hasAlpha(), 3);
+    prepare_write(self);
+    self->quantiseInPlace(dither, res);
+    delete res;
+    lua_pushvalue(L, 1);
+    return 1;
+HANDLE_END
+}
+
+static void push_integral (lua_State *L, IntegralImage *integral)
+{
+    void **self_ptr = static_cast<void**>(lua_newuserdata(L, sizeof(*self_ptr)));
+    lua_extmemburden(L, integral->numBytes());
+    *self_ptr = integral;
+    luaL_getmetatable(L, INTEGRAL_TAG);
+    lua_setmetatable(L, -2);
+}
+
+static int integral_gc (lua_State *L)
+{ 
+    check_args(L, 1); 
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    lua_extmemburden(L, -(long)self->numBytes());
+    delete self; 
+    return 0; 
+}
+
+static int integral_eq (lua_State *L)
+{
+    check_args(L, 2); 
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    IntegralImage *that = check_ptr<IntegralImage>(L, 2, INTEGRAL_TAG);
+    lua_pushboolean(L, self==that); 
+    return 1; 
+}
+
+static int integral_tostring (lua_State *L)
+{
+    check_args(L,1);
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    std::stringstream ss;
+    ss << *self;
+    push_string(L, ss.str());
+    return 1;
+}
+
+static int integral_sum_common (lua_State *L, bool mean)
+{
+HANDLE_BEGIN
+    check_args(L, 3);
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    simglen_t left, bottom;
+    check_scoord(L, 2, left, bottom);
+    uimglen_t width, height;
+    check_coord(L, 3, width, height);
+    double sum[4];
+    unsigned long n = self->sum(left, bottom, width, height, sum);
+    if (mean) {
+        if (n == 0) my_lua_error(L, "Mean of a rectangle that is not on the image.");
+        for (chan_t c=0 ; c<self->channels ; ++c) sum[c] /= n;
+    }
+    push_channels(L, sum, self->channels);
+    return 1;
+HANDLE_END
+}
+
+static int integral_sum (lua_State *L)
+{
+    return integral_sum_common(L, false);
+}
+
+static int integral_mean (lua_State *L)
+{
+    return integral_sum_common(L, true);
+}
+
+static int integral_box_blur (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 2);
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    uimglen_t radius = check_int(L, 2, 0, std::numeric_limits<uimglen_t>::max());
+    push_image(L, self->boxBlur(radius));
+    return 1;
+HANDLE_END
+}
+
+static int integral_blur (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 2);
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    ImageBase *radii = check_image(L, 2);
+    if (radii->channels() != 1) my_lua_error(L, "Radii must be a 1 channel image.");
+    if (radii->width != self->width || radii->height != self->height)
+        my_lua_error(L, "Radii must be the same size as the image.");
+    push_image(L, self->blur(static_cast<Image<1,0>*>(radii)));
+    return 1;
+HANDLE_END
+}
+
+static int integral_index (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L,2);
+    IntegralImage *self = check_ptr<IntegralImage>(L, 1, INTEGRAL_TAG);
+    const char *key = luaL_checkstring(L, 2);
+    if (!::strcmp(key, "width")) {
+        lua_pushnumber(L, self->width);
+    } else if (!::strcmp(key, "height")) {
+        lua_pushnumber(L, self->height);
+    } else if (!::strcmp(key, "size")) {
+        lua_pushvector2(L, self->width, self->height);
+    } else if (!::strcmp(key, "channels")) {
+        lua_pushnumber(L, self->channels);
+    } else if (!::strcmp(key, "hasAlpha")) {
+        lua_pushboolean(L, self->alpha);
+    } else if (!::strcmp(key, "numBytes")) {
+        lua_pushnumber(L, self->numBytes());
+    } else if (!::strcmp(key, "sum")) {
+        lua_pushcfunction(L, integral_sum);
+    } else if (!::strcmp(key, "mean")) {
+        lua_pushcfunction(L, integral_mean);
+    } else if (!::strcmp(key, "boxBlur")) {
+        lua_pushcfunction(L, integral_box_blur);
+    } else if (!::strcmp(key, "blur")) {
+        lua_pushcfunction(L, integral_blur);
+    } else {
+        my_lua_error(L, "Not a readable IntegralImage field: \""+std::string(key)+"\"");
+    }
+    return 1;
+HANDLE_END
+}
+
+const luaL_reg integral_meta_table[] = {
+    {"__tostring", integral_tostring},
+    {"__gc",       integral_gc},
+    {"__index",    integral_index},
+    {"__eq",       integral_eq},
+
+    {NULL, NULL}
+};
+
+static int image_integral (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 1);
+    ImageBase *self = check_image(L, 1);
+    push_integral(L, new IntegralImage(self));
+    return 1;
+HANDLE_END
+}
+
+static int image_box_blur (lua_State *L)
+{
+HANDLE_BEGIN
+    check_args(L, 2);
+    ImageBase *self = check_image(L, 1);
+    uimglen_t radius = check_int(L, 2, 0, std::numeric_limits<uimglen_t>::max());
+    IntegralImage integral(self);
+    push_image(L, integral.boxBlur(radius));
+    return 1;
+HANDLE_END
 }
 
 template<chan_t sch, chan_t scha, chan_t dch, chan_t dcha>
 ImageBase *image_swizzle3 (const Image<sch,scha> *src, int *mapping)
 {
-    Image<dch,dcha> *dst = new Image<dch,dcha>(src->width, src->height);
-    for (uimglen_t y=0 ; y<src->height ; ++y) {
-        for (uimglen_t x=0 ; x<src->width ; ++x) {
-            for (chan_t c=0 ; c<dch+dcha ; ++c) {
-                switch (mapping[c]) {
-                    case -1:
-                    dst->pixel(x,y)[c] = 0;
-                    break;
-                    case -2:
-                    dst->pixel(x,y)[c] = 1;
-                    break;
-                    default:
-                    dst->pixel(x,y)[c] = src->pixel(x,y)[mapping[c]];
-                }
-            }
-        }
-    }
-    return dst;
+    auto *e = new ImageExprView<dch,dcha,sch,scha>(src, 0, 0, src->height, NULL, false, false, mapping);
+    return new Image<dch,dcha>(src->width, src->height, e);
 }
         
 template<chan_t sch, chan_t scha>
@@ -1870,9 +2954,18 @@ static ImageBase *image_swizzle (const ImageBase *img, chan_t ch2, bool a2, int
 
 static int image_index (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,2);
     ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
     const char *key = luaL_checkstring(L, 2);
+    if (!::strcmp(key, "freed")) {
+        lua_pushboolean(L, self == NULL);
+        return 1;
+    } else if (!::strcmp(key, "free")) {
+        lua_pushcfunction(L, image_free);
+        return 1;
+    }
+    if (self == NULL) my_lua_error(L, "Image has been freed.");
     if (!::strcmp(key, "allChannels")) {
         lua_pushnumber(L, self->channels());
     } else if (!::strcmp(key, "colourChannels")) {
@@ -1887,14 +2980,28 @@ static int image_index (lua_State *L)
         lua_pushvector2(L, self->width, self->height);
     } else if (!::strcmp(key, "numPixels")) {
         lua_pushnumber(L, self->numPixels());
+    } else if (!::strcmp(key, "numBytes")) {
+        lua_pushnumber(L, self->numBytes());
+    } else if (!::strcmp(key, "storage")) {
+        lua_pushstring(L, pixel_storage_to_string(self->pixelStorage()));
     } else if (!::strcmp(key, "save")) {
         lua_pushcfunction(L, image_save);
     } else if (!::strcmp(key, "foreach")) {
         lua_pushcfunction(L, image_foreach);
+    } else if (!::strcmp(key, "foreachRow")) {
+        lua_pushcfunction(L, image_foreach_row);
     } else if (!::strcmp(key, "map")) {
         lua_pushcfunction(L, image_map);
+    } else if (!::strcmp(key, "mapRows")) {
+        lua_pushcfunction(L, image_map_rows);
+    } else if (!::strcmp(key, "mapParallel")) {
+        lua_pushcfunction(L, image_map_parallel);
+    } else if (!::strcmp(key, "eval")) {
+        lua_pushcfunction(L, image_eval);
     } else if (!::strcmp(key, "reduce")) {
         lua_pushcfunction(L, image_reduce);
+    } else if (!::strcmp(key, "reduceRows")) {
+        lua_pushcfunction(L, image_reduce_rows);
     } else if (!::strcmp(key, "crop")) {
         lua_pushcfunction(L, image_crop);
     } else if (!::strcmp(key, "cropCentre")) {
@@ -1905,8 +3012,18 @@ static int image_index (lua_State *L)
         lua_pushcfunction(L, image_scale_by);
     } else if (!::strcmp(key, "rotate")) {
         lua_pushcfunction(L, image_rotate);
+    } else if (!::strcmp(key, "rotate90")) {
+        lua_pushcfunction(L, image_rotate90);
+    } else if (!::strcmp(key, "transpose")) {
+        lua_pushcfunction(L, image_transpose);
+    } else if (!::strcmp(key, "integral")) {
+        lua_pushcfunction(L, image_integral);
+    } else if (!::strcmp(key, "boxBlur")) {
+        lua_pushcfunction(L, image_box_blur);
     } else if (!::strcmp(key, "clone")) {
         lua_pushcfunction(L, image_clone);
+    } else if (!::strcmp(key, "pack")) {
+        lua_pushcfunction(L, image_pack);
     } else if (!::strcmp(key, "flip")) {
         lua_pushcfunction(L, image_flip);
     } else if (!::strcmp(key, "mirror")) {
@@ -1915,24 +3032,56 @@ static int image_index (lua_State *L)
         lua_pushcfunction(L, image_rms_diff);
     } else if (!::strcmp(key, "meanDiff")) {
         lua_pushcfunction(L, image_mean_diff);
+    } else if (!::strcmp(key, "sum")) {
+        lua_pushcfunction(L, image_sum);
+    } else if (!::strcmp(key, "mean")) {
+        lua_pushcfunction(L, image_mean);
+    } else if (!::strcmp(key, "minimum")) {
+        lua_pushcfunction(L, image_minimum);
+    } else if (!::strcmp(key, "maximum")) {
+        lua_pushcfunction(L, image_maximum);
+    } else if (!::strcmp(key, "variance")) {
+        lua_pushcfunction(L, image_variance);
+    } else if (!::strcmp(key, "histogram")) {
+        lua_pushcfunction(L, image_histogram);
+    } else if (!::strcmp(key, "percentile")) {
+        lua_pushcfunction(L, image_percentile);
+    } else if (!::strcmp(key, "median")) {
+        lua_pushcfunction(L, image_median);
+    } else if (!::strcmp(key, "autoLevels")) {
+        lua_pushcfunction(L, image_auto_levels);
+    } else if (!::strcmp(key, "autoExposure")) {
+        lua_pushcfunction(L, image_auto_exposure);
     } else if (!::strcmp(key, "abs")) {
         lua_pushcfunction(L, image_abs);
+    } else if (!::strcmp(key, "absInPlace")) {
+        lua_pushcfunction(L, image_abs_in_place);
+    } else if (!::strcmp(key, "negateInPlace")) {
+        lua_pushcfunction(L, image_negate_in_place);
     } else if (!::strcmp(key, "max")) {
         lua_pushcfunction(L, image_max);
     } else if (!::strcmp(key, "min")) {
         lua_pushcfunction(L, image_min);
     } else if (!::strcmp(key, "clamp")) {
         lua_pushcfunction(L, image_clamp);
+    } else if (!::strcmp(key, "clampInPlace")) {
+        lua_pushcfunction(L, image_clamp_in_place);
     } else if (!::strcmp(key, "gamma")) {
         lua_pushcfunction(L, image_gamma);
+    } else if (!::strcmp(key, "gammaInPlace")) {
+        lua_pushcfunction(L, image_gamma_in_place);
     } else if (!::strcmp(key, "convolve")) {
         lua_pushcfunction(L, image_convolve);
     } else if (!::strcmp(key, "convolveSep")) {
         lua_pushcfunction(L, image_convolve_sep);
     } else if (!::strcmp(key, "normalise")) {
         lua_pushcfunction(L, image_normalise);
+    } else if (!::strcmp(key, "normaliseInPlace")) {
+        lua_pushcfunction(L, image_normalise_in_place);
     } else if (!::strcmp(key, "quantise")) {
         lua_pushcfunction(L, image_quantise);
+    } else if (!::strcmp(key, "quantiseInPlace")) {
+        lua_pushcfunction(L, image_quantise_in_place);
     } else if (!::strcmp(key, "draw")) {
         lua_pushcfunction(L, image_draw);
     } else if (!::strcmp(key, "drawLine")) {
@@ -1974,6 +3123,7 @@ static int image_index (lua_State *L)
                 }
             }
             if (swizzle) {
+                self = check_image(L, 1);
                 push_image(L, image_swizzle(self, nu_chans, has_alpha, mapping));
                 return 1;
             } else {
@@ -1985,10 +3135,12 @@ static int image_index (lua_State *L)
         }
     }
     return 1;
+HANDLE_END
 }
 
 static int image_call (lua_State *L)
 {
+HANDLE_BEGIN
     uimglen_t x;
     uimglen_t y;
     switch (lua_gettop(L)) {
@@ -2003,7 +3155,7 @@ static int image_call (lua_State *L)
         my_lua_error(L, "Only allowed: image(x,y) or image(vector2(x,y))");
         return 1;
     }
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
 
     if (x>=self->width || y>=self->height) {
         std::stringstream ss;
@@ -2012,50 +3164,65 @@ static int image_call (lua_State *L)
     }
     push_colour(L, self->channels(), self->hasAlpha(), self->pixelSlow(x,y));
     return 1;
+HANDLE_END
 }
 
 static int image_add (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<op_add>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_sub (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<op_sub>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_mul (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<op_mul>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_div (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<op_div>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_pow (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_zip_lua1<powf>(L));
     return 1;
+HANDLE_END
 }
 
 static int image_concat (lua_State *L)
 {
+HANDLE_BEGIN
     push_image(L, image_blend_lua1(L));
     return 1;
+HANDLE_END
 }
 
 static int image_unm (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,2); // quirk of lua -- takes 2 even though 1 is unused
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image_or_planar(L, 1);
     push_image(L, self->unm());
     return 1;
+HANDLE_END
 }
 
 
@@ -2077,6 +3244,47 @@ const luaL_reg image_meta_table[] = {
     {NULL, NULL}
 };
 
+// In the worker states of mapParallel and makeParallel, the images (copies of upvalues) can only be
+// read, so that those threads never create, modify or free lazy images or pixels of their own.
+static int image_refuse_in_worker (lua_State *L)
+{
+    my_lua_error(L, "Images cannot be created or modified inside mapParallel or makeParallel.");
+    return 0;
+}
+
+static int image_index_worker (lua_State *L)
+{
+    check_args(L,2);
+    const char *key = luaL_checkstring(L, 2);
+    static const char *const readable[] = {
+        "freed", "allChannels", "colourChannels", "hasAlpha", "width", "height", "size",
+        "numPixels", "numBytes", "storage", NULL
+    };
+    for (const char *const *r = readable ; *r != NULL ; ++r) {
+        if (!::strcmp(key, *r)) return image_index(L);
+    }
+    my_lua_error(L, "Image field \""+std::string(key)+"\" is not available inside mapParallel or "
+                    "makeParallel, where images can only be read.");
+    return 1;
+}
+
+const luaL_reg worker_image_meta_table[] = {
+    {"__tostring", image_tostring},
+    {"__gc",       image_gc},
+    {"__index",    image_index_worker},
+    {"__eq",       image_eq},
+    {"__call",     image_call},
+    {"__mul",      image_refuse_in_worker},
+    {"__unm",      image_refuse_in_worker},
+    {"__add",      image_refuse_in_worker},
+    {"__sub",      image_refuse_in_worker},
+    {"__div",      image_refuse_in_worker},
+    {"__pow",      image_refuse_in_worker},
+    {"__concat",   image_refuse_in_worker},
+
+    {NULL, NULL}
+};
+
 
 
 
@@ -2172,10 +3380,58 @@ const luaL_reg vimage_meta_table[] = {
 
 
 template<chan_t ch, chan_t ach>
-ImageBase *image_from_lua_func (lua_State *L, uimglen_t width, uimglen_t height, int func_index)
+ImageBase *image_from_lua_workers (lua_State *L, uimglen_t width, uimglen_t height, int func_index)
+{
+    LuaWorkers workers(L, func_index, width, height);
+    Image<ch,ach> *my_image = new Image<ch,ach>(width, height);
+    try {
+        lua_workers_rows(workers, width, height, [&] (lua_State *W, uimglen_t y0, uimglen_t y1) {
+            for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                for (uimglen_t x=0 ; x<width ; ++x) {
+                    lua_pushvalue(W, 1);
+                    lua_pushvector2(W, x, y);
+                    if (lua_pcall(W, 1, 1, 0) != 0)
+                        EXCEPT << "While initialising the image at (" << x << "," << y << "): " << lua_tostring(W, -1) << ENDL;
+                    if (!check_colour(W, my_image->pixel(x,y), -1))
+                        EXCEPT << "While initialising the image at (" << x << "," << y << "): returned value had bad type: " << type_name(W, -1) << ENDL;
+                    lua_pop(W, 1);
+                }
+            }
+        });
+    } catch (...) {
+        delete my_image;
+        throw;
+    }
+    return my_image;
+}
+
+template<chan_t ch, chan_t ach>
+ImageBase *image_from_lua_func (lua_State *L, uimglen_t width, uimglen_t height, int func_index, bool rows, bool parallel)
 {
+    if (parallel) return image_from_lua_workers<ch,ach>(L, width, height, func_index);
     Image<ch,ach> *my_image = new Image<ch,ach>(width, height);
     for (uimglen_t y=0 ; y<height ; ++y) {
+        if (rows) {
+            // The function fills in the output table, which is kept below it on the stack.
+            lua_createtable(L, width, 0);
+            lua_pushvalue(L, func_index);
+            lua_pushnumber(L, y);
+            lua_pushvalue(L, -3);
+            int status = lua_pcall(L, 2, 0, 0);
+            if (status != 0) {
+                const char *msg = lua_tostring(L, -1);
+                delete my_image;
+                my_lua_error(L, "While initialising row "+str(y)+" of the image: "+str(msg));
+            }
+            uimglen_t x = check_row(L, -1, &my_image->pixel(0,y), width);
+            if (x < width) {
+                delete my_image;
+                my_lua_error(L, "While initialising the image at ("+str(x)+","+str(y)+"): "
+                                "output value had bad type: "+type_name(L,-1));
+            }
+            lua_pop(L, 1);
+            continue;
+        }
         for (uimglen_t x=0 ; x<width ; ++x) {
             lua_pushvalue(L, func_index);
             lua_pushvector2(L, x, y);
@@ -2252,6 +3508,7 @@ void pascals_triangle_shutdown (void)
 
 static int global_gaussian (lua_State *L)
 {
+HANDLE_BEGIN
     check_args(L,1);
     uimglen_t size = check_int(L, 1, 1, pascal_lines);
     Image<1,0> *my_image = new Image<1,0>(size, 1);
@@ -2261,10 +3518,12 @@ static int global_gaussian (lua_State *L)
     push_image(L, my_image->normalise());
     delete my_image;
     return 1;
+HANDLE_END
 }
 
-static int global_make (lua_State *L)
+static int global_make_common (lua_State *L, bool rows, bool parallel)
 {
+HANDLE_BEGIN
     uimglen_t w, h;
     chan_t channels;
     bool alpha = false;
@@ -2281,6 +3540,7 @@ static int global_make (lua_State *L)
         channels = check_int(L, 2, 1, 4);
         ii = 3;
     }
+    if (rows || parallel) check_is_function(L, ii);
     if (alpha) channels++;
 
     ImageBase *image = NULL;
@@ -2288,10 +3548,10 @@ static int global_make (lua_State *L)
     switch (lua_type(L, ii)) {
         case LUA_TFUNCTION: {
             switch (channels) {
-                case 1: image = image_from_lua_func<1,0>(L,w,h,ii); break;
-                case 2: image = alpha ? image_from_lua_func<1,1>(L,w,h,ii) : image_from_lua_func<2,0>(L,w,h,ii); break;
-                case 3: image = alpha ? image_from_lua_func<2,1>(L,w,h,ii) : image_from_lua_func<3,0>(L,w,h,ii); break;
-                case 4: image = alpha ? image_from_lua_func<3,1>(L,w,h,ii) : image_from_lua_func<4,0>(L,w,h,ii); break;
+                case 1: image = image_from_lua_func<1,0>(L,w,h,ii,rows,parallel); break;
+                case 2: image = alpha ? image_from_lua_func<1,1>(L,w,h,ii,rows,parallel) : image_from_lua_func<2,0>(L,w,h,ii,rows,parallel); break;
+                case 3: image = alpha ? image_from_lua_func<2,1>(L,w,h,ii,rows,parallel) : image_from_lua_func<3,0>(L,w,h,ii,rows,parallel); break;
+                case 4: image = alpha ? image_from_lua_func<3,1>(L,w,h,ii,rows,parallel) : image_from_lua_func<4,0>(L,w,h,ii,rows,parallel); break;
                 default: my_lua_error(L, "Internal error");
             }
         }
@@ -2322,14 +3582,72 @@ static int global_make (lua_State *L)
 
     push_image(L, image);
     return 1;
+HANDLE_END
+}
+
+static int global_make (lua_State *L)
+{
+    return global_make_common(L, false, false);
+}
+
+static int global_make_rows (lua_State *L)
+{
+    return global_make_common(L, true, false);
+}
+
+static int global_make_parallel (lua_State *L)
+{
+    return global_make_common(L, false, true);
+}
+
+static int global_eval (lua_State *L)
+{
+HANDLE_BEGIN
+    if (lua_gettop(L) < 2 || lua_gettop(L) > 4) my_lua_error(L, "Wrong number of arguments to eval.");
+    uimglen_t w, h;
+    check_coord(L, 1, w, h);
+    std::string src = luaL_checkstring(L, 2);
+    bool alpha = lua_gettop(L) >= 3 && check_bool(L, 3);
+    PixelExpr e(src, check_pixel_expr_constants(L, 4), 0);
+    push_image(L, pixel_expr_image(e, NULL, w, h, alpha));
+    return 1;
+HANDLE_END
 }
 
 static int global_open (lua_State *L)
 {
 HANDLE_BEGIN
-    check_args(L,1);
-    std::string filename = luaL_checkstring(L,1);
-    ImageBase *image = image_load(filename);
+    std::string filename;
+    ImageBase *image;
+    switch (lua_gettop(L)) {
+        case 1:
+        case 2: {
+            filename = luaL_checkstring(L,1);
+            bool map = false;
+            bool packed = false;
+            if (lua_gettop(L) == 2) {
+                if (lua_type(L, 2) == LUA_TSTRING) {
+                    std::string mode = lua_tostring(L, 2);
+                    if (mode == "PACKED") {
+                        packed = true;
+                    } else {
+                        EXCEPT << "Expected PACKED.  Got: \"" << mode << "\"" << ENDL;
+                    }
+                } else {
+                    map = check_bool(L, 2);
+                }
+            }
+            image = image_load(filename, map, packed);
+        } break;
+        case 3: {
+            filename = luaL_checkstring(L,1);
+            uimglen_t left, bottom, width, height;
+            check_coord(L, 2, left, bottom);
+            check_coord(L, 3, width, height);
+            image = image_load_region(filename, left, bottom, width, height);
+        } break;
+        default: my_lua_error(L, "open() takes 1, 2, or 3 arguments.");
+    }
     if (image == NULL) {
         lua_pushnil(L);
     } else {
@@ -2385,34 +3703,39 @@ HANDLE_END
 static int global_mipmaps (lua_State *L)
 {
 HANDLE_BEGIN
-    ImageBase *self;
+    unsigned args = lua_gettop(L);
+    if (args < 1) my_lua_error(L, "Expected at least 1 arg.");
+    ImageBase *self = check_image(L, 1);
     ScaleFilter scale_filter = SF_BOX;
-    switch (lua_gettop(L)) {
-        case 2:
-        scale_filter = scale_filter_from_string(luaL_checkstring(L, 2));
-        __attribute__((fallthrough));
-        case 1:
-        self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
-        break;
-        default: my_lua_error(L, "Expected 1 or 2 args.");
+    if (args >= 2) scale_filter = scale_filter_from_string(luaL_checkstring(L, 2));
+    bool linear = false;
+    bool preserve_coverage = false;
+    float alpha_ref = 0.5;
+    for (unsigned i=3 ; i<=args ; ++i) {
+        std::string flag = luaL_checkstring(L, i);
+        if (flag == "LINEAR") {
+            linear = true;
+        } else if (flag == "ALPHA_COVERAGE") {
+            if (!self->hasAlpha()) EXCEPT << "ALPHA_COVERAGE needs an image with alpha." << ENDL;
+            preserve_coverage = true;
+            if (i < args && lua_type(L, i+1) == LUA_TNUMBER) {
+                alpha_ref = lua_tonumber(L, ++i);
+            }
+        } else {
+            EXCEPT << "Unrecognised mipmaps flag: " << flag << ENDL;
+        }
     }
-    unsigned counter = 1;
+
+    std::vector<ImageBase*> levels = image_mipmaps(self, scale_filter, linear, preserve_coverage, alpha_ref);
+
     lua_newtable(L);
     int table_index = lua_gettop(L);
-
     lua_pushvalue(L, 1);
-    ImageBase *last = self;
-    uimglen_t width = last->width;
-    uimglen_t height = last->height;
-    lua_rawseti(L, table_index, counter++);
-
-    do {
-        width = last->width == 1 ? 1 : last->width / 2;
-        height = last->height == 1 ? 1 : last->height / 2;
-        last = last->scale(width, height, scale_filter);
-        push_image(L, last);
-        lua_rawseti(L, table_index, counter++);
-    } while (height > 1 || width > 1);
+    lua_rawseti(L, table_index, 1);
+    for (unsigned i=0 ; i<levels.size() ; ++i) {
+        push_image(L, levels[i]);
+        lua_rawseti(L, table_index, i + 2);
+    }
 
     return 1;
 HANDLE_END
@@ -2459,12 +3782,12 @@ static ImageBases get_image_vector (lua_State *L, int table_index)
                 lua_pop(L, 1);
                 break;
             }
-            imgs.push_back(check_ptr<ImageBase>(L, -1, IMAGE_TAG));
+            imgs.push_back(check_image(L, -1));
             lua_pop(L, 1);
             counter++;
         }
     } else {
-        imgs.push_back(check_ptr<ImageBase>(L, table_index, IMAGE_TAG));
+        imgs.push_back(check_image(L, table_index));
     }
     if (imgs.size() == 0) {
         my_lua_error(L, "Table had no elements.");
@@ -2604,6 +3927,14 @@ HANDLE_BEGIN
 HANDLE_END
 }
 
+// Block compression throughput (blocks per second), and the number of blocks compressed.
+static int push_dds_encode_stats (lua_State *L, const DDSEncodeStats &stats)
+{
+    lua_pushnumber(L, stats.seconds > 0 ? stats.blocks / stats.seconds : 0);
+    lua_pushnumber(L, stats.blocks);
+    return 2;
+}
+
 static int global_dds_save_simple (lua_State *L)
 {
 HANDLE_BEGIN
@@ -2617,8 +3948,7 @@ HANDLE_BEGIN
     content.kind = DDS_SIMPLE;
     content.simple = get_image_vector(L, 3);
     int squish_flags = get_squish_flags(L, 4);
-    dds_save(filename, format, content, squish_flags);
-    return 0;
+    return push_dds_encode_stats(L, dds_save(filename, format, content, squish_flags));
 HANDLE_END
 }
 
@@ -2640,8 +3970,7 @@ HANDLE_BEGIN
     content.cube.Z = get_image_vector(L, 7);
     content.cube.z = get_image_vector(L, 8);
     int squish_flags = get_squish_flags(L, 9);
-    dds_save(filename, format, content, squish_flags);
-    return 0;
+    return push_dds_encode_stats(L, dds_save(filename, format, content, squish_flags));
 HANDLE_END
 }
 
@@ -2680,8 +4009,7 @@ HANDLE_BEGIN
     if (content.volume.size() == 0) {
         my_lua_error(L, "Expected at least one mipmap when saving "+filename+".");
     }
-    dds_save(filename, format, content, squish_flags);
-    return 0;
+    return push_dds_encode_stats(L, dds_save(filename, format, content, squish_flags));
 HANDLE_END
 }
 
@@ -2899,12 +4227,73 @@ static int global_seconds (lua_State *L)
     return 1;
 }
 
+static int global_threads (lua_State *L)
+{
+    if (lua_gettop(L) == 1) {
+        parallel_set_threads(check_int(L, 1, 0, 1024));
+    } else {
+        check_args(L,0);
+    }
+    lua_pushnumber(L, parallel_get_threads());
+    return 1;
+}
+
+static int global_memory_budget (lua_State *L)
+{
+    if (lua_gettop(L) == 1) {
+        lua_Number budget = luaL_checknumber(L, 1);
+        if (budget < 0) my_lua_error(L, "Memory budget must not be negative.");
+        pixel_pool_set_budget(size_t(budget));
+    } else {
+        check_args(L,0);
+    }
+    lua_pushnumber(L, pixel_pool_get_budget());
+    return 1;
+}
+
+static int global_memory_high_water (lua_State *L)
+{
+    if (lua_gettop(L) == 1) {
+        lua_Number high_water = luaL_checknumber(L, 1);
+        if (high_water < 0) my_lua_error(L, "Memory high water mark must not be negative.");
+        pixel_pool_set_high_water(size_t(high_water));
+    } else {
+        check_args(L,0);
+    }
+    lua_pushnumber(L, pixel_pool_get_high_water());
+    return 1;
+}
+
+static int global_memory_stats (lua_State *L)
+{
+    check_args(L,0);
+    PixelPoolStats stats = pixel_pool_stats();
+    lua_createtable(L, 0, 8);
+    lua_pushnumber(L, stats.live);
+    lua_setfield(L, -2, "live");
+    lua_pushnumber(L, stats.peak);
+    lua_setfield(L, -2, "peak");
+    lua_pushnumber(L, stats.cached);
+    lua_setfield(L, -2, "cached");
+    lua_pushnumber(L, stats.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, stats.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, stats.collections);
+    lua_setfield(L, -2, "collections");
+    lua_pushnumber(L, pixel_pool_get_budget());
+    lua_setfield(L, -2, "budget");
+    lua_pushnumber(L, pixel_pool_get_high_water());
+    lua_setfield(L, -2, "highWater");
+    return 1;
+}
+
 /*
 static int global_make_voxel (lua_State *L)
 {
     check_args(L,2);
 
-    ImageBase *self = check_ptr<ImageBase>(L, 1, IMAGE_TAG);
+    ImageBase *self = check_image(L, 1);
     uimglen_t depth = check_t<uimglen_t>(L, 2);
     
 
@@ -2921,6 +4310,9 @@ static int global_make_voxel (lua_State *L)
 
 static const luaL_reg global[] = {
     {"make", global_make},
+    {"makeRows", global_make_rows},
+    {"makeParallel", global_make_parallel},
+    {"eval", global_eval},
     {"open", global_open},
     {"text_codepoint", global_text_codepoint},
     {"text", global_text},
@@ -2942,20 +4334,48 @@ static const luaL_reg global[] = {
     {"colour", global_colour},
     {"gaussian", global_gaussian},
     {"seconds", global_seconds},
+    {"threads", global_threads},
+    {"memory_budget", global_memory_budget},
+    {"memory_high_water", global_memory_high_water},
+    {"memory_stats", global_memory_stats},
  //   {"make_voxel", global_make_voxel},
 
     {NULL, NULL}
 };
 
 
-void lua_wrappers_image_init (lua_State *L)
+// The globals of worker states that neither create nor modify images.
+static const char *const worker_globals[] = {
+    "RGBtoHSL", "HSLtoRGB", "HSVtoHSL", "HSLtoHSV", "RGBtoHSV", "HSVtoRGB", "colour", "seconds", NULL
+};
+
+static int global_refuse_in_worker (lua_State *L)
 {
-    pascals_triangle_init();
+    my_lua_error(L, std::string(lua_tostring(L, lua_upvalueindex(1)))
+                    + " cannot be used inside mapParallel or makeParallel.");
+    return 0;
+}
+
+static int global_lerp_worker (lua_State *L)
+{
+    for (int i=1 ; i<=lua_gettop(L) ; ++i) {
+        if (is_ptr(L, i, IMAGE_TAG)) return image_refuse_in_worker(L);
+    }
+    return global_lerp(L);
+}
 
+void lua_wrappers_image_open (lua_State *L, bool worker)
+{
     luaL_newmetatable(L, IMAGE_TAG);
-    luaL_register(L, NULL, image_meta_table);
+    luaL_register(L, NULL, worker ? worker_image_meta_table : image_meta_table);
     lua_pop(L,1);
 
+    if (!worker) {
+        luaL_newmetatable(L, INTEGRAL_TAG);
+        luaL_register(L, NULL, integral_meta_table);
+        lua_pop(L,1);
+    }
+
 /*
     luaL_newmetatable(L, VIMAGE_TAG);
     luaL_register(L, NULL, vimage_meta_table);
@@ -2964,10 +4384,36 @@ void lua_wrappers_image_init (lua_State *L)
 
     luaL_register(L, "_G", global);
     lua_pop(L, 1);
+
+    if (worker) {
+        for (const luaL_reg *r = global ; r->name != NULL ; ++r) {
+            const char *const *w = worker_globals;
+            while (*w != NULL && ::strcmp(*w, r->name)) ++w;
+            if (*w != NULL) continue;
+            if (!::strcmp(r->name, "lerp")) {
+                lua_pushcfunction(L, global_lerp_worker);
+            } else {
+                lua_pushstring(L, r->name);
+                lua_pushcclosure(L, global_refuse_in_worker, 1);
+            }
+            lua_setglobal(L, r->name);
+        }
+    }
+}
+
+void lua_wrappers_image_init (lua_State *L)
+{
+    pascals_triangle_init();
+
+    // Images waiting to be collected hold memory, see memory_high_water.
+    collector_state = L;
+    pixel_pool_set_collector([L] () { lua_gc(L, LUA_GCCOLLECT, 0); });
 }
 
 void lua_wrappers_image_shutdown (lua_State *L)
 {
     (void) L;
+    collector_state = NULL;
+    pixel_pool_set_collector(nullptr);
     pascals_triangle_shutdown();
 }
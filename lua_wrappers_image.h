@@ -32,9 +32,15 @@ extern "C" {
 
 #define IMAGE_TAG "Image"
 #define VIMAGE_TAG "VoxelImage"
+#define INTEGRAL_TAG "IntegralImage"
 
 void check_args (lua_State *L, int expected);
 
+/** Registers the image functions and metatable in L (done by init, and for worker states).  In a
+ * worker state images can only be read: the globals and methods that would create or modify one
+ * raise an error instead. */
+void lua_wrappers_image_open (lua_State *L, bool worker);
+
 void lua_wrappers_image_init (lua_State *L);
 void lua_wrappers_image_shutdown (lua_State *L);
 
@@ -37,6 +37,7 @@ extern "C" {
 
 #include "interpreter.h"
 #include "image.h"
+#include "parallel.h"
 #include "text.h"
 
 #define LUAIMG_VERSION "0.9"
@@ -57,6 +58,8 @@ const char *usage =
     "              | -F <file> | --File <file>       Short-hand for -f <file> --\n"
     "              | -i | --interactive              Enter interactive mode after processing -e and -f\n"
     "              | -p <str> | --prompt <str>       Override the interactive prompt (default \"luaimg> \")\n"
+    "              | -j <n> | --threads <n>          Use n threads for image processing (default 0, i.e. one\n"
+    "                                                per hardware thread)\n"
     "Scripts and snippets are executed in sequence.\n"
     "The non-option <arg> list is passed to the code via the Lua ... construct.\n"
 ;
@@ -105,6 +108,16 @@ int main (int argc, char **argv)
             interactive = true;
         } else if (arg=="-p" || arg=="--prompt") {
             prompt = next_arg(so_far,argc,argv);
+        } else if (arg=="-j" || arg=="--threads") {
+            std::string n = next_arg(so_far,argc,argv);
+            char *end;
+            long threads = strtol(n.c_str(), &end, 10);
+            if (n.empty() || *end != '\0' || threads < 0 || threads > 1024) {
+                std::cerr<<"ERROR: Invalid number of threads: \""<<n<<"\"\n"<<std::endl;
+                std::cerr<<usage<<std::endl;
+                exit(EXIT_FAILURE);
+            }
+            parallel_set_threads(threads);
         } else if (arg=="-f" || arg=="--file") {
             work.push_back(std::pair<FileOrSnippet,std::string>(F, next_arg(so_far,argc,argv)));
         } else if (arg=="-F" || arg=="--File") {
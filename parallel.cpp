@@ -0,0 +1,243 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+namespace {
+
+    typedef std::function<void(uint32_t, uint32_t)> Body;
+
+    // Set while the current thread is executing a band, so nested calls run serially.
+    thread_local bool inside_band = false;
+
+    unsigned default_threads (void)
+    {
+        unsigned n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : n;
+    }
+
+    class WorkerPool {
+
+        // Only one thread can have a job in the pool at a time.
+        std::mutex submitMutex;
+
+        // Guards everything below.
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable finished;
+
+        std::vector<std::thread> workers;
+        unsigned threads;
+        bool stopping;
+
+        // The current job.  Only modified while busy == 0, read by workers under the mutex.
+        const Body *body;
+        uint32_t height;
+        uint32_t bandSize;
+        uint32_t numBands;
+        std::atomic<uint32_t> nextBand;
+        uint32_t bandsLeft;
+        unsigned busy;
+        unsigned long generation;
+        std::exception_ptr error;
+
+        // Returns the number of bands completed by this thread.
+        uint32_t runBands (const Body &b, uint32_t h, uint32_t bs, uint32_t nb)
+        {
+            uint32_t done = 0;
+            inside_band = true;
+            while (true) {
+                uint32_t band = nextBand++;
+                if (band >= nb) break;
+                uint32_t y0 = band * bs;
+                uint32_t y1 = std::min(h, y0 + bs);
+                try {
+                    b(y0, y1);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                }
+                done++;
+            }
+            inside_band = false;
+            return done;
+        }
+
+        void workerMain (void)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            unsigned long seen = generation;
+            while (true) {
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                // The job may already have been finished by the other threads.
+                if (body == NULL) continue;
+                busy++;
+                const Body &b = *body;
+                uint32_t h = height, bs = bandSize, nb = numBands;
+                lock.unlock();
+                uint32_t done = runBands(b, h, bs, nb);
+                lock.lock();
+                bandsLeft -= done;
+                busy--;
+                if (bandsLeft == 0 && busy == 0) finished.notify_all();
+            }
+        }
+
+        void stopWorkers (void)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &w : workers) w.join();
+            workers.clear();
+            stopping = false;
+        }
+
+        void startWorkers (void)
+        {
+            for (unsigned i=1 ; i<threads ; ++i) {
+                workers.emplace_back(&WorkerPool::workerMain, this);
+            }
+        }
+
+        public:
+
+        WorkerPool (void)
+          : threads(default_threads()), stopping(false), body(NULL), height(0), bandSize(0),
+            numBands(0), nextBand(0), bandsLeft(0), busy(0), generation(0)
+        {
+        }
+
+        ~WorkerPool (void)
+        {
+            stopWorkers();
+        }
+
+        void setThreads (unsigned n)
+        {
+            std::lock_guard<std::mutex> lock(submitMutex);
+            if (n == 0) n = default_threads();
+            if (n == threads) return;
+            stopWorkers();
+            threads = n;
+            // Workers are started lazily by the next job.
+        }
+
+        unsigned getThreads (void)
+        {
+            std::lock_guard<std::mutex> lock(submitMutex);
+            return threads;
+        }
+
+        static bool serial (uint32_t h, unsigned long row_work)
+        {
+            return inside_band || h < 2 || h * row_work < PARALLEL_MIN_WORK;
+        }
+
+        unsigned concurrency (uint32_t h, unsigned long row_work)
+        {
+            if (serial(h, row_work)) return 1;
+            std::lock_guard<std::mutex> lock(submitMutex);
+            return std::min(h, threads);
+        }
+
+        void run (uint32_t h, unsigned long row_work, const Body &b)
+        {
+            if (h == 0) return;
+            if (serial(h, row_work)) {
+                b(0, h);
+                return;
+            }
+            std::unique_lock<std::mutex> submit(submitMutex, std::try_to_lock);
+            if (!submit.owns_lock() || threads <= 1) {
+                b(0, h);
+                return;
+            }
+            if (workers.size() + 1 != threads) startWorkers();
+
+            // A few bands per thread so that uneven rows balance out.
+            uint32_t bands = std::min(h, threads * 4);
+            uint32_t bs = (h + bands - 1) / bands;
+            uint32_t nb = (h + bs - 1) / bs;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                body = &b;
+                height = h;
+                bandSize = bs;
+                numBands = nb;
+                nextBand = 0;
+                bandsLeft = nb;
+                error = nullptr;
+                generation++;
+            }
+            wake.notify_all();
+
+            uint32_t done = runBands(b, h, bs, nb);
+
+            std::exception_ptr e;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                bandsLeft -= done;
+                finished.wait(lock, [&] { return bandsLeft == 0 && busy == 0; });
+                body = NULL;
+                e = error;
+                error = nullptr;
+            }
+            if (e) std::rethrow_exception(e);
+        }
+    };
+
+    WorkerPool pool;
+}
+
+void parallel_set_threads (unsigned n)
+{
+    pool.setThreads(n);
+}
+
+unsigned parallel_get_threads (void)
+{
+    return pool.getThreads();
+}
+
+void parallel_rows (uint32_t height, unsigned long row_work, const Body &body)
+{
+    pool.run(height, row_work, body);
+}
+
+unsigned parallel_rows_threads (uint32_t height, unsigned long row_work)
+{
+    return pool.concurrency(height, row_work);
+}
@@ -0,0 +1,57 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstdint>
+
+#include <functional>
+
+/** Work (roughly, pixels times per-pixel cost) below which parallel_rows does not bother waking the
+ * worker threads. */
+static const unsigned long PARALLEL_MIN_WORK = 1 << 15;
+
+/** Set the number of threads used for image processing, including the calling thread.  0 means one
+ * per hardware thread, 1 means everything runs serially on the calling thread. */
+void parallel_set_threads (unsigned n);
+
+/** The number of threads currently used for image processing. */
+unsigned parallel_get_threads (void);
+
+/** Call body(y0, y1) for a set of disjoint bands of rows that together cover [0, height).  Bands are
+ * processed concurrently by the worker pool and the calling thread, and the call returns when they
+ * are all done.  Since every row is visited exactly once, kernels that compute each output row
+ * independently give bit-identical results to a serial loop.
+ *
+ * row_work estimates the cost of a single row (usually its width).  Small jobs, jobs submitted from
+ * inside another band, or jobs submitted while the pool is busy with another thread's job run
+ * serially on the calling thread.  If body throws, the first exception is rethrown in the calling
+ * thread once all bands have finished. */
+void parallel_rows (uint32_t height, unsigned long row_work,
+                    const std::function<void(uint32_t, uint32_t)> &body);
+
+/** The most bands that parallel_rows(height, row_work, ...) would run at once if called now from
+ * this thread: 1 for a job it would run serially, e.g. a small or nested one. */
+unsigned parallel_rows_threads (uint32_t height, unsigned long row_work);
+
+#endif
@@ -0,0 +1,577 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+
+#include <algorithm>
+
+#include <exception.h>
+
+#include "parallel.h"
+#include "pixel_expr.h"
+
+typedef PixelExpr::Op Op;
+
+// The value of op on single components, used both for constant folding and (inlined with op
+// known) by the loops of evalBlock.
+static inline float pixel_expr_apply (Op op, float a, float b, float c)
+{
+    switch (op) {
+        case PixelExpr::OP_ADD: return a + b;
+        case PixelExpr::OP_SUB: return a - b;
+        case PixelExpr::OP_MUL: return a * b;
+        case PixelExpr::OP_DIV: return a / b;
+        // As in Lua, the result has the sign of b.
+        case PixelExpr::OP_MOD: return a - floorf(a / b) * b;
+        case PixelExpr::OP_POW: return powf(a, b);
+        case PixelExpr::OP_MIN: return b < a ? b : a;
+        case PixelExpr::OP_MAX: return b > a ? b : a;
+        case PixelExpr::OP_LT: return a < b ? 1 : 0;
+        case PixelExpr::OP_LE: return a <= b ? 1 : 0;
+        case PixelExpr::OP_EQ: return a == b ? 1 : 0;
+        case PixelExpr::OP_NE: return a != b ? 1 : 0;
+        case PixelExpr::OP_NEG: return -a;
+        case PixelExpr::OP_ABS: return fabsf(a);
+        case PixelExpr::OP_FLOOR: return floorf(a);
+        case PixelExpr::OP_CEIL: return ceilf(a);
+        case PixelExpr::OP_SQRT: return sqrtf(a);
+        case PixelExpr::OP_EXP: return expf(a);
+        case PixelExpr::OP_LOG: return logf(a);
+        case PixelExpr::OP_SIN: return sinf(a);
+        case PixelExpr::OP_COS: return cosf(a);
+        case PixelExpr::OP_TAN: return tanf(a);
+        case PixelExpr::OP_SELECT: return a != 0 ? b : c;
+    }
+    return 0;
+}
+
+static unsigned pixel_expr_arity (Op op)
+{
+    if (op == PixelExpr::OP_SELECT) return 3;
+    if (op >= PixelExpr::OP_NEG) return 1;
+    return 2;
+}
+
+// A value during compilation: the register of each of its components.
+typedef std::vector<unsigned> Val;
+
+// Recursive descent over the source, emitting code into the PixelExpr as it goes.  The grammar and
+// operator priorities are Lua's, but only the constructs listed in pixel_expr.h are accepted.
+class PixelExprCompiler {
+
+    PixelExpr &e;
+    const std::string &src;
+    const std::map<std::string, std::vector<float>> &constants;
+    size_t pos;
+
+    enum Token { T_END, T_NUMBER, T_NAME, T_OP };
+    Token tok;
+    size_t tokPos;
+    std::string tokText;
+    float tokNumber;
+
+    [[noreturn]] void error (size_t at, const std::string &msg)
+    {
+        EXCEPT << "Cannot compile \"" << src << "\" at column " << at + 1 << ": " << msg << ENDL;
+    }
+
+    void next (void)
+    {
+        while (pos < src.length() && isspace((unsigned char)src[pos])) pos++;
+        tokPos = pos;
+        if (pos >= src.length()) {
+            tok = T_END;
+            tokText = "end of input";
+            return;
+        }
+        char ch = src[pos];
+        if (isdigit((unsigned char)ch) || (ch == '.' && pos + 1 < src.length() && isdigit((unsigned char)src[pos+1]))) {
+            const char *begin = src.c_str() + pos;
+            char *end;
+            tokNumber = strtod(begin, &end);
+            pos += end - begin;
+            tok = T_NUMBER;
+            tokText = src.substr(tokPos, pos - tokPos);
+            return;
+        }
+        if (isalpha((unsigned char)ch) || ch == '_') {
+            while (pos < src.length() && (isalnum((unsigned char)src[pos]) || src[pos] == '_')) pos++;
+            tok = T_NAME;
+            tokText = src.substr(tokPos, pos - tokPos);
+            return;
+        }
+        static const char *two[] = { "<=", ">=", "==", "~=", "..", NULL };
+        for (const char **t = two ; *t != NULL ; ++t) {
+            if (src.compare(pos, 2, *t) == 0) {
+                pos += 2;
+                tok = T_OP;
+                tokText = *t;
+                return;
+            }
+        }
+        pos++;
+        tok = T_OP;
+        tokText = std::string(1, ch);
+    }
+
+    bool isOp (const char *op) { return tok == T_OP && tokText == op; }
+
+    void expect (const char *op)
+    {
+        if (!isOp(op)) error(tokPos, std::string("expected ") + op + " but got " + tokText);
+        next();
+    }
+
+    unsigned newReg (void)
+    {
+        e.isConstant.push_back(false);
+        e.constant.push_back(0);
+        return e.isConstant.size() - 1;
+    }
+
+    unsigned constReg (float v)
+    {
+        unsigned r = newReg();
+        e.isConstant[r] = true;
+        e.constant[r] = v;
+        return r;
+    }
+
+    unsigned inputReg (PixelExpr::Input in)
+    {
+        if (e.inputReg[in] < 0) e.inputReg[in] = newReg();
+        return e.inputReg[in];
+    }
+
+    unsigned sizeReg (int &reg)
+    {
+        if (reg < 0) reg = newReg();
+        return reg;
+    }
+
+    unsigned emit (Op op, unsigned a, unsigned b=0, unsigned c=0)
+    {
+        unsigned arity = pixel_expr_arity(op);
+        bool folds = e.isConstant[a] && (arity < 2 || e.isConstant[b]) && (arity < 3 || e.isConstant[c]);
+        if (folds) {
+            float cb = arity < 2 ? 0 : e.constant[b];
+            float cc = arity < 3 ? 0 : e.constant[c];
+            return constReg(pixel_expr_apply(op, e.constant[a], cb, cc));
+        }
+        // x^2 is common, and cheaper as a multiply.
+        if (op == PixelExpr::OP_POW && e.isConstant[b] && e.constant[b] == 2) {
+            op = PixelExpr::OP_MUL;
+            b = a;
+        }
+        unsigned dst = newReg();
+        PixelExpr::Instr i = { op, dst, a, arity < 2 ? a : b, arity < 3 ? a : c };
+        e.code.push_back(i);
+        return dst;
+    }
+
+    static std::string typeName (const Val &v)
+    {
+        return v.size() == 1 ? "number" : "vector" + std::to_string(v.size());
+    }
+
+    // Component-wise, with numbers broadcast to vectors.
+    Val zip (size_t at, Op op, const Val &a, const Val &b, const char *what)
+    {
+        if (a.size() != b.size() && a.size() != 1 && b.size() != 1)
+            error(at, std::string("cannot ") + what + " " + typeName(a) + " and " + typeName(b));
+        size_t n = std::max(a.size(), b.size());
+        Val r(n);
+        for (size_t i=0 ; i<n ; ++i)
+            r[i] = emit(op, a[a.size() == 1 ? 0 : i], b[b.size() == 1 ? 0 : i]);
+        return r;
+    }
+
+    Val map (Op op, const Val &a)
+    {
+        Val r(a.size());
+        for (size_t i=0 ; i<a.size() ; ++i) r[i] = emit(op, a[i]);
+        return r;
+    }
+
+    unsigned sum (const Val &a)
+    {
+        unsigned r = a[0];
+        for (size_t i=1 ; i<a.size() ; ++i) r = emit(PixelExpr::OP_ADD, r, a[i]);
+        return r;
+    }
+
+    unsigned dot (size_t at, const Val &a, const Val &b)
+    {
+        if (a.size() != b.size()) error(at, "dot of " + typeName(a) + " and " + typeName(b));
+        return sum(zip(at, PixelExpr::OP_MUL, a, b, "multiply"));
+    }
+
+    unsigned length (size_t at, const Val &a)
+    {
+        return emit(PixelExpr::OP_SQRT, dot(at, a, a));
+    }
+
+    Val variable (size_t at, const std::string &name)
+    {
+        if (name == "c") {
+            if (e.inChannels == 0) error(at, "c is only available when there is a source image");
+            Val r(e.inChannels);
+            for (unsigned i=0 ; i<e.inChannels ; ++i) r[i] = inputReg(PixelExpr::Input(PixelExpr::IN_C0 + i));
+            return r;
+        }
+        if (name == "pos") return Val { inputReg(PixelExpr::IN_POS_X), inputReg(PixelExpr::IN_POS_Y) };
+        if (name == "x") return Val { emit(PixelExpr::OP_DIV, inputReg(PixelExpr::IN_POS_X), sizeReg(e.widthReg)) };
+        if (name == "y") return Val { emit(PixelExpr::OP_DIV, inputReg(PixelExpr::IN_POS_Y), sizeReg(e.heightReg)) };
+        if (name == "size") return Val { sizeReg(e.widthReg), sizeReg(e.heightReg) };
+        auto it = constants.find(name);
+        if (it != constants.end()) {
+            Val r;
+            for (float v : it->second) r.push_back(constReg(v));
+            return r;
+        }
+        if (name == "and" || name == "or" || name == "not" || name == "function" || name == "local"
+            || name == "if" || name == "nil" || name == "true" || name == "false")
+            error(at, "\"" + name + "\" is not supported");
+        error(at, "unknown variable \"" + name + "\"");
+    }
+
+    Val call (size_t at, const std::string &name, const std::vector<Val> &args)
+    {
+        auto need = [&] (size_t n) {
+            if (args.size() != n)
+                error(at, name + " takes " + std::to_string(n) + " arguments, got " + std::to_string(args.size()));
+        };
+        struct { const char *name; Op op; } unary[] = {
+            { "abs", PixelExpr::OP_ABS }, { "floor", PixelExpr::OP_FLOOR }, { "ceil", PixelExpr::OP_CEIL },
+            { "sqrt", PixelExpr::OP_SQRT }, { "exp", PixelExpr::OP_EXP }, { "log", PixelExpr::OP_LOG },
+            { "sin", PixelExpr::OP_SIN }, { "cos", PixelExpr::OP_COS }, { "tan", PixelExpr::OP_TAN },
+        };
+        for (const auto &u : unary) {
+            if (name == u.name) {
+                need(1);
+                return map(u.op, args[0]);
+            }
+        }
+        if (name == "vec" || name == "vec2" || name == "vec3" || name == "vec4") {
+            Val r;
+            for (const Val &a : args) r.insert(r.end(), a.begin(), a.end());
+            size_t want = name == "vec" ? 0 : name[3] - '0';
+            if (r.size() < 1 || r.size() > 4 || (want != 0 && r.size() != want))
+                error(at, name + " given " + std::to_string(r.size()) + " components");
+            return r;
+        }
+        if (name == "pow") {
+            need(2);
+            return zip(at, PixelExpr::OP_POW, args[0], args[1], "raise");
+        }
+        if (name == "min" || name == "max") {
+            if (args.size() < 1) error(at, name + " needs at least one argument");
+            Val r = args[0];
+            for (size_t i=1 ; i<args.size() ; ++i)
+                r = zip(at, name == "min" ? PixelExpr::OP_MIN : PixelExpr::OP_MAX, r, args[i], "compare");
+            return r;
+        }
+        if (name == "clamp") {
+            need(3);
+            return zip(at, PixelExpr::OP_MIN, zip(at, PixelExpr::OP_MAX, args[0], args[1], "clamp"), args[2], "clamp");
+        }
+        if (name == "lerp") {
+            // (1-t)*a + t*b, as in the Lua lerp.
+            need(3);
+            Val one_minus_t = zip(at, PixelExpr::OP_SUB, Val { constReg(1) }, args[2], "subtract");
+            return zip(at, PixelExpr::OP_ADD, zip(at, PixelExpr::OP_MUL, one_minus_t, args[0], "lerp"),
+                       zip(at, PixelExpr::OP_MUL, args[2], args[1], "lerp"), "lerp");
+        }
+        if (name == "dot") {
+            need(2);
+            return Val { dot(at, args[0], args[1]) };
+        }
+        if (name == "norm") {
+            need(1);
+            return zip(at, PixelExpr::OP_DIV, args[0], Val { length(at, args[0]) }, "divide");
+        }
+        if (name == "select") {
+            need(3);
+            const Val &cond = args[0], &a = args[1], &b = args[2];
+            size_t n = std::max(cond.size(), std::max(a.size(), b.size()));
+            for (const Val *v : { &cond, &a, &b }) {
+                if (v->size() != 1 && v->size() != n) error(at, "select of mismatched sizes");
+            }
+            Val r(n);
+            for (size_t i=0 ; i<n ; ++i) {
+                r[i] = emit(PixelExpr::OP_SELECT, cond[cond.size() == 1 ? 0 : i],
+                            a[a.size() == 1 ? 0 : i], b[b.size() == 1 ? 0 : i]);
+            }
+            return r;
+        }
+        error(at, "unknown function \"" + name + "\"");
+    }
+
+    Val swizzle (size_t at, const Val &v, const std::string &fields)
+    {
+        if (fields.size() > 4) error(at, "swizzle ." + fields + " is too long");
+        Val r;
+        for (char f : fields) {
+            size_t i = f == 'x' ? 0 : f == 'y' ? 1 : f == 'z' ? 2 : f == 'w' ? 3 : 4;
+            if (i >= v.size()) error(at, "no field ." + std::string(1, f) + " in " + typeName(v));
+            r.push_back(v[i]);
+        }
+        return r;
+    }
+
+    Val primary (void)
+    {
+        size_t at = tokPos;
+        Val v;
+        if (tok == T_NUMBER) {
+            v = Val { constReg(tokNumber) };
+            next();
+        } else if (tok == T_NAME) {
+            std::string name = tokText;
+            next();
+            if (isOp("(")) {
+                next();
+                std::vector<Val> args;
+                if (!isOp(")")) {
+                    args.push_back(expr(0));
+                    while (isOp(",")) {
+                        next();
+                        args.push_back(expr(0));
+                    }
+                }
+                expect(")");
+                v = call(at, name, args);
+            } else {
+                v = variable(at, name);
+            }
+        } else if (isOp("(")) {
+            next();
+            v = expr(0);
+            expect(")");
+        } else {
+            error(at, "unexpected " + tokText);
+        }
+        while (true) {
+            at = tokPos;
+            if (isOp(".")) {
+                next();
+                if (tok != T_NAME) error(tokPos, "expected a swizzle after .");
+                v = swizzle(at, v, tokText);
+                next();
+            } else if (isOp("(") || isOp("[") || isOp(":") || isOp("{") || isOp("\"") || isOp("'")) {
+                error(at, "\"" + tokText + "\" is not supported here");
+            } else {
+                return v;
+            }
+        }
+    }
+
+    // Lua's priorities: left and right for each binary operator.
+    struct Binary { const char *op; int left, right; };
+
+    const Binary *binary (void)
+    {
+        static const Binary ops[] = {
+            { "+", 6, 6 }, { "-", 6, 6 }, { "*", 7, 7 }, { "/", 7, 7 }, { "%", 7, 7 },
+            { "^", 10, 9 }, { "..", 5, 4 },
+            { "==", 3, 3 }, { "~=", 3, 3 }, { "<", 3, 3 }, { "<=", 3, 3 }, { ">", 3, 3 }, { ">=", 3, 3 },
+            { "and", 2, 2 }, { "or", 1, 1 },
+        };
+        if (tok != T_OP && tok != T_NAME) return NULL;
+        for (const Binary &b : ops) {
+            if (tokText == b.op) return &b;
+        }
+        return NULL;
+    }
+
+    Val compare (size_t at, const std::string &op, const Val &a, const Val &b)
+    {
+        if (op == "==" || op == "~=") {
+            // As in Lua, a single answer even for vectors.
+            if (a.size() != b.size()) error(at, "cannot compare " + typeName(a) + " and " + typeName(b));
+            Val r = zip(at, op == "==" ? PixelExpr::OP_EQ : PixelExpr::OP_NE, a, b, "compare");
+            unsigned all = r[0];
+            for (size_t i=1 ; i<r.size() ; ++i)
+                all = emit(op == "==" ? PixelExpr::OP_MIN : PixelExpr::OP_MAX, all, r[i]);
+            return Val { all };
+        }
+        if (op == "<") return zip(at, PixelExpr::OP_LT, a, b, "compare");
+        if (op == "<=") return zip(at, PixelExpr::OP_LE, a, b, "compare");
+        if (op == ">") return zip(at, PixelExpr::OP_LT, b, a, "compare");
+        return zip(at, PixelExpr::OP_LE, b, a, "compare");
+    }
+
+    Val expr (int limit)
+    {
+        static const int UNARY_PRIORITY = 8;
+        size_t at = tokPos;
+        Val v;
+        if (isOp("-")) {
+            next();
+            v = map(PixelExpr::OP_NEG, expr(UNARY_PRIORITY));
+        } else if (isOp("#")) {
+            next();
+            v = Val { length(at, expr(UNARY_PRIORITY)) };
+        } else if (tok == T_NAME && tokText == "not") {
+            error(at, "\"not\" is not supported");
+        } else {
+            v = primary();
+        }
+        while (const Binary *b = binary()) {
+            if (b->left <= limit) break;
+            at = tokPos;
+            std::string op = b->op;
+            if (op == "and" || op == "or" || op == "..") error(at, "\"" + op + "\" is not supported");
+            next();
+            Val v2 = expr(b->right);
+            if (op == "+") v = zip(at, PixelExpr::OP_ADD, v, v2, "add");
+            else if (op == "-") v = zip(at, PixelExpr::OP_SUB, v, v2, "subtract");
+            else if (op == "*") v = zip(at, PixelExpr::OP_MUL, v, v2, "multiply");
+            else if (op == "/") v = zip(at, PixelExpr::OP_DIV, v, v2, "divide");
+            else if (op == "%") v = zip(at, PixelExpr::OP_MOD, v, v2, "take the modulus of");
+            else if (op == "^") v = zip(at, PixelExpr::OP_POW, v, v2, "raise");
+            else v = compare(at, op, v, v2);
+        }
+        return v;
+    }
+
+    public:
+
+    PixelExprCompiler (PixelExpr &e, const std::string &src,
+                       const std::map<std::string, std::vector<float>> &constants)
+      : e(e), src(src), constants(constants), pos(0)
+    {
+        next();
+        e.result = expr(0);
+        if (tok != T_END) error(tokPos, "unexpected " + tokText);
+    }
+};
+
+PixelExpr::PixelExpr (const std::string &src, const std::map<std::string, std::vector<float>> &constants,
+                      unsigned in_channels)
+  : inChannels(in_channels), widthReg(-1), heightReg(-1)
+{
+    if (in_channels > 4) EXCEPT << "Cannot evaluate an expression on " << in_channels << " channels." << ENDL;
+    for (unsigned i=0 ; i<IN_MAX ; ++i) inputReg[i] = -1;
+    PixelExprCompiler(*this, src, constants);
+}
+
+void PixelExpr::initRegisters (float *regs, uimglen_t width, uimglen_t height) const
+{
+    for (size_t r=0 ; r<isConstant.size() ; ++r) {
+        if (isConstant[r]) std::fill_n(regs + r*PIXEL_EXPR_BLOCK, PIXEL_EXPR_BLOCK, constant[r]);
+    }
+    if (widthReg >= 0) std::fill_n(regs + widthReg*PIXEL_EXPR_BLOCK, PIXEL_EXPR_BLOCK, float(width));
+    if (heightReg >= 0) std::fill_n(regs + heightReg*PIXEL_EXPR_BLOCK, PIXEL_EXPR_BLOCK, float(height));
+}
+
+// One instruction over a whole block.  Every lane is computed, even past the pixels in use, so that
+// the loop has a fixed count.
+template<PixelExpr::Op op> static void pixel_expr_run (float *__restrict__ d, const float *__restrict__ a,
+                                                       const float *__restrict__ b, const float *__restrict__ c)
+{
+    for (unsigned l=0 ; l<PIXEL_EXPR_BLOCK ; ++l) d[l] = pixel_expr_apply(op, a[l], b[l], c[l]);
+}
+
+void PixelExpr::evalBlock (const float *in, uimglen_t x0, uimglen_t y, unsigned n, float *out,
+                           float *regs) const
+{
+    auto reg = [&] (unsigned r) { return regs + size_t(r) * PIXEL_EXPR_BLOCK; };
+    for (unsigned k=0 ; k<inChannels ; ++k) {
+        if (inputReg[IN_C0 + k] < 0) continue;
+        float *d = reg(inputReg[IN_C0 + k]);
+        for (unsigned l=0 ; l<n ; ++l) d[l] = in[l*inChannels + k];
+        std::fill(d + n, d + PIXEL_EXPR_BLOCK, 0.0f);
+    }
+    if (inputReg[IN_POS_X] >= 0) {
+        float *d = reg(inputReg[IN_POS_X]);
+        for (unsigned l=0 ; l<PIXEL_EXPR_BLOCK ; ++l) d[l] = float(x0 + l);
+    }
+    if (inputReg[IN_POS_Y] >= 0) std::fill_n(reg(inputReg[IN_POS_Y]), PIXEL_EXPR_BLOCK, float(y));
+
+    for (const Instr &i : code) {
+        float *d = reg(i.dst);
+        const float *a = reg(i.a), *b = reg(i.b), *c = reg(i.c);
+        switch (i.op) {
+            #define PIXEL_EXPR_CASE(op) case op: pixel_expr_run<op>(d, a, b, c); break
+            PIXEL_EXPR_CASE(OP_ADD); PIXEL_EXPR_CASE(OP_SUB); PIXEL_EXPR_CASE(OP_MUL);
+            PIXEL_EXPR_CASE(OP_DIV); PIXEL_EXPR_CASE(OP_MOD); PIXEL_EXPR_CASE(OP_POW);
+            PIXEL_EXPR_CASE(OP_MIN); PIXEL_EXPR_CASE(OP_MAX); PIXEL_EXPR_CASE(OP_LT);
+            PIXEL_EXPR_CASE(OP_LE); PIXEL_EXPR_CASE(OP_EQ); PIXEL_EXPR_CASE(OP_NE);
+            PIXEL_EXPR_CASE(OP_NEG); PIXEL_EXPR_CASE(OP_ABS); PIXEL_EXPR_CASE(OP_FLOOR);
+            PIXEL_EXPR_CASE(OP_CEIL); PIXEL_EXPR_CASE(OP_SQRT); PIXEL_EXPR_CASE(OP_EXP);
+            PIXEL_EXPR_CASE(OP_LOG); PIXEL_EXPR_CASE(OP_SIN); PIXEL_EXPR_CASE(OP_COS);
+            PIXEL_EXPR_CASE(OP_TAN); PIXEL_EXPR_CASE(OP_SELECT);
+            #undef PIXEL_EXPR_CASE
+        }
+    }
+
+    unsigned w = width();
+    for (unsigned k=0 ; k<w ; ++k) {
+        const float *s = reg(result[k]);
+        for (unsigned l=0 ; l<n ; ++l) out[l*w + k] = s[l];
+    }
+}
+
+template<chan_t ch, chan_t ach>
+static ImageBase *pixel_expr_image2 (const PixelExpr &e, const ImageBase *src, uimglen_t width,
+                                     uimglen_t height)
+{
+    Image<ch,ach> *ret = new Image<ch,ach>(width, height);
+    const float *in = src == NULL ? NULL : src->raw();
+    unsigned in_ch = src == NULL ? 0 : src->channels();
+    float *out = ret->raw();
+    parallel_rows(height, width * (e.size() + 1), [&] (uimglen_t y0, uimglen_t y1) {
+        std::vector<float> regs(e.registers());
+        e.initRegisters(&regs[0], width, height);
+        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+            for (uimglen_t x0=0 ; x0<width ; x0+=PIXEL_EXPR_BLOCK) {
+                unsigned n = std::min(uimglen_t(PIXEL_EXPR_BLOCK), width - x0);
+                size_t i = size_t(y) * width + x0;
+                e.evalBlock(in == NULL ? NULL : in + i*in_ch, x0, y, n, out + i*(ch+ach), &regs[0]);
+            }
+        }
+    });
+    return ret;
+}
+
+ImageBase *pixel_expr_image (const PixelExpr &e, const ImageBase *src, uimglen_t width,
+                             uimglen_t height, bool alpha)
+{
+    if (alpha) {
+        switch (e.width()) {
+            case 2: return pixel_expr_image2<1,1>(e, src, width, height);
+            case 3: return pixel_expr_image2<2,1>(e, src, width, height);
+            case 4: return pixel_expr_image2<3,1>(e, src, width, height);
+            default: EXCEPT << "An image with alpha needs 2 to 4 components, the expression gives " << e.width() << "." << ENDL;
+        }
+    }
+    switch (e.width()) {
+        case 1: return pixel_expr_image2<1,0>(e, src, width, height);
+        case 2: return pixel_expr_image2<2,0>(e, src, width, height);
+        case 3: return pixel_expr_image2<3,0>(e, src, width, height);
+        case 4: return pixel_expr_image2<4,0>(e, src, width, height);
+    }
+    EXCEPT << "Internal error: expression of " << e.width() << " components." << ENDL;
+}
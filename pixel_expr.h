@@ -0,0 +1,112 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#ifndef PIXEL_EXPR_H
+#define PIXEL_EXPR_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+/** Pixels evaluated by one pass over a compiled expression.  Each instruction loops over this many
+ * floats, which the compiler vectorises. */
+static const unsigned PIXEL_EXPR_BLOCK = 64;
+
+/** A small expression language for computing pixels without calling Lua, e.g.
+ * "vec(1-x^2, y^1.5, x*y)".  It has Lua's arithmetic and comparison operators (the latter giving 1
+ * or 0), swizzles like .xy, the vec constructors, and the functions abs, floor, ceil, sqrt, exp, log,
+ * sin, cos, tan, pow, min, max, clamp, lerp, dot, norm (normalise), select(cond, a, b), and # for
+ * length.  The inputs are c (the source pixel, if there is a source image), pos (the pixel
+ * coordinates), x and y (pos divided by the image size), size, and any named constants given.
+ *
+ * Values are vectors of 1 to 4 components, whose sizes are checked at compile time, so the program
+ * is compiled down to operations on single components of a block of pixels.  Constant parts are
+ * folded at compile time. */
+class PixelExpr {
+
+    public:
+
+    enum Op {
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW, OP_MIN, OP_MAX,
+        OP_LT, OP_LE, OP_EQ, OP_NE,
+        OP_NEG, OP_ABS, OP_FLOOR, OP_CEIL, OP_SQRT, OP_EXP, OP_LOG, OP_SIN, OP_COS, OP_TAN,
+        OP_SELECT
+    };
+
+    struct Instr {
+        Op op;
+        unsigned dst, a, b, c;
+    };
+
+    // Per-pixel inputs, whose registers are filled for each block before the instructions run.
+    enum Input { IN_C0, IN_C1, IN_C2, IN_C3, IN_POS_X, IN_POS_Y, IN_MAX };
+
+    /** Compile src, throwing an exception that names the construct (and its column) if it cannot.
+     * in_channels is the number of channels of the source pixel c, or 0 if there is no source. */
+    PixelExpr (const std::string &src, const std::map<std::string, std::vector<float>> &constants,
+               unsigned in_channels);
+
+    /** Number of components of the result. */
+    unsigned width (void) const { return result.size(); }
+
+    /** Number of instructions after constant folding. */
+    size_t size (void) const { return code.size(); }
+
+    /** Compute the n <= PIXEL_EXPR_BLOCK pixels from (x0, y) rightwards into out, width() floats
+     * per pixel.  in holds the source pixels (in_channels floats each), or is NULL if there is no
+     * source.  regs is scratch of at least registers() floats, which must first be set up with
+     * initRegisters. */
+    void evalBlock (const float *in, uimglen_t x0, uimglen_t y, unsigned n, float *out,
+                    float *regs) const;
+
+    /** Number of floats of scratch needed by evalBlock. */
+    size_t registers (void) const { return isConstant.size() * PIXEL_EXPR_BLOCK; }
+
+    /** Fill the registers of regs that are the same for every block, for an image of the given
+     * size. */
+    void initRegisters (float *regs, uimglen_t width, uimglen_t height) const;
+
+    private:
+
+    friend class PixelExprCompiler;
+
+    unsigned inChannels;
+    // Per register: whether it is a constant, and if so its value.
+    std::vector<bool> isConstant;
+    std::vector<float> constant;
+    // Registers of the inputs, or -1 if the program does not read them.
+    int inputReg[IN_MAX];
+    // Registers of the image size, or -1.
+    int widthReg, heightReg;
+    std::vector<Instr> code;
+    std::vector<unsigned> result;
+};
+
+/** A new image of the given size from e, with an alpha channel (the last component) if alpha.  src
+ * supplies c for each pixel, or is NULL. */
+ImageBase *pixel_expr_image (const PixelExpr &e, const ImageBase *src, uimglen_t width,
+                             uimglen_t height, bool alpha);
+
+#endif
@@ -0,0 +1,239 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+#include <exception.h>
+
+#include "pixel_pool.h"
+
+namespace {
+
+    std::mutex mutex;
+
+    // Freed buffers by size class.
+    std::map<size_t, std::vector<void*>> cache;
+
+    PixelPoolStats stats = { 0, 0, 0, 0, 0, 0 };
+    size_t budget = 0;
+    size_t high_water = 0;
+
+    std::function<void(void)> collector;
+    std::thread::id collector_thread;
+    bool collecting = false;
+    // Memory in use beyond which pixel_pool_collect_point calls the collector again.
+    size_t collect_at = 0;
+    size_t cache_limit = PIXEL_POOL_DEFAULT_CACHE;
+
+    // The smallest size class at least as big as bytes: multiples of a quarter of the
+    // enclosing power of 2, so at most 25% is wasted.
+    size_t size_class (size_t bytes)
+    {
+        if (bytes <= PIXEL_POOL_ALIGNMENT) return PIXEL_POOL_ALIGNMENT;
+        size_t pow2 = PIXEL_POOL_ALIGNMENT;
+        while (pow2 * 2 < bytes) pow2 *= 2;
+        size_t step = pow2 / 4;
+        return (bytes + step - 1) / step * step;
+    }
+
+    void *system_alloc (size_t bytes)
+    {
+        #ifdef WIN32
+        void *r = _aligned_malloc(bytes, PIXEL_POOL_ALIGNMENT);
+        #else
+        void *r;
+        if (posix_memalign(&r, PIXEL_POOL_ALIGNMENT, bytes) != 0) r = NULL;
+        #endif
+        return r;
+    }
+
+    void system_free (void *ptr)
+    {
+        #ifdef WIN32
+        _aligned_free(ptr);
+        #else
+        free(ptr);
+        #endif
+    }
+
+    // Give back cached buffers until at most target bytes remain cached.  Called with the mutex
+    // held.
+    void trim_to (size_t target)
+    {
+        while (stats.cached > target && !cache.empty()) {
+            // Largest first, they are the least likely to be reused.
+            auto it = std::prev(cache.end());
+            while (!it->second.empty() && stats.cached > target) {
+                system_free(it->second.back());
+                it->second.pop_back();
+                stats.cached -= it->first;
+            }
+            if (it->second.empty()) cache.erase(it);
+        }
+    }
+
+}
+
+void *pixel_pool_alloc (size_t bytes)
+{
+    size_t sz = size_class(bytes);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(sz);
+        if (it != cache.end() && !it->second.empty()) {
+            void *r = it->second.back();
+            it->second.pop_back();
+            stats.cached -= sz;
+            stats.live += sz;
+            stats.peak = std::max(stats.peak, stats.live);
+            stats.hits++;
+            return r;
+        }
+        if (budget != 0) {
+            if (stats.live + sz > budget) {
+                EXCEPT << "Allocating " << bytes << " bytes of pixels would exceed the memory budget of "
+                       << budget << " bytes (" << stats.live << " in use)." << ENDL;
+            }
+            if (stats.live + stats.cached + sz > budget) trim_to(budget - stats.live - sz);
+        }
+        if (high_water != 0) trim_to(high_water - std::min(high_water, stats.live + sz));
+        // Reserve it now, so concurrent allocations respect the budget.
+        stats.live += sz;
+        stats.peak = std::max(stats.peak, stats.live);
+        stats.misses++;
+    }
+    void *r = system_alloc(sz);
+    if (r == NULL) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.live -= sz;
+        throw std::bad_alloc();
+    }
+    return r;
+}
+
+void pixel_pool_free (void *ptr, size_t bytes)
+{
+    if (ptr == NULL) return;
+    size_t sz = size_class(bytes);
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.live -= sz;
+    size_t limit = cache_limit;
+    if (budget != 0) limit = std::min(limit, budget - std::min(budget, stats.live));
+    if (high_water != 0) limit = std::min(limit, high_water - std::min(high_water, stats.live));
+    if (stats.cached + sz > limit) {
+        system_free(ptr);
+        return;
+    }
+    cache[sz].push_back(ptr);
+    stats.cached += sz;
+}
+
+void pixel_pool_trim (void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    trim_to(0);
+}
+
+void pixel_pool_set_budget (size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    if (budget != 0) trim_to(budget - std::min(budget, stats.live));
+}
+
+size_t pixel_pool_get_budget (void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return budget;
+}
+
+void pixel_pool_set_collector (const std::function<void(void)> &c)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    collector = c;
+    collector_thread = std::this_thread::get_id();
+}
+
+void pixel_pool_collect_point (void)
+{
+    std::function<void(void)> c;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (collecting || !collector || high_water == 0) return;
+        if (std::this_thread::get_id() != collector_thread) return;
+        if (stats.live <= std::max(high_water, collect_at)) return;
+        stats.collections++;
+        collecting = true;
+        c = collector;
+    }
+    // Not under the lock, as the collector frees buffers.
+    try {
+        c();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        collecting = false;
+        throw;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    collecting = false;
+    // Whatever is still in use is reachable, so wait for a quarter more before trying again.
+    collect_at = stats.live + stats.live / 4;
+}
+
+void pixel_pool_set_high_water (size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    high_water = bytes;
+    collect_at = 0;
+    if (high_water != 0) trim_to(high_water - std::min(high_water, stats.live));
+}
+
+size_t pixel_pool_get_high_water (void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return high_water;
+}
+
+void pixel_pool_set_cache (size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cache_limit = bytes;
+    trim_to(cache_limit);
+}
+
+PixelPoolStats pixel_pool_stats (void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
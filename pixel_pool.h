@@ -0,0 +1,82 @@
+/* Copyright (c) David Cunningham and the Grit Game Engine project 2015
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIXEL_POOL_H
+#define PIXEL_POOL_H
+
+#include <cstddef>
+
+#include <functional>
+
+/** Alignment of every buffer from pixel_pool_alloc, enough for any SIMD load. */
+static const size_t PIXEL_POOL_ALIGNMENT = 64;
+
+/** Freed buffers kept for reuse, beyond which they are given back to the system. */
+static const size_t PIXEL_POOL_DEFAULT_CACHE = size_t(256) << 20;
+
+/** Memory for image pixels.  Sizes are rounded up to a size class (4 per power of 2), and freed
+ * buffers are kept per size class, so images of the same size (e.g. animation frames) reuse each
+ * other's memory rather than going back to the system.  Throws if the budget would be exceeded.
+ * Thread safe. */
+void *pixel_pool_alloc (size_t bytes);
+
+/** Return a buffer from pixel_pool_alloc, bytes must be the size that was asked for. */
+void pixel_pool_free (void *ptr, size_t bytes);
+
+/** Give all the cached buffers back to the system. */
+void pixel_pool_trim (void);
+
+/** Limit on the memory for pixels, both in use and cached, or 0 for no limit.  Cached buffers are
+ * given back to stay within it, and allocations that would still exceed it throw. */
+void pixel_pool_set_budget (size_t bytes);
+size_t pixel_pool_get_budget (void);
+
+/** Called by pixel_pool_collect_point to free unreachable images (i.e. run the garbage collector)
+ * when the memory in use is above the high water mark.  Never called by the allocator itself. */
+void pixel_pool_set_collector (const std::function<void(void)> &collector);
+
+/** Call the collector if the memory in use is above the high water mark, and has grown by a quarter
+ * since the last collection (so images that really are in use do not cause one every time).  Only
+ * call this where freeing unreachable images is safe, e.g. on entry to a binding.  Does nothing on
+ * other threads than the one that set the collector, or recursively. */
+void pixel_pool_collect_point (void);
+
+/** Memory in use (in bytes) beyond which pixel_pool_collect_point calls the collector, or 0 for
+ * never.  Cached buffers are given back to stay within it. */
+void pixel_pool_set_high_water (size_t bytes);
+size_t pixel_pool_get_high_water (void);
+
+/** Limit on the memory in cached buffers. */
+void pixel_pool_set_cache (size_t bytes);
+
+struct PixelPoolStats {
+    size_t live;                // Bytes in buffers that are in use (rounded up to size classes).
+    size_t peak;                // The most that live has been.
+    size_t cached;              // Bytes in freed buffers that are kept for reuse.
+    unsigned long long hits;    // Allocations that reused a cached buffer.
+    unsigned long long misses;  // Allocations that needed new memory.
+    unsigned long long collections;  // Calls of the collector.
+};
+
+PixelPoolStats pixel_pool_stats (void);
+
+#endif
@@ -19,95 +19,624 @@
  * THE SOFTWARE.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <exception.h>
-#include <io_util.h>
 
+#include "parallel.h"
 #include "sfi.h"
 
-void sfi_save (const std::string &filename, ImageBase *image)
-{
+/* The original header is width (4 bytes), height (4 bytes), channels (1 byte), and a byte that is
+ * 'A' if there is an alpha channel and 'a' if not.  The floats follow immediately.  Since that
+ * leaves them misaligned, padded files use 'P' and 'p' instead, followed by 6 bytes of padding, so
+ * the floats start at byte 16 and the file can be mapped directly into memory.
+ *
+ * Version 2 files start with "SFI2", then width and height (4 bytes each), channels, alpha (0 or
+ * 1), sample format (0 for float, 1 for half) and a zero byte, then the tile size (4 bytes).  Then
+ * comes the tile directory, and the tiles.  The directory has an entry for each tile, in rows
+ * starting at the bottom, of 8 bytes for the offset of the tile in the file, 4 for its stored size,
+ * and 4 for its codec.  A tile contains its pixels in rows, with the channels of each pixel
+ * together, and tiles on the right/top edge are cut to fit the image.  The codec is 0 if the tile
+ * is stored as-is, and 1 if the bytes have been shuffled (all the first bytes of each sample, then
+ * all the second bytes, etc) and then compressed with sfi_lz_compress.
+ */
+#define SFI_HEADER_SIZE 10
+#define SFI_PADDED_HEADER_SIZE 16
+#define SFI2_HEADER_SIZE 20
+#define SFI2_DIRECTORY_ENTRY_SIZE 16
+#define SFI2_TILE_SIZE 256
 
-    uimglen_t width = image->width;
-    uimglen_t height = image->height;
-    chan_t channels = image->channels();
+#define SFI2_SAMPLE_FLOAT 0
+#define SFI2_SAMPLE_HALF 1
 
-    OutFile out(filename);
-    out.write(width);
-    out.write(height);
-    out.write(channels);
+#define SFI2_CODEC_NONE 0
+#define SFI2_CODEC_SHUFFLE_LZ 1
 
-    out.write(image->hasAlpha() ? 'A' : 'a');
+namespace {
 
-    float *raw = image->raw();
-    for (size_t i=0 ; i<width*height*channels ; ++i) {
-        out.write(raw[i]);
+    template<class T> void write_value (std::ostream &out, const T &v)
+    {
+        out.write(reinterpret_cast<const char*>(&v), sizeof(T));
     }
-}
 
-ImageBase *sfi_open (const std::string &filename)
-{
-    InFile in(filename);
-
-    uimglen_t width, height;
-    chan_t channels;
-    in.read(width);
-    in.read(height);
-    in.read(channels);
-
-    char alpha_char;
-    in.read(alpha_char);
-    bool has_alpha;
-    if (alpha_char == 'A') {
-        has_alpha = true;
-    } else if (alpha_char == 'a') {
-        has_alpha = false;
-    } else {
-        EXCEPT<<filename<<": corrupted image file"<<std::endl;
+    template<class T> void read_value (std::istream &in, T &v)
+    {
+        in.read(reinterpret_cast<char*>(&v), sizeof(T));
     }
 
-    ImageBase *img = NULL;
-
-    try {
-        switch (channels) {
-            case 1: if (has_alpha) {
-                img = new Image<0,1>(width,height);
-            } else {
-                img = new Image<1,0>(width,height);
-            } break;
-            case 2: if (has_alpha) {
-                img = new Image<1,1>(width,height);
-            } else {
-                img = new Image<2,0>(width,height);
-            } break;
-            case 3: if (has_alpha) {
-                img = new Image<2,1>(width,height);
-            } else {
-                img = new Image<3,0>(width,height);
-            } break;
-            case 4: if (has_alpha) {
-                img = new Image<3,1>(width,height);
-            } else {
-                img = new Image<4,0>(width,height);
-            } break;
-            default:
+    struct SFIHeader {
+        unsigned version;
+        uimglen_t width, height;
+        chan_t channels;
+        bool hasAlpha;
+        // Where the floats (version 1) or the tile directory (version 2) start.
+        size_t offset;
+        // Version 2 only.
+        bool half;
+        uimglen_t tileSize;
+
+        size_t payload (void) const { return size_t(width) * height * channels * sizeof(float); }
+    };
+
+    SFIHeader read_header (std::istream &in, const std::string &filename)
+    {
+        SFIHeader h;
+        char magic[4];
+        in.read(magic, 4);
+        if (in.good() && !memcmp(magic, "SFI2", 4)) {
+            uint8_t alpha = 0, sample = 0, zero = 0;
+            h.version = 2;
+            read_value(in, h.width);
+            read_value(in, h.height);
+            read_value(in, h.channels);
+            read_value(in, alpha);
+            read_value(in, sample);
+            read_value(in, zero);
+            read_value(in, h.tileSize);
+            if (!in.good() || alpha > 1 || sample > SFI2_SAMPLE_HALF || h.tileSize == 0
+                || h.tileSize > 65536) {
+                EXCEPT<<filename<<": corrupted image file"<<std::endl;
+            }
+            h.hasAlpha = alpha == 1;
+            h.half = sample == SFI2_SAMPLE_HALF;
+            h.offset = SFI2_HEADER_SIZE;
+        } else {
+            char alpha_char = 0;
+            h.version = 1;
+            h.half = false;
+            h.tileSize = 0;
+            memcpy(&h.width, magic, sizeof(h.width));
+            read_value(in, h.height);
+            read_value(in, h.channels);
+            read_value(in, alpha_char);
+            if (!in.good()) {
+                EXCEPT<<filename<<": corrupted image file"<<std::endl;
+            }
+            switch (alpha_char) {
+                case 'A': h.hasAlpha = true; h.offset = SFI_HEADER_SIZE; break;
+                case 'a': h.hasAlpha = false; h.offset = SFI_HEADER_SIZE; break;
+                case 'P': h.hasAlpha = true; h.offset = SFI_PADDED_HEADER_SIZE; break;
+                case 'p': h.hasAlpha = false; h.offset = SFI_PADDED_HEADER_SIZE; break;
+                default:
+                EXCEPT<<filename<<": corrupted image file"<<std::endl;
+            }
+        }
+        if (h.channels < 1 || h.channels > 4) {
             EXCEPT<<filename<<": corrupted image file"<<std::endl;
         }
+        return h;
+    }
+
+    template<chan_t ch, chan_t ach>
+    ImageBase *make_image (uimglen_t width, uimglen_t height, void *pixels, ImageStorage *storage)
+    {
+        if (pixels == NULL) return new Image<ch,ach>(width, height);
+        return new Image<ch,ach>(width, height, static_cast<Colour<ch,ach>*>(pixels), storage);
+    }
+
+    /** Allocate an image with the channels given in the header, or wrap the given pixels if not
+     * NULL. */
+    ImageBase *make_image (const SFIHeader &h, uimglen_t width, uimglen_t height,
+                           void *pixels=NULL, ImageStorage *storage=NULL)
+    {
+        switch (h.channels) {
+            case 1: return h.hasAlpha ? make_image<0,1>(width, height, pixels, storage)
+                                      : make_image<1,0>(width, height, pixels, storage);
+            case 2: return h.hasAlpha ? make_image<1,1>(width, height, pixels, storage)
+                                      : make_image<2,0>(width, height, pixels, storage);
+            case 3: return h.hasAlpha ? make_image<2,1>(width, height, pixels, storage)
+                                      : make_image<3,0>(width, height, pixels, storage);
+            case 4: return h.hasAlpha ? make_image<3,1>(width, height, pixels, storage)
+                                      : make_image<4,0>(width, height, pixels, storage);
+            default: return NULL;
+        }
+    }
+
+    /** A private (copy-on-write) mapping of a whole file.  Drawing into the image copies the
+     * affected pages, and never changes the file. */
+    class SFIMapping : public ImageStorage {
+        public:
+        char *base;
+        size_t size;
+        #ifdef WIN32
+        HANDLE file, mapping;
+        #endif
+
+        SFIMapping (const std::string &filename)
+          : base(NULL), size(0)
+        {
+            #ifdef WIN32
+            file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE) {
+                EXCEPT << "Couldn't open " << filename << ENDL;
+            }
+            LARGE_INTEGER sz;
+            GetFileSizeEx(file, &sz);
+            size = size_t(sz.QuadPart);
+            mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+            if (mapping != NULL) base = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+            if (base == NULL) {
+                if (mapping != NULL) CloseHandle(mapping);
+                CloseHandle(file);
+                EXCEPT << "Couldn't map " << filename << " into memory." << ENDL;
+            }
+            #else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                EXCEPT << "Couldn't open " << filename << ": " << strerror(errno) << ENDL;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                EXCEPT << "Couldn't stat " << filename << ": " << strerror(errno) << ENDL;
+            }
+            size = st.st_size;
+            void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (m == MAP_FAILED) {
+                EXCEPT << "Couldn't map " << filename << " into memory: " << strerror(errno) << ENDL;
+            }
+            base = static_cast<char*>(m);
+            #endif
+        }
+
+        ~SFIMapping (void)
+        {
+            #ifdef WIN32
+            UnmapViewOfFile(base);
+            CloseHandle(mapping);
+            CloseHandle(file);
+            #else
+            munmap(base, size);
+            #endif
+        }
+    };
+
+
+    uint32_t load32 (const uint8_t *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    void lz_put_length (std::vector<uint8_t> &dst, size_t len)
+    {
+        for ( ; len >= 255 ; len -= 255) dst.push_back(255);
+        dst.push_back(uint8_t(len));
+    }
+
+    void lz_put_literals (std::vector<uint8_t> &dst, const uint8_t *src, size_t len, unsigned match_nibble)
+    {
+        dst.push_back(uint8_t((len < 15 ? len : 15) << 4 | match_nibble));
+        if (len >= 15) lz_put_length(dst, len - 15);
+        dst.insert(dst.end(), src, src + len);
+    }
+
+    /* An LZ77 codec in the style of LZ4.  The stream is a sequence of a token byte, literals, a
+     * 2 byte offset, and a match.  The top 4 bits of the token are the number of literals and the
+     * bottom 4 bits are the match length minus 4, where 15 means extra length bytes follow (255
+     * meaning more follow again).  The final sequence has only literals.
+     */
+    void sfi_lz_compress (const uint8_t *src, size_t n, std::vector<uint8_t> &dst)
+    {
+        const unsigned HASH_BITS = 14;
+        std::vector<uint32_t> table(1 << HASH_BITS, 0);
+        size_t anchor = 0;
+        size_t i = 0;
+        while (i + 4 <= n) {
+            uint32_t seq = load32(src + i);
+            uint32_t &slot = table[(seq * 2654435761u) >> (32 - HASH_BITS)];
+            size_t cand = slot;
+            slot = i;
+            if (cand >= i || i - cand > 65535 || load32(src + cand) != seq) {
+                ++i;
+                continue;
+            }
+            size_t len = 4;
+            while (i + len < n && src[cand + len] == src[i + len]) ++len;
+            lz_put_literals(dst, src + anchor, i - anchor, len - 4 < 15 ? len - 4 : 15);
+            uint16_t offset = i - cand;
+            dst.push_back(offset & 0xff);
+            dst.push_back(offset >> 8);
+            if (len - 4 >= 15) lz_put_length(dst, len - 4 - 15);
+            i += len;
+            anchor = i;
+        }
+        lz_put_literals(dst, src + anchor, n - anchor, 0);
+    }
+
+    /** Returns false if src is not a valid stream that decompresses to exactly n bytes. */
+    bool sfi_lz_decompress (const uint8_t *src, size_t src_len, uint8_t *dst, size_t n)
+    {
+        const uint8_t *end = src + src_len;
+        size_t o = 0;
+        while (src < end) {
+            unsigned token = *src++;
+            size_t len = token >> 4;
+            if (len == 15) {
+                do {
+                    if (src == end) return false;
+                    len += *src;
+                } while (*src++ == 255);
+            }
+            if (size_t(end - src) < len || n - o < len) return false;
+            memcpy(dst + o, src, len);
+            src += len;
+            o += len;
+            if (src == end) break;
+
+            if (end - src < 2) return false;
+            size_t offset = src[0] | src[1] << 8;
+            src += 2;
+            len = (token & 15) + 4;
+            if ((token & 15) == 15) {
+                do {
+                    if (src == end) return false;
+                    len += *src;
+                } while (*src++ == 255);
+            }
+            if (offset == 0 || offset > o || n - o < len) return false;
+            // May overlap, which repeats the last offset bytes.
+            for (size_t j=0 ; j<len ; ++j, ++o) dst[o] = dst[o - offset];
+        }
+        return o == n;
+    }
+
+    struct TileEntry {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t codec;
+    };
+
+    /** Encode the tile whose bottom left pixel is (x0, y0) and is w by h pixels. */
+    void encode_tile (const ImageBase *img, uimglen_t x0, uimglen_t y0, uimglen_t w, uimglen_t h,
+                      bool half, std::vector<uint8_t> &out, uint32_t &codec)
+    {
+        const chan_t c = img->channels();
+        const size_t samples = size_t(w) * h * c;
+        const unsigned bytes = half ? 2 : 4;
+        std::vector<uint8_t> raw(samples * bytes);
+        const float *src = img->raw();
+        size_t i = 0;
+        for (uimglen_t y=0 ; y<h ; ++y) {
+            const float *row = src + (size_t(y0 + y) * img->width + x0) * c;
+            for (size_t j=0 ; j<size_t(w)*c ; ++j, ++i) {
+                if (half) {
+                    uint16_t v = float_to_half(row[j]);
+                    memcpy(&raw[i * 2], &v, 2);
+                } else {
+                    memcpy(&raw[i * 4], &row[j], 4);
+                }
+            }
+        }
+
+        std::vector<uint8_t> shuffled(raw.size());
+        for (unsigned b=0 ; b<bytes ; ++b) {
+            for (i=0 ; i<samples ; ++i) shuffled[b*samples + i] = raw[i*bytes + b];
+        }
+        out.clear();
+        sfi_lz_compress(&shuffled[0], shuffled.size(), out);
+        if (out.size() < raw.size()) {
+            codec = SFI2_CODEC_SHUFFLE_LZ;
+        } else {
+            codec = SFI2_CODEC_NONE;
+            out.swap(raw);
+        }
+    }
+
+    /** Decode a w by h tile into its samples as they are stored (floats or halves). */
+    void decode_tile (const SFIHeader &hd, const std::vector<uint8_t> &in, uint32_t codec,
+                      uimglen_t w, uimglen_t h, std::vector<uint8_t> &raw, const std::string &filename)
+    {
+        const size_t samples = size_t(w) * h * hd.channels;
+        const unsigned bytes = hd.half ? 2 : 4;
+        raw.resize(samples * bytes);
+        if (codec == SFI2_CODEC_NONE) {
+            if (in.size() != raw.size()) EXCEPT<<filename<<": corrupted image file"<<std::endl;
+            raw = in;
+        } else if (codec == SFI2_CODEC_SHUFFLE_LZ) {
+            std::vector<uint8_t> shuffled(raw.size());
+            if (!sfi_lz_decompress(in.empty() ? NULL : &in[0], in.size(), &shuffled[0], shuffled.size()))
+                EXCEPT<<filename<<": corrupted image file"<<std::endl;
+            for (unsigned b=0 ; b<bytes ; ++b) {
+                for (size_t i=0 ; i<samples ; ++i) raw[i*bytes + b] = shuffled[b*samples + i];
+            }
+        } else {
+            EXCEPT<<filename<<": corrupted image file"<<std::endl;
+        }
+    }
+
+    void save_v1 (std::ostream &out, ImageBase *image, bool padded)
+    {
+        uimglen_t width = image->width;
+        uimglen_t height = image->height;
+        chan_t channels = image->channels();
+        const float *raw = image->raw();
 
+        char padding[SFI_PADDED_HEADER_SIZE - SFI_HEADER_SIZE] = { 0 };
+        char alpha_char = padded ? (image->hasAlpha() ? 'P' : 'p') : (image->hasAlpha() ? 'A' : 'a');
+        write_value(out, width);
+        write_value(out, height);
+        write_value(out, channels);
+        write_value(out, alpha_char);
+        if (padded) out.write(padding, sizeof(padding));
+
+        out.write(reinterpret_cast<const char*>(raw), std::streamsize(image->numPixels()) * channels * sizeof(float));
+    }
+
+    void save_v2 (std::ostream &out, ImageBase *image, bool half)
+    {
+        const uimglen_t t = SFI2_TILE_SIZE;
+        const uimglen_t tiles_x = (image->width + t - 1) / t;
+        const uimglen_t tiles_y = (image->height + t - 1) / t;
+        std::vector<std::vector<uint8_t>> tiles(size_t(tiles_x) * tiles_y);
+        std::vector<TileEntry> dir(tiles.size());
+        image->raw();  // Force a lazy image before sharing it between threads.
+
+        parallel_rows(tiles_y, size_t(tiles_x) * t * t * image->channels(), [&] (uimglen_t ty0, uimglen_t ty1) {
+            for (uimglen_t ty=ty0 ; ty<ty1 ; ++ty) {
+                for (uimglen_t tx=0 ; tx<tiles_x ; ++tx) {
+                    size_t i = size_t(ty) * tiles_x + tx;
+                    uimglen_t w = std::min(t, image->width - tx*t);
+                    uimglen_t h = std::min(t, image->height - ty*t);
+                    encode_tile(image, tx*t, ty*t, w, h, half, tiles[i], dir[i].codec);
+                }
+            }
+        });
+
+        uint64_t offset = SFI2_HEADER_SIZE + tiles.size() * SFI2_DIRECTORY_ENTRY_SIZE;
+        for (size_t i=0 ; i<tiles.size() ; ++i) {
+            dir[i].offset = offset;
+            dir[i].size = tiles[i].size();
+            offset += tiles[i].size();
+        }
+
+        out.write("SFI2", 4);
+        write_value(out, image->width);
+        write_value(out, image->height);
+        write_value(out, uint8_t(image->channels()));
+        write_value(out, uint8_t(image->hasAlpha() ? 1 : 0));
+        write_value(out, uint8_t(half ? SFI2_SAMPLE_HALF : SFI2_SAMPLE_FLOAT));
+        write_value(out, uint8_t(0));
+        write_value(out, t);
+        for (const TileEntry &e : dir) {
+            write_value(out, e.offset);
+            write_value(out, e.size);
+            write_value(out, e.codec);
+        }
+        for (const std::vector<uint8_t> &tile : tiles) {
+            out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+        }
+    }
+
+    ImageBase *open_v1_region (std::istream &in, const SFIHeader &h, uimglen_t left, uimglen_t bottom,
+                               uimglen_t width, uimglen_t height, const std::string &filename)
+    {
+        ImageBase *img = make_image(h, width, height);
         float *raw = img->raw();
-        for (size_t i=0 ; i<width*height*channels ; ++i) {
-            in.read(raw[i]);
+        const size_t row = size_t(width) * h.channels * sizeof(float);
+        for (uimglen_t y=0 ; y<height ; ++y) {
+            in.seekg(h.offset + ((size_t(bottom + y) * h.width + left) * h.channels) * sizeof(float));
+            in.read(reinterpret_cast<char*>(raw) + y * row, row);
+            if (size_t(in.gcount()) != row) {
+                delete img;
+                EXCEPT<<filename<<": corrupted image file"<<std::endl;
+            }
+        }
+        return img;
+    }
+
+    template<chan_t ch, chan_t ach>
+    ImageBase *make_half_image (uimglen_t width, uimglen_t height, std::vector<Half> &&samples)
+    {
+        return new Image<ch,ach>(width, height, new ImageExprPacked<ch,ach,Half>(std::move(samples)));
+    }
+
+    /** A packed image of the given halves (see ImageExprPacked), with the channels given in the
+     * header. */
+    ImageBase *make_half_image (const SFIHeader &h, uimglen_t width, uimglen_t height,
+                                std::vector<Half> &&samples)
+    {
+        switch (h.channels) {
+            case 1: return h.hasAlpha ? make_half_image<0,1>(width, height, std::move(samples))
+                                      : make_half_image<1,0>(width, height, std::move(samples));
+            case 2: return h.hasAlpha ? make_half_image<1,1>(width, height, std::move(samples))
+                                      : make_half_image<2,0>(width, height, std::move(samples));
+            case 3: return h.hasAlpha ? make_half_image<2,1>(width, height, std::move(samples))
+                                      : make_half_image<3,0>(width, height, std::move(samples));
+            case 4: return h.hasAlpha ? make_half_image<3,1>(width, height, std::move(samples))
+                                      : make_half_image<4,0>(width, height, std::move(samples));
+            default: return NULL;
+        }
+    }
+
+    /** Only the tiles that overlap the region are read and decoded.  If packed is set and the file
+     * holds halves, they are copied as they are into a packed image. */
+    ImageBase *open_v2_region (std::istream &in, const SFIHeader &h, uimglen_t left, uimglen_t bottom,
+                               uimglen_t width, uimglen_t height, const std::string &filename,
+                               bool packed=false)
+    {
+        packed = packed && h.half;
+        const uimglen_t t = h.tileSize;
+        const uimglen_t tiles_x = (h.width + t - 1) / t;
+        const uimglen_t tiles_y = (h.height + t - 1) / t;
+        std::vector<TileEntry> dir(size_t(tiles_x) * tiles_y);
+        in.seekg(h.offset);
+        for (TileEntry &e : dir) {
+            read_value(in, e.offset);
+            read_value(in, e.size);
+            read_value(in, e.codec);
+        }
+        if (!in.good()) EXCEPT<<filename<<": corrupted image file"<<std::endl;
+        // Tiles are only compressed if that makes them smaller.
+        const size_t max_tile = size_t(t) * t * h.channels * (h.half ? 2 : 4);
+        for (const TileEntry &e : dir) {
+            if (e.size > max_tile) EXCEPT<<filename<<": corrupted image file"<<std::endl;
+        }
+
+        const chan_t c = h.channels;
+        std::vector<Half> halves(packed ? size_t(width) * height * c : 0);
+        ImageBase *img = packed ? NULL : make_image(h, width, height);
+        if (width == 0 || height == 0) return packed ? make_half_image(h, width, height, std::move(halves)) : img;
+        const uimglen_t tx0 = left / t, tx1 = (left + width - 1) / t + 1;
+        const uimglen_t ty0 = bottom / t, ty1 = (bottom + height - 1) / t + 1;
+        try {
+            // Reading is serial, decoding is done a row of tiles at a time in parallel.
+            std::vector<std::vector<uint8_t>> tiles(size_t(tx1 - tx0) * (ty1 - ty0));
+            for (uimglen_t ty=ty0 ; ty<ty1 ; ++ty) {
+                for (uimglen_t tx=tx0 ; tx<tx1 ; ++tx) {
+                    const TileEntry &e = dir[size_t(ty) * tiles_x + tx];
+                    std::vector<uint8_t> &tile = tiles[size_t(ty - ty0) * (tx1 - tx0) + tx - tx0];
+                    tile.resize(e.size);
+                    in.seekg(e.offset);
+                    in.read(reinterpret_cast<char*>(tile.data()), e.size);
+                    if (size_t(in.gcount()) != e.size) EXCEPT<<filename<<": corrupted image file"<<std::endl;
+                }
+            }
+            float *raw = packed ? NULL : img->raw();
+            parallel_rows(ty1 - ty0, size_t(tx1 - tx0) * t * t * c, [&] (uimglen_t j0, uimglen_t j1) {
+                std::vector<uint8_t> samples;
+                for (uimglen_t ty=ty0+j0 ; ty<ty0+j1 ; ++ty) {
+                    for (uimglen_t tx=tx0 ; tx<tx1 ; ++tx) {
+                        const uimglen_t w = std::min(t, h.width - tx*t);
+                        const uimglen_t th = std::min(t, h.height - ty*t);
+                        decode_tile(h, tiles[size_t(ty - ty0) * (tx1 - tx0) + tx - tx0],
+                                    dir[size_t(ty) * tiles_x + tx].codec, w, th, samples, filename);
+                        // Copy the part of the tile that is in the region.
+                        const uimglen_t x0 = std::max(left, tx*t), x1 = std::min(left + width, tx*t + w);
+                        const uimglen_t y0 = std::max(bottom, ty*t), y1 = std::min(bottom + height, ty*t + th);
+                        const size_t n = size_t(x1 - x0) * c;
+                        for (uimglen_t y=y0 ; y<y1 ; ++y) {
+                            const size_t dst = (size_t(y - bottom) * width + x0 - left) * c;
+                            const size_t src = (size_t(y - ty*t) * w + x0 - tx*t) * c;
+                            if (packed) {
+                                memcpy(&halves[dst], &samples[src * 2], n * 2);
+                            } else if (h.half) {
+                                for (size_t i=0 ; i<n ; ++i) {
+                                    uint16_t v;
+                                    memcpy(&v, &samples[(src + i) * 2], 2);
+                                    raw[dst + i] = half_to_float(v);
+                                }
+                            } else {
+                                memcpy(raw + dst, &samples[src * 4], n * 4);
+                            }
+                        }
+                    }
+                }
+            });
+        } catch (...) {
+            delete img;
+            throw;
+        }
+        return packed ? make_half_image(h, width, height, std::move(halves)) : img;
+    }
+
+}
+
+void sfi_save (const std::string &filename, ImageBase *image, SFIFormat format)
+{
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out.good()) {
+        EXCEPT << "Couldn't open " << filename << " for writing." << ENDL;
+    }
+    switch (format) {
+        case SFI_RAW: save_v1(out, image, false); break;
+        case SFI_RAW_PADDED: save_v1(out, image, true); break;
+        case SFI_TILED: save_v2(out, image, false); break;
+        case SFI_TILED_HALF: save_v2(out, image, true); break;
+    }
+    out.close();
+    if (!out.good()) {
+        EXCEPT << "Couldn't write " << filename << ENDL;
+    }
+}
+
+ImageBase *sfi_open (const std::string &filename, bool map, bool packed)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.good()) {
+        EXCEPT << "Couldn't open " << filename << ENDL;
+    }
+    SFIHeader h = read_header(in, filename);
+
+    if (h.version == 2) {
+        return open_v2_region(in, h, 0, 0, h.width, h.height, filename, packed);
+    }
+
+    // Files with the original header have misaligned floats, so they are always read.
+    if (map && h.offset == SFI_PADDED_HEADER_SIZE) {
+        in.close();
+        SFIMapping *m = new SFIMapping(filename);
+        if (m->size != h.offset + h.payload()) {
+            delete m;
+            EXCEPT<<filename<<": corrupted image file"<<std::endl;
         }
+        return make_image(h, h.width, h.height, m->base + h.offset, m);
+    }
 
-    } catch (const Exception &e) {
+    ImageBase *img = make_image(h, h.width, h.height);
+    in.seekg(h.offset);
+    in.read(reinterpret_cast<char*>(img->raw()), h.payload());
+    if (size_t(in.gcount()) != h.payload()) {
         delete img;
-        throw e;
+        EXCEPT<<filename<<": corrupted image file"<<std::endl;
     }
 
     return img;
 }
+
+ImageBase *sfi_open_region (const std::string &filename, uimglen_t left, uimglen_t bottom,
+                            uimglen_t width, uimglen_t height)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.good()) {
+        EXCEPT << "Couldn't open " << filename << ENDL;
+    }
+    SFIHeader h = read_header(in, filename);
+    if (left > h.width || width > h.width - left || bottom > h.height || height > h.height - bottom) {
+        EXCEPT << filename << ": region (" << left << ", " << bottom << ") size (" << width << ", "
+               << height << ") is outside the image (" << h.width << ", " << h.height << ")." << ENDL;
+    }
+    if (h.version == 2) return open_v2_region(in, h, left, bottom, width, height, filename);
+    return open_v1_region(in, h, left, bottom, width, height, filename);
+}
@@ -26,8 +26,23 @@
 
 #include "image.h"
 
-void sfi_save (const std::string &filename, ImageBase *img);
+enum SFIFormat {
+    SFI_RAW,        // Version 1: a header followed by all the floats.
+    SFI_RAW_PADDED, // Version 1 with the header padded to 16 bytes, so the file can be mapped.
+    SFI_TILED,      // Version 2: losslessly compressed tiles of floats.
+    SFI_TILED_HALF  // Version 2: losslessly compressed tiles of half floats.
+};
 
-ImageBase *sfi_open (const std::string &filename);
+void sfi_save (const std::string &filename, ImageBase *img, SFIFormat format=SFI_RAW);
+
+/** With map set, files saved by sfi_save as SFI_RAW_PADDED are mapped (copy-on-write) rather than read, so opening
+ * is instant and pages are only loaded as they are touched.  With packed set, SFI_TILED_HALF files
+ * are returned as PS_F16 images (see image_pack). */
+ImageBase *sfi_open (const std::string &filename, bool map=false, bool packed=false);
+
+/** Read only part of the image.  For version 2 files, only the tiles that overlap it are
+ * decoded. */
+ImageBase *sfi_open_region (const std::string &filename, uimglen_t left, uimglen_t bottom,
+                            uimglen_t width, uimglen_t height);
 
 #endif